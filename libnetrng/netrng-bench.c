@@ -0,0 +1,255 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Measures per-call latency of netrng_get_seed_timed with several threads
+ reading from the same client.
+
+ Usage: netrng-bench [-t THREADS] [-n CALLS] [-s SIZE] [-b CACHE] ENDPOINT...
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include <inttypes.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netrng.h"
+
+#define DEFAULT_THREADS (4)
+#define DEFAULT_CALLS (100000)
+#define DEFAULT_SEED_SIZE (64)
+
+/* Per call timeout. Calls that time out are counted as failures. */
+#define CALL_TIMEOUT_MS (5000)
+
+struct BenchThread {
+	pthread_t thread;
+	NetRngClient *client;
+	size_t calls;
+	size_t seed_size;
+	uint64_t *latencies;
+	size_t failures;
+	size_t blocked;
+};
+
+typedef struct BenchThread BenchThread;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void *bench_thread(void *arg)
+{
+	BenchThread *bench;
+	unsigned char seed[4096];
+	uint64_t start;
+	size_t i;
+
+	bench = (BenchThread *)arg;
+
+	for (i=0; i < bench->calls; i++) {
+		start = now_ns();
+
+		if (netrng_get_seed(bench->client, seed, bench->seed_size)) {
+			bench->blocked++;
+
+			if (netrng_get_seed_timed(bench->client, seed, bench->seed_size, CALL_TIMEOUT_MS)) {
+				bench->failures++;
+			}
+		}
+
+		bench->latencies[i] = now_ns() - start;
+	}
+
+	return NULL;
+}
+
+static void show_usage(const char *app)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] ENDPOINT...\n\n"
+		"Options:\n"
+		"-b SIZE     Cache size. (Default: library default)\n"
+		"-h          Help. Show this message and exit\n"
+		"-n CALLS    Calls per thread. (Default: %d)\n"
+		"-s SIZE     Seed size in bytes (1 - 4096). (Default: %d)\n"
+		"-t THREADS  Number of reader threads. (Default: %d)\n"
+		, app, DEFAULT_CALLS, DEFAULT_SEED_SIZE, DEFAULT_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+	NetRngClient *client;
+	NetRngOptions options;
+	BenchThread *threads;
+	uint64_t *latencies;
+	size_t num_threads = DEFAULT_THREADS;
+	size_t calls = DEFAULT_CALLS;
+	size_t seed_size = DEFAULT_SEED_SIZE;
+	size_t total_calls;
+	size_t failures = 0;
+	size_t blocked = 0;
+	size_t i;
+	uint64_t start;
+	uint64_t elapsed;
+	double seconds;
+	unsigned char warmup[DEFAULT_SEED_SIZE];
+	int opt;
+
+	netrng_options_init(&options);
+
+	while ((opt = getopt(argc, argv, "b:hn:s:t:")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (sscanf(optarg, "%zu", &options.cache_size) != 1) {
+					fprintf(stderr, "Invalid cache size\n");
+					return 1;
+				}
+				break;
+			case 'h':
+				show_usage(argv[0]);
+				return 0;
+			case 'n':
+				if (sscanf(optarg, "%zu", &calls) != 1 || !calls) {
+					fprintf(stderr, "Invalid number of calls\n");
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%zu", &seed_size) != 1 || !seed_size || seed_size > 4096) {
+					fprintf(stderr, "Invalid seed size\n");
+					return 1;
+				}
+				break;
+			case 't':
+				if (sscanf(optarg, "%zu", &num_threads) != 1 || !num_threads) {
+					fprintf(stderr, "Invalid number of threads\n");
+					return 1;
+				}
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	client = netrng_create((const char *const *)(argv + optind), (size_t)(argc - optind), &options);
+	if (!client) {
+		perror("netrng_create");
+		return 1;
+	}
+
+	/* Wait for the first bytes so connection time is not measured */
+	if (netrng_get_seed_timed(client, warmup, sizeof(warmup), 30000)) {
+		perror("Unable to get random bytes from server");
+		netrng_destroy(client);
+		return 1;
+	}
+
+	threads = calloc(num_threads, sizeof(BenchThread));
+	latencies = calloc(num_threads * calls, sizeof(uint64_t));
+
+	if (!threads || !latencies) {
+		fprintf(stderr, "Out of memory\n");
+		netrng_destroy(client);
+		return 1;
+	}
+
+	start = now_ns();
+
+	for (i=0; i < num_threads; i++) {
+		threads[i].client = client;
+		threads[i].calls = calls;
+		threads[i].seed_size = seed_size;
+		threads[i].latencies = latencies + i * calls;
+
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i])) {
+			fprintf(stderr, "Unable to create thread\n");
+			return 1;
+		}
+	}
+
+	for (i=0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		failures += threads[i].failures;
+		blocked += threads[i].blocked;
+	}
+
+	elapsed = now_ns() - start;
+	seconds = (double)elapsed / 1e9;
+	total_calls = num_threads * calls;
+
+	qsort(latencies, total_calls, sizeof(uint64_t), compare_u64);
+
+	printf("Threads: %zu. Calls: %zu. Seed size: %zu bytes\n", num_threads, total_calls, seed_size);
+	printf("Elapsed: %.3f s. Rate: %.0f calls/s (%.0f bytes/s)\n", seconds,
+		(double)total_calls / seconds, (double)(total_calls * seed_size) / seconds);
+	printf("Blocked: %zu. Timed out: %zu\n", blocked, failures);
+	printf("Latency (ns): min %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 "\n",
+		latencies[0],
+		latencies[total_calls / 2],
+		latencies[total_calls * 90 / 100],
+		latencies[total_calls * 99 / 100],
+		latencies[total_calls * 999 / 1000],
+		latencies[total_calls - 1]);
+
+	free(latencies);
+	free(threads);
+	netrng_destroy(client);
+
+	return failures? 2: 0;
+}
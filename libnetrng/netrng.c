@@ -0,0 +1,990 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Network RNG client library.
+
+ The cache is a single producer, multiple consumer ring buffer. head and tail
+ are byte counters that never wrap so the ring index is counter & mask.
+
+ - The refill thread is the only producer. It copies payload bytes at tail and
+   then publishes the new tail.
+ - Consumers copy bytes at head and then try to advance head with a compare and
+   swap. If another consumer advanced head first the copy is discarded and the
+   read is retried, so every byte is returned to exactly one caller.
+
+ Blocking reads only take wait_lock when the cache does not have enough bytes.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "netrng.h"
+
+#define DEFAULT_PORT "4545"
+#define DEFAULT_CACHE_SIZE (1024*1024)
+#define DEFAULT_KEEPALIVE_MS (10000)
+#define DEFAULT_CONNECT_RETRY_MS (1000)
+#define DEFAULT_CONNECT_TIMEOUT_MS (5000)
+
+/* Don't ask the server for little amounts of entropy but wait until more is needed */
+#define MIN_REQUEST_SIZE (4096)
+
+#define HEADER_SIZE (sizeof(uint32_t))
+
+/*
+ Request asking the server for overload notices and the frame length of a notice.
+ A notice is followed by a uint32_t backoff hint in ms.
+*/
+#define OVERLOAD_NOTICE (0xffffffffU)
+#define RECV_BUF_SIZE (65536)
+#define CACHE_LINE_SIZE (64)
+
+struct NetRngEndpoint {
+	char *host;
+	char *port;
+
+	/* Not used before this time after an overload notice */
+	struct timespec retry_after;
+};
+
+typedef struct NetRngEndpoint NetRngEndpoint;
+
+struct NetRngClient {
+	/* Read position. Advanced by consumers. */
+	uint64_t head;
+	unsigned char head_pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+
+	/* Write position. Advanced by the refill thread only. */
+	uint64_t tail;
+	unsigned char tail_pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+
+	/* Consumers wake the refill thread when the cache drops below this level */
+	size_t wake_threshold;
+	int wake_pending;
+	int waiters;
+	int connected;
+	int stop;
+
+	unsigned char *cache;
+	size_t capacity;
+	size_t mask;
+
+	NetRngOptions options;
+
+	NetRngEndpoint *endpoints;
+	size_t num_endpoints;
+	size_t endpoint_index;
+
+	pthread_t thread;
+	int thread_started;
+	int wake_fds[2];
+
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+
+	/* Refill thread state */
+	int sock;
+	/* Entropy requested but not received yet */
+	uint64_t seed_pending;
+	/* Payload bytes remaining in the current frame */
+	uint32_t bytes_pending;
+	/* Handle headers split between different reads */
+	unsigned char header_buf[HEADER_SIZE];
+	size_t header_bytes;
+	/* The next header is the backoff hint of an overload notice */
+	int notice_pending;
+
+	unsigned int reconnect_count;
+	struct timespec last_request;
+
+	unsigned char recv_buf[RECV_BUF_SIZE];
+};
+
+static int64_t elapsed_ms(const struct timespec *since, const struct timespec *now)
+{
+	return (int64_t)(now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static size_t cache_available(NetRngClient *client)
+{
+	uint64_t head;
+	uint64_t tail;
+
+	/* Load head first. Head can only move towards tail. */
+	head = __atomic_load_n(&client->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&client->tail, __ATOMIC_SEQ_CST);
+
+	return (size_t)(tail - head);
+}
+
+static int cache_read(NetRngClient *client, unsigned char *data, size_t data_len)
+{
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+	size_t size_1;
+
+	head = __atomic_load_n(&client->head, __ATOMIC_ACQUIRE);
+
+	do {
+		tail = __atomic_load_n(&client->tail, __ATOMIC_SEQ_CST);
+
+		if (tail - head < data_len) {
+			return -1;
+		}
+
+		offset = (size_t)head & client->mask;
+		size_1 = client->capacity - offset;
+
+		/* Read in a single step */
+		if (data_len <= size_1) {
+			memcpy(data, client->cache + offset, data_len);
+		} else {
+			memcpy(data, client->cache + offset, size_1);
+			memcpy(data + size_1, client->cache, data_len - size_1);
+		}
+
+	/* On failure head is reloaded and the bytes copied may have been given to another reader. Try again. */
+	} while (!__atomic_compare_exchange_n(&client->head, &head, head + data_len, 0,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return 0;
+}
+
+static size_t cache_write(NetRngClient *client, const unsigned char *data, size_t data_len)
+{
+	uint64_t head;
+	uint64_t tail;
+	size_t space;
+	size_t offset;
+	size_t size_1;
+
+	tail = client->tail;
+	head = __atomic_load_n(&client->head, __ATOMIC_ACQUIRE);
+
+	space = client->capacity - (size_t)(tail - head);
+	if (data_len > space) {
+		data_len = space;
+	}
+
+	if (!data_len) {
+		return 0;
+	}
+
+	offset = (size_t)tail & client->mask;
+	size_1 = client->capacity - offset;
+
+	/* We can write everything in one go */
+	if (data_len <= size_1) {
+		memcpy(client->cache + offset, data, data_len);
+	} else {
+		memcpy(client->cache + offset, data, size_1);
+		memcpy(client->cache, data + size_1, data_len - size_1);
+	}
+
+	__atomic_store_n(&client->tail, tail + data_len, __ATOMIC_SEQ_CST);
+
+	/* Only take the lock if someone is waiting */
+	if (__atomic_load_n(&client->waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&client->wait_lock);
+		pthread_cond_broadcast(&client->wait_cond);
+		pthread_mutex_unlock(&client->wait_lock);
+	}
+
+	return data_len;
+}
+
+/**
+* Wakes up the refill thread. Only the first caller after the thread woke up writes to the pipe.
+*/
+static void refill_wake(NetRngClient *client)
+{
+	static const unsigned char wake_byte = 1;
+	ssize_t status;
+
+	if (__atomic_exchange_n(&client->wake_pending, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	do {
+		status = write(client->wake_fds[1], &wake_byte, 1);
+	} while (status < 0 && errno == EINTR);
+}
+
+static void refill_check(NetRngClient *client)
+{
+	if (cache_available(client) < __atomic_load_n(&client->wake_threshold, __ATOMIC_RELAXED)) {
+		refill_wake(client);
+	}
+}
+
+static int client_send_request(NetRngClient *client, uint32_t entropy_requested)
+{
+	uint32_t request;
+	ssize_t status;
+
+	request = htonl(entropy_requested);
+
+	do {
+		status = send(client->sock, &request, sizeof(request), MSG_NOSIGNAL);
+	} while (status < 0 && errno == EINTR);
+
+	/* The socket is blocking so a partial send means the connection is broken */
+	if (status != (ssize_t)sizeof(request)) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &client->last_request);
+
+	return 0;
+}
+
+/**
+* Requests entropy when below the low watermark. Also publishes the level at which
+* consumers should wake up the refill thread.
+*/
+static int client_fill(NetRngClient *client)
+{
+	size_t available;
+	uint64_t inflight;
+	uint64_t missing;
+	size_t low_water;
+
+	available = cache_available(client);
+	inflight = client->seed_pending + client->bytes_pending;
+	low_water = client->options.low_water;
+
+	if (inflight + available < client->capacity) {
+		missing = client->capacity - available - inflight;
+	} else {
+		missing = 0;
+	}
+
+	/* Blocked readers may need more than the watermark allows */
+	if (missing && (available + inflight < low_water || __atomic_load_n(&client->waiters, __ATOMIC_SEQ_CST))) {
+		if (missing >= OVERLOAD_NOTICE) {
+			missing = OVERLOAD_NOTICE - 1;
+		}
+
+		if (client_send_request(client, (uint32_t)missing)) {
+			return -1;
+		}
+
+		client->seed_pending += missing;
+		inflight += missing;
+	}
+
+	__atomic_store_n(&client->wake_threshold, (inflight < low_water)? low_water - (size_t)inflight: 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void endpoint_backoff(NetRngEndpoint *endpoint, uint32_t backoff_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, &endpoint->retry_after);
+
+	endpoint->retry_after.tv_sec += (time_t)(backoff_ms / 1000);
+	endpoint->retry_after.tv_nsec += (long)(backoff_ms % 1000) * 1000000L;
+	if (endpoint->retry_after.tv_nsec >= 1000000000L) {
+		endpoint->retry_after.tv_sec++;
+		endpoint->retry_after.tv_nsec -= 1000000000L;
+	}
+}
+
+static int client_receive(NetRngClient *client)
+{
+	ssize_t recv_status;
+	size_t offset;
+	size_t copy_len;
+	size_t data_len;
+	uint32_t frame_len;
+
+	recv_status = recv(client->sock, client->recv_buf, RECV_BUF_SIZE, 0);
+
+	/* Server disconnected */
+	if (recv_status == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if (recv_status < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	data_len = (size_t)recv_status;
+	offset = 0;
+
+	while (offset < data_len) {
+		if (!client->bytes_pending) {
+			/* Handle partial headers */
+			copy_len = HEADER_SIZE - client->header_bytes;
+			if (copy_len > data_len - offset) {
+				copy_len = data_len - offset;
+			}
+
+			memcpy(client->header_buf + client->header_bytes, client->recv_buf + offset, copy_len);
+			client->header_bytes += copy_len;
+			offset += copy_len;
+
+			if (client->header_bytes < HEADER_SIZE) {
+				break;
+			}
+
+			client->header_bytes = 0;
+			memcpy(&frame_len, client->header_buf, HEADER_SIZE);
+			frame_len = ntohl(frame_len);
+
+			/* The server refused a request. Move to another one for a while. */
+			if (client->notice_pending) {
+				endpoint_backoff(&client->endpoints[client->endpoint_index], frame_len);
+				errno = EBUSY;
+				return -1;
+			}
+
+			if (frame_len == OVERLOAD_NOTICE && client->options.overload_notices) {
+				client->notice_pending = 1;
+				continue;
+			}
+
+			client->bytes_pending = frame_len;
+			client->seed_pending = (frame_len > client->seed_pending)? 0: client->seed_pending - frame_len;
+			continue;
+		}
+
+		copy_len = client->bytes_pending;
+		if (copy_len > data_len - offset) {
+			copy_len = data_len - offset;
+		}
+
+		/*
+		 The server never exceeds what was requested so this never drops anything.
+		 The overload notice request is only free with daemons that understand it,
+		 others take it as a request for 4G and the excess is dropped here.
+		*/
+		cache_write(client, client->recv_buf + offset, copy_len);
+
+		client->bytes_pending -= (uint32_t)copy_len;
+		offset += copy_len;
+	}
+
+	return 0;
+}
+
+static void client_disconnect(NetRngClient *client)
+{
+	if (client->sock >= 0) {
+		close(client->sock);
+		client->sock = -1;
+	}
+
+	client->seed_pending = 0;
+	client->bytes_pending = 0;
+	client->header_bytes = 0;
+	client->notice_pending = 0;
+
+	__atomic_store_n(&client->connected, 0, __ATOMIC_RELEASE);
+}
+
+/**
+* Connects to a single address. Returns the connected blocking socket or -1.
+*/
+static int connect_address(const struct addrinfo *addr, int timeout_ms)
+{
+	int sock;
+	int opts;
+	int status;
+	int so_error;
+	int nodelay = 1;
+	socklen_t so_error_len = sizeof(so_error);
+	struct pollfd pfd;
+
+	sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sock < 0) {
+		return -1;
+	}
+
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	opts = fcntl(sock, F_GETFL);
+	if (opts < 0 || fcntl(sock, F_SETFL, opts | O_NONBLOCK) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	status = connect(sock, addr->ai_addr, addr->ai_addrlen);
+	if (status < 0 && errno != EINPROGRESS) {
+		close(sock);
+		return -1;
+	}
+
+	if (status < 0) {
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		do {
+			status = poll(&pfd, 1, timeout_ms);
+		} while (status < 0 && errno == EINTR);
+
+		if (status <= 0) {
+			if (!status) {
+				errno = ETIMEDOUT;
+			}
+			close(sock);
+			return -1;
+		}
+
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) < 0 || so_error) {
+			if (so_error) {
+				errno = so_error;
+			}
+			close(sock);
+			return -1;
+		}
+	}
+
+	/* Requests are 4 bytes. Blocking sends keep them whole. */
+	if (fcntl(sock, F_SETFL, opts & ~O_NONBLOCK) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	return sock;
+}
+
+/**
+* Tries all endpoints once starting from the current one.
+*/
+static int client_connect(NetRngClient *client)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	NetRngEndpoint *endpoint;
+	struct timespec now;
+	size_t i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i=0; i < client->num_endpoints; i++) {
+		endpoint = &client->endpoints[client->endpoint_index];
+
+		/* Overloaded servers are skipped until their backoff hint expires */
+		if (elapsed_ms(&endpoint->retry_after, &now) < 0) {
+			client->endpoint_index = (client->endpoint_index + 1) % client->num_endpoints;
+			continue;
+		}
+
+		if (!getaddrinfo(endpoint->host, endpoint->port, &hints, &addrs)) {
+			for (addr = addrs; addr; addr = addr->ai_next) {
+				client->sock = connect_address(addr, (int)client->options.connect_timeout_ms);
+				if (client->sock >= 0) {
+					break;
+				}
+			}
+
+			freeaddrinfo(addrs);
+
+			/* Refused requests are answered with a notice instead of a disconnect */
+			if (client->sock >= 0 && client->options.overload_notices &&
+			    client_send_request(client, OVERLOAD_NOTICE)) {
+				close(client->sock);
+				client->sock = -1;
+			}
+
+			if (client->sock >= 0) {
+				client->reconnect_count = 0;
+				clock_gettime(CLOCK_MONOTONIC, &client->last_request);
+				__atomic_store_n(&client->connected, 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+
+		/* Fail over to the next endpoint */
+		client->endpoint_index = (client->endpoint_index + 1) % client->num_endpoints;
+	}
+
+	return -1;
+}
+
+/**
+* Waits until the refill thread is woken up or timeout_ms expires.
+*/
+static void refill_thread_wait(NetRngClient *client, int sock, int timeout_ms, int *sock_ready)
+{
+	struct pollfd pfds[2];
+	unsigned char drain[64];
+	nfds_t nfds = 1;
+
+	pfds[0].fd = client->wake_fds[0];
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+
+	if (sock >= 0) {
+		pfds[1].fd = sock;
+		pfds[1].events = POLLIN;
+		pfds[1].revents = 0;
+		nfds = 2;
+	}
+
+	*sock_ready = 0;
+
+	if (poll(pfds, nfds, timeout_ms) <= 0) {
+		return;
+	}
+
+	if (pfds[0].revents & POLLIN) {
+		while (read(client->wake_fds[0], drain, sizeof(drain)) == (ssize_t)sizeof(drain)) {}
+		__atomic_store_n(&client->wake_pending, 0, __ATOMIC_RELEASE);
+	}
+
+	if (nfds > 1 && pfds[1].revents) {
+		*sock_ready = 1;
+	}
+}
+
+static void *refill_thread(void *arg)
+{
+	NetRngClient *client;
+	struct timespec now;
+	struct timespec wait_now;
+	int64_t idle_time;
+	int64_t delay;
+	int sock_ready;
+
+	client = (NetRngClient *)arg;
+
+	while (!__atomic_load_n(&client->stop, __ATOMIC_ACQUIRE)) {
+		if (client->sock < 0) {
+			if (client_connect(client)) {
+				/* All endpoints failed. Back off before trying again. */
+				delay = (int64_t)client->options.connect_retry_ms +
+				        (int64_t)client->options.connect_retry_ms * client->reconnect_count * 3 / 2;
+
+				if (delay < (int64_t)client->options.connect_retry_ms * 10) {
+					client->reconnect_count++;
+				}
+
+				/* Readers waking the thread up must not cut the delay short */
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				idle_time = 0;
+				while (idle_time < delay && !__atomic_load_n(&client->stop, __ATOMIC_ACQUIRE)) {
+					refill_thread_wait(client, -1, (int)(delay - idle_time), &sock_ready);
+					clock_gettime(CLOCK_MONOTONIC, &wait_now);
+					idle_time = elapsed_ms(&now, &wait_now);
+				}
+				continue;
+			}
+		}
+
+		if (client_fill(client)) {
+			client_disconnect(client);
+			client->endpoint_index = (client->endpoint_index + 1) % client->num_endpoints;
+			continue;
+		}
+
+		/* Keep-alive. The server closes idle connections. */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		idle_time = elapsed_ms(&client->last_request, &now);
+
+		if (idle_time >= (int64_t)client->options.keepalive_ms) {
+			if (client_send_request(client, 0)) {
+				client_disconnect(client);
+				client->endpoint_index = (client->endpoint_index + 1) % client->num_endpoints;
+				continue;
+			}
+			idle_time = 0;
+		}
+
+		refill_thread_wait(client, client->sock, (int)((int64_t)client->options.keepalive_ms - idle_time), &sock_ready);
+
+		if (sock_ready && client_receive(client)) {
+			client_disconnect(client);
+			client->endpoint_index = (client->endpoint_index + 1) % client->num_endpoints;
+		}
+	}
+
+	return NULL;
+}
+
+static int endpoint_parse(NetRngEndpoint *endpoint, const char *spec)
+{
+	const char *host;
+	const char *port;
+	size_t host_len;
+
+	/* [ipv6]:port */
+	if (spec[0] == '[') {
+		host = spec + 1;
+		port = strchr(host, ']');
+		if (!port) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		host_len = (size_t)(port - host);
+		port++;
+
+		if (*port == ':') {
+			port++;
+		} else if (*port) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else {
+		host = spec;
+		port = strrchr(spec, ':');
+
+		if (port) {
+			host_len = (size_t)(port - host);
+			port++;
+		} else {
+			host_len = strlen(host);
+		}
+	}
+
+	if (!port || !*port) {
+		port = DEFAULT_PORT;
+	}
+
+	endpoint->host = malloc(host_len + 1);
+	endpoint->port = malloc(strlen(port) + 1);
+
+	if (!endpoint->host || !endpoint->port) {
+		free(endpoint->host);
+		free(endpoint->port);
+		endpoint->host = NULL;
+		endpoint->port = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(endpoint->host, host, host_len);
+	endpoint->host[host_len] = '\0';
+	strcpy(endpoint->port, port);
+
+	return 0;
+}
+
+void netrng_options_init(NetRngOptions *options)
+{
+	memset(options, 0, sizeof(NetRngOptions));
+
+	options->cache_size = DEFAULT_CACHE_SIZE;
+	options->low_water = 0;
+	options->keepalive_ms = DEFAULT_KEEPALIVE_MS;
+	options->connect_retry_ms = DEFAULT_CONNECT_RETRY_MS;
+	options->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+	options->overload_notices = 0;
+}
+
+NetRngClient *netrng_create(const char *const *endpoints, size_t num_endpoints, const NetRngOptions *options)
+{
+	NetRngClient *client;
+	NetRngOptions default_options;
+	void *mem;
+	size_t capacity;
+	size_t i;
+	pthread_condattr_t condattr;
+	int status;
+
+	if (!endpoints || !num_endpoints) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!options) {
+		netrng_options_init(&default_options);
+		options = &default_options;
+	}
+
+	if (!options->cache_size || options->cache_size > (SIZE_MAX >> 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Keep the read and write positions in separate cache lines */
+	if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(NetRngClient))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	client = (NetRngClient *)mem;
+	memset(client, 0, sizeof(NetRngClient));
+
+	client->sock = -1;
+	client->wake_fds[0] = -1;
+	client->wake_fds[1] = -1;
+	memcpy(&client->options, options, sizeof(NetRngOptions));
+
+	for (capacity = 1; capacity < options->cache_size; capacity <<= 1) {}
+
+	client->capacity = capacity;
+	client->mask = capacity - 1;
+
+	if (!client->options.low_water || client->options.low_water > capacity) {
+		client->options.low_water = (capacity > MIN_REQUEST_SIZE)? capacity - MIN_REQUEST_SIZE: capacity;
+	}
+
+	if (!client->options.keepalive_ms) {
+		client->options.keepalive_ms = DEFAULT_KEEPALIVE_MS;
+	}
+
+	client->cache = malloc(capacity);
+	client->endpoints = calloc(num_endpoints, sizeof(NetRngEndpoint));
+
+	if (!client->cache || !client->endpoints) {
+		netrng_destroy(client);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	client->num_endpoints = num_endpoints;
+
+	for (i=0; i < num_endpoints; i++) {
+		if (endpoint_parse(&client->endpoints[i], endpoints[i])) {
+			status = errno;
+			netrng_destroy(client);
+			errno = status;
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&client->wait_lock, NULL);
+
+	/* Timed waits use the monotonic clock */
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&client->wait_cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	if (pipe(client->wake_fds)) {
+		status = errno;
+		netrng_destroy(client);
+		errno = status;
+		return NULL;
+	}
+
+	for (i=0; i < 2; i++) {
+		fcntl(client->wake_fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(client->wake_fds[i], F_SETFL, fcntl(client->wake_fds[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	status = pthread_create(&client->thread, NULL, refill_thread, client);
+	if (status) {
+		netrng_destroy(client);
+		errno = status;
+		return NULL;
+	}
+
+	client->thread_started = 1;
+
+	return client;
+}
+
+void netrng_destroy(NetRngClient *client)
+{
+	size_t i;
+
+	if (!client) {
+		return;
+	}
+
+	if (client->thread_started) {
+		__atomic_store_n(&client->stop, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&client->wake_pending, 0, __ATOMIC_RELEASE);
+		refill_wake(client);
+		pthread_join(client->thread, NULL);
+
+		pthread_cond_destroy(&client->wait_cond);
+		pthread_mutex_destroy(&client->wait_lock);
+	}
+
+	client_disconnect(client);
+
+	for (i=0; i < 2; i++) {
+		if (client->wake_fds[i] >= 0) {
+			close(client->wake_fds[i]);
+		}
+	}
+
+	if (client->endpoints) {
+		for (i=0; i < client->num_endpoints; i++) {
+			free(client->endpoints[i].host);
+			free(client->endpoints[i].port);
+		}
+
+		free(client->endpoints);
+	}
+
+	if (client->cache) {
+		/* Don't leave random bytes behind */
+		memset(client->cache, 0, client->capacity);
+		free(client->cache);
+	}
+
+	free(client);
+}
+
+int netrng_get_seed(NetRngClient *client, unsigned char *buffer, size_t buffer_len)
+{
+	if (!client || (!buffer && buffer_len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cache_read(client, buffer, buffer_len)) {
+		refill_wake(client);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	refill_check(client);
+
+	return 0;
+}
+
+int netrng_get_seed_timed(NetRngClient *client, unsigned char *buffer, size_t buffer_len, int timeout_ms)
+{
+	struct timespec deadline;
+	int status;
+
+	if (!client || (!buffer && buffer_len) || buffer_len > client->capacity) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Fast path. No locks. */
+	if (!cache_read(client, buffer, buffer_len)) {
+		refill_check(client);
+		return 0;
+	}
+
+	if (!timeout_ms) {
+		refill_wake(client);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&client->wait_lock);
+	__atomic_add_fetch(&client->waiters, 1, __ATOMIC_SEQ_CST);
+
+	status = 0;
+	for (;;) {
+		if (!cache_read(client, buffer, buffer_len)) {
+			status = 0;
+			break;
+		}
+
+		/* Make sure the refill thread knows someone is waiting */
+		refill_wake(client);
+
+		if (status == ETIMEDOUT) {
+			break;
+		}
+
+		if (timeout_ms > 0) {
+			status = pthread_cond_timedwait(&client->wait_cond, &client->wait_lock, &deadline);
+		} else {
+			pthread_cond_wait(&client->wait_cond, &client->wait_lock);
+		}
+	}
+
+	__atomic_sub_fetch(&client->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&client->wait_lock);
+
+	if (status == ETIMEDOUT) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	refill_check(client);
+
+	return 0;
+}
+
+size_t netrng_available(NetRngClient *client)
+{
+	if (!client) return 0;
+
+	return cache_available(client);
+}
+
+size_t netrng_capacity(const NetRngClient *client)
+{
+	if (!client) return 0;
+
+	return client->capacity;
+}
+
+int netrng_is_connected(NetRngClient *client)
+{
+	if (!client) return 0;
+
+	return __atomic_load_n(&client->connected, __ATOMIC_ACQUIRE);
+}
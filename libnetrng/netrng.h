@@ -0,0 +1,177 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ Network RNG client library.
+
+ Keeps a local cache of random bytes received from one or more quantisusb-rngd
+ servers. The cache is refilled by a background thread and can be read from any
+ number of threads without taking a lock.
+*/
+
+#ifndef _NETRNG_H_
+#define _NETRNG_H_
+
+#include <stddef.h>
+
+/* Export Macros */
+#if defined(_WIN32)
+#  if defined(NETRNG_DLL)
+#    define NETRNG_PUBLIC __declspec(dllexport)
+#  else
+#    define NETRNG_PUBLIC __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#    if __GNUC__ >= 4
+#      define NETRNG_PUBLIC __attribute__ ((visibility("default")))
+#    endif
+#endif
+
+#if !defined(NETRNG_PUBLIC)
+#  define NETRNG_PUBLIC
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+* @defgroup NetRngClient NetRngClient
+* Network RNG client.
+*/
+
+struct NetRngClient;
+
+/**
+* @ingroup NetRngClient
+* @struct NetRngClient <netrng.h>
+* @ref NetRngClient struct.
+*/
+typedef struct NetRngClient NetRngClient;
+
+/**
+* @addtogroup NetRngClient
+* @{
+*/
+
+/**
+* Client options. Always initialize with netrng_options_init.
+*/
+struct NetRngOptions {
+	/** Size of the local cache in bytes. Rounded up to a power of two. */
+	size_t cache_size;
+
+	/**
+	* Refill watermark. More random bytes are requested when the bytes cached plus the
+	* bytes already requested fall below this value. 0 uses cache_size - 4096.
+	*/
+	size_t low_water;
+
+	/** Interval between keep-alive requests in milliseconds. The server drops idle clients after 30s. */
+	unsigned int keepalive_ms;
+
+	/** Base reconnection delay in milliseconds. */
+	unsigned int connect_retry_ms;
+
+	/** Maximum time to wait for a connection to be established in milliseconds. */
+	unsigned int connect_timeout_ms;
+
+	/**
+	* Non-zero asks the servers for overload notices. A server that refuses a request then
+	* sends a notice with a backoff time instead of dropping the connection, and the client
+	* skips it for that long. The request for notices is 0xffffffff bytes which servers
+	* without admission control take literally, so only enable this when all endpoints
+	* support it. Off by default.
+	*/
+	int overload_notices;
+};
+
+typedef struct NetRngOptions NetRngOptions;
+
+/**
+* Sets all options to their default values.
+*/
+NETRNG_PUBLIC void netrng_options_init(NetRngOptions *options);
+
+/**
+* Creates a new client and starts the background refill thread.
+*
+* @param endpoints Server endpoints as "host", "host:port" or "[ipv6]:port". The client
+*                  connects to one endpoint at a time and fails over to the next one in order.
+* @param num_endpoints Number of endpoints.
+* @param options Client options or NULL for defaults.
+*
+* Returns: The client or NULL on error with errno set.
+*/
+NETRNG_PUBLIC NetRngClient *netrng_create(const char *const *endpoints, size_t num_endpoints,
+                                          const NetRngOptions *options);
+
+/**
+* Stops the background thread and destroys the client. No other thread may use the
+* client during or after this call.
+*/
+NETRNG_PUBLIC void netrng_destroy(NetRngClient *client);
+
+/**
+* Fills a buffer with random bytes suitable for seeding an RNG.
+* This function never blocks and fails immediately if there are not enough random bytes cached.
+*
+* Returns: 0 on success, -1 otherwise with errno set to EAGAIN.
+*/
+NETRNG_PUBLIC int netrng_get_seed(NetRngClient *client, unsigned char *buffer, size_t buffer_len);
+
+/**
+* Same as netrng_get_seed but waits up to timeout_ms milliseconds for random bytes to become available.
+* A negative timeout waits forever.
+*
+* Returns: 0 on success, -1 otherwise with errno set to ETIMEDOUT or EINVAL if buffer_len
+* exceeds the cache size.
+*/
+NETRNG_PUBLIC int netrng_get_seed_timed(NetRngClient *client, unsigned char *buffer, size_t buffer_len,
+                                        int timeout_ms);
+
+/**
+* Gets the number of random bytes currently cached.
+*/
+NETRNG_PUBLIC size_t netrng_available(NetRngClient *client);
+
+/**
+* Gets the number of bytes the cache can hold.
+*/
+NETRNG_PUBLIC size_t netrng_capacity(const NetRngClient *client);
+
+/**
+* Returns non-zero if the client is connected to a server.
+*/
+NETRNG_PUBLIC int netrng_is_connected(NetRngClient *client);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,7 @@
  Example application using the async api for seedgenerator.
 */
 var seedgen = require('./seedgenerator.js');
+var BenchStats = require('./benchstats.js');
 var fs = require('fs');
 var program = require('commander');
 
@@ -12,6 +13,7 @@ var DEFAULT_HOST = 'localhost';
 var DEFAULT_BUFFER_SIZE = 1024*1024;
 var totalRounds = 0;
 var startTime = 0;
+var benchStats;
 
 function default_param(param, def) {
     return typeof param !== 'undefined' ? param : def;
@@ -20,9 +22,12 @@ function default_param(param, def) {
 program
   .version('1.0')
   .option('-b, --buffer <size>', 'Random bytes buffer size. (Default: ' + DEFAULT_BUFFER_SIZE + ')', parseInt)
-  .option('-h, --host <host>', 'Network RNGD host. (Default: ' + DEFAULT_HOST + ')')
+  .option('-B, --bench', 'Benchmark. Quiet and report rate and GC pressure on exit.')
+  .option('-h, --host <host>', 'Network RNGD host. Separate multiple hosts with commas. (Default: ' + DEFAULT_HOST + ')')
   .option('-o, --output <file>', 'Write all seeds received to this file.')
   .option('-p, --port <port>', 'Network RNGD port. (Default: ' + DEFAULT_PORT + ')', parseInt)
+  .option('-s, --tls', 'Connect with TLS 1.3.')
+  .option('-c, --ca <file>', 'Trusted CA certificates (PEM) for TLS. (Default: system CAs)')
   .parse(process.argv);
 
 if (program.output) {
@@ -33,51 +38,75 @@ process.on('exit', function() {
     if (typeof writeStream !== 'undefined') {
         writeStream.end();
     }
-    console.log('Total Rounds: ' + totalRounds + ' Rate: ' + totalRounds / (process.uptime()-startTime)  + ' rounds/s');
+
+    if (typeof benchStats !== 'undefined') {
+        console.log(benchStats.report(totalRounds));
+    } else {
+        console.log('Total Rounds: ' + totalRounds + ' Rate: ' + totalRounds / (process.uptime()-startTime)  + ' rounds/s');
+    }
 });
 
 process.on('SIGINT', function() {
     process.exit(1);
 });
 
+/* Seeds written to a file are kept by the stream so only reuse the buffer without output */
+var sharedSeed = new Buffer(64);
+
+function onSeed(seed) {
+    if (!program.bench) {
+        console.log('Seed of size ' + seed.length + ' bytes received from seed generator. Available: ' + generator.getSeedAvailable());
+    }
+
+    if (typeof writeStream !== 'undefined') {
+        writeStream.write(seed);
+    }
+
+    totalRounds++;
+    if (totalRounds >= TOTAL_ROUNDS) {
+        process.exit(code=0);
+    }
+    global.setImmediate(playRound);
+}
+
+function onSeedError() {
+    throw new Error('Aborting to make sure all rounds completed ok. Rounds played: ' + totalRounds);
+}
+
 function playRound() {
-    generator.getSeedAsync(new Buffer(64),
-        function(seed) {
-            console.log('Seed of size ' + seed.length + ' bytes received from seed generator. Available: ' + generator.getSeedAvailable());
-
-            if (typeof writeStream !== 'undefined') {
-                writeStream.write(seed);
-            }
-
-            totalRounds++;
-            if (totalRounds >= TOTAL_ROUNDS) {
-                process.exit(code=0);
-            }
-            global.setImmediate(playRound);
-        },
-
-        function() {
-            throw new Error('Aborting to make sure all rounds completed ok. Rounds played: ' + totalRounds);
-        },
-        5000
-    );
+    generator.getSeedAsync((typeof writeStream !== 'undefined')? new Buffer(64): sharedSeed,
+        onSeed, onSeedError, 5000);
 }
 
-var generator = new seedgen(connectOptions={host: default_param(program.host, DEFAULT_HOST), port: default_param(program.port, DEFAULT_PORT)},
-	size=default_param(program.buffer, DEFAULT_BUFFER_SIZE), autoconnect=true);
+var tlsOptions = program.ca ? {ca: fs.readFileSync(program.ca)} : true;
+
+var connectOptions = default_param(program.host, DEFAULT_HOST).split(',').map(function(host) {
+    var options = {host: host, port: default_param(program.port, DEFAULT_PORT)};
+
+    if (program.tls) {
+        options.tls = tlsOptions;
+    }
 
-generator.on('connect', function () { 
-    console.log('remote seed generator ' + generator.getConnectOptions().host + ' connected');
+    return options;
 });
 
-generator.on('disconnect', function(message) {
-    console.log('remote seed generator ' + generator.getConnectOptions().host + ' disconnected ' + message);
+var generator = new seedgen(connectOptions,
+	size=default_param(program.buffer, DEFAULT_BUFFER_SIZE), autoconnect=true);
+
+generator.on('connect', function (options) {
+    console.log('remote seed generator ' + options.host + ' connected');
 });
 
-generator.on('entropy-received', function(seed) {
-    console.log('received: ' + seed.length + ' bytes of entropy from ' + generator.getConnectOptions().host + '. Entropy available: ' + generator.getSeedAvailable());
+generator.on('disconnect', function(message, options) {
+    console.log('remote seed generator ' + options.host + ' disconnected ' + message);
 });
 
+if (!program.bench) {
+    generator.on('entropy-received', function(seed, options) {
+        console.log('received: ' + seed.length + ' bytes of entropy from ' + options.host + '. Entropy available: ' + generator.getSeedAvailable());
+    });
+}
+
 var started = false;
 generator.on('connect',
     function() {
@@ -89,6 +118,9 @@ generator.on('connect',
 
         /* Start when the generator is ready */
 	startTime = process.uptime();
+        if (program.bench) {
+            benchStats = new BenchStats();
+        }
         playRound();
     }
 );
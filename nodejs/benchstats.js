@@ -0,0 +1,42 @@
+/*
+ Rate and GC statistics for the example applications.
+*/
+var perfHooks = require('perf_hooks');
+
+function BenchStats() {
+	var self = this;
+
+	this.gcCount = 0;
+	this.gcTime = 0;
+	this.startTime = process.hrtime();
+	this.startHeap = process.memoryUsage().heapUsed;
+
+	this.observer = new perfHooks.PerformanceObserver(function(list) {
+		list.getEntries().forEach(function(entry) {
+			self.gcCount++;
+			self.gcTime += entry.duration;
+		});
+	});
+
+	this.observer.observe({ entryTypes: ['gc'] });
+}
+
+/**
+ Returns a one line report. rounds is the number of operations completed.
+*/
+BenchStats.prototype.report = function(rounds) {
+	var elapsed = process.hrtime(this.startTime);
+	var seconds = elapsed[0] + elapsed[1] / 1e9;
+	var memory = process.memoryUsage();
+
+	this.observer.disconnect();
+
+	return 'Rounds: ' + rounds +
+	       ' Rate: ' + Math.round(rounds / seconds) + ' rounds/s' +
+	       ' GC: ' + this.gcCount + ' collections (' + (this.gcCount * 1e6 / Math.max(rounds, 1)).toFixed(1) + ' per 1M rounds)' +
+	       ' ' + this.gcTime.toFixed(1) + ' ms (' + (this.gcTime * 100 / (seconds * 1000)).toFixed(2) + '% of run time)' +
+	       ' Heap: ' + Math.round(memory.heapUsed / 1024) + ' KiB (' +
+	       ((memory.heapUsed >= this.startHeap)? '+': '') + Math.round((memory.heapUsed - this.startHeap) / 1024) + ' KiB)';
+};
+
+module.exports = BenchStats;
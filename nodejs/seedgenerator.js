@@ -1,11 +1,43 @@
 var util = require('util');
 var net = require('net');
+var tls = require('tls');
 var buffer = require('buffer');
 var events = require('events');
 
 var REMOTE_CONNECT_RETRY_TIME = 1000;
 var SEED_BUFFER_DEFAULT_SIZE = 1024*1024;
 
+/* Don't ask for less entropy than this unless the buffer is smaller */
+var MIN_REQUEST_SIZE = 4096;
+
+/* Servers that send nothing for this long while requests are pending are dropped */
+var SOURCE_STALL_TIMEOUT = 3000;
+var HEALTH_CHECK_INTERVAL = 500;
+
+/* Weight of new samples in latency and throughput averages */
+var EWMA_WEIGHT = 0.2;
+
+/*
+ Refill controller. Bytes in flight are kept at INFLIGHT_GAIN times the bytes consumed
+ during one round trip. Below LOW_WATER_GAIN round trips of reserve (and never less
+ than a quarter of the buffer) everything missing is requested at once.
+*/
+var INFLIGHT_GAIN = 2;
+var LOW_WATER_GAIN = 4;
+var LOW_WATER_MIN_FRACTION = 0.25;
+
+var WAITER_QUEUE_INITIAL_SIZE = 64;
+var REQUEST_RING_INITIAL_SIZE = 16;
+var WAITER_POOL_MAX_SIZE = 1024;
+
+/* Waiter scheduling policies. See SeedGenerator.setSchedulingPolicy */
+var SCHEDULING_FIFO = 'fifo';
+var SCHEDULING_SIZE_CLASS = 'sizeclass';
+
+/* Upper bounds of the request size classes in bytes */
+var WAITER_SIZE_CLASSES = [64, 1024, 16384, Infinity];
+var WAITER_STARVATION_TIMEOUT = 100;
+
 function default_param(param, def) {
 	return typeof param !== 'undefined' ? param : def;
 }
@@ -15,28 +47,38 @@ function SeedBuffer(capacity) {
 	this.size = 0;
 	this.beginIndex = 0;
 	this.endIndex = 0;
+	/* Total bytes ever read. Used to measure the consumption rate. */
+	this.bytesRead = 0;
 }
 
-SeedBuffer.prototype.write = function (buf) {
+/**
+ Writes buf[start..end) to the buffer. start and end default to the whole buffer.
+*/
+SeedBuffer.prototype.write = function (buf, start, end) {
 	var capacity;
 	var bytesToWrite;
+	var length;
 
-	if (buf.length <= 0) return 0;
+	start = default_param(start, 0);
+	end = default_param(end, buf.length);
+	length = end - start;
+
+	if (length <= 0) return 0;
 
 	capacity = this.buffer.length;
-	bytesToWrite = (buf.length > this.getSpace())? this.getSpace(): buf.length;
+	bytesToWrite = (length > this.getSpace())? this.getSpace(): length;
 
  	/* We can write everything in one go */
 	if (bytesToWrite <= capacity - this.endIndex) {
-		buf.copy(this.buffer, this.endIndex, 0, bytesToWrite);
+		buf.copy(this.buffer, this.endIndex, start, start + bytesToWrite);
 
 		this.endIndex += bytesToWrite;
 		if (this.endIndex === capacity) this.endIndex= 0;
   	} else {
 		var size_1 = capacity - this.endIndex;
 
-		buf.copy(this.buffer, this.endIndex, 0, size_1);
-		buf.copy(this.buffer, 0, size_1, bytesToWrite);
+		buf.copy(this.buffer, this.endIndex, start, start + size_1);
+		buf.copy(this.buffer, 0, start + size_1, start + bytesToWrite);
 
 		this.endIndex = bytesToWrite - size_1;
 	}
@@ -62,272 +104,427 @@ SeedBuffer.prototype.getSpace = function() {
 	return this.capacity() - this.available();
 };
 
-SeedBuffer.prototype.read = function(buf)
+/**
+ Reads into buf[start..end). start and end default to the whole buffer.
+*/
+SeedBuffer.prototype.read = function(buf, start, end)
 {
 	var capacity;
 	var bytesToRead;
+	var length;
 
-	if (buf.length <= 0) return 0;
+	start = default_param(start, 0);
+	end = default_param(end, buf.length);
+	length = end - start;
+
+	if (length <= 0) return 0;
 
 	capacity = this.capacity();
-	bytesToRead = (buf.length > this.available())?this.available():buf.length;
+	bytesToRead = (length > this.available())?this.available():length;
 
 	/* Read in a single step */
 	if (bytesToRead <= capacity - this.beginIndex) {
-		this.buffer.copy(buf, 0, this.beginIndex, this.beginIndex + bytesToRead);
+		this.buffer.copy(buf, start, this.beginIndex, this.beginIndex + bytesToRead);
 		this.beginIndex += bytesToRead;
   	} else {
 		var size_1 = capacity - this.beginIndex;
 		var size_2 = bytesToRead - size_1;
 
-		this.buffer.copy(buf, 0, this.beginIndex, this.beginIndex + size_1);
-		this.buffer.copy(buf, size_1, 0, size_2);
+		this.buffer.copy(buf, start, this.beginIndex, this.beginIndex + size_1);
+		this.buffer.copy(buf, start + size_1, 0, size_2);
 		this.beginIndex = size_2;
   	}
 	if (this.beginIndex === capacity) this.beginIndex = 0;
 
   	this.size -= bytesToRead;
+	this.bytesRead += bytesToRead;
 
 	return bytesToRead;
 };
 
 
 /**
-connectOptions - See: net.connect
+ FIFO queue backed by a ring buffer. Grows by doubling, never shrinks.
 */
-function SeedGenerator(connectOptions, size, autoconnect, connectRetryTime) {
-	if (typeof connectOptions === 'undefined') {
-		throw new Error('connectOptions are required');
+function WaiterQueue(capacity) {
+	var size = 1;
+
+	while (size < default_param(capacity, WAITER_QUEUE_INITIAL_SIZE)) {
+		size *= 2;
 	}
 
-	this.connectOptions = connectOptions;
+	this.items = new Array(size);
+	this.mask = size - 1;
+	this.head = 0;
+	this.length = 0;
+}
 
-	this.autoconnect = default_param(autoconnect, true);
-	this.connected = false;
+WaiterQueue.prototype.push = function(item) {
+	if (this.length === this.items.length) {
+		var items = new Array(this.items.length * 2);
+		var i;
 
-	this.seedBuf = new SeedBuffer(default_param(size, SEED_BUFFER_DEFAULT_SIZE));
+		for (i = 0; i < this.length; i++) {
+			items[i] = this.items[(this.head + i) & this.mask];
+		}
+
+		this.items = items;
+		this.mask = items.length - 1;
+		this.head = 0;
+	}
+
+	this.items[(this.head + this.length) & this.mask] = item;
+	this.length++;
+};
+
+WaiterQueue.prototype.peek = function() {
+	return this.items[this.head];
+};
+
+WaiterQueue.prototype.shift = function() {
+	var item = this.items[this.head];
+
+	this.items[this.head] = undefined;
+	this.head = (this.head + 1) & this.mask;
+	this.length--;
+
+	return item;
+};
+
+
+/**
+ Requests sent to a server and not fully answered yet. The records are allocated
+ once and reused. Grows by doubling, never shrinks.
+*/
+function RequestRing(capacity) {
+	var size = 1;
+	var i;
+
+	while (size < default_param(capacity, REQUEST_RING_INITIAL_SIZE)) {
+		size *= 2;
+	}
+
+	this.records = new Array(size);
+	for (i = 0; i < size; i++) {
+		this.records[i] = { time: 0, remaining: 0, started: false };
+	}
+
+	this.mask = size - 1;
+	this.head = 0;
+	this.length = 0;
+}
+
+RequestRing.prototype.push = function(time, remaining) {
+	var record;
+
+	if (this.length === this.records.length) {
+		var records = new Array(this.records.length * 2);
+		var i;
+
+		for (i = 0; i < records.length; i++) {
+			records[i] = (i < this.length)? this.records[(this.head + i) & this.mask]:
+			             { time: 0, remaining: 0, started: false };
+		}
+
+		this.records = records;
+		this.mask = records.length - 1;
+		this.head = 0;
+	}
+
+	record = this.records[(this.head + this.length) & this.mask];
+	record.time = time;
+	record.remaining = remaining;
+	record.started = false;
+	this.length++;
+};
+
+RequestRing.prototype.peek = function() {
+	return this.records[this.head];
+};
+
+RequestRing.prototype.shift = function() {
+	this.head = (this.head + 1) & this.mask;
+	this.length--;
+};
+
+RequestRing.prototype.clear = function() {
+	this.head = 0;
+	this.length = 0;
+};
+
+
+/**
+ A single rngd server. Keeps its own connection, framing state and performance
+ estimates. All entropy received is written to the generator's seed buffer.
+*/
+function RemoteSource(generator, connectOptions) {
+	this.generator = generator;
+	this.connectOptions = connectOptions;
+	this.client = null;
+	this.connected = false;
 
 	this.seedPending = 0;
 	this.bytesPending = 0;
 	this.headerBuf = new Buffer(4);
-	this.headerBytesPending = 0;
+	this.headerBytesReceived = 0;
+	/* Reused for requests whenever the socket has nothing queued */
+	this.requestBuf = new Buffer(4);
 
 	this.idleInterval = null;
 	this.connectTimeout = null;
-	this.connectRetryTime = default_param(connectRetryTime, REMOTE_CONNECT_RETRY_TIME);
 	this.reconnectCount = 0;
-	this.readyTriggered = false;
-	this.seedWaiters = new Array();
-};
 
-util.inherits(SeedGenerator, events.EventEmitter);
+	/* Requests not fully answered yet. Used to measure latency. */
+	this.requests = new RequestRing();
+	/* Time from sending a request until its first byte arrives (ms) */
+	this.latency = 0;
+	/* Rate at which entropy arrives while requests are pending (bytes/s) */
+	this.throughput = 0;
+	this.bytesReceived = 0;
+	this.lastReceived = 0;
+	this.lastSample = 0;
+}
 
-SeedGenerator.prototype.connect = function() {
+/**
+ Options for tls.connect. connectOptions.tls is true or an object with
+ tls.connect options such as ca, cert and key. Only TLS 1.3 is accepted.
+*/
+RemoteSource.prototype.getTLSOptions = function() {
+	var options = {};
+	var key;
+
+	for (key in this.connectOptions) {
+		if (key !== 'tls') options[key] = this.connectOptions[key];
+	}
+
+	if (typeof this.connectOptions.tls === 'object') {
+		for (key in this.connectOptions.tls) {
+			options[key] = this.connectOptions.tls[key];
+		}
+	}
+
+	options.minVersion = 'TLSv1.3';
+
+	if (typeof options.servername === 'undefined' && options.host && net.isIP(options.host) === 0) {
+		options.servername = options.host;
+	}
+
+	return options;
+};
+
+RemoteSource.prototype.connect = function() {
 	var self = this;
+	var generator = this.generator;
+	var onConnect;
 
 	if (this.connected === true) {
 		console.log('Already connected!');
 		return;
 	}
 
-	if (self.idleInterval) {
-		clearInterval(self.idleInterval);
-		self.idleInterval = null;
-	}
+	this.clearTimers();
+
+	onConnect = function() {
+		self.connected = true;
+		self.reconnectCount = 0;
+		self.lastReceived = Date.now();
+		self.lastSample = self.lastReceived;
+
+		/* Idle handling. The server will close all idle connections after 30 seconds.
+		*/
+		self.idleInterval = setInterval(
+					function(source) {
+						source.sendIdle();
+					}, 10000, self);
 
-	if (self.connectTimeout) {
-		clearTimeout(self.connectTimeout);
-		self.connectTimeout = null;
+		generator.emit('connect', self.connectOptions);
+		generator.fill();
+	};
+
+	if (this.connectOptions.tls) {
+		this.client = tls.connect(this.getTLSOptions(), onConnect);
+	} else {
+		this.client = net.connect(this.connectOptions, onConnect);
 	}
 
-	this.client = net.connect(self.connectOptions,
+	this.client.on('data',
+		function(chunk) {
+			self.onData(chunk);
+		}
+	);
+
+	this.client.on('error',
+		function(msg) {
+			self.onDisconnect(msg);
+		}
+	);
+
+	this.client.on('close',
 		function() {
-			self.connected = true;
-			self.reconnectCount = 0;
-
-			/* Idle handling. The server will close all idle connections after 30 seconds.
-			*/
-			self.idleInterval = setInterval(
-						function(generator) {
-							generator.sendIdle();
-						}, 10000, self);
-
-			self.emit('connect');
-			self.fill();
+			self.onDisconnect();
 		}
 	);
+};
 
-	this.client.on('data', 
-		function(chunk) {
-			var endOffset = chunk.length;
-			var bytesConsumed = 0;
-			var seedSize = 0;
-                        var chunkBuf;
-
-			//console.log('Received packet. Size: ' + chunk.length);
-
-			while(bytesConsumed < chunk.length) {
-				/* Handle partial headers */
-				if (self.headerBytesPending > 0) {
-					chunk.copy(self.headerBuf, 4 - self.headerBytesPending, bytesConsumed, 4);
-					self.headerBytesPending = 0;
-					self.bytesPending = self.headerBuf.readUInt32BE(0);
-					self.seedPending -= self.bytesPending;
-					bytesConsumed += 4;
-
-				} else if (self.bytesPending === 0) {
-					/* Complete header */
-					if ((chunk.length - bytesConsumed) >= 4) {
-						self.bytesPending = chunk.readUInt32BE(bytesConsumed);
-						self.seedPending -= self.bytesPending;
-						bytesConsumed += 4;
-					} else {
-						chunk.copy(self.headerBuf, 0, bytesConsumed);
-						self.bytesPending = 0;
-						self.headerBytesPending = 4 - chunk.length;
-						break;
-					}
-				}
-
-				if (chunk.length >= (self.bytesPending + bytesConsumed)) {
-					endOffset = bytesConsumed + self.bytesPending;
-				} else {
-					endOffset = chunk.length;
-				}
-
-				seedSize = endOffset - bytesConsumed;
-				self.bytesPending -= seedSize;
-
-				/* Write in buf */
-                                chunkBuf = chunk.slice(bytesConsumed, endOffset);
-
-				self.seedBuf.write(chunkBuf);
-
-				bytesConsumed = endOffset;
-
-				self.emit('entropy-received', chunkBuf);
+RemoteSource.prototype.onData = function(chunk) {
+	var generator = this.generator;
+	var offset = 0;
+	var endOffset;
+	var copyLen;
+	var chunkBuf;
+
+	while (offset < chunk.length) {
+		/* Handle headers split between different packets */
+		if (this.bytesPending === 0) {
+			copyLen = Math.min(4 - this.headerBytesReceived, chunk.length - offset);
+			chunk.copy(this.headerBuf, this.headerBytesReceived, offset, offset + copyLen);
+			this.headerBytesReceived += copyLen;
+			offset += copyLen;
+
+			if (this.headerBytesReceived < 4) {
+				break;
 			}
 
-			/* Send available data to seed waiters */
-			while(self.seedWaiters.length > 0) {
-				var seedWaiter = self.seedWaiters[0];
+			this.headerBytesReceived = 0;
+			this.bytesPending = this.headerBuf.readUInt32BE(0);
+			this.seedPending = Math.max(this.seedPending - this.bytesPending, 0);
+			continue;
+		}
 
-				if (seedWaiter.buffer.length > self.getSeedAvailable()) {
-					break;
-				}
+		endOffset = Math.min(chunk.length, offset + this.bytesPending);
+		this.bytesPending -= endOffset - offset;
 
-				self.seedWaiters.shift();
+		generator.seedBuf.write(chunk, offset, endOffset);
+		this.onReceived(endOffset - offset);
 
-				var seedBuf = seedWaiter.buffer;
-				var seedCallback = seedWaiter.callback;
+		/* Only slice when somebody is listening */
+		if (generator.listenerCount('entropy-received') > 0) {
+			chunkBuf = chunk.slice(offset, endOffset);
+			generator.emit('entropy-received', chunkBuf, this.connectOptions);
+		}
 
-				self.seedBuf.read(seedBuf);
+		offset = endOffset;
+	}
 
-				if (seedWaiter.timer !== null) {
-					clearTimeout(seedWaiter.timer);
-				}
+	generator.serveWaiters();
 
-				global.setImmediate(function() { seedCallback(seedBuf); });
-			}
+	if (generator.readyTriggered === false && generator.seedBuf.isFull()) {
+		generator.readyTriggered = true;
+		generator.emit('ready');
+	}
 
-			if (self.readyTriggered === false && self.seedBuf.isFull()) {
-				self.readyTriggered = true;
-				self.emit('ready');
-			}
+	generator.fill();
+};
 
-			self.fill();
-		}
-	);
+/**
+ Updates latency and throughput estimates.
+*/
+RemoteSource.prototype.onReceived = function(length) {
+	var now = Date.now();
+	var request;
 
-	this.client.on('end',
-		function() {
-			if (self.idleInterval) {
-				clearInterval(self.idleInterval);
-				self.idleInterval = null;
-			}
+	this.bytesReceived += length;
+	this.lastReceived = now;
 
-			self.headerBytesPending = 0;
-			self.bytesPending = 0;
-			self.seedPending = 0;
-			self.connected = false;
+	while (length > 0 && this.requests.length > 0) {
+		request = this.requests.peek();
 
-			self.emit('disconnect');
+		if (request.started === false) {
+			request.started = true;
+			this.latency = (this.latency === 0)? now - request.time:
+			               this.latency + (now - request.time - this.latency) * EWMA_WEIGHT;
+		}
 
-			if (self.autoconnect === true) {
-				self.reconnect();
-			} else {
-				while(self.seedWaiters.length > 0) {
-					var seedWaiter = self.seedWaiters.shift();
+		if (request.remaining > length) {
+			request.remaining -= length;
+			break;
+		}
 
-					var seedCallback = seedWaiter.errorCallback;
+		length -= request.remaining;
+		this.requests.shift();
+	}
+};
 
-					if (seedWaiter.timer !== null) {
-						clearTimeout(seedWaiter.timer);
-					}
+RemoteSource.prototype.onDisconnect = function(msg) {
+	var generator = this.generator;
 
-					global.setImmediate(function() { seedCallback(); });
-				}
-			}
-		}
-	);
+	if (this.connected === false && this.client === null) {
+		return;
+	}
 
-	this.client.on('error',
-		function(msg) {
-			if (self.idleInterval) {
-				clearInterval(self.idleInterval);
-				self.idleInterval = null;
-			}
+	this.clearTimers();
 
-			self.headerBytesPending = 0;
-			self.bytesPending = 0;
-			self.seedPending = 0;
-			self.connected = false;
+	if (this.client !== null) {
+		this.client.removeAllListeners();
+		/* Errors after destroy must not crash the process */
+		this.client.on('error', function() {});
+		this.client.destroy();
+		this.client = null;
+	}
 
-			self.emit('disconnect', msg);
+	this.headerBytesReceived = 0;
+	this.bytesPending = 0;
+	this.seedPending = 0;
+	this.requests.clear();
+	this.connected = false;
 
-			if (self.autoconnect === true) {
-				self.reconnect();
-			} else {
-				while(self.seedWaiters.length > 0) {
-					var seedWaiter = self.seedWaiters.shift();
+	generator.emit('disconnect', msg, this.connectOptions);
 
-					var seedCallback = seedWaiter.errorCallback;
+	if (generator.autoconnect === true) {
+		this.reconnect();
+		/* Ask the remaining servers for what this one owed us */
+		generator.fill();
+	} else if (generator.isConnected() === false) {
+		generator.failWaiters();
+	}
+};
 
-					if (seedWaiter.timer !== null) {
-						clearTimeout(seedWaiter.timer);
-					}
+RemoteSource.prototype.clearTimers = function() {
+	if (this.idleInterval) {
+		clearInterval(this.idleInterval);
+		this.idleInterval = null;
+	}
 
-					global.setImmediate(function() { seedCallback(); });
-				}
-			}
-		}
-	);
+	if (this.connectTimeout) {
+		clearTimeout(this.connectTimeout);
+		this.connectTimeout = null;
+	}
+};
+
+/**
+ Gets a buffer for a request. The socket keeps a reference to buffers it could not
+ write immediately so the shared one is only reused when nothing is queued.
+*/
+RemoteSource.prototype.getRequestBuffer = function() {
+	if (this.client.writableLength === 0) {
+		return this.requestBuf;
+	}
+
+	return new Buffer(4);
 };
 
-SeedGenerator.prototype.sendIdle = function() {
-	var buf = new Buffer(4);
+RemoteSource.prototype.sendIdle = function() {
+	var buf = this.getRequestBuffer();
 	buf.writeUInt32BE(0, 0);
 	this.client.write(buf);
 };
 
-SeedGenerator.prototype.fill = function() {
-	var entropyMissing = this.seedBuf.getSpace() - (this.seedPending + this.bytesPending);
+RemoteSource.prototype.request = function(entropyRequested) {
+	var buf = this.getRequestBuffer();
 
-	/* Don't ask the remote source for little amounts of entropy but wait until more is needed */
-	if (entropyMissing < 4096 && entropyMissing < this.seedBuf.capacity()) {
-		return;
+	/* Stall detection starts with the first pending request */
+	if (this.seedPending + this.bytesPending === 0) {
+		this.lastReceived = Date.now();
 	}
 
-	if (this.connected === true) {
-		//console.log('Requesting ' + entropyMissing + ' bytes of entropy from server');
-		var buf = new Buffer(4);
-		buf.writeUInt32BE(entropyMissing, 0);
-		this.client.write(buf);
-		this.seedPending += entropyMissing;
-	}
+	buf.writeUInt32BE(entropyRequested, 0);
+	this.client.write(buf);
+
+	this.seedPending += entropyRequested;
+	this.requests.push(Date.now(), entropyRequested);
 };
 
-SeedGenerator.prototype.reconnect = function() {
+RemoteSource.prototype.reconnect = function() {
 	var delay;
 	var self = this;
 
@@ -336,32 +533,632 @@ SeedGenerator.prototype.reconnect = function() {
 	}
 
 	if (self.connectTimeout === null) {
-		delay = self.connectRetryTime + (self.connectRetryTime * self.reconnectCount * 1.5);
+		delay = self.generator.connectRetryTime + (self.generator.connectRetryTime * self.reconnectCount * 1.5);
 
-		if (delay < self.connectRetryTime * 10) {
+		if (delay < self.generator.connectRetryTime * 10) {
 			self.reconnectCount++;
 		}
 
-		console.log('Attempting connection after ' + delay + 'ms');
+		console.log('Attempting connection to ' + self.connectOptions.host + ' after ' + delay + 'ms');
 
-		self.connectTimeout = setTimeout(function() { self.connect(); }, delay);
+		self.connectTimeout = setTimeout(function() { self.connectTimeout = null; self.connect(); }, delay);
 	}
 };
 
-SeedGenerator.prototype.stop = function() {
-	if (this.connectTimeout) {
-		clearTimeout(this.connectTimeout);
-		this.connectTimeout = null;
+RemoteSource.prototype.stop = function() {
+	this.clearTimers();
+	this.connected = false;
+
+	if (this.client !== null) {
+		this.client.end();
 	}
+};
 
-	if (this.idleInterval) {
-		clearInterval(this.idleInterval);
-		this.idleInterval = null;
+/**
+ Called periodically. Samples throughput and ejects servers that stopped
+ sending while requests are pending.
+*/
+RemoteSource.prototype.checkHealth = function(now) {
+	var elapsed;
+
+	if (this.connected === false) {
+		return;
+	}
+
+	if (this.seedPending + this.bytesPending === 0) {
+		this.bytesReceived = 0;
+		this.lastReceived = now;
+		this.lastSample = now;
+		return;
+	}
+
+	if (now - this.lastReceived >= this.generator.stallTimeout) {
+		console.log('Remote seed generator ' + this.connectOptions.host + ' stalled. Ejecting');
+		this.onDisconnect('stalled');
+		return;
+	}
+
+	elapsed = now - this.lastSample;
+	if (elapsed > 0 && this.bytesReceived > 0) {
+		var rate = this.bytesReceived * 1000 / elapsed;
+
+		this.throughput = (this.throughput === 0)? rate: this.throughput + (rate - this.throughput) * EWMA_WEIGHT;
+		this.bytesReceived = 0;
+		this.lastSample = now;
+	}
+};
+
+/**
+ Share of refill requests for this server. Servers that answer quickly and
+ deliver more bytes per second get a bigger share.
+*/
+RemoteSource.prototype.getWeight = function(defaultThroughput, defaultLatency) {
+	var throughput = (this.throughput > 0)? this.throughput: defaultThroughput;
+	var latency = (this.latency > 0)? this.latency: defaultLatency;
+
+	return throughput / Math.max(latency, 1);
+};
+
+
+/**
+connectOptions - See: net.connect. May be an Array to use several servers in parallel.
+*/
+function SeedGenerator(connectOptions, size, autoconnect, connectRetryTime, stallTimeout) {
+	var i;
+	var optionsList;
+
+	if (typeof connectOptions === 'undefined') {
+		throw new Error('connectOptions are required');
+	}
+
+	optionsList = Array.isArray(connectOptions)? connectOptions: [connectOptions];
+
+	if (optionsList.length === 0) {
+		throw new Error('connectOptions are required');
+	}
+
+	this.connectOptions = connectOptions;
+
+	this.autoconnect = default_param(autoconnect, true);
+	this.connected = false;
+
+	this.seedBuf = new SeedBuffer(default_param(size, SEED_BUFFER_DEFAULT_SIZE));
+
+	this.connectRetryTime = default_param(connectRetryTime, REMOTE_CONNECT_RETRY_TIME);
+	this.stallTimeout = default_param(stallTimeout, SOURCE_STALL_TIMEOUT);
+	this.healthInterval = null;
+	this.readyTriggered = false;
+	this.seedWaiters = null;
+	this.setSchedulingPolicy(SCHEDULING_SIZE_CLASS);
+
+	/* Waiters whose callbacks run on the next setImmediate */
+	this.completedWaiters = new WaiterQueue();
+	this.completeScheduled = false;
+	this.waiterPool = new Array();
+
+	/* Bytes already read into partially filled waiters. See reservedSpace. */
+	this.partialBytes = 0;
+
+	/* Refill controller state. See updateRefillTarget */
+	this.consumptionRate = 0;
+	this.roundTripTime = 0;
+	this.inflightTarget = 0;
+	this.lowWater = this.seedBuf.capacity();
+	this.lastBytesRead = 0;
+	this.lastRateSample = Date.now();
+
+	/* Counters reported by getMetrics */
+	this.requestCount = 0;
+	this.bytesRequested = 0;
+	this.urgentRefills = 0;
+	this.underruns = 0;
+
+	this.sources = new Array();
+	for (i = 0; i < optionsList.length; i++) {
+		this.sources.push(new RemoteSource(this, optionsList[i]));
+	}
+
+	/* Scratch space for fill. Reused on every call. */
+	this.fillSources = new Array(this.sources.length);
+	this.fillWeights = new Array(this.sources.length);
+
+	/* Keep the connected flag up to date */
+	this.on('connect', function() { this.connected = true; });
+	this.on('disconnect', function() { this.connected = this.isConnected(); });
+};
+
+util.inherits(SeedGenerator, events.EventEmitter);
+
+SeedGenerator.prototype.connect = function() {
+	var self = this;
+	var i;
+
+	if (this.healthInterval === null) {
+		this.healthInterval = setInterval(function() { self.checkHealth(); }, HEALTH_CHECK_INTERVAL);
+	}
+
+	for (i = 0; i < this.sources.length; i++) {
+		if (this.sources[i].connected === false && this.sources[i].client === null) {
+			this.sources[i].connect();
+		}
+	}
+};
+
+SeedGenerator.prototype.checkHealth = function() {
+	var now = Date.now();
+	var i;
+
+	for (i = 0; i < this.sources.length; i++) {
+		this.sources[i].checkHealth(now);
+	}
+
+	this.updateRefillTarget(now);
+};
+
+/**
+ Recomputes the refill targets from the consumption rate and the round trip time.
+ The rate follows increases immediately and decays slowly so a burst is not forgotten
+ on the next sample.
+*/
+SeedGenerator.prototype.updateRefillTarget = function(now) {
+	var elapsed = now - this.lastRateSample;
+	var bytesRead = this.seedBuf.bytesRead;
+	var capacity = this.seedBuf.capacity();
+	var totalLatency = 0;
+	var measured = 0;
+	var rate;
+	var bdp;
+	var i;
+
+	if (elapsed <= 0) {
+		return;
+	}
+
+	rate = (bytesRead - this.lastBytesRead) * 1000 / elapsed;
+	this.consumptionRate = (rate > this.consumptionRate)? rate:
+	                       this.consumptionRate + (rate - this.consumptionRate) * EWMA_WEIGHT;
+	this.lastBytesRead = bytesRead;
+	this.lastRateSample = now;
+
+	for (i = 0; i < this.sources.length; i++) {
+		if (this.sources[i].connected === true && this.sources[i].latency > 0) {
+			totalLatency += this.sources[i].latency;
+			measured++;
+		}
+	}
+
+	/* No round trip measured yet. Keep refilling everything. */
+	if (measured === 0) {
+		this.roundTripTime = 0;
+		this.inflightTarget = 0;
+		this.lowWater = capacity;
+		return;
+	}
+
+	this.roundTripTime = totalLatency / measured;
+
+	/* Bytes consumed during one round trip */
+	bdp = this.consumptionRate * this.roundTripTime / 1000;
+
+	this.inflightTarget = Math.min(Math.ceil(INFLIGHT_GAIN * bdp) + MIN_REQUEST_SIZE, capacity);
+	this.lowWater = Math.min(Math.max(Math.ceil(LOW_WATER_GAIN * bdp), Math.floor(capacity * LOW_WATER_MIN_FRACTION)), capacity);
+};
+
+SeedGenerator.prototype.allocWaiter = function(buffer, callback, errorCallback) {
+	var seedWaiter = (this.waiterPool.length > 0)? this.waiterPool.pop():
+	                 { buffer: null, callback: null, errorCallback: null, timer: null, failed: false, done: false, queued: false,
+	                   offset: 0, queuedTime: 0 };
+
+	seedWaiter.buffer = buffer;
+	seedWaiter.callback = callback;
+	seedWaiter.errorCallback = errorCallback;
+	seedWaiter.timer = null;
+	seedWaiter.failed = false;
+	seedWaiter.done = false;
+	seedWaiter.queued = false;
+	seedWaiter.offset = 0;
+
+	return seedWaiter;
+};
+
+SeedGenerator.prototype.freeWaiter = function(seedWaiter) {
+	seedWaiter.buffer = null;
+	seedWaiter.callback = null;
+	seedWaiter.errorCallback = null;
+	seedWaiter.timer = null;
+
+	/* Timed out waiters are still referenced by seedWaiters. Leave them to the GC. */
+	if (seedWaiter.queued === false && this.waiterPool.length < WAITER_POOL_MAX_SIZE) {
+		this.waiterPool.push(seedWaiter);
+	}
+};
+
+/**
+ Queues the waiter's callback. All callbacks queued in the same tick run from a single setImmediate.
+*/
+SeedGenerator.prototype.completeWaiter = function(seedWaiter, failed) {
+	if (seedWaiter.timer !== null) {
+		clearTimeout(seedWaiter.timer);
+		seedWaiter.timer = null;
+	}
+
+	seedWaiter.failed = failed;
+	seedWaiter.done = true;
+	this.completedWaiters.push(seedWaiter);
+
+	if (this.completeScheduled === false) {
+		this.completeScheduled = true;
+		global.setImmediate(runCompletedWaiters, this);
+	}
+};
+
+function runCompletedWaiters(self) {
+	var count = self.completedWaiters.length;
+	var seedWaiter;
+
+	self.completeScheduled = false;
+
+	/* Waiters completed by these callbacks run on the next round */
+	while (count-- > 0) {
+		seedWaiter = self.completedWaiters.shift();
+
+		if (seedWaiter.failed === false) {
+			seedWaiter.callback(seedWaiter.buffer);
+		} else if (typeof seedWaiter.errorCallback === 'function') {
+			seedWaiter.errorCallback();
+		}
+
+		self.freeWaiter(seedWaiter);
+	}
+}
+
+function onWaiterTimeout(self, seedWaiter) {
+	seedWaiter.timer = null;
+
+	/* Stays in seedWaiters until it reaches the head. See serveWaiters. */
+	self.completeWaiter(seedWaiter, true);
+
+	/* Bytes taken by a partially filled waiter are returned for the others */
+	if (self.returnPartial(seedWaiter) > 0) {
+		self.serveWaiters();
+	}
+}
+
+/**
+ Returns the bytes read into a waiter that will not complete to the seed buffer and
+ wipes them from the waiter's buffer, which the caller keeps. They are appended after
+ newer bytes so they no longer come out in the order they were received.
+ Returns the number of bytes returned.
+*/
+SeedGenerator.prototype.returnPartial = function(seedWaiter) {
+	var returned;
+
+	if (seedWaiter.offset === 0) {
+		return 0;
+	}
+
+	returned = this.seedBuf.write(seedWaiter.buffer, 0, seedWaiter.offset);
+	seedWaiter.buffer.fill(0, 0, seedWaiter.offset);
+	this.partialBytes -= seedWaiter.offset;
+	seedWaiter.offset = 0;
+
+	return returned;
+};
+
+/**
+ Space kept free for the bytes of partially filled waiters so they fit back in the
+ buffer if the waiter times out. At most half the buffer is kept so requests larger
+ than the buffer still make progress; the excess of those is lost on a timeout.
+*/
+SeedGenerator.prototype.reservedSpace = function() {
+	return Math.min(this.partialBytes, Math.floor(this.seedBuf.capacity() / 2));
+};
+
+/**
+ Selects how waiting getSeedAsync requests are served.
+
+ 'fifo'      - In order of arrival. A large request at the head blocks everything behind it.
+ 'sizeclass' - Requests are grouped by size and smaller classes are served first. Requests in
+               the largest class are filled partially as bytes arrive. A class whose oldest
+               request has waited longer than starvationTimeout ms is served before all others.
+
+ Can only be changed while no requests are waiting.
+*/
+SeedGenerator.prototype.setSchedulingPolicy = function(policy, starvationTimeout) {
+	var i;
+
+	if (policy !== SCHEDULING_FIFO && policy !== SCHEDULING_SIZE_CLASS) {
+		throw new Error('Unknown scheduling policy: ' + policy);
+	}
+
+	if (this.seedWaiters !== null && this.getWaiterCount() > 0) {
+		throw new Error('Cannot change the scheduling policy while requests are waiting');
+	}
+
+	this.schedulingPolicy = policy;
+	this.starvationTimeout = default_param(starvationTimeout, WAITER_STARVATION_TIMEOUT);
+	this.sizeClasses = (policy === SCHEDULING_FIFO)? [Infinity]: WAITER_SIZE_CLASSES;
+
+	this.seedWaiters = new Array();
+	for (i = 0; i < this.sizeClasses.length; i++) {
+		this.seedWaiters.push(new WaiterQueue());
+	}
+};
+
+SeedGenerator.prototype.getSizeClass = function(length) {
+	var i = 0;
+
+	while (length > this.sizeClasses[i]) {
+		i++;
+	}
+
+	return i;
+};
+
+SeedGenerator.prototype.getWaiterCount = function() {
+	var count = 0;
+	var i;
+
+	for (i = 0; i < this.seedWaiters.length; i++) {
+		count += this.seedWaiters[i].length;
+	}
+
+	return count;
+};
+
+/**
+ Gets the size class whose oldest waiter is starving or -1.
+*/
+SeedGenerator.prototype.getStarvingClass = function() {
+	var now = 0;
+	var oldest = -1;
+	var oldestTime = 0;
+	var queue;
+	var i;
+
+	/* The smallest class is always served first */
+	for (i = 1; i < this.seedWaiters.length; i++) {
+		queue = this.seedWaiters[i];
+
+		if (queue.length === 0 || queue.peek().done === true) {
+			continue;
+		}
+
+		if (now === 0) {
+			now = Date.now();
+		}
+
+		if (now - queue.peek().queuedTime >= this.starvationTimeout &&
+		    (oldest < 0 || queue.peek().queuedTime < oldestTime)) {
+			oldest = i;
+			oldestTime = queue.peek().queuedTime;
+		}
+	}
+
+	return oldest;
+};
+
+/**
+ Returns true if a request of the given size class must wait behind queued requests.
+*/
+SeedGenerator.prototype.mustQueue = function(sizeClass) {
+	var i;
+
+	for (i = 0; i <= sizeClass; i++) {
+		if (this.seedWaiters[i].length > 0) {
+			return true;
+		}
+	}
+
+	return sizeClass < this.seedWaiters.length - 1 && this.getStarvingClass() >= 0;
+};
+
+/**
+ Serves waiters of a single size class. Returns false if the head waiter could not be completed.
+*/
+SeedGenerator.prototype.serveClass = function(sizeClass) {
+	var queue = this.seedWaiters[sizeClass];
+	var partial = (this.schedulingPolicy === SCHEDULING_SIZE_CLASS && sizeClass === this.seedWaiters.length - 1);
+	var seedWaiter;
+	var available;
+
+	while (queue.length > 0) {
+		seedWaiter = queue.peek();
+
+		/* Timed out. Already completed. */
+		if (seedWaiter.done === true) {
+			queue.shift();
+			continue;
+		}
+
+		available = this.getSeedAvailable();
+
+		if (seedWaiter.buffer.length - seedWaiter.offset > available) {
+			/* Large requests take what is there instead of holding everything behind them */
+			if (partial === true && available > 0) {
+				available = this.seedBuf.read(seedWaiter.buffer, seedWaiter.offset, seedWaiter.buffer.length);
+				seedWaiter.offset += available;
+				this.partialBytes += available;
+			}
+
+			return false;
+		}
+
+		queue.shift();
+		seedWaiter.queued = false;
+
+		this.seedBuf.read(seedWaiter.buffer, seedWaiter.offset, seedWaiter.buffer.length);
+		this.partialBytes -= seedWaiter.offset;
+		this.completeWaiter(seedWaiter, false);
+	}
+
+	return true;
+};
+
+/**
+ Sends available data to seed waiters.
+*/
+SeedGenerator.prototype.serveWaiters = function() {
+	var starving;
+	var i;
+
+	if (this.seedWaiters.length > 1) {
+		starving = this.getStarvingClass();
+
+		/* Everything else waits until the starving request is done */
+		if (starving >= 0 && this.serveClass(starving) === false) {
+			return;
+		}
+	}
+
+	/* Bytes a smaller request is waiting for are not given to larger ones */
+	for (i = 0; i < this.seedWaiters.length; i++) {
+		if (this.serveClass(i) === false) {
+			break;
+		}
+	}
+};
+
+SeedGenerator.prototype.failWaiters = function() {
+	var seedWaiter;
+	var i;
+
+	for (i = 0; i < this.seedWaiters.length; i++) {
+		while(this.seedWaiters[i].length > 0) {
+			seedWaiter = this.seedWaiters[i].shift();
+
+			if (seedWaiter.done === false) {
+				seedWaiter.queued = false;
+				this.returnPartial(seedWaiter);
+				this.completeWaiter(seedWaiter, true);
+			}
+		}
+	}
+};
+
+SeedGenerator.prototype.isConnected = function() {
+	var i;
+
+	for (i = 0; i < this.sources.length; i++) {
+		if (this.sources[i].connected === true) {
+			return true;
+		}
+	}
+
+	return false;
+};
+
+SeedGenerator.prototype.getSeedPending = function() {
+	var pending = 0;
+	var i;
+
+	for (i = 0; i < this.sources.length; i++) {
+		pending += this.sources[i].seedPending + this.sources[i].bytesPending;
+	}
+
+	return pending;
+};
+
+SeedGenerator.prototype.fill = function() {
+	var pending = this.getSeedPending();
+	var reserved = this.reservedSpace();
+	var entropyMissing = this.seedBuf.getSpace() - reserved - pending;
+	var urgent = true;
+	var connected = this.fillSources;
+	var weights = this.fillWeights;
+	var totalThroughput = 0;
+	var totalLatency = 0;
+	var measured = 0;
+	var totalWeight = 0;
+	var share;
+	var source;
+	var i;
+
+	/* Don't ask the remote source for little amounts of entropy but wait until more is needed */
+	if (entropyMissing < MIN_REQUEST_SIZE && entropyMissing < this.seedBuf.capacity() - reserved) {
+		return;
+	}
+
+	/*
+	 Once the buffer has been filled and a round trip was measured only what is consumed
+	 during a round trip is kept in flight. Falling below the low watermark means
+	 consumption outran the estimate so everything missing is requested.
+	*/
+	if (this.readyTriggered === true && this.inflightTarget > 0 && this.seedBuf.available() >= this.lowWater) {
+		urgent = false;
+		entropyMissing = Math.min(entropyMissing, this.inflightTarget - pending);
+
+		if (entropyMissing < MIN_REQUEST_SIZE) {
+			return;
+		}
+	}
+
+	connected.length = 0;
+
+	for (i = 0; i < this.sources.length; i++) {
+		source = this.sources[i];
+
+		if (source.connected === true) {
+			connected.push(source);
+
+			if (source.throughput > 0 && source.latency > 0) {
+				totalThroughput += source.throughput;
+				totalLatency += source.latency;
+				measured++;
+			}
+		}
+	}
+
+	if (connected.length === 0) {
+		return;
+	}
+
+	if (urgent === true && this.readyTriggered === true) {
+		this.urgentRefills++;
+	}
+
+	/* Servers without measurements yet are treated as average */
+	for (i = 0; i < connected.length; i++) {
+		weights[i] = connected[i].getWeight((measured > 0)? totalThroughput / measured: 1,
+		                                    (measured > 0)? totalLatency / measured: 1);
+		totalWeight += weights[i];
+	}
+
+	//console.log('Requesting ' + entropyMissing + ' bytes of entropy from ' + connected.length + ' servers');
+
+	for (i = 0; i < connected.length && entropyMissing > 0; i++) {
+		share = Math.floor(entropyMissing * weights[i] / totalWeight);
+
+		/* Small shares are merged into the next server. The last one gets the remainder. */
+		if (i === connected.length - 1 || share > entropyMissing) {
+			share = entropyMissing;
+		} else if (share < MIN_REQUEST_SIZE) {
+			totalWeight -= weights[i];
+			continue;
+		}
+
+		connected[i].request(share);
+		this.requestCount++;
+		this.bytesRequested += share;
+		entropyMissing -= share;
+		totalWeight -= weights[i];
+	}
+};
+
+SeedGenerator.prototype.stop = function() {
+	var i;
+
+	if (this.healthInterval) {
+		clearInterval(this.healthInterval);
+		this.healthInterval = null;
 	}
 
 	this.autoconnect = false;
 	this.connected = false;
-	this.client.end();
+
+	for (i = 0; i < this.sources.length; i++) {
+		this.sources[i].stop();
+	}
 };
 
 /*
@@ -371,6 +1168,7 @@ SeedGenerator.prototype.stop = function() {
 */
 SeedGenerator.prototype.getSeed = function(buffer) {
 	if (this.seedBuf.available() < buffer.length) {
+		this.underruns++;
 		throw new Error('No entropy available');
 	}
 
@@ -378,32 +1176,39 @@ SeedGenerator.prototype.getSeed = function(buffer) {
 	this.fill();
 };
 
+/*
+ Fills a buffer with random bytes and calls callback(buffer) once done.
+ errorCallback is called if the generator is stopped or after timeout ms.
+ Without a timeout the request waits until random bytes are available.
+
+ Bytes already read into a request that fails are wiped from buffer and given to
+ later requests, after bytes received since. Random bytes are then not returned in
+ the order the servers sent them.
+*/
 SeedGenerator.prototype.getSeedAsync = function(buffer, callback, errorCallback, timeout) {
-	var self = this;
+	var seedWaiter = this.allocWaiter(buffer, callback, errorCallback);
+	var sizeClass = this.getSizeClass(buffer.length);
 
-	if (self.seedBuf.available() < buffer.length) {
-		if (self.connected === false && self.autoconnect === false) {
-			global.setImmediate(errorCallback);
+	if (this.seedBuf.available() < buffer.length || this.mustQueue(sizeClass)) {
+		if (this.connected === false && this.autoconnect === false) {
+			this.completeWaiter(seedWaiter, true);
 			return;
 		}
 
-		var timeoutTimer = null;
-		if (typeof errorCallback !== 'undefined') {
-			timeoutTimer = setTimeout(errorCallback, timeout);
-		}
-
-		if (typeof timeout !== 'undefined') {
-			timeout = 50;
+		if (typeof timeout !== 'undefined' && typeof errorCallback !== 'undefined') {
+			seedWaiter.timer = setTimeout(onWaiterTimeout, timeout, this, seedWaiter);
 		}
 
-		var req = { buffer: buffer, callback: callback, errorCallback: errorCallback, timer: timeoutTimer };
-		this.seedWaiters.push(req);
+		seedWaiter.queued = true;
+		seedWaiter.queuedTime = Date.now();
+		this.seedWaiters[sizeClass].push(seedWaiter);
+		this.serveWaiters();
 
 	} else {
-		self.seedBuf.read(buffer);
-		self.fill();
+		this.seedBuf.read(buffer);
+		this.fill();
 
-		global.setImmediate(function() { callback(buffer); });
+		this.completeWaiter(seedWaiter, false);
 	}
 };
 
@@ -416,4 +1221,45 @@ SeedGenerator.prototype.getConnectOptions = function() {
 	return this.connectOptions;
 };
 
+/**
+ Per server state. Latency in ms and throughput in bytes/s.
+*/
+SeedGenerator.prototype.getServerStats = function() {
+	var stats = new Array();
+	var i;
+
+	for (i = 0; i < this.sources.length; i++) {
+		stats.push({
+			connectOptions: this.sources[i].connectOptions,
+			connected: this.sources[i].connected,
+			pending: this.sources[i].seedPending + this.sources[i].bytesPending,
+			latency: this.sources[i].latency,
+			throughput: this.sources[i].throughput
+		});
+	}
+
+	return stats;
+};
+
+/**
+ Returns the refill controller state and counters.
+ consumptionRate is in bytes per second. roundTripTime is in ms.
+*/
+SeedGenerator.prototype.getMetrics = function() {
+	return {
+		available: this.seedBuf.available(),
+		capacity: this.seedBuf.capacity(),
+		pending: this.getSeedPending(),
+		waiters: this.getWaiterCount(),
+		consumptionRate: this.consumptionRate,
+		roundTripTime: this.roundTripTime,
+		inflightTarget: this.inflightTarget,
+		lowWater: this.lowWater,
+		requests: this.requestCount,
+		bytesRequested: this.bytesRequested,
+		urgentRefills: this.urgentRefills,
+		underruns: this.underruns
+	};
+};
+
 module.exports = SeedGenerator;
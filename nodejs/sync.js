@@ -8,6 +8,7 @@
 
 */
 var seedgen = require('./seedgenerator.js');
+var BenchStats = require('./benchstats.js');
 var fs = require('fs');
 var program = require('commander');
 
@@ -21,6 +22,7 @@ var DEFAULT_BUFFER_SIZE = 1024*1024;
 var totalRounds = 0;
 var started = false;
 var startTime = 0;
+var benchStats;
 
 function default_param(param, def) {
     return typeof param !== 'undefined' ? param : def;
@@ -29,9 +31,12 @@ function default_param(param, def) {
 program
   .version('1.0')
   .option('-b, --buffer <size>', 'Random bytes buffer size. (Default: ' + DEFAULT_BUFFER_SIZE + ')', parseInt)
-  .option('-h, --host <host>', 'Network RNGD host. (Default: ' + DEFAULT_HOST + ')')
+  .option('-B, --bench', 'Benchmark. Run rounds back to back and report rate and GC pressure on exit.')
+  .option('-h, --host <host>', 'Network RNGD host. Separate multiple hosts with commas. (Default: ' + DEFAULT_HOST + ')')
   .option('-o, --output <file>', 'Write all seeds received to this file.')
   .option('-p, --port <port>', 'Network RNGD port. (Default: ' + DEFAULT_PORT + ')', parseInt)
+  .option('-s, --tls', 'Connect with TLS 1.3.')
+  .option('-c, --ca <file>', 'Trusted CA certificates (PEM) for TLS. (Default: system CAs)')
   .parse(process.argv);
 
 if (program.output) {
@@ -40,36 +45,77 @@ if (program.output) {
 }
 
 process.on('exit', function() {
-    console.log('Total Rounds: ' + totalRounds + ' Rate: ' + totalRounds / (process.uptime() - startTime)  + ' rounds/s');
+    if (typeof benchStats !== 'undefined') {
+        console.log(benchStats.report(totalRounds));
+    } else {
+        console.log('Total Rounds: ' + totalRounds + ' Rate: ' + totalRounds / (process.uptime() - startTime)  + ' rounds/s');
+    }
 });
 
 process.on('SIGINT', function() {
     process.exit(1);
 });
 
-var generator = new seedgen(connectOptions={host: default_param(program.host, DEFAULT_HOST), port: default_param(program.port, DEFAULT_PORT)},
-	size=default_param(program.buffer, DEFAULT_BUFFER_SIZE), autoconnect=true);
+var tlsOptions = program.ca ? {ca: fs.readFileSync(program.ca)} : true;
+
+var connectOptions = default_param(program.host, DEFAULT_HOST).split(',').map(function(host) {
+    var options = {host: host, port: default_param(program.port, DEFAULT_PORT)};
+
+    if (program.tls) {
+        options.tls = tlsOptions;
+    }
 
-generator.on('connect', function () { 
-    console.log('remote seed generator ' + generator.getConnectOptions().host + ' connected');
+    return options;
 });
 
-generator.on('disconnect', function(message) {
-    console.log('remote seed generator ' + generator.getConnectOptions().host + ' disconnected ' + message);
+var generator = new seedgen(connectOptions,
+	size=default_param(program.buffer, DEFAULT_BUFFER_SIZE), autoconnect=true);
+
+generator.on('connect', function (options) {
+    console.log('remote seed generator ' + options.host + ' connected');
 });
 
-generator.on('entropy-received', function(seed) {
-    //console.log('received: ' + seed.length + ' bytes of entropy from ' + generator.getConnectOptions().host + '. Entropy available: ' + getSeedAvailable());
+generator.on('disconnect', function(message, options) {
+    console.log('remote seed generator ' + options.host + ' disconnected ' + message);
 });
 
+if (!program.bench) {
+    generator.on('entropy-received', function(seed, options) {
+        //console.log('received: ' + seed.length + ' bytes of entropy from ' + options.host + '. Entropy available: ' + getSeedAvailable());
+    });
+}
+
+/* Seeds written to a file are kept by the stream so only reuse the buffer without output */
+var sharedSeed = new Buffer(64);
+
+/*
+ Benchmark: Play rounds back to back and yield only when the generator runs dry.
+*/
+function playBench() {
+      for (;;) {
+          if (generator.getSeedAvailable() < sharedSeed.length) {
+              global.setImmediate(playBench);
+              return;
+          }
+
+          generator.getSeed(sharedSeed);
+
+          totalRounds++;
+
+          if (totalRounds >= TOTAL_ROUNDS) {
+              process.exit(code=0);
+          }
+      }
+}
+
 function playRound() {
-      var seed = new Buffer(64);
+      var seed = (typeof writeStream !== 'undefined')? new Buffer(64): sharedSeed;
       var i;
 
       for (i=0; i < ROUNDS_PER_MS; i++) {
           generator.getSeed(seed);
 
-	  //console.log('Seed of size ' + seed.length + ' bytes received from seed generator ' + generator.getConnectOptions().host + '. Available: ' + generator.getSeedAvailable());
+	  //console.log('Seed of size ' + seed.length + ' bytes received from seed generator.  Available: ' + generator.getSeedAvailable());
 
           if (typeof writeStream !== 'undefined') {
               writeStream.write(seed);
@@ -93,6 +139,12 @@ function playAll() {
 	started = true;
 	startTime = process.uptime();
 
+	if (program.bench) {
+		benchStats = new BenchStats();
+		global.setImmediate(playBench);
+		return;
+	}
+
 	global.setImmediate(playRound);
 }
 
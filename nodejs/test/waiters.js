@@ -0,0 +1,41 @@
+var assert = require('assert');
+var SeedGenerator = require('../seedgenerator.js');
+
+/*
+ A request in the largest size class that times out after being filled partially
+ must give its bytes back. Nothing connects: bytes are written to the seed buffer directly.
+*/
+function testPartialTimeout(done) {
+	var generator = new SeedGenerator({ host: '127.0.0.1', port: 1 }, 65536, true);
+	var buffer = new Buffer(32768);
+	var seed = new Buffer(1000);
+	var received = 0;
+
+	seed.fill(0x5a);
+	generator.seedBuf.write(seed);
+
+	generator.getSeedAsync(buffer,
+		function() {
+			received = buffer.length;
+		},
+		function() {
+			var i;
+
+			assert.strictEqual(generator.getSeedAvailable() + received, seed.length);
+			assert.strictEqual(generator.partialBytes, 0);
+
+			/* The bytes given back must not stay with the caller as well */
+			for (i = 0; i < buffer.length; i++) {
+				assert.strictEqual(buffer[i], 0);
+			}
+			done();
+		}, 50);
+
+	/* Everything available went to the waiter */
+	assert.strictEqual(generator.getSeedAvailable(), 0);
+	assert.strictEqual(generator.getMetrics().waiters, 1);
+}
+
+testPartialTimeout(function() {
+	console.log('ok');
+});
@@ -0,0 +1,156 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "admission.h"
+#include <string.h>
+
+/* Time constant of the supply and demand rates (ns) */
+#define ADMISSION_RATE_PERIOD (10000000000ULL)
+
+void admission_options_init(AdmissionOptions *options)
+{
+	memset(options, 0, sizeof(AdmissionOptions));
+	options->min_backoff_ms = ADMISSION_MIN_BACKOFF;
+}
+
+void admission_init(Admission *admission, const AdmissionOptions *options)
+{
+	memset(admission, 0, sizeof(Admission));
+	admission->options = *options;
+}
+
+int admission_check(Admission *admission, uint64_t client_outstanding, uint32_t bytes)
+{
+	int result = ADMISSION_OK;
+
+	/* Keep-alives are always answered */
+	if (!bytes) {
+		return ADMISSION_OK;
+	}
+
+	if (admission->options.client_limit && client_outstanding + bytes > admission->options.client_limit) {
+		result = ADMISSION_CLIENT_LIMIT;
+	} else if (admission->options.total_limit && admission->outstanding + bytes > admission->options.total_limit) {
+		result = ADMISSION_TOTAL_LIMIT;
+	}
+
+	if (result != ADMISSION_OK) {
+		admission->requests_refused++;
+		admission->bytes_refused += bytes;
+	}
+
+	return result;
+}
+
+void admission_add(Admission *admission, uint64_t bytes, int requested)
+{
+	admission->outstanding += bytes;
+
+	if (requested) {
+		admission->demanded += bytes;
+	}
+}
+
+void admission_remove(Admission *admission, uint64_t bytes)
+{
+	admission->outstanding = bytes < admission->outstanding? admission->outstanding - bytes: 0;
+}
+
+void admission_supply(Admission *admission, uint64_t bytes)
+{
+	admission->supplied += bytes;
+}
+
+void admission_update(Admission *admission, uint64_t now_ns)
+{
+	uint64_t elapsed;
+	double weight;
+
+	if (!admission->update_ns) {
+		admission->start_ns = now_ns;
+		admission->update_ns = now_ns;
+		return;
+	}
+
+	elapsed = now_ns - admission->update_ns;
+	if (!elapsed) {
+		return;
+	}
+
+	/* Exponential moving average with uneven update intervals. Plain average until a period has passed. */
+	if (now_ns - admission->start_ns < ADMISSION_RATE_PERIOD) {
+		weight = (double)elapsed / (double)(now_ns - admission->start_ns);
+	} else {
+		weight = (double)elapsed / (double)ADMISSION_RATE_PERIOD;
+	}
+
+	if (weight > 1) {
+		weight = 1;
+	}
+
+	admission->supply_rate += weight * ((double)admission->supplied * 1e9 / (double)elapsed - admission->supply_rate);
+	admission->demand_rate += weight * ((double)admission->demanded * 1e9 / (double)elapsed - admission->demand_rate);
+
+	admission->supplied = 0;
+	admission->demanded = 0;
+	admission->update_ns = now_ns;
+}
+
+unsigned int admission_backoff_ms(const Admission *admission)
+{
+	double backoff;
+
+	if (admission->supply_rate < 1) {
+		return ADMISSION_MAX_BACKOFF;
+	}
+
+	backoff = (double)admission->outstanding * 1000 / admission->supply_rate;
+
+	if (backoff < admission->options.min_backoff_ms) {
+		return admission->options.min_backoff_ms;
+	}
+
+	if (backoff > ADMISSION_MAX_BACKOFF) {
+		return ADMISSION_MAX_BACKOFF;
+	}
+
+	return (unsigned int)backoff;
+}
+
+void admission_get_stats(const Admission *admission, AdmissionStats *stats)
+{
+	stats->outstanding = admission->outstanding;
+	stats->supply_rate = (uint64_t)admission->supply_rate;
+	stats->demand_rate = (uint64_t)admission->demand_rate;
+	stats->requests_refused = admission->requests_refused;
+	stats->bytes_refused = admission->bytes_refused;
+}
@@ -0,0 +1,132 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Admission control for client requests.
+
+ Tracks the bytes requested by clients but not sent yet, the rate random data
+ is supplied by the devices and the rate it is requested. Requests that would
+ take the bytes outstanding for a client or for all clients over their limits
+ are refused. A refused client is given a backoff hint: the time needed to
+ serve everything outstanding at the current supply rate.
+*/
+
+/** Backoff hints are within these bounds (ms) */
+#define ADMISSION_MIN_BACKOFF (100)
+#define ADMISSION_MAX_BACKOFF (60000)
+
+/**
+* Result of admission_check.
+*/
+enum AdmissionResult {
+	ADMISSION_OK = 0,
+	/** The client has too much outstanding */
+	ADMISSION_CLIENT_LIMIT,
+	/** All clients together have too much outstanding */
+	ADMISSION_TOTAL_LIMIT
+};
+
+struct AdmissionOptions {
+	/** Maximum bytes outstanding per client. 0 for no limit. */
+	uint64_t client_limit;
+
+	/** Maximum bytes outstanding for all clients. 0 for no limit. */
+	uint64_t total_limit;
+
+	/** Smallest backoff hint (ms) */
+	unsigned int min_backoff_ms;
+};
+
+typedef struct AdmissionOptions AdmissionOptions;
+
+struct AdmissionStats {
+	uint64_t outstanding;
+
+	/** Bytes per second, averaged over about 10s */
+	uint64_t supply_rate;
+	uint64_t demand_rate;
+
+	uint64_t requests_refused;
+	uint64_t bytes_refused;
+};
+
+typedef struct AdmissionStats AdmissionStats;
+
+/**
+* Admission state. Kept by the caller.
+*/
+struct Admission {
+	AdmissionOptions options;
+
+	uint64_t outstanding;
+
+	/* Bytes since the last update */
+	uint64_t supplied;
+	uint64_t demanded;
+
+	double supply_rate;
+	double demand_rate;
+	uint64_t start_ns;
+	uint64_t update_ns;
+
+	uint64_t requests_refused;
+	uint64_t bytes_refused;
+};
+
+typedef struct Admission Admission;
+
+/**
+* Sets the default options: no limits.
+*/
+void admission_options_init(AdmissionOptions *options);
+
+void admission_init(Admission *admission, const AdmissionOptions *options);
+
+/**
+* Whether a client with client_outstanding bytes may request bytes more.
+* Refusals are counted.
+*
+* Returns: One of AdmissionResult.
+*/
+int admission_check(Admission *admission, uint64_t client_outstanding, uint32_t bytes);
+
+/**
+* Adds admitted bytes, or the bytes of clients taken over after a restart.
+*/
+void admission_add(Admission *admission, uint64_t bytes, int requested);
+
+/**
+* Removes bytes that were sent or belonged to a client that is gone.
+*/
+void admission_remove(Admission *admission, uint64_t bytes);
+
+/**
+* Counts random bytes supplied by the devices and sources.
+*/
+void admission_supply(Admission *admission, uint64_t bytes);
+
+/**
+* Updates the supply and demand rates. Call about once per second.
+*/
+void admission_update(Admission *admission, uint64_t now_ns);
+
+/**
+* Gets the backoff hint for refused clients in ms.
+*/
+unsigned int admission_backoff_ms(const Admission *admission);
+
+void admission_get_stats(const Admission *admission, AdmissionStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
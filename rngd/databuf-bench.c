@@ -0,0 +1,510 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ DataBuffer benchmarks.
+
+ Suites:
+ cycle     write + read of the same size through the ring. Aligned runs never
+           split an operation at the end of the ring, offset runs split one
+           write and one read per lap.
+ pair      read + unread at a fixed position, either contiguous or split across
+           the end of the ring. Shows the cost of the split copy on its own.
+ entropy   The pattern of the daemon: client sized reads, a partial unread for
+           every fourth (short) send and device sized writes to refill.
+ backends  Memory backends: create, first touch and steady state.
+
+ Each case is calibrated to run for at least MIN_RUN_NS and then repeated.
+ The median, the minimum and the interquartile range relative to the median
+ are reported. A large IQR means the machine was too noisy for the result.
+
+ Usage: databuf-bench [-b CAPACITY] [-n BYTES] [-r REPEATS] [-s SUITE]
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "databuf.h"
+
+#define DEFAULT_CAPACITY (64UL*1024UL*1024UL)
+#define DEFAULT_BYTES (4UL*1024UL*1024UL*1024UL)
+#define DEFAULT_REPEATS (11)
+#define MAX_REPEATS (101)
+
+/* Each timed run lasts at least this long */
+#define MIN_RUN_NS (10000000ULL)
+
+/* Same as a device transfer and a client frame in the daemon */
+#define WRITE_SIZE (512*16)
+#define READ_SIZE (65536)
+
+/* Default buffer size of the daemon */
+#define ENTROPY_CAPACITY (2UL*1024UL*1024UL)
+
+#define MAX_OP_SIZE (65536)
+
+#define GIB ((double)(1UL << 30))
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+struct Backend {
+	const char *name;
+	int legacy;
+	int flags;
+};
+
+typedef struct Backend Backend;
+
+static const Backend backends[] = {
+	{"malloc", 1, 0},
+	{"mmap", 0, 0},
+	{"hugepages", 0, DATA_BUF_HUGEPAGES},
+	{"hugepages+nodump", 0, DATA_BUF_HUGEPAGES | DATA_BUF_NODUMP},
+	{"hugepages+nodump+wipe", 0, DATA_BUF_HUGEPAGES | DATA_BUF_NODUMP | DATA_BUF_WIPE},
+	{"hugepages+nodump+wipe-nt", 0, DATA_BUF_HUGEPAGES | DATA_BUF_NODUMP | DATA_BUF_WIPE_STREAM},
+	{"hugepages+nodump+wipe+lock", 0, DATA_BUF_HUGEPAGES | DATA_BUF_NODUMP | DATA_BUF_WIPE | DATA_BUF_LOCK}
+};
+
+static const size_t op_sizes[] = {16, 64, 512, 4096, WRITE_SIZE, MAX_OP_SIZE};
+static const size_t capacities[] = {64UL*1024UL, ENTROPY_CAPACITY, DEFAULT_CAPACITY};
+
+/* Client request sizes. The largest is a full frame less the header. */
+static const size_t request_sizes[] = {16, 64, 4096, READ_SIZE - 4};
+
+/**
+* A benchmark case. run performs iterations and returns the elapsed time of the timed part.
+*/
+struct BenchCase {
+	DataBuffer *buf;
+	size_t size;
+
+	/* Operations and bytes moved per iteration */
+	unsigned int ops;
+	size_t bytes;
+
+	uint64_t (*run)(struct BenchCase *bench, uint64_t iterations);
+};
+
+typedef struct BenchCase BenchCase;
+
+static unsigned char scratch[MAX_OP_SIZE];
+static unsigned char write_buf[WRITE_SIZE];
+static int repeats = DEFAULT_REPEATS;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+* Moves both ends of an empty buffer forward by len bytes.
+*/
+static void advance(DataBuffer *buf, size_t len)
+{
+	size_t chunk;
+
+	while (len) {
+		chunk = len < MAX_OP_SIZE? len: MAX_OP_SIZE;
+		data_buf_write(buf, scratch, chunk);
+		data_buf_read(buf, scratch, chunk);
+		len -= chunk;
+	}
+}
+
+/**
+* Appends len bytes.
+*/
+static void fill(DataBuffer *buf, size_t len)
+{
+	size_t chunk;
+
+	while (len) {
+		chunk = len < MAX_OP_SIZE? len: MAX_OP_SIZE;
+		data_buf_write(buf, scratch, chunk);
+		len -= chunk;
+	}
+}
+
+static uint64_t run_cycle(BenchCase *bench, uint64_t iterations)
+{
+	uint64_t start;
+	uint64_t i;
+
+	start = now_ns();
+
+	for (i=0; i < iterations; i++) {
+		data_buf_write(bench->buf, scratch, bench->size);
+		data_buf_read(bench->buf, scratch, bench->size);
+	}
+
+	return now_ns() - start;
+}
+
+static uint64_t run_pair(BenchCase *bench, uint64_t iterations)
+{
+	uint64_t start;
+	uint64_t i;
+
+	start = now_ns();
+
+	for (i=0; i < iterations; i++) {
+		data_buf_read(bench->buf, scratch, bench->size);
+		data_buf_unread(bench->buf, scratch, bench->size);
+	}
+
+	return now_ns() - start;
+}
+
+static uint64_t run_entropy(BenchCase *bench, uint64_t iterations)
+{
+	uint64_t start;
+	uint64_t i;
+	size_t len;
+
+	start = now_ns();
+
+	for (i=0; i < iterations; i++) {
+		len = data_buf_read(bench->buf, scratch, bench->size);
+
+		/* Short send: half of the data goes back */
+		if (!(i & 3)) {
+			data_buf_unread(bench->buf, scratch + len / 2, len - len / 2);
+		}
+
+		while (data_buf_space(bench->buf) >= WRITE_SIZE) {
+			data_buf_write(bench->buf, write_buf, WRITE_SIZE);
+		}
+	}
+
+	return now_ns() - start;
+}
+
+/**
+* Calibrates, runs and reports a case.
+*/
+static void bench_case(const char *suite, const char *label, BenchCase *bench)
+{
+	double samples[MAX_REPEATS];
+	uint64_t iterations = 1;
+	uint64_t elapsed;
+	double median;
+	int i;
+
+	/* Warm up and find the number of iterations for MIN_RUN_NS */
+	for (;;) {
+		elapsed = bench->run(bench, iterations);
+
+		if (elapsed >= MIN_RUN_NS) {
+			break;
+		}
+
+		if (elapsed < MIN_RUN_NS / 16) {
+			iterations *= 16;
+		} else {
+			iterations = iterations * MIN_RUN_NS / (elapsed? elapsed: 1) + 1;
+		}
+	}
+
+	for (i=0; i < repeats; i++) {
+		elapsed = bench->run(bench, iterations);
+		samples[i] = (double)elapsed / (double)(iterations * bench->ops);
+	}
+
+	qsort(samples, (size_t)repeats, sizeof(double), compare_double);
+	median = samples[repeats / 2];
+
+	printf("%-8s %-36s %9.2f ns/op %8.2f GiB/s  min %9.2f  iqr %5.1f%%\n",
+		suite, label, median,
+		(double)bench->bytes / bench->ops / median * 1e9 / GIB,
+		samples[0],
+		(samples[repeats * 3 / 4] - samples[repeats / 4]) / median * 100.0);
+}
+
+static DataBuffer *create_buffer(size_t capacity)
+{
+	DataBuffer *buf;
+
+	buf = data_buf_create(capacity);
+	if (!buf) {
+		fprintf(stderr, "Unable to create buffer of %zu bytes: %s\n", capacity, strerror(errno));
+	}
+
+	return buf;
+}
+
+static void suite_cycle(void)
+{
+	BenchCase bench;
+	char label[64];
+	size_t c;
+	size_t s;
+	int offset;
+
+	for (c=0; c < COUNT(capacities); c++) {
+		for (s=0; s < COUNT(op_sizes); s++) {
+			if (op_sizes[s] > capacities[c] / 2) continue;
+
+			for (offset=0; offset < 2; offset++) {
+				bench.buf = create_buffer(capacities[c]);
+				if (!bench.buf) return;
+
+				bench.size = op_sizes[s];
+				bench.ops = 2;
+				bench.bytes = 2 * op_sizes[s];
+				bench.run = run_cycle;
+
+				/* Half full. Offset runs start half an operation off the ring end. */
+				advance(bench.buf, offset? op_sizes[s] / 2: 0);
+				fill(bench.buf, capacities[c] / 2);
+
+				snprintf(label, sizeof(label), "cap %8zu size %5zu %s", capacities[c], op_sizes[s], offset? "offset": "aligned");
+				bench_case("cycle", label, &bench);
+
+				data_buf_destroy(bench.buf);
+			}
+		}
+	}
+}
+
+static void suite_pair(void)
+{
+	BenchCase bench;
+	char label[64];
+	size_t c;
+	size_t s;
+	int split;
+
+	for (c=0; c < COUNT(capacities); c++) {
+		for (s=0; s < COUNT(op_sizes); s++) {
+			if (op_sizes[s] > capacities[c] / 2) continue;
+
+			for (split=0; split < 2; split++) {
+				bench.buf = create_buffer(capacities[c]);
+				if (!bench.buf) return;
+
+				bench.size = op_sizes[s];
+				bench.ops = 2;
+				bench.bytes = 2 * op_sizes[s];
+				bench.run = run_pair;
+
+				/* Readable data starts half an operation before the end when split */
+				advance(bench.buf, split? capacities[c] - op_sizes[s] / 2: 0);
+				fill(bench.buf, capacities[c] / 2);
+
+				snprintf(label, sizeof(label), "cap %8zu size %5zu %s", capacities[c], op_sizes[s], split? "split": "contiguous");
+				bench_case("pair", label, &bench);
+
+				data_buf_destroy(bench.buf);
+			}
+		}
+	}
+}
+
+static void suite_entropy(void)
+{
+	BenchCase bench;
+	char label[64];
+	size_t r;
+
+	for (r=0; r < COUNT(request_sizes); r++) {
+		bench.buf = create_buffer(ENTROPY_CAPACITY);
+		if (!bench.buf) return;
+
+		bench.size = request_sizes[r];
+		bench.run = run_entropy;
+
+		/* One op is a send. Every fourth send returns half of its data. */
+		bench.ops = 1;
+		bench.bytes = request_sizes[r] - request_sizes[r] / 8;
+
+		fill(bench.buf, ENTROPY_CAPACITY);
+
+		snprintf(label, sizeof(label), "cap %8lu request %5zu", ENTROPY_CAPACITY, request_sizes[r]);
+		bench_case("entropy", label, &bench);
+
+		data_buf_destroy(bench.buf);
+	}
+}
+
+static void run_backend(const Backend *backend, size_t capacity, uint64_t total_bytes)
+{
+	static unsigned char read_buf[READ_SIZE];
+	DataBuffer *buf;
+	uint64_t start;
+	uint64_t create_ns;
+	uint64_t fill_ns;
+	uint64_t run_ns;
+	uint64_t moved = 0;
+	uint64_t ops = 0;
+	size_t len;
+
+	start = now_ns();
+
+	if (backend->legacy) {
+		buf = data_buf_create(capacity);
+	} else {
+		buf = data_buf_create_ex(capacity, backend->flags);
+	}
+
+	if (!buf) {
+		printf("%-8s %-28s unavailable: %s\n", "backends", backend->name, strerror(errno));
+		return;
+	}
+
+	create_ns = now_ns() - start;
+
+	/* First touch */
+	start = now_ns();
+	while (data_buf_space(buf) >= WRITE_SIZE) {
+		data_buf_write(buf, write_buf, WRITE_SIZE);
+	}
+	fill_ns = now_ns() - start;
+
+	/* Steady state. Keep the buffer mostly full like the daemon does. */
+	start = now_ns();
+	while (moved < total_bytes) {
+		len = data_buf_read(buf, read_buf, READ_SIZE);
+		moved += len;
+		ops++;
+
+		while (data_buf_space(buf) >= WRITE_SIZE) {
+			data_buf_write(buf, write_buf, WRITE_SIZE);
+			ops++;
+		}
+	}
+	run_ns = now_ns() - start;
+
+	printf("%-8s %-28s create %9.3f ms  first touch %9.3f ms  steady %7.2f GiB/s  %6.1f ns/op\n",
+		"backends",
+		backend->name,
+		(double)create_ns / 1e6,
+		(double)fill_ns / 1e6,
+		(double)moved / GIB / ((double)run_ns / 1e9),
+		(double)run_ns / (double)ops);
+
+	data_buf_destroy(buf);
+}
+
+static void suite_backends(size_t capacity, uint64_t total_bytes)
+{
+	size_t i;
+
+	printf("backends capacity: %zu bytes. Moved per backend: %" PRIu64 " bytes\n", capacity, total_bytes);
+
+	for (i=0; i < COUNT(backends); i++) {
+		run_backend(&backends[i], capacity, total_bytes);
+	}
+}
+
+static void show_usage(const char *app)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS]\n\n"
+		"Options:\n"
+		"-b CAPACITY  Buffer capacity for the backends suite. (Default: %lu)\n"
+		"-h           Help. Show this message and exit\n"
+		"-n BYTES     Bytes moved per backend. (Default: %lu)\n"
+		"-r REPEATS   Timed runs per case (1 - %d). (Default: %d)\n"
+		"-s SUITE     Run only cycle, pair, entropy or backends\n"
+		, app, DEFAULT_CAPACITY, DEFAULT_BYTES, MAX_REPEATS, DEFAULT_REPEATS);
+}
+
+int main(int argc, char **argv)
+{
+	size_t capacity = DEFAULT_CAPACITY;
+	uint64_t total_bytes = DEFAULT_BYTES;
+	const char *suite = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:hn:r:s:")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (sscanf(optarg, "%zu", &capacity) != 1 || capacity < READ_SIZE) {
+					fprintf(stderr, "Invalid capacity\n");
+					return 1;
+				}
+				break;
+			case 'h':
+				show_usage(argv[0]);
+				return 0;
+			case 'n':
+				if (sscanf(optarg, "%" SCNu64, &total_bytes) != 1 || !total_bytes) {
+					fprintf(stderr, "Invalid number of bytes\n");
+					return 1;
+				}
+				break;
+			case 'r':
+				if (sscanf(optarg, "%d", &repeats) != 1 || repeats < 1 || repeats > MAX_REPEATS) {
+					fprintf(stderr, "Invalid number of repeats\n");
+					return 1;
+				}
+				break;
+			case 's':
+				suite = optarg;
+				if (strcmp(suite, "cycle") && strcmp(suite, "pair") && strcmp(suite, "entropy") && strcmp(suite, "backends")) {
+					fprintf(stderr, "Unknown suite: %s\n", suite);
+					return 1;
+				}
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (!suite || !strcmp(suite, "cycle")) suite_cycle();
+	if (!suite || !strcmp(suite, "pair")) suite_pair();
+	if (!suite || !strcmp(suite, "entropy")) suite_entropy();
+	if (!suite || !strcmp(suite, "backends")) suite_backends(capacity, total_bytes);
+
+	return 0;
+}
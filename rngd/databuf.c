@@ -24,11 +24,27 @@
  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/* MAP_ANONYMOUS, MAP_HUGETLB and the madvise flags */
+#define _GNU_SOURCE
+
 #include "databuf.h"
+#include "probes.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Huge page size assumed when rounding huge page mappings */
+#define HUGE_PAGE_SIZE (2UL*1024UL*1024UL)
+
+/* Below this wiping uses plain stores. Streaming stores only pay off for larger regions. */
+#define WIPE_STREAM_MIN (256)
 
 struct DataBuffer {
 	unsigned char *buffer;
@@ -36,8 +52,55 @@ struct DataBuffer {
 	size_t size;
 	size_t beg_index;
 	size_t end_index;
+
+	/* Length of the mapping. 0 if buffer was allocated with malloc. */
+	size_t map_size;
+	int flags;
 };
 
+/**
+ Zeroes consumed bytes. Streaming stores bypass the cache. They are slower when
+ the bytes were just read and are still cached, which is the usual case.
+*/
+static void data_buf_wipe(unsigned char *data, size_t data_len, int stream)
+{
+#if defined(__SSE2__)
+	__m128i zero;
+	size_t head;
+
+	if (stream && data_len >= WIPE_STREAM_MIN) {
+		head = (size_t)(-(uintptr_t)data & 15);
+		memset(data, 0, head);
+		data += head;
+		data_len -= head;
+
+		zero = _mm_setzero_si128();
+
+		while (data_len >= 64) {
+			_mm_stream_si128((__m128i *)data, zero);
+			_mm_stream_si128((__m128i *)(data + 16), zero);
+			_mm_stream_si128((__m128i *)(data + 32), zero);
+			_mm_stream_si128((__m128i *)(data + 48), zero);
+			data += 64;
+			data_len -= 64;
+		}
+
+		while (data_len >= 16) {
+			_mm_stream_si128((__m128i *)data, zero);
+			data += 16;
+			data_len -= 16;
+		}
+
+		_mm_sfence();
+	}
+#else
+	(void)stream;
+#endif
+
+	memset(data, 0, data_len);
+	__asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
 DataBuffer *data_buf_create(size_t capacity)
 {
 	DataBuffer *data_buf;
@@ -65,13 +128,91 @@ DataBuffer *data_buf_create(size_t capacity)
 	return data_buf;
 }
 
+DataBuffer *data_buf_create_ex(size_t capacity, int flags)
+{
+	DataBuffer *data_buf;
+	void *map = MAP_FAILED;
+	size_t map_size;
+	int saved_errno;
+
+	if (!capacity) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	data_buf = malloc(sizeof(DataBuffer));
+
+	if (!data_buf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(data_buf, 0, sizeof(DataBuffer));
+
+#ifdef MAP_HUGETLB
+	/* Only worth it when at least one huge page is filled. Fails unless huge pages are reserved. */
+	if ((flags & DATA_BUF_HUGEPAGES) && capacity >= HUGE_PAGE_SIZE && capacity <= SIZE_MAX - HUGE_PAGE_SIZE) {
+		map_size = (capacity + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	if (map == MAP_FAILED) {
+		map_size = capacity;
+		map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+		if (map == MAP_FAILED) {
+			free(data_buf);
+			return NULL;
+		}
+
+#ifdef MADV_HUGEPAGE
+		if (flags & DATA_BUF_HUGEPAGES) {
+			madvise(map, map_size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+#ifdef MADV_DONTDUMP
+	if (flags & DATA_BUF_NODUMP) {
+		madvise(map, map_size, MADV_DONTDUMP);
+	}
+#endif
+
+	if ((flags & DATA_BUF_LOCK) && mlock(map, map_size)) {
+		saved_errno = errno;
+		munmap(map, map_size);
+		free(data_buf);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	/* Anonymous mappings are already zeroed */
+	data_buf->buffer = map;
+	data_buf->map_size = map_size;
+	data_buf->capacity = capacity;
+	data_buf->flags = flags;
+
+	return data_buf;
+}
+
 void data_buf_destroy(DataBuffer *buf)
 {
 	if (!buf) {
 		return;
 	}
 
-	if (buf->buffer) {
+	if (buf->map_size) {
+		if (buf->flags & (DATA_BUF_WIPE | DATA_BUF_WIPE_STREAM)) {
+			data_buf_wipe(buf->buffer, buf->capacity, 0);
+		}
+
+		if (buf->flags & DATA_BUF_LOCK) {
+			munlock(buf->buffer, buf->map_size);
+		}
+
+		munmap(buf->buffer, buf->map_size);
+	} else if (buf->buffer) {
 		free(buf->buffer);
 	}
 
@@ -104,6 +245,8 @@ size_t data_buf_write(DataBuffer *buf, const unsigned char *data, size_t data_le
 
 	buf->size += bytes_to_write;
 
+	PROBE3(rngd, buffer_write, data_len, bytes_to_write, buf->size);
+
 	return bytes_to_write;
 }
 
@@ -136,6 +279,9 @@ size_t data_buf_read(DataBuffer *buf, unsigned char *data, size_t data_len)
 	/* Read in a single step */
 	if (bytes_to_read <= capacity - buf->beg_index) {
 		memcpy(data, buf->buffer + buf->beg_index, bytes_to_read);
+		if (buf->flags & (DATA_BUF_WIPE | DATA_BUF_WIPE_STREAM)) {
+			data_buf_wipe(buf->buffer + buf->beg_index, bytes_to_read, buf->flags & DATA_BUF_WIPE_STREAM);
+		}
 		buf->beg_index += bytes_to_read;
   	} else {
 		size_t size_1 = capacity - buf->beg_index;
@@ -143,12 +289,18 @@ size_t data_buf_read(DataBuffer *buf, unsigned char *data, size_t data_len)
 		
 		memcpy(data, buf->buffer + buf->beg_index, size_1);
 		memcpy(data + size_1, buf->buffer, size_2);
+		if (buf->flags & (DATA_BUF_WIPE | DATA_BUF_WIPE_STREAM)) {
+			data_buf_wipe(buf->buffer + buf->beg_index, size_1, buf->flags & DATA_BUF_WIPE_STREAM);
+			data_buf_wipe(buf->buffer, size_2, buf->flags & DATA_BUF_WIPE_STREAM);
+		}
 		buf->beg_index = size_2;
   	}
 
 	if (buf->beg_index == capacity) buf->beg_index = 0;
   	buf->size -= bytes_to_read;
 
+	PROBE3(rngd, buffer_read, data_len, bytes_to_read, buf->size);
+
 	return bytes_to_read;
 }
 
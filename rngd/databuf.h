@@ -10,11 +10,39 @@ extern "C" {
 struct DataBuffer;
 typedef struct DataBuffer DataBuffer;
 
+/**
+* Memory flags for data_buf_create_ex.
+*/
+enum DataBufferFlags {
+	/** Back the buffer with huge pages. Falls back to transparent huge pages. */
+	DATA_BUF_HUGEPAGES = 1,
+	/** Lock the buffer in memory so it is never swapped. */
+	DATA_BUF_LOCK = 2,
+	/** Exclude the buffer from core dumps. */
+	DATA_BUF_NODUMP = 4,
+	/** Wipe bytes as soon as they are read. */
+	DATA_BUF_WIPE = 8,
+	/**
+	 Wipe with non-temporal stores. Only pays off if the bytes read are not in the
+	 cache. See databuf-bench.
+	*/
+	DATA_BUF_WIPE_STREAM = 16
+};
+
 /**
 * Creates a data buffer with the given capacity.
 */
 DataBuffer *data_buf_create(size_t capacity);
 
+/**
+* Creates a data buffer with the given capacity backed by an anonymous mapping.
+* flags is a combination of DataBufferFlags. Flags not supported by the system are ignored
+* except DATA_BUF_LOCK.
+*
+* Returns: The buffer or NULL with errno set.
+*/
+DataBuffer *data_buf_create_ex(size_t capacity, int flags);
+
 /**
 * Destroys a data buffer.
 */
@@ -0,0 +1,422 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "devsel.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define DEVSEL_DEFAULT_WEIGHT (1)
+
+/* Longest configuration line */
+#define DEVSEL_LINE_MAX (4096)
+
+/* Most daemons sharing a host */
+#define DEVSEL_MAX_SHARDS (1024)
+
+/* Largest read weight */
+#define DEVSEL_MAX_WEIGHT (1000)
+
+struct DeviceEntry {
+	char *serial;
+	int allowed;
+	int denied;
+	int has_weight;
+	unsigned int weight;
+};
+
+typedef struct DeviceEntry DeviceEntry;
+
+struct DeviceSelection {
+	DeviceEntry *entries;
+	size_t num_entries;
+	size_t entries_size;
+
+	/* Set once an allow directive is seen */
+	int allow_list;
+	unsigned int default_weight;
+
+	unsigned int shard_index;
+	/* 0 if sharding is off */
+	unsigned int shard_count;
+};
+
+DeviceSelection *devsel_create(void)
+{
+	DeviceSelection *sel;
+
+	sel = malloc(sizeof(DeviceSelection));
+	if (!sel) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(sel, 0, sizeof(DeviceSelection));
+	sel->default_weight = DEVSEL_DEFAULT_WEIGHT;
+
+	return sel;
+}
+
+void devsel_destroy(DeviceSelection *sel)
+{
+	size_t i;
+
+	if (!sel) {
+		return;
+	}
+
+	for (i=0; i < sel->num_entries; i++) {
+		free(sel->entries[i].serial);
+	}
+
+	free(sel->entries);
+	free(sel);
+}
+
+static DeviceEntry *devsel_find(const DeviceSelection *sel, const char *serial)
+{
+	size_t i;
+
+	for (i=0; i < sel->num_entries; i++) {
+		if (!strcmp(sel->entries[i].serial, serial)) {
+			return &sel->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static DeviceEntry *devsel_entry(DeviceSelection *sel, const char *serial)
+{
+	DeviceEntry *entry;
+	DeviceEntry *entries;
+	size_t entries_size;
+
+	entry = devsel_find(sel, serial);
+	if (entry) {
+		return entry;
+	}
+
+	if (sel->num_entries == sel->entries_size) {
+		entries_size = sel->entries_size ? sel->entries_size * 2 : 16;
+
+		entries = realloc(sel->entries, entries_size * sizeof(DeviceEntry));
+		if (!entries) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		sel->entries = entries;
+		sel->entries_size = entries_size;
+	}
+
+	entry = &sel->entries[sel->num_entries];
+	memset(entry, 0, sizeof(DeviceEntry));
+
+	entry->serial = strdup(serial);
+	if (!entry->serial) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	sel->num_entries++;
+
+	return entry;
+}
+
+static int parse_uint(const char *str, unsigned int max, unsigned int *value)
+{
+	unsigned long number;
+	char *end;
+
+	if (*str < '0' || *str > '9') {
+		return -1;
+	}
+
+	errno = 0;
+	number = strtoul(str, &end, 10);
+	if (errno || *end || number > max) {
+		return -1;
+	}
+
+	*value = (unsigned int)number;
+
+	return 0;
+}
+
+static int parse_shard(const char *str, unsigned int *index, unsigned int *count)
+{
+	char buffer[32];
+	char *slash;
+
+	if (strlen(str) >= sizeof(buffer)) {
+		return -1;
+	}
+
+	strcpy(buffer, str);
+
+	slash = strchr(buffer, '/');
+	if (!slash) {
+		return -1;
+	}
+
+	*slash = '\0';
+
+	if (parse_uint(buffer, DEVSEL_MAX_SHARDS, index) || parse_uint(slash + 1, DEVSEL_MAX_SHARDS, count)) {
+		return -1;
+	}
+
+	if (*count == 0 || *index >= *count) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ Applies one directive. Returns 0, -1 with errno set to EINVAL for syntax errors or ENOMEM.
+*/
+static int devsel_directive(DeviceSelection *sel, char *line)
+{
+	char *saveptr;
+	char *keyword;
+	char *serial;
+	char *arg;
+	DeviceEntry *entry;
+	unsigned int weight = 0;
+
+	keyword = strtok_r(line, " \t\r\n", &saveptr);
+	if (!keyword) {
+		return 0;
+	}
+
+	if (!strcmp(keyword, "shard")) {
+		arg = strtok_r(NULL, " \t\r\n", &saveptr);
+		if (!arg || strtok_r(NULL, " \t\r\n", &saveptr) || parse_shard(arg, &sel->shard_index, &sel->shard_count)) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!strcmp(keyword, "default-weight")) {
+		arg = strtok_r(NULL, " \t\r\n", &saveptr);
+		if (!arg || strtok_r(NULL, " \t\r\n", &saveptr) || parse_uint(arg, DEVSEL_MAX_WEIGHT, &sel->default_weight)) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!strcmp(keyword, "weight")) {
+		arg = strtok_r(NULL, " \t\r\n", &saveptr);
+		if (!arg || parse_uint(arg, DEVSEL_MAX_WEIGHT, &weight)) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else if (!strcmp(keyword, "allow")) {
+		sel->allow_list = 1;
+	} else if (strcmp(keyword, "deny")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	serial = strtok_r(NULL, " \t\r\n", &saveptr);
+	if (!serial) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (; serial; serial = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		entry = devsel_entry(sel, serial);
+		if (!entry) {
+			return -1;
+		}
+
+		if (keyword[0] == 'w') {
+			entry->has_weight = 1;
+			entry->weight = weight;
+		} else if (keyword[0] == 'a') {
+			entry->allowed = 1;
+		} else {
+			entry->denied = 1;
+		}
+	}
+
+	return 0;
+}
+
+int devsel_load(DeviceSelection *sel, const char *path)
+{
+	FILE *file;
+	char line[DEVSEL_LINE_MAX];
+	char *comment;
+	unsigned int line_number = 0;
+	int status = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to open device configuration %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+
+		if (!strchr(line, '\n') && !feof(file)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "%s:%u: Line too long", path, line_number);
+			errno = EINVAL;
+			status = -1;
+			break;
+		}
+
+		comment = strchr(line, '#');
+		if (comment) {
+			*comment = '\0';
+		}
+
+		if (devsel_directive(sel, line)) {
+			if (errno == EINVAL) {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "%s:%u: Invalid directive", path, line_number);
+			} else {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "%s:%u: %s", path, line_number, strerror(errno));
+			}
+			status = -1;
+			break;
+		}
+	}
+
+	if (!status && ferror(file)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to read device configuration %s", path);
+		errno = EIO;
+		status = -1;
+	}
+
+	fclose(file);
+
+	return status;
+}
+
+int devsel_set_shard(DeviceSelection *sel, const char *shard)
+{
+	unsigned int index;
+	unsigned int count;
+
+	if (parse_shard(shard, &index, &count)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sel->shard_index = index;
+	sel->shard_count = count;
+
+	return 0;
+}
+
+void devsel_get_shard(const DeviceSelection *sel, unsigned int *index, unsigned int *count)
+{
+	*index = sel->shard_index;
+	*count = sel->shard_count;
+}
+
+/* splitmix64 finalizer */
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x;
+}
+
+unsigned int devsel_shard_of(const char *serial, unsigned int count)
+{
+	const unsigned char *p;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t score;
+	uint64_t best_score = 0;
+	unsigned int best = 0;
+	unsigned int i;
+
+	/* FNV-1a of the serial number */
+	for (p = (const unsigned char *)serial; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	/* Highest random weight. Ties go to the lower index. */
+	for (i=0; i < count; i++) {
+		score = mix64(hash ^ mix64((uint64_t)i + 1));
+
+		if (i == 0 || score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+int devsel_select(const DeviceSelection *sel, const char *serial, unsigned int *weight)
+{
+	const DeviceEntry *entry = NULL;
+
+	if (serial && *serial) {
+		entry = devsel_find(sel, serial);
+	} else {
+		serial = NULL;
+	}
+
+	if (entry && entry->denied) {
+		return DEVSEL_DENIED;
+	}
+
+	if (sel->allow_list && !(entry && entry->allowed)) {
+		return DEVSEL_NOT_ALLOWED;
+	}
+
+	if (sel->shard_count > 1) {
+		if (serial ? devsel_shard_of(serial, sel->shard_count) != sel->shard_index : sel->shard_index != 0) {
+			return DEVSEL_OTHER_SHARD;
+		}
+	}
+
+	*weight = (entry && entry->has_weight) ? entry->weight : sel->default_weight;
+
+	return DEVSEL_OPEN;
+}
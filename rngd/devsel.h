@@ -0,0 +1,83 @@
+#ifndef _DEVSEL_H_
+#define _DEVSEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Chooses the devices a daemon opens.
+
+ Devices are matched by serial number against allow and deny lists and get a
+ read weight. In shard mode several daemons on one host each claim a disjoint
+ subset of the devices. Every device belongs to the shard with the highest
+ hash of its serial number and the shard index (rendezvous hashing), so the
+ daemons agree without talking to each other and only the devices of a shard
+ that is added or removed move.
+
+ Configuration file, one directive per line. # starts a comment.
+
+   allow SERIAL...     Only open the listed devices. May be repeated.
+   deny SERIAL...      Never open the listed devices. Wins over allow.
+   weight N SERIAL...  Read weight of the listed devices.
+   default-weight N    Read weight of all other devices. (Default: 1)
+   shard INDEX/COUNT   Only open the devices of shard INDEX (0 to COUNT-1).
+*/
+struct DeviceSelection;
+typedef struct DeviceSelection DeviceSelection;
+
+/** Why a device is not opened */
+enum DeviceSelectionResult {
+	DEVSEL_OPEN = 0,
+	DEVSEL_DENIED,
+	DEVSEL_NOT_ALLOWED,
+	DEVSEL_OTHER_SHARD
+};
+
+/**
+* Creates a selection that opens every device with weight 1.
+*
+* Returns: The selection or NULL with errno set.
+*/
+DeviceSelection *devsel_create(void);
+
+void devsel_destroy(DeviceSelection *sel);
+
+/**
+* Adds the directives in a configuration file. Errors are reported through syslog.
+*
+* Returns: 0 on success, -1 with errno set. errno is EINVAL for syntax errors.
+*/
+int devsel_load(DeviceSelection *sel, const char *path);
+
+/**
+* Parses INDEX/COUNT and sets the shard. Overrides the configuration file.
+*
+* Returns: 0 on success, -1 with errno set to EINVAL.
+*/
+int devsel_set_shard(DeviceSelection *sel, const char *shard);
+
+/**
+* Gets the shard. count is 0 if sharding is off.
+*/
+void devsel_get_shard(const DeviceSelection *sel, unsigned int *index, unsigned int *count);
+
+/**
+* Decides whether to open a device. serial is NULL if the device has no serial number.
+* Devices without one are only opened by shard 0 and never match allow lists.
+*
+* Returns: DEVSEL_OPEN and the read weight or the reason the device is skipped.
+*/
+int devsel_select(const DeviceSelection *sel, const char *serial, unsigned int *weight);
+
+/**
+* Gets the shard a device belongs to out of count shards.
+*/
+unsigned int devsel_shard_of(const char *serial, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Handover of the daemon state to a new process.
+
+ Everything goes over a SOCK_SEQPACKET socketpair so each message arrives
+ whole together with its descriptors:
+ 1. HandoverHeader with the listener descriptors.
+ 2. Batches of HandoverClientRecord with the client descriptors.
+ 3. The buffered data in chunks of at most HANDOVER_DATA_CHUNK bytes.
+ The new process answers with a single HANDOVER_ACK byte.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "handover.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#define HANDOVER_MAGIC (0x52474e48U) /* "RNGH" */
+#define HANDOVER_VERSION (1)
+
+/* Clients (and descriptors) per message */
+#define HANDOVER_BATCH (64)
+
+#define HANDOVER_DATA_CHUNK (65536)
+
+#define HANDOVER_ACK ('A')
+
+/* Time allowed for each message before the handover is abandoned */
+#define HANDOVER_TIMEOUT (10)
+
+struct HandoverHeader {
+	uint32_t magic;
+	uint32_t version;
+	/* Bit n is set when listener slot n is sent */
+	uint32_t listeners;
+	uint32_t num_clients;
+	uint32_t next_client_id;
+	uint32_t reserved;
+	uint64_t data_len;
+};
+
+struct HandoverClientRecord {
+	uint32_t id;
+	uint32_t entropy_requested;
+	uint32_t entropy_pending;
+	uint32_t header_bytes_pending;
+	uint32_t keepalive_pending;
+	/* Overload notice state. Zero from daemons without admission control. */
+	uint32_t flags;
+	uint64_t idle_ms;
+};
+
+#define HANDOVER_CLIENT_OVERLOAD_NOTICES (1U << 0)
+#define HANDOVER_CLIENT_NOTICE_PENDING_SHIFT (1)
+#define HANDOVER_CLIENT_NOTICE_PENDING_MASK (0xfU)
+#define HANDOVER_CLIENT_NOTICE_BACKOFF_SHIFT (16)
+
+typedef struct HandoverHeader HandoverHeader;
+typedef struct HandoverClientRecord HandoverClientRecord;
+
+union HandoverControl {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+};
+
+static void handover_wipe(void *data, size_t data_len)
+{
+	memset(data, 0, data_len);
+	__asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
+static void handover_close_all(const int *fds, size_t num_fds)
+{
+	size_t i;
+
+	for (i = 0; i < num_fds; i++) {
+		close(fds[i]);
+	}
+}
+
+static int handover_set_timeout(int sock)
+{
+	struct timeval timeout;
+
+	timeout.tv_sec = HANDOVER_TIMEOUT;
+	timeout.tv_usec = 0;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int handover_sendmsg(int sock, const void *data, size_t data_len, const int *fds, size_t num_fds)
+{
+	union HandoverControl control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t status;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = data_len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num_fds) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	do {
+		status = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (status < 0 && errno == EINTR);
+
+	if (status < 0) {
+		return -1;
+	}
+
+	if ((size_t)status != data_len) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Receives one message of exactly data_len bytes with up to max_fds descriptors.
+*/
+static int handover_recvmsg(int sock, void *data, size_t data_len, int *fds, size_t max_fds, size_t *num_fds)
+{
+	union HandoverControl control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t status;
+	size_t count;
+
+	*num_fds = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = data_len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		status = recvmsg(sock, &msg, 0);
+	} while (status < 0 && errno == EINTR);
+
+	if (status < 0) {
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (*num_fds + count > max_fds) {
+			/* Never leak descriptors that were not asked for */
+			memcpy(fds + *num_fds, CMSG_DATA(cmsg), sizeof(int) * (max_fds - *num_fds));
+			handover_close_all((const int *)CMSG_DATA(cmsg) + (max_fds - *num_fds), count - (max_fds - *num_fds));
+			handover_close_all(fds, max_fds);
+			*num_fds = 0;
+			errno = EPROTO;
+			return -1;
+		}
+
+		memcpy(fds + *num_fds, CMSG_DATA(cmsg), sizeof(int) * count);
+		*num_fds += count;
+	}
+
+	if ((size_t)status != data_len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		handover_close_all(fds, *num_fds);
+		*num_fds = 0;
+		errno = status ? EPROTO : ECONNRESET;
+		return -1;
+	}
+
+	return 0;
+}
+
+int handover_spawn(char *const argv[], pid_t *pid)
+{
+	int fds[2];
+	char value[16];
+	long max_fd;
+	int fd;
+	sigset_t mask;
+	pid_t child;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		return -1;
+	}
+
+	if (handover_set_timeout(fds[0])) {
+		goto error;
+	}
+
+	max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0 || max_fd > INT_MAX) {
+		max_fd = INT_MAX;
+	}
+
+	/* setenv is not safe after fork. Set it here and remove it again below. */
+	snprintf(value, sizeof(value), "%d", fds[1]);
+	if (setenv(HANDOVER_ENV, value, 1)) {
+		goto error;
+	}
+
+	child = fork();
+	if (child == 0) {
+		for (fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
+			if (fd != fds[1]) {
+				close(fd);
+			}
+		}
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	unsetenv(HANDOVER_ENV);
+
+	if (child < 0) {
+		goto error;
+	}
+
+	close(fds[1]);
+	*pid = child;
+
+	return fds[0];
+
+error:
+	fd = errno;
+	close(fds[0]);
+	close(fds[1]);
+	errno = fd;
+	return -1;
+}
+
+int handover_send(int sock, const HandoverState *state)
+{
+	HandoverHeader header;
+	HandoverClientRecord records[HANDOVER_BATCH];
+	int fds[HANDOVER_BATCH];
+	size_t num_fds;
+	size_t i;
+	size_t batch;
+	size_t offset;
+	size_t chunk;
+	ssize_t status;
+	char ack;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HANDOVER_MAGIC;
+	header.version = HANDOVER_VERSION;
+	header.num_clients = (uint32_t)state->num_clients;
+	header.next_client_id = state->next_client_id;
+	header.data_len = state->data_len;
+
+	num_fds = 0;
+	for (i = 0; i < HANDOVER_MAX_LISTENERS; i++) {
+		if (state->listeners[i] >= 0) {
+			header.listeners |= 1U << i;
+			fds[num_fds++] = state->listeners[i];
+		}
+	}
+
+	if (handover_sendmsg(sock, &header, sizeof(header), fds, num_fds)) {
+		return -1;
+	}
+
+	for (offset = 0; offset < state->num_clients; offset += batch) {
+		batch = state->num_clients - offset;
+		if (batch > HANDOVER_BATCH) {
+			batch = HANDOVER_BATCH;
+		}
+
+		memset(records, 0, sizeof(records));
+		for (i = 0; i < batch; i++) {
+			const HandoverClient *client = &state->clients[offset + i];
+
+			records[i].id = client->id;
+			records[i].entropy_requested = client->entropy_requested;
+			records[i].entropy_pending = client->entropy_pending;
+			records[i].header_bytes_pending = client->header_bytes_pending;
+			records[i].keepalive_pending = (uint32_t)!!client->keepalive_pending;
+			records[i].idle_ms = client->idle_ms;
+			records[i].flags = (client->overload_notices ? HANDOVER_CLIENT_OVERLOAD_NOTICES : 0) |
+				(client->notice_pending & HANDOVER_CLIENT_NOTICE_PENDING_MASK) << HANDOVER_CLIENT_NOTICE_PENDING_SHIFT |
+				(client->notice_backoff_ms > 0xffffU ? 0xffffU : client->notice_backoff_ms) << HANDOVER_CLIENT_NOTICE_BACKOFF_SHIFT;
+			fds[i] = client->socket;
+		}
+
+		if (handover_sendmsg(sock, records, sizeof(HandoverClientRecord) * batch, fds, batch)) {
+			return -1;
+		}
+	}
+
+	for (offset = 0; offset < state->data_len; offset += chunk) {
+		chunk = state->data_len - offset;
+		if (chunk > HANDOVER_DATA_CHUNK) {
+			chunk = HANDOVER_DATA_CHUNK;
+		}
+
+		if (handover_sendmsg(sock, state->data + offset, chunk, NULL, 0)) {
+			return -1;
+		}
+	}
+
+	do {
+		status = recv(sock, &ack, 1, 0);
+	} while (status < 0 && errno == EINTR);
+
+	if (status < 0) {
+		return -1;
+	}
+
+	if (status != 1 || ack != HANDOVER_ACK) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	return 0;
+}
+
+int handover_inherited_socket(void)
+{
+	const char *value;
+	char *end;
+	long fd;
+
+	value = getenv(HANDOVER_ENV);
+	if (!value) {
+		return -1;
+	}
+
+	errno = 0;
+	fd = strtol(value, &end, 10);
+	if (errno || *end || end == value || fd < 0 || fd > INT_MAX) {
+		fd = -1;
+	}
+
+	unsetenv(HANDOVER_ENV);
+
+	return (int)fd;
+}
+
+int handover_receive(int sock, HandoverState *state)
+{
+	HandoverHeader header;
+	HandoverClientRecord records[HANDOVER_BATCH];
+	int fds[HANDOVER_BATCH];
+	size_t num_fds;
+	size_t i;
+	size_t j;
+	size_t batch;
+	size_t offset;
+	size_t chunk;
+	char ack = HANDOVER_ACK;
+	int saved_errno;
+
+	memset(state, 0, sizeof(HandoverState));
+	for (i = 0; i < HANDOVER_MAX_LISTENERS; i++) {
+		state->listeners[i] = -1;
+	}
+
+	if (handover_set_timeout(sock)) {
+		return -1;
+	}
+
+	if (handover_recvmsg(sock, &header, sizeof(header), fds, HANDOVER_MAX_LISTENERS, &num_fds)) {
+		return -1;
+	}
+
+	if (header.magic != HANDOVER_MAGIC || header.version != HANDOVER_VERSION || header.data_len > SIZE_MAX) {
+		handover_close_all(fds, num_fds);
+		errno = EPROTO;
+		return -1;
+	}
+
+	for (i = 0, j = 0; i < HANDOVER_MAX_LISTENERS; i++) {
+		if (header.listeners & (1U << i)) {
+			if (j == num_fds) {
+				break;
+			}
+
+			state->listeners[i] = fds[j++];
+		}
+	}
+
+	if (j != num_fds || i != HANDOVER_MAX_LISTENERS) {
+		handover_close_all(fds + j, num_fds - j);
+		errno = EPROTO;
+		goto error;
+	}
+
+	if (header.num_clients) {
+		state->clients = calloc(header.num_clients, sizeof(HandoverClient));
+		if (!state->clients) {
+			goto error;
+		}
+	}
+
+	if (header.data_len) {
+		state->data = malloc((size_t)header.data_len);
+		if (!state->data) {
+			goto error;
+		}
+	}
+
+	for (offset = 0; offset < header.num_clients; offset += batch) {
+		batch = header.num_clients - offset;
+		if (batch > HANDOVER_BATCH) {
+			batch = HANDOVER_BATCH;
+		}
+
+		if (handover_recvmsg(sock, records, sizeof(HandoverClientRecord) * batch, fds, batch, &num_fds)) {
+			goto error;
+		}
+
+		if (num_fds != batch) {
+			handover_close_all(fds, num_fds);
+			errno = EPROTO;
+			goto error;
+		}
+
+		for (i = 0; i < batch; i++) {
+			HandoverClient *client = &state->clients[offset + i];
+
+			client->socket = fds[i];
+			client->id = records[i].id;
+			client->entropy_requested = records[i].entropy_requested;
+			client->entropy_pending = records[i].entropy_pending;
+			client->header_bytes_pending = records[i].header_bytes_pending;
+			client->keepalive_pending = !!records[i].keepalive_pending;
+			client->idle_ms = records[i].idle_ms;
+			client->overload_notices = !!(records[i].flags & HANDOVER_CLIENT_OVERLOAD_NOTICES);
+			client->notice_pending = (records[i].flags >> HANDOVER_CLIENT_NOTICE_PENDING_SHIFT) & HANDOVER_CLIENT_NOTICE_PENDING_MASK;
+			client->notice_backoff_ms = records[i].flags >> HANDOVER_CLIENT_NOTICE_BACKOFF_SHIFT;
+		}
+
+		state->num_clients += batch;
+	}
+
+	for (offset = 0; offset < header.data_len; offset += chunk) {
+		chunk = (size_t)header.data_len - offset;
+		if (chunk > HANDOVER_DATA_CHUNK) {
+			chunk = HANDOVER_DATA_CHUNK;
+		}
+
+		if (handover_recvmsg(sock, state->data + offset, chunk, fds, 0, &num_fds)) {
+			goto error;
+		}
+	}
+
+	state->data_len = (size_t)header.data_len;
+	state->next_client_id = header.next_client_id;
+
+	if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	saved_errno = errno;
+
+	for (i = 0; i < HANDOVER_MAX_LISTENERS; i++) {
+		if (state->listeners[i] >= 0) {
+			close(state->listeners[i]);
+		}
+	}
+
+	for (i = 0; i < state->num_clients; i++) {
+		close(state->clients[i].socket);
+	}
+
+	if (state->data) {
+		handover_wipe(state->data, (size_t)header.data_len);
+	}
+
+	handover_state_free(state);
+
+	errno = saved_errno;
+	return -1;
+}
+
+int handover_wait(int sock, int timeout_ms)
+{
+	struct pollfd pfd;
+	char buf;
+	int status;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	do {
+		status = poll(&pfd, 1, timeout_ms);
+	} while (status < 0 && errno == EINTR);
+
+	if (status > 0) {
+		/* Nothing else is sent. This only returns at EOF. */
+		while (recv(sock, &buf, 1, 0) > 0) {
+		}
+	}
+
+	close(sock);
+
+	if (status == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return status < 0 ? -1 : 0;
+}
+
+void handover_state_free(HandoverState *state)
+{
+	if (state->data) {
+		handover_wipe(state->data, state->data_len);
+		free(state->data);
+	}
+
+	free(state->clients);
+
+	state->clients = NULL;
+	state->num_clients = 0;
+	state->data = NULL;
+	state->data_len = 0;
+}
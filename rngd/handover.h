@@ -0,0 +1,117 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Hands the listeners, the connected clients and the buffered random bytes
+ of a running daemon to a new daemon process.
+
+ The old process starts the new one with handover_spawn. The new process
+ finds the socket with handover_inherited_socket and calls handover_receive.
+ Sockets are passed with SCM_RIGHTS so connections are never closed.
+ The old process exits once the new one has acknowledged everything and the
+ new process uses handover_wait to know when the devices have been released.
+*/
+
+/** Environment variable with the handover socket of a new process */
+#define HANDOVER_ENV "QUANTIS_RNGD_HANDOVER_FD"
+
+/** Listener slots. Unused slots are -1. */
+#define HANDOVER_LISTENER_IPV4 (0)
+#define HANDOVER_LISTENER_IPV6 (1)
+#define HANDOVER_MAX_LISTENERS (2)
+
+/**
+* State of a connected client.
+*/
+struct HandoverClient {
+	int socket;
+	uint32_t id;
+	uint32_t entropy_requested;
+	uint32_t entropy_pending;
+	uint32_t header_bytes_pending;
+	int keepalive_pending;
+	/** Milliseconds since the last request */
+	uint64_t idle_ms;
+	/** Whether the client asked for overload notices */
+	int overload_notices;
+	/** Bytes of an overload notice not sent yet and its backoff hint (ms, up to 65535) */
+	uint32_t notice_pending;
+	uint32_t notice_backoff_ms;
+};
+
+typedef struct HandoverClient HandoverClient;
+
+struct HandoverState {
+	int listeners[HANDOVER_MAX_LISTENERS];
+
+	HandoverClient *clients;
+	size_t num_clients;
+
+	/** Next connection id for traces */
+	uint32_t next_client_id;
+
+	/** Buffered random bytes, oldest first */
+	unsigned char *data;
+	size_t data_len;
+};
+
+typedef struct HandoverState HandoverState;
+
+/**
+* Starts a new process with argv and the handover socket in HANDOVER_ENV.
+* argv[0] is looked up in PATH so an upgraded binary is started.
+* All other descriptors are closed in the new process.
+*
+* Returns: The socket to send the state to or -1 with errno set.
+*/
+int handover_spawn(char *const argv[], pid_t *pid);
+
+/**
+* Sends the state and waits for the new process to acknowledge it.
+* The sockets in state are still open in this process when it returns.
+*
+* Returns: 0 once the new process owns the state, -1 with errno set otherwise.
+*/
+int handover_send(int sock, const HandoverState *state);
+
+/**
+* Gets the handover socket inherited from the old process and removes HANDOVER_ENV.
+*
+* Returns: The socket or -1 if the process was not started by handover_spawn.
+*/
+int handover_inherited_socket(void);
+
+/**
+* Receives the state from the old process and acknowledges it.
+* Free the state with handover_state_free.
+*
+* Returns: 0 on success, -1 with errno set. errno is EPROTO if the old process sent an unknown format.
+*/
+int handover_receive(int sock, HandoverState *state);
+
+/**
+* Waits for the old process to exit. The socket is always closed.
+*
+* Returns: 0 on success, -1 with errno set to ETIMEDOUT if the old process is still running.
+*/
+int handover_wait(int sock, int timeout_ms);
+
+/**
+* Wipes and frees the client list and data. Does not close any sockets.
+*/
+void handover_state_free(HandoverState *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "health.h"
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+/* False positive probability of each test is 2^-HEALTH_ALPHA_LOG2 */
+#define HEALTH_ALPHA_LOG2 (20)
+
+/**
+ Smallest k where the binomial CDF of n trials with probability p reaches 1 - alpha.
+ The upper tail is summed in log space so small p^k do not underflow.
+*/
+static unsigned int critbinom(unsigned int n, double p, double alpha)
+{
+	double tail = 0;
+	double log_pmf;
+	unsigned int k;
+
+	for (k = n; k > 0; k--) {
+		log_pmf = lgamma((double)n + 1) - lgamma((double)k + 1) - lgamma((double)(n - k) + 1) +
+			(double)k * log(p) + (double)(n - k) * log1p(-p);
+
+		tail += exp(log_pmf);
+		if (tail > alpha) {
+			return k;
+		}
+	}
+
+	return 0;
+}
+
+int health_test_init(HealthTest *test, double entropy_bits)
+{
+	if (!(entropy_bits >= 0.5 && entropy_bits <= 8)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(test, 0, sizeof(HealthTest));
+
+	test->rct_cutoff = 1 + (unsigned int)ceil(HEALTH_ALPHA_LOG2 / entropy_bits);
+	test->apt_cutoff = 1 + critbinom(HEALTH_APT_WINDOW, pow(2, -entropy_bits), pow(2, -HEALTH_ALPHA_LOG2));
+
+	/* No sample yet */
+	test->rct_value = -1;
+	test->apt_value = -1;
+
+	return 0;
+}
+
+int health_test_run(HealthTest *test, const unsigned char *data, size_t data_len)
+{
+	int result = HEALTH_OK;
+	size_t i;
+
+	for (i=0; i < data_len; i++) {
+		if (data[i] == test->rct_value) {
+			/* Counts stop at the cutoff so a stuck source does not wrap them but keeps failing */
+			if (test->rct_count < test->rct_cutoff) {
+				test->rct_count++;
+			}
+
+			if (test->rct_count == test->rct_cutoff && !result) {
+				result = HEALTH_RCT_FAILED;
+			}
+		} else {
+			test->rct_value = data[i];
+			test->rct_count = 1;
+		}
+
+		if (test->apt_samples == 0) {
+			test->apt_value = data[i];
+			test->apt_count = 1;
+		} else if (data[i] == test->apt_value) {
+			if (++test->apt_count == test->apt_cutoff && !result) {
+				result = HEALTH_APT_FAILED;
+			}
+		}
+
+		if (++test->apt_samples == HEALTH_APT_WINDOW) {
+			test->apt_samples = 0;
+		}
+	}
+
+	if (result) {
+		test->failures++;
+	}
+
+	return result;
+}
@@ -0,0 +1,70 @@
+#ifndef _HEALTH_H_
+#define _HEALTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Continuous health tests for entropy sources (NIST SP 800-90B section 4.4).
+
+ The repetition count test fails when one byte repeats too many times in a row
+ and the adaptive proportion test when one byte is too common within a window
+ of 512 bytes. Cutoffs follow from the min-entropy per byte the source is
+ assumed to provide and a false positive probability of 2^-20 for a source
+ that provides exactly that. Real sources provide much more so a failure means
+ the source is stuck or badly biased.
+*/
+
+/** Window of the adaptive proportion test */
+#define HEALTH_APT_WINDOW (512)
+
+enum HealthResult {
+	HEALTH_OK = 0,
+	HEALTH_RCT_FAILED,
+	HEALTH_APT_FAILED
+};
+
+struct HealthTest {
+	/* Repetition count test */
+	unsigned int rct_cutoff;
+	unsigned int rct_count;
+	int rct_value;
+
+	/* Adaptive proportion test */
+	unsigned int apt_cutoff;
+	unsigned int apt_count;
+	unsigned int apt_samples;
+	int apt_value;
+
+	/** Failures since health_test_init */
+	uint64_t failures;
+};
+
+typedef struct HealthTest HealthTest;
+
+/**
+* Sets the cutoffs for a source assumed to provide entropy_bits of min-entropy
+* per byte, between 0.5 and 8.
+*
+* Returns: 0 on success, -1 with errno set to EINVAL.
+*/
+int health_test_init(HealthTest *test, double entropy_bits);
+
+/**
+* Runs the tests on the next bytes of the source. The state carries over
+* between calls so data must be passed in the order it was produced.
+*
+* Returns: HEALTH_OK or the first test that failed.
+*/
+int health_test_run(HealthTest *test, const unsigned char *data, size_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,934 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* vmsplice, F_SETPIPE_SZ and pthread_condattr_setclock */
+#define _GNU_SOURCE
+
+#include "outbuf.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DEFAULT_BUFFER_SIZE (16*1024*1024)
+#define DEFAULT_SYNC_INTERVAL_MS (1000)
+
+/* Buffers are split in chunks of at most this size. There are always at least MIN_CHUNKS. */
+#define MAX_CHUNK_SIZE (1024*1024)
+#define MIN_CHUNKS (4)
+
+/* A partially filled chunk is handed to the writer once it is this old */
+#define FLUSH_INTERVAL_MS (100)
+
+/* How often the writer checks whether the reader of a pipe consumed spliced pages */
+#define SPLICE_POLL_MS (10)
+
+/* Pipe size requested for zero copy output. Fails silently above the system limit. */
+#define PIPE_SIZE (1024*1024)
+
+#define HEX_LINE_BYTES (32)
+
+/* Largest number of input bytes consumed and output bytes produced by a single record */
+#define MAX_RECORD_INPUT (HEX_LINE_BYTES)
+#define MAX_RECORD_OUTPUT (2*HEX_LINE_BYTES + 1)
+
+struct OutputChunk {
+	unsigned char *data;
+	size_t size;
+
+	/* Bytes written to the fd once this chunk was written out */
+	uint64_t end_offset;
+};
+
+struct OutputBuffer {
+	int fd;
+	int format;
+	int zero_copy;
+	int regular_file;
+	unsigned int sync_interval_ms;
+	int drop_when_full;
+
+	uint64_t rotate_size;
+	unsigned int rotate_interval_ms;
+	int (*rotate)(int fd, void *user_data);
+	void *rotate_data;
+
+	/* Writer thread. Bytes in the current file and when the first one was written. */
+	uint64_t file_bytes;
+	uint64_t file_started_ms;
+	/* The current file is old enough. The next write starts a new one. */
+	int file_expired;
+
+	unsigned char *memory;
+	size_t memory_size;
+	struct OutputChunk *chunks;
+	size_t chunk_count;
+	size_t chunk_size;
+
+	/* Chunk counters. Chunks are used in order and these only increase. */
+	uint64_t queued;
+	uint64_t written;
+	uint64_t released;
+	uint64_t bytes_written;
+	uint64_t bytes_queued;
+
+	/* Producer counters are only touched by the producer, the rest with the lock held */
+	OutputBufferStats stats;
+
+	/* Producer state. chunks[queued % chunk_count] is owned by the producer while chunk_owned is set. */
+	int chunk_owned;
+	uint64_t chunk_started_ms;
+	unsigned char partial[MAX_RECORD_INPUT];
+	size_t partial_len;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t space_cond;
+	pthread_t thread;
+	int closing;
+	int error;
+};
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+void output_buf_options_init(OutputBufferOptions *options)
+{
+	memset(options, 0, sizeof(OutputBufferOptions));
+
+	options->format = OUTPUT_BUF_RAW;
+	options->buffer_size = DEFAULT_BUFFER_SIZE;
+	options->sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+	options->zero_copy = 1;
+}
+
+int output_buf_parse_format(const char *name)
+{
+	if (!strcmp(name, "raw")) return OUTPUT_BUF_RAW;
+	if (!strcmp(name, "hex")) return OUTPUT_BUF_HEX;
+	if (!strcmp(name, "u32")) return OUTPUT_BUF_U32;
+	if (!strcmp(name, "float")) return OUTPUT_BUF_FLOAT;
+
+	return -1;
+}
+
+/**
+* Input bytes per record.
+*/
+static size_t record_input(int format)
+{
+	switch (format) {
+		case OUTPUT_BUF_HEX:
+			return HEX_LINE_BYTES;
+		case OUTPUT_BUF_U32:
+		case OUTPUT_BUF_FLOAT:
+			return sizeof(uint32_t);
+		default:
+			return 1;
+	}
+}
+
+/**
+* Largest number of bytes a record is formatted to.
+*/
+static size_t record_output(int format)
+{
+	switch (format) {
+		case OUTPUT_BUF_HEX:
+			return 2*HEX_LINE_BYTES + 1;
+		case OUTPUT_BUF_U32:
+			/* 4294967295\n */
+			return 11;
+		case OUTPUT_BUF_FLOAT:
+			/* 0.12345678\n */
+			return 11;
+		default:
+			return 1;
+	}
+}
+
+#if defined(__SSE2__)
+/**
+* Converts 16 nibbles to ASCII hex digits.
+*/
+static __m128i hex_encode_nibbles(__m128i nibbles)
+{
+	__m128i letters;
+
+	/* '0' + n, with 'a' - '0' - 10 added for n > 9 */
+	letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+
+	return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+#endif
+
+/**
+* Writes 2 * len hex digits to out.
+*/
+static void hex_encode(const unsigned char *data, size_t len, unsigned char *out)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	__m128i mask = _mm_set1_epi8(0x0f);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i bytes;
+		__m128i high;
+		__m128i low;
+
+		bytes = _mm_loadu_si128((const __m128i *)(data + i));
+		high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+		low = _mm_and_si128(bytes, mask);
+
+		_mm_storeu_si128((__m128i *)(out + 2*i), hex_encode_nibbles(_mm_unpacklo_epi8(high, low)));
+		_mm_storeu_si128((__m128i *)(out + 2*i + 16), hex_encode_nibbles(_mm_unpackhi_epi8(high, low)));
+	}
+#endif
+
+	for (; i < len; i++) {
+		out[2*i] = (unsigned char)hex_digits[data[i] >> 4];
+		out[2*i + 1] = (unsigned char)hex_digits[data[i] & 0x0f];
+	}
+}
+
+/**
+* Formats value in decimal followed by a newline. Returns the number of bytes written.
+*/
+static size_t format_u32(uint32_t value, unsigned char *out)
+{
+	unsigned char digits[10];
+	size_t pos = sizeof(digits);
+	size_t len;
+	uint32_t pair;
+
+	while (value >= 100) {
+		pair = (value % 100) * 2;
+		value /= 100;
+		digits[--pos] = (unsigned char)digit_pairs[pair + 1];
+		digits[--pos] = (unsigned char)digit_pairs[pair];
+	}
+
+	if (value >= 10) {
+		digits[--pos] = (unsigned char)digit_pairs[value * 2 + 1];
+		digits[--pos] = (unsigned char)digit_pairs[value * 2];
+	} else {
+		digits[--pos] = (unsigned char)('0' + value);
+	}
+
+	len = sizeof(digits) - pos;
+	memcpy(out, digits + pos, len);
+	out[len] = '\n';
+
+	return len + 1;
+}
+
+/**
+* Formats a fraction (0 - 99999999) as 0.DDDDDDDD followed by a newline.
+*/
+static void format_fraction(uint32_t fraction, unsigned char *out)
+{
+	int i;
+	uint32_t pair;
+
+	out[0] = '0';
+	out[1] = '.';
+
+	for (i=8; i > 0; i -= 2) {
+		pair = (fraction % 100) * 2;
+		fraction /= 100;
+		out[i] = (unsigned char)digit_pairs[pair];
+		out[i + 1] = (unsigned char)digit_pairs[pair + 1];
+	}
+
+	out[10] = '\n';
+}
+
+/**
+* Maps 4 bytes to the first 8 decimals of a number in [0, 1).
+*
+* The top 24 bits are the binary fraction (as in a float). Scaling by 10^8 and
+* truncating keeps distinct inputs distinct since 2^24 < 10^8.
+*/
+static uint32_t fraction_digits(uint32_t value)
+{
+	return (uint32_t)(((uint64_t)(value >> 8) * 100000000ULL) >> 24);
+}
+
+#if defined(__SSE2__)
+/**
+* fraction_digits for 4 values at a time.
+*/
+static void fraction_digits_4(const unsigned char *data, uint32_t *fractions)
+{
+	__m128i mantissa;
+	__m128i scale;
+	__m128i even;
+	__m128i odd;
+
+	mantissa = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)data), 8);
+	scale = _mm_set1_epi32(100000000);
+
+	/* 24 x 27 bit products fit in 64 bits. The results fit in the low half of each lane. */
+	even = _mm_srli_epi64(_mm_mul_epu32(mantissa, scale), 24);
+	odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(mantissa, 32), scale), 24);
+
+	_mm_storeu_si128((__m128i *)fractions, _mm_or_si128(even, _mm_slli_epi64(odd, 32)));
+}
+#endif
+
+/**
+* Formats complete records. out must have room for records * record_output(format) bytes.
+* Returns the number of bytes written.
+*/
+static size_t format_records(int format, const unsigned char *data, size_t records, unsigned char *out)
+{
+	unsigned char *start = out;
+	uint32_t value;
+	size_t i = 0;
+
+	switch (format) {
+		case OUTPUT_BUF_HEX:
+			for (i=0; i < records; i++) {
+				hex_encode(data + i * HEX_LINE_BYTES, HEX_LINE_BYTES, out);
+				out[2*HEX_LINE_BYTES] = '\n';
+				out += 2*HEX_LINE_BYTES + 1;
+			}
+			break;
+		case OUTPUT_BUF_U32:
+			for (i=0; i < records; i++) {
+				memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t));
+				out += format_u32(value, out);
+			}
+			break;
+		case OUTPUT_BUF_FLOAT:
+#if defined(__SSE2__)
+			for (; i + 4 <= records; i += 4) {
+				uint32_t fractions[4];
+				int j;
+
+				fraction_digits_4(data + i * sizeof(uint32_t), fractions);
+
+				for (j=0; j < 4; j++) {
+					format_fraction(fractions[j], out);
+					out += 11;
+				}
+			}
+#endif
+			for (; i < records; i++) {
+				memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t));
+				format_fraction(fraction_digits(value), out);
+				out += 11;
+			}
+			break;
+		default:
+			memcpy(out, data, records);
+			out += records;
+			break;
+	}
+
+	return (size_t)(out - start);
+}
+
+/**
+* Formats as much of data as fits in chunk. Incomplete records are kept until more data arrives.
+* Returns the number of input bytes consumed.
+*/
+static size_t output_buf_format(OutputBuffer *outbuf, struct OutputChunk *chunk, const unsigned char *data, size_t data_len)
+{
+	size_t input = record_input(outbuf->format);
+	size_t output = record_output(outbuf->format);
+	size_t consumed = 0;
+	size_t records;
+	size_t len;
+
+	if (outbuf->partial_len) {
+		len = input - outbuf->partial_len;
+		if (len > data_len) len = data_len;
+
+		memcpy(outbuf->partial + outbuf->partial_len, data, len);
+		outbuf->partial_len += len;
+		consumed = len;
+
+		if (outbuf->partial_len < input) {
+			return consumed;
+		}
+
+		chunk->size += format_records(outbuf->format, outbuf->partial, 1, chunk->data + chunk->size);
+		outbuf->partial_len = 0;
+	}
+
+	records = (data_len - consumed) / input;
+	if (records > (outbuf->chunk_size - chunk->size) / output) {
+		records = (outbuf->chunk_size - chunk->size) / output;
+	}
+
+	chunk->size += format_records(outbuf->format, data + consumed, records, chunk->data + chunk->size);
+	consumed += records * input;
+
+	if (data_len - consumed < input) {
+		memcpy(outbuf->partial, data + consumed, data_len - consumed);
+		outbuf->partial_len = data_len - consumed;
+		consumed = data_len;
+	}
+
+	return consumed;
+}
+
+/**
+* Marks chunks that can be reused. Called with the lock held.
+*
+* Spliced pages belong to the pipe until the reader consumes them, so with zero copy
+* a chunk is only released once the bytes still in the pipe no longer include it.
+*/
+static void output_buf_release(OutputBuffer *outbuf)
+{
+	uint64_t consumed;
+	int pending;
+
+	if (!outbuf->zero_copy) {
+		outbuf->released = outbuf->written;
+		return;
+	}
+
+	if (outbuf->released == outbuf->written) {
+		return;
+	}
+
+	if (ioctl(outbuf->fd, FIONREAD, &pending) || pending < 0) {
+		return;
+	}
+
+	consumed = outbuf->bytes_written - (uint64_t)pending;
+
+	while (outbuf->released < outbuf->written &&
+		outbuf->chunks[outbuf->released % outbuf->chunk_count].end_offset <= consumed) {
+		outbuf->released++;
+	}
+}
+
+/**
+* Syncs and hands over the current file and continues with a new one. Called on the writer thread.
+*/
+static int output_buf_rotate(OutputBuffer *outbuf)
+{
+	int fd;
+
+	if (outbuf->sync_interval_ms && fdatasync(outbuf->fd)) {
+		return -1;
+	}
+
+	fd = outbuf->rotate(outbuf->fd, outbuf->rotate_data);
+	if (fd < 0) {
+		return -1;
+	}
+
+	outbuf->fd = fd;
+	outbuf->file_bytes = 0;
+	outbuf->file_expired = 0;
+
+	return 0;
+}
+
+/**
+* Writes a chunk, starting new files at rotate_size boundaries.
+* rotations is incremented for each new file.
+*/
+static int output_buf_write_chunk(OutputBuffer *outbuf, const struct OutputChunk *chunk, uint64_t *rotations)
+{
+	struct iovec iov;
+	size_t offset = 0;
+	size_t len;
+	ssize_t status;
+
+	while (offset < chunk->size) {
+		len = chunk->size - offset;
+
+		if (outbuf->file_expired || (outbuf->rotate_size && outbuf->file_bytes >= outbuf->rotate_size)) {
+			if (output_buf_rotate(outbuf)) {
+				return -1;
+			}
+
+			(*rotations)++;
+		}
+
+		if (outbuf->rotate_size && len > outbuf->rotate_size - outbuf->file_bytes) {
+			len = (size_t)(outbuf->rotate_size - outbuf->file_bytes);
+		}
+
+		if (outbuf->zero_copy) {
+			iov.iov_base = chunk->data + offset;
+			iov.iov_len = len;
+			status = vmsplice(outbuf->fd, &iov, 1, 0);
+		} else {
+			status = write(outbuf->fd, chunk->data + offset, len);
+		}
+
+		if (status < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if (!outbuf->file_bytes) {
+			outbuf->file_started_ms = now_ms();
+		}
+
+		offset += (size_t)status;
+		outbuf->file_bytes += (uint64_t)status;
+	}
+
+	return 0;
+}
+
+static void output_buf_sync(OutputBuffer *outbuf)
+{
+	if (fdatasync(outbuf->fd) && !outbuf->error) {
+		outbuf->error = errno;
+	}
+
+	outbuf->stats.syncs++;
+}
+
+/**
+* Writer thread. Writes queued chunks in order and syncs regular files periodically.
+*/
+static void *output_buf_thread(void *arg)
+{
+	OutputBuffer *outbuf = (OutputBuffer *)arg;
+	struct OutputChunk *chunk;
+	struct timespec deadline;
+	uint64_t next_sync;
+	uint64_t next_rotation;
+	uint64_t synced_bytes = 0;
+	uint64_t rotations;
+	uint64_t wake;
+	uint64_t now;
+	int sync;
+	int status;
+
+	sync = outbuf->regular_file && outbuf->sync_interval_ms;
+	next_sync = now_ms() + outbuf->sync_interval_ms;
+
+	pthread_mutex_lock(&outbuf->lock);
+
+	for (;;) {
+		if (outbuf->written == outbuf->queued) {
+			if (outbuf->closing) {
+				break;
+			}
+
+			wake = 0;
+
+			if (sync && synced_bytes != outbuf->bytes_written) {
+				wake = next_sync;
+			}
+
+			if (outbuf->released != outbuf->written) {
+				now = now_ms() + SPLICE_POLL_MS;
+				if (!wake || now < wake) wake = now;
+			}
+
+			if (outbuf->rotate_interval_ms && outbuf->file_bytes && !outbuf->file_expired) {
+				next_rotation = outbuf->file_started_ms + outbuf->rotate_interval_ms;
+				if (!wake || next_rotation < wake) wake = next_rotation;
+			}
+
+			if (wake) {
+				deadline.tv_sec = (time_t)(wake / 1000);
+				deadline.tv_nsec = (long)(wake % 1000) * 1000000L;
+				pthread_cond_timedwait(&outbuf->work_cond, &outbuf->lock, &deadline);
+			} else {
+				pthread_cond_wait(&outbuf->work_cond, &outbuf->lock);
+			}
+		}
+
+		if (outbuf->written != outbuf->queued) {
+			chunk = &outbuf->chunks[outbuf->written % outbuf->chunk_count];
+
+			if (!outbuf->error) {
+				rotations = 0;
+
+				pthread_mutex_unlock(&outbuf->lock);
+				status = output_buf_write_chunk(outbuf, chunk, &rotations);
+				pthread_mutex_lock(&outbuf->lock);
+
+				if (status && !outbuf->error) {
+					outbuf->error = errno;
+				}
+
+				outbuf->stats.rotations += rotations;
+			}
+
+			outbuf->bytes_written += chunk->size;
+			chunk->end_offset = outbuf->bytes_written;
+			outbuf->written++;
+		}
+
+		/* The new file is only created once there is data for it */
+		if (outbuf->rotate_interval_ms && outbuf->file_bytes &&
+			now_ms() - outbuf->file_started_ms >= outbuf->rotate_interval_ms) {
+			outbuf->file_expired = 1;
+		}
+
+		output_buf_release(outbuf);
+		pthread_cond_signal(&outbuf->space_cond);
+
+		if (sync && synced_bytes != outbuf->bytes_written && now_ms() >= next_sync) {
+			synced_bytes = outbuf->bytes_written;
+
+			pthread_mutex_unlock(&outbuf->lock);
+			status = fdatasync(outbuf->fd);
+			pthread_mutex_lock(&outbuf->lock);
+
+			if (status && !outbuf->error) {
+				outbuf->error = errno;
+			}
+
+			outbuf->stats.syncs++;
+			next_sync = now_ms() + outbuf->sync_interval_ms;
+		}
+	}
+
+	if (sync && synced_bytes != outbuf->bytes_written) {
+		output_buf_sync(outbuf);
+	}
+
+	pthread_mutex_unlock(&outbuf->lock);
+
+	return NULL;
+}
+
+OutputBuffer *output_buf_create(int fd, const OutputBufferOptions *options)
+{
+	OutputBuffer *outbuf;
+	OutputBufferOptions defaults;
+	pthread_condattr_t condattr;
+	struct stat st;
+	size_t page_size;
+	size_t i;
+	int status;
+
+	if (!options) {
+		output_buf_options_init(&defaults);
+		options = &defaults;
+	}
+
+	if (options->format < OUTPUT_BUF_RAW || options->format > OUTPUT_BUF_FLOAT) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		return NULL;
+	}
+
+	outbuf = calloc(1, sizeof(OutputBuffer));
+	if (!outbuf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	outbuf->fd = fd;
+	outbuf->format = options->format;
+	outbuf->regular_file = S_ISREG(st.st_mode);
+	outbuf->sync_interval_ms = options->sync_interval_ms;
+	outbuf->drop_when_full = options->drop_when_full;
+
+	if (options->rotate) {
+		outbuf->rotate_size = options->rotate_size;
+		outbuf->rotate_interval_ms = options->rotate_interval_ms;
+		outbuf->rotate = options->rotate;
+		outbuf->rotate_data = options->rotate_data;
+	}
+
+	/* Rotated outputs are files */
+	outbuf->zero_copy = options->zero_copy && S_ISFIFO(st.st_mode) && !outbuf->rotate;
+
+	if (outbuf->zero_copy) {
+		/* Fewer, larger pipe buffers mean fewer wakeups for the reader */
+		fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+	}
+
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+	outbuf->memory_size = options->buffer_size? options->buffer_size: DEFAULT_BUFFER_SIZE;
+	outbuf->chunk_size = outbuf->memory_size / MIN_CHUNKS;
+	if (outbuf->chunk_size > MAX_CHUNK_SIZE) outbuf->chunk_size = MAX_CHUNK_SIZE;
+
+	/* Chunks are page aligned so vmsplice hands whole pages to the pipe */
+	outbuf->chunk_size -= outbuf->chunk_size % page_size;
+	if (outbuf->chunk_size < page_size) outbuf->chunk_size = page_size;
+
+	outbuf->chunk_count = outbuf->memory_size / outbuf->chunk_size;
+	if (outbuf->chunk_count < MIN_CHUNKS) outbuf->chunk_count = MIN_CHUNKS;
+
+	outbuf->memory_size = outbuf->chunk_count * outbuf->chunk_size;
+
+	/* Mapped rather than malloced: pages still referenced by a pipe must never be handed out again */
+	outbuf->memory = mmap(NULL, outbuf->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (outbuf->memory == MAP_FAILED) {
+		free(outbuf);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	outbuf->chunks = calloc(outbuf->chunk_count, sizeof(struct OutputChunk));
+	if (!outbuf->chunks) {
+		munmap(outbuf->memory, outbuf->memory_size);
+		free(outbuf);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i=0; i < outbuf->chunk_count; i++) {
+		outbuf->chunks[i].data = outbuf->memory + i * outbuf->chunk_size;
+	}
+
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&outbuf->lock, NULL);
+	pthread_cond_init(&outbuf->work_cond, &condattr);
+	pthread_cond_init(&outbuf->space_cond, NULL);
+
+	pthread_condattr_destroy(&condattr);
+
+	status = pthread_create(&outbuf->thread, NULL, output_buf_thread, outbuf);
+	if (status) {
+		pthread_cond_destroy(&outbuf->space_cond);
+		pthread_cond_destroy(&outbuf->work_cond);
+		pthread_mutex_destroy(&outbuf->lock);
+		free(outbuf->chunks);
+		munmap(outbuf->memory, outbuf->memory_size);
+		free(outbuf);
+		errno = status;
+		return NULL;
+	}
+
+	return outbuf;
+}
+
+/**
+* Gets the chunk being filled, waiting for the writer to free one if needed.
+* If wait is 0 and no chunk is free, fails with EAGAIN.
+*/
+static struct OutputChunk *output_buf_current_chunk(OutputBuffer *outbuf, int wait)
+{
+	struct OutputChunk *chunk;
+	int error;
+
+	chunk = &outbuf->chunks[outbuf->queued % outbuf->chunk_count];
+
+	if (outbuf->chunk_owned) {
+		return chunk;
+	}
+
+	pthread_mutex_lock(&outbuf->lock);
+
+	if (outbuf->queued - outbuf->released >= outbuf->chunk_count && !outbuf->error) {
+		if (!wait) {
+			pthread_mutex_unlock(&outbuf->lock);
+			errno = EAGAIN;
+			return NULL;
+		}
+
+		outbuf->stats.waits++;
+
+		do {
+			pthread_cond_wait(&outbuf->space_cond, &outbuf->lock);
+		} while (outbuf->queued - outbuf->released >= outbuf->chunk_count && !outbuf->error);
+	}
+
+	error = outbuf->error;
+
+	pthread_mutex_unlock(&outbuf->lock);
+
+	if (error) {
+		errno = error;
+		return NULL;
+	}
+
+	chunk->size = 0;
+	outbuf->chunk_owned = 1;
+	outbuf->chunk_started_ms = now_ms();
+
+	return chunk;
+}
+
+/**
+* Hands the current chunk to the writer thread.
+*/
+static void output_buf_queue_chunk(OutputBuffer *outbuf)
+{
+	if (!outbuf->chunk_owned) {
+		return;
+	}
+
+	pthread_mutex_lock(&outbuf->lock);
+	outbuf->queued++;
+	outbuf->bytes_queued += outbuf->chunks[(outbuf->queued - 1) % outbuf->chunk_count].size;
+
+	if (outbuf->bytes_queued - outbuf->bytes_written > outbuf->stats.max_bytes_queued) {
+		outbuf->stats.max_bytes_queued = outbuf->bytes_queued - outbuf->bytes_written;
+	}
+
+	pthread_cond_signal(&outbuf->work_cond);
+	pthread_mutex_unlock(&outbuf->lock);
+
+	outbuf->chunk_owned = 0;
+}
+
+int output_buf_write(OutputBuffer *outbuf, const unsigned char *data, size_t data_len)
+{
+	struct OutputChunk *chunk;
+	size_t output;
+	size_t len;
+
+	output = record_output(outbuf->format);
+
+	outbuf->stats.bytes_in += data_len;
+
+	while (data_len) {
+		chunk = output_buf_current_chunk(outbuf, !outbuf->drop_when_full);
+		if (!chunk) {
+			if (errno != EAGAIN) {
+				return -1;
+			}
+
+			outbuf->stats.bytes_dropped += data_len;
+			outbuf->stats.drops++;
+			break;
+		}
+
+		if (outbuf->format == OUTPUT_BUF_RAW) {
+			len = outbuf->chunk_size - chunk->size;
+			if (len > data_len) len = data_len;
+
+			memcpy(chunk->data + chunk->size, data, len);
+			chunk->size += len;
+		} else {
+			len = output_buf_format(outbuf, chunk, data, data_len);
+		}
+
+		data += len;
+		data_len -= len;
+
+		if (outbuf->chunk_size - chunk->size < output) {
+			output_buf_queue_chunk(outbuf);
+		}
+	}
+
+	/* Do not hold on to data for too long when the input is slow */
+	if (outbuf->chunk_owned && now_ms() - outbuf->chunk_started_ms >= FLUSH_INTERVAL_MS) {
+		output_buf_queue_chunk(outbuf);
+	}
+
+	return 0;
+}
+
+void output_buf_get_stats(OutputBuffer *outbuf, OutputBufferStats *stats)
+{
+	pthread_mutex_lock(&outbuf->lock);
+
+	*stats = outbuf->stats;
+	stats->bytes_written = outbuf->bytes_written;
+	stats->bytes_queued = outbuf->bytes_queued - outbuf->bytes_written;
+
+	pthread_mutex_unlock(&outbuf->lock);
+}
+
+int output_buf_close(OutputBuffer *outbuf)
+{
+	struct OutputChunk *chunk;
+	int error;
+
+	if (!outbuf) return 0;
+
+	/* A trailing partial hex line is still written. Incomplete numbers are dropped. */
+	if (outbuf->format == OUTPUT_BUF_HEX && outbuf->partial_len) {
+		chunk = output_buf_current_chunk(outbuf, 1);
+
+		if (chunk) {
+			hex_encode(outbuf->partial, outbuf->partial_len, chunk->data + chunk->size);
+			chunk->size += 2 * outbuf->partial_len;
+			chunk->data[chunk->size++] = '\n';
+		}
+	}
+
+	output_buf_queue_chunk(outbuf);
+
+	pthread_mutex_lock(&outbuf->lock);
+	outbuf->closing = 1;
+	pthread_cond_signal(&outbuf->work_cond);
+	pthread_mutex_unlock(&outbuf->lock);
+
+	pthread_join(outbuf->thread, NULL);
+
+	error = outbuf->error;
+
+	pthread_cond_destroy(&outbuf->space_cond);
+	pthread_cond_destroy(&outbuf->work_cond);
+	pthread_mutex_destroy(&outbuf->lock);
+
+	/* Pages still in a pipe stay valid: the pipe holds its own references */
+	munmap(outbuf->memory, outbuf->memory_size);
+	free(outbuf->chunks);
+	free(outbuf);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+#ifndef _OUTBUF_H_
+#define _OUTBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Buffered output to a file or pipe.
+
+ Data is formatted into a ring of large chunks and written by a separate thread,
+ so the caller never waits for the disk unless the whole ring is full.
+ Pipes are fed with vmsplice so the pages are not copied again by the kernel.
+ Regular files are flushed with fdatasync from the writer thread.
+*/
+struct OutputBuffer;
+typedef struct OutputBuffer OutputBuffer;
+
+/**
+* Output formats.
+*/
+enum OutputBufferFormat {
+	/** Bytes as read from the device */
+	OUTPUT_BUF_RAW = 0,
+	/** Lowercase hex, 32 bytes per line */
+	OUTPUT_BUF_HEX,
+	/** Unsigned 32 bit integers (host byte order) in decimal, one per line */
+	OUTPUT_BUF_U32,
+	/** Numbers in [0, 1) with 24 bits of precision and 8 decimals, one per line */
+	OUTPUT_BUF_FLOAT
+};
+
+/**
+* Output options.
+*/
+struct OutputBufferOptions {
+	/** One of OutputBufferFormat */
+	int format;
+	/** Total memory used for buffering. 0 for the default. */
+	size_t buffer_size;
+	/** Milliseconds between fdatasync calls for regular files. 0 disables syncing. */
+	unsigned int sync_interval_ms;
+	/** Use vmsplice when the output is a pipe */
+	int zero_copy;
+	/** Drop data instead of waiting when all buffers are waiting to be written */
+	int drop_when_full;
+
+	/** Start a new file once this many bytes were written to the current one. 0 disables. */
+	uint64_t rotate_size;
+	/** Start a new file once the current one is this old. 0 disables. */
+	unsigned int rotate_interval_ms;
+	/**
+	* Called on the writer thread to start a new file. The old fd is synced first
+	* and is handed over to the callback, which must close it.
+	* Returns the new fd or -1 with errno set, which stops all output.
+	*/
+	int (*rotate)(int fd, void *user_data);
+	void *rotate_data;
+};
+
+typedef struct OutputBufferOptions OutputBufferOptions;
+
+/**
+* Output counters.
+*/
+struct OutputBufferStats {
+	/** Bytes accepted by output_buf_write */
+	uint64_t bytes_in;
+	/** Bytes dropped because the buffers were full */
+	uint64_t bytes_dropped;
+	/** Number of writes that dropped data */
+	uint64_t drops;
+	/** Number of writes that had to wait for the writer */
+	uint64_t waits;
+	/** Formatted bytes written to the output */
+	uint64_t bytes_written;
+	/** Formatted bytes waiting to be written */
+	uint64_t bytes_queued;
+	/** Largest value of bytes_queued seen */
+	uint64_t max_bytes_queued;
+	uint64_t syncs;
+	uint64_t rotations;
+};
+
+typedef struct OutputBufferStats OutputBufferStats;
+
+/**
+* Fills options with the defaults.
+*/
+void output_buf_options_init(OutputBufferOptions *options);
+
+/**
+* Parses a format name (raw, hex, u32 or float).
+*
+* Returns: The format or -1 if the name is not known.
+*/
+int output_buf_parse_format(const char *name);
+
+/**
+* Creates an output writing to fd. The fd is not closed by the buffer.
+*
+* Returns: The buffer or NULL with errno set.
+*/
+OutputBuffer *output_buf_create(int fd, const OutputBufferOptions *options);
+
+/**
+* Queues data for output. Blocks only while all buffers are waiting to be written,
+* unless drop_when_full is set in which case the data that does not fit is dropped.
+*
+* Returns: 0 on success, -1 with errno set if a previous write failed.
+*/
+int output_buf_write(OutputBuffer *outbuf, const unsigned char *data, size_t data_len);
+
+/**
+* Gets the counters. Must be called from the thread that writes.
+*/
+void output_buf_get_stats(OutputBuffer *outbuf, OutputBufferStats *stats);
+
+/**
+* Writes out all queued data, syncs regular files and destroys the buffer.
+*
+* Returns: 0 on success, -1 with errno set if any write failed.
+*/
+int output_buf_close(OutputBuffer *outbuf);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/**
+ Static probes (USDT) for perf, bpftrace and SystemTap.
+
+ Compiled in when sys/sdt.h is available (systemtap-sdt-dev or
+ systemtap-sdt-devel). See the SDT variable in the Makefile. An unused probe
+ is a single nop, but its arguments are still computed so they must be cheap.
+ Without sys/sdt.h the probes compile to nothing.
+
+ Providers are quantisusb for the library and rngd for the daemon. The probes
+ and their arguments are listed in the PROBES section of quantisusb-rngd(8)
+ and bpftrace/ has scripts using them.
+*/
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE0(provider, name) DTRACE_PROBE(provider, name)
+#define PROBE1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define PROBE2(provider, name, a1, a2) DTRACE_PROBE2(provider, name, a1, a2)
+#define PROBE3(provider, name, a1, a2, a3) DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define PROBE4(provider, name, a1, a2, a3, a4) DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#define PROBE5(provider, name, a1, a2, a3, a4, a5) DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#else
+#define PROBE0(provider, name) do {} while (0)
+#define PROBE1(provider, name, a1) do {} while (0)
+#define PROBE2(provider, name, a1, a2) do {} while (0)
+#define PROBE3(provider, name, a1, a2, a3) do {} while (0)
+#define PROBE4(provider, name, a1, a2, a3, a4) do {} while (0)
+#define PROBE5(provider, name, a1, a2, a3, a4, a5) do {} while (0)
+#endif
+
+#endif
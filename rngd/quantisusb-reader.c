@@ -25,8 +25,13 @@
 */
 
 /*
- Reads data from all available devices and outputs them to stdout.
+ Reads data from all available devices and outputs them to stdout
+ or to one file per device. Throughput and timing statistics are
+ written to stderr on exit.
 
+ Usage: quantisusb-reader [OPTIONS]
+ -t reads through the library event thread instead of a select loop.
+ -d, -n and -w run a benchmark of the given duration or size.
 */
 
 #define __STDC_FORMAT_MACROS
@@ -40,35 +45,183 @@
 #include <inttypes.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <stdint.h>
+#include <sys/resource.h>
 #include "quantisusb.h"
+#include "outbuf.h"
+#include "readstats.h"
+
+/* How often stop conditions are checked while waiting for data */
+#define POLL_INTERVAL_MS (100)
+
+static volatile int should_exit;
+
+static OutputBufferOptions output_options;
+
+/* Output for stdout. NULL when writing one file per device. */
+static OutputBuffer *stdout_buf;
+
+/* Per device files are named PREFIX-SERIAL */
+static const char *output_prefix;
 
 /**
- Data for benchmark: 10Mb
+* State of a device. Kept after the device is removed so it is included in the report.
 */
-#define BENCHMARK_BYTES (10*1024*1024)
+struct DeviceState {
+	struct DeviceState *next;
+	ReadStats stats;
 
-static volatile int should_exit;
-static uint64_t total_bytes;
+	/* Output file when writing one file per device */
+	int fd;
+	OutputBuffer *buf;
+};
+
+static struct DeviceState *device_states;
+
+/* Set when the event thread merges all devices into one stream */
+static struct DeviceState *merged_state;
+
+/* Benchmark settings. 0 means no limit. */
+static uint64_t warmup_ns;
+static uint64_t duration_ns;
+static uint64_t byte_target;
+
+/* Statistics are reset once the warm-up is over */
+static uint64_t start_ns;
+static uint64_t measure_start_ns;
+static double measure_start_cpu;
+static int measuring;
+
+/* Bytes read since measuring started */
+static uint64_t measured_bytes;
 
 void onsigterm(int dummy)
 {
 	should_exit = 1;
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+* Gets the user and system CPU time used by the process in seconds.
+*/
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return 0;
+	}
+
+	return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+		(double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static struct DeviceState *create_device_state(const char *name)
+{
+	struct DeviceState *state;
+
+	state = calloc(1, sizeof(struct DeviceState));
+	if (!state) {
+		return NULL;
+	}
+
+	read_stats_init(&state->stats, name);
+	state->fd = -1;
+
+	state->next = device_states;
+	device_states = state;
+
+	return state;
+}
+
+/**
+* Starts measuring once the warm-up is over.
+*/
+static void check_warmup(uint64_t now)
+{
+	struct DeviceState *state;
+
+	if (measuring || now - start_ns < warmup_ns) {
+		return;
+	}
+
+	for (state = device_states; state; state = state->next) {
+		read_stats_reset(&state->stats);
+	}
+
+	measured_bytes = 0;
+	measure_start_ns = now;
+	measure_start_cpu = cpu_seconds();
+	measuring = 1;
+}
+
+/**
+* Checks whether the benchmark duration or byte target was reached.
+*/
+static int benchmark_done(uint64_t now)
+{
+	if (!measuring) {
+		return 0;
+	}
+
+	if (duration_ns && now - measure_start_ns >= duration_ns) {
+		return 1;
+	}
+
+	return byte_target && measured_bytes >= byte_target;
+}
+
+/**
+* Records data read from a device and writes it out.
+*
+* state is NULL for data merged from all devices by the event thread.
+*/
+static void process_data(struct DeviceState *state, const unsigned char *data, size_t data_len, uint64_t latency_ns)
+{
+	OutputBuffer *buf = stdout_buf;
+	uint64_t now;
+
+	now = now_ns();
+	check_warmup(now);
+
+	if (state) {
+		read_stats_add(&state->stats, now, data_len, latency_ns);
+
+		if (output_prefix) {
+			buf = state->buf;
+		}
+	}
+
+	measured_bytes += data_len;
+
+	if (buf && output_buf_write(buf, data, data_len)) {
+		perror("Output error");
+		should_exit = 1;
+	}
+}
+
 /**
 * Called when data is read from a device
 */
 static void on_read(QuantisUSBDevice *device, const unsigned char *data, int data_len)
 {
-	write(STDOUT_FILENO, data, (size_t)data_len);
-	fsync(STDOUT_FILENO);
-
-	total_bytes += (uint64_t)data_len;
+	process_data(quantis_usb_device_get_user_data(device), data, (size_t)data_len,
+		quantis_usb_device_get_transfer_latency(device));
 }
 
 /**
@@ -79,8 +232,163 @@ static void on_error(QuantisUSBDevice *device)
 	perror("Quantis error");
 }
 
+static void close_device_output(struct DeviceState *state)
+{
+	if (!state->buf) {
+		return;
+	}
+
+	if (output_buf_close(state->buf)) {
+		perror("Output error");
+	}
+
+	close(state->fd);
+	state->buf = NULL;
+	state->fd = -1;
+}
+
+/**
+* Opens PREFIX-SERIAL for the device.
+*
+* Returns: 0 on success, -1 on failure.
+*/
+static int open_device_output(struct DeviceState *state)
+{
+	char path[4096];
+
+	if (snprintf(path, sizeof(path), "%s-%s", output_prefix, state->stats.name) >= (int)sizeof(path)) {
+		fprintf(stderr, "Output file name too long\n");
+		return -1;
+	}
+
+	/* Appended to so a device that is plugged in again does not lose earlier output */
+	state->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (state->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	state->buf = output_buf_create(state->fd, &output_options);
+	if (!state->buf) {
+		perror("Unable to create output buffer");
+		close(state->fd);
+		state->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Tracks each device that appears and opens its output file when writing one file per device.
+*/
 static void on_device(QuantisUSBDevice *device, int present)
 {
+	struct DeviceState *state;
+	char serial[64];
+
+	if (merged_state) {
+		return;
+	}
+
+	if (!present) {
+		state = quantis_usb_device_get_user_data(device);
+		if (state) {
+			quantis_usb_device_set_user_data(device, NULL);
+			close_device_output(state);
+		}
+		return;
+	}
+
+	if (quantis_usb_get_serial_number(device, serial, sizeof(serial))) {
+		fprintf(stderr, "Unable to get device serial number\n");
+		should_exit = 1;
+		return;
+	}
+
+	/* A device that is plugged in again continues its statistics */
+	for (state = device_states; state; state = state->next) {
+		if (!strcmp(state->stats.name, serial)) {
+			break;
+		}
+	}
+
+	if (!state) {
+		state = create_device_state(serial);
+		if (!state) {
+			fprintf(stderr, "Out of memory\n");
+			should_exit = 1;
+			return;
+		}
+	}
+
+	if (output_prefix && open_device_output(state)) {
+		should_exit = 1;
+		return;
+	}
+
+	quantis_usb_device_set_user_data(device, state);
+}
+
+/**
+* Writes the benchmark report to stderr.
+*/
+static int report(int format, uint64_t end_ns)
+{
+	struct DeviceState *state;
+	ReadStats **stats;
+	ReadStats total;
+	size_t count = 0;
+	double seconds = 0;
+	double cpu = 0;
+
+	for (state = device_states; state; state = state->next) {
+		count++;
+	}
+
+	stats = calloc(count? count: 1, sizeof(ReadStats *));
+	if (!stats) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	read_stats_init(&total, "total");
+	count = 0;
+
+	for (state = device_states; state; state = state->next) {
+		stats[count++] = &state->stats;
+		read_stats_merge(&total, &state->stats);
+	}
+
+	if (measuring) {
+		seconds = (double)(end_ns - measure_start_ns) / 1e9;
+		cpu = cpu_seconds() - measure_start_cpu;
+	}
+
+	read_stats_report(stderr, format, stats, count, &total, seconds, cpu);
+
+	free(stats);
+
+	return 0;
+}
+
+static void show_usage(const char *app)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS]\n\n"
+		"Options:\n"
+		"-b SIZE    Output buffer size in bytes per output. (Default: %zu)\n"
+		"-d SECS    Stop after measuring for SECS seconds\n"
+		"-f FORMAT  Output format: raw, hex, u32 or float. (Default: raw)\n"
+		"-h         Help. Show this message and exit\n"
+		"-n BYTES   Stop after measuring BYTES bytes\n"
+		"-o PREFIX  Write each device to PREFIX-SERIAL instead of stdout\n"
+		"-r FORMAT  Report format: text, json or csv. (Default: text)\n"
+		"-s MS      Milliseconds between syncs of regular files. 0 disables syncing. (Default: %u)\n"
+		"-t         Read through the library event thread. Devices are reported together\n"
+		"-w SECS    Warm-up time excluded from the statistics. (Default: 0)\n"
+		"-Z         Do not use vmsplice when stdout is a pipe\n"
+		, app, output_options.buffer_size, output_options.sync_interval_ms);
 }
 
 static int should_open_device(QuantisUSBDevice *device)
@@ -97,9 +405,106 @@ int main(int argc, char **argv)
 	int nfds;
 	int select_status;
 	struct timeval timeout;
-	struct timespec start;
-	struct timespec end;
-	int benchmark = 1;
+	struct DeviceState *state;
+	int event_thread = 0;
+	int report_format = READ_STATS_TEXT;
+	unsigned char buffer[64*1024];
+	ssize_t read_status;
+	double seconds;
+	int status = 0;
+	int opt;
+
+	output_buf_options_init(&output_options);
+
+	while ((opt = getopt(argc, argv, "b:d:f:hn:o:r:s:tw:Z")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (sscanf(optarg, "%zu", &output_options.buffer_size) != 1 || !output_options.buffer_size) {
+					fprintf(stderr, "Invalid buffer size\n");
+					return 1;
+				}
+				break;
+			case 'd':
+				if (sscanf(optarg, "%lf", &seconds) != 1 || seconds <= 0) {
+					fprintf(stderr, "Invalid duration\n");
+					return 1;
+				}
+				duration_ns = (uint64_t)(seconds * 1e9);
+				break;
+			case 'n':
+				if (sscanf(optarg, "%" SCNu64, &byte_target) != 1 || !byte_target) {
+					fprintf(stderr, "Invalid number of bytes\n");
+					return 1;
+				}
+				break;
+			case 'r':
+				report_format = read_stats_parse_format(optarg);
+				if (report_format < 0) {
+					fprintf(stderr, "Invalid report format: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'w':
+				if (sscanf(optarg, "%lf", &seconds) != 1 || seconds < 0) {
+					fprintf(stderr, "Invalid warm-up time\n");
+					return 1;
+				}
+				warmup_ns = (uint64_t)(seconds * 1e9);
+				break;
+			case 'f':
+				output_options.format = output_buf_parse_format(optarg);
+				if (output_options.format < 0) {
+					fprintf(stderr, "Invalid output format: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'h':
+				show_usage(argv[0]);
+				return 0;
+			case 'o':
+				output_prefix = optarg;
+				break;
+			case 's':
+				if (sscanf(optarg, "%u", &output_options.sync_interval_ms) != 1) {
+					fprintf(stderr, "Invalid sync interval\n");
+					return 1;
+				}
+				break;
+			case 't':
+				event_thread = 1;
+				break;
+			case 'Z':
+				output_options.zero_copy = 0;
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	/* The event thread merges all devices into a single stream */
+	if (event_thread && output_prefix) {
+		fprintf(stderr, "Per device output is not available with -t\n");
+		return 1;
+	}
+
+	if (!output_prefix) {
+		stdout_buf = output_buf_create(STDOUT_FILENO, &output_options);
+		if (!stdout_buf) {
+			perror("Unable to create output buffer");
+			return 1;
+		}
+	}
+
+	if (event_thread) {
+		/* The library merges all devices so they are reported as one */
+		merged_state = create_device_state("all");
+		if (!merged_state) {
+			fprintf(stderr, "Out of memory\n");
+			output_buf_close(stdout_buf);
+			return 1;
+		}
+	}
 
 	signal(SIGTERM, onsigterm);
         signal(SIGINT, onsigterm);
@@ -111,23 +516,44 @@ int main(int argc, char **argv)
 	if (quantis_usb_device_count(ctx) < 1) {
 		fprintf(stderr, "No Quantis USB devices found\n");
 		quantis_usb_destroy(ctx);
+		output_buf_close(stdout_buf);
+		return 1;
+	}
+
+	if (event_thread && quantis_usb_start_event_thread(ctx, 0, 0)) {
+		perror("Unable to start event thread");
+		quantis_usb_destroy(ctx);
+		output_buf_close(stdout_buf);
 		return 1;
 	}
 
-	if (benchmark) {
-		if (clock_gettime(CLOCK_MONOTONIC, &start)) {
-			fprintf(stderr, "Monotonic clock not available. Benchmark disabled\n");
-			benchmark = 0;
+	start_ns = now_ns();
+	check_warmup(start_ns);
+
+	while(!should_exit && event_thread) {
+		read_status = quantis_usb_read_bytes(ctx, buffer, sizeof(buffer), POLL_INTERVAL_MS);
+		if (read_status < 0) {
+			if (errno != ETIMEDOUT) {
+				perror("Quantis error");
+				break;
+			}
+		} else {
+			/* Transfer latency is not known here. Jitter is measured between reads. */
+			process_data(merged_state, buffer, (size_t)read_status, 0);
+		}
+
+		if (benchmark_done(now_ns())) {
+			break;
 		}
 	}
 
-	while(!should_exit) {
+	while(!should_exit && !event_thread) {
 		FD_ZERO(&readfds);
 		FD_ZERO(&writefds);
 		FD_ZERO(&errorfds);
 
-		timeout.tv_sec = 120;
-		timeout.tv_usec = 0;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = POLL_INTERVAL_MS * 1000;
 		nfds = 0;
 
 		quantis_usb_read_all(ctx);
@@ -150,26 +576,28 @@ int main(int argc, char **argv)
 			break;
 		}
 
-		if (benchmark && total_bytes > BENCHMARK_BYTES) {
+		if (benchmark_done(now_ns())) {
 			break;
 		}
-
 	}
 
-	if (benchmark) {
-		if (clock_gettime(CLOCK_MONOTONIC, &end)) {
-			fprintf(stderr, "Monotonic clock not available. Benchmark disabled\n");
-		} else {
-			time_t millis;
+	if (report(report_format, now_ns())) {
+		status = 1;
+	}
 
-			millis = ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_nsec - start.tv_nsec) / 1000000);
+	/* Closes the per device outputs */
+	quantis_usb_destroy(ctx);
 
-			double seconds = (double)millis / 1000.0;
+	if (output_buf_close(stdout_buf)) {
+		perror("Output error");
+		status = 1;
+	}
 
-			fprintf(stderr, "Total read: %" PRIu64 ". Read rate: %.0f bytes/sec\n", total_bytes, (double)total_bytes / seconds);
-		}
+	while (device_states) {
+		state = device_states;
+		device_states = state->next;
+		free(state);
 	}
 
-	quantis_usb_destroy(ctx);
-	return 0;
+	return status;
 }
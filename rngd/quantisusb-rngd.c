@@ -44,8 +44,10 @@
  The server will never exceed the sum of all requested entropy but there
  are no guarantees on the number of responses.
 
- The server does not enforce any kind of request timeout and requests never
- fail.
+ The server does not enforce any kind of request timeout. Requests only fail
+ with admission control (-A). Clients that sent a request of 0xffffffff then
+ get a frame of length 0xffffffff followed by a uint32_t backoff hint in ms.
+ Other clients are disconnected.
 
  The server will always send the data in the order it was received from the hardware.
  This is used for testing and to ensure that there is absolutely no difference between
@@ -60,6 +62,9 @@
 
 #define __STDC_FORMAT_MACROS
 
+/* accept4 */
+#define _GNU_SOURCE
+
 #if __STDC_VERSION__ >= 199901L
 #define _XOPEN_SOURCE 600
 #else
@@ -70,6 +75,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <getopt.h>
 #include <sys/types.h>
@@ -78,7 +84,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
 #include <syslog.h>
 
@@ -89,8 +97,20 @@
 #include <time.h>
 
 #include <sys/signalfd.h>
+#include <sys/wait.h>
 
+#include "admission.h"
 #include "databuf.h"
+#include "devsel.h"
+#include "handover.h"
+#include "health.h"
+#include "outbuf.h"
+#include "probes.h"
+#include "reqstats.h"
+#include "source.h"
+#include "spool.h"
+#include "trace.h"
+#include "tlsserver.h"
 #include "quantisusb.h"
 #include "version.h"
 
@@ -105,6 +125,15 @@
 #define HEADER_SIZE (sizeof(uint32_t))
 #define MAX_FRAME_SIZE (65536)
 
+/*
+ A request of OVERLOAD_NOTICE_REQUEST bytes asks for overload notices. Refused
+ requests are then answered with a frame of length OVERLOAD_NOTICE_LENGTH
+ followed by a uint32_t backoff hint in ms instead of closing the connection.
+*/
+#define OVERLOAD_NOTICE_REQUEST (0xffffffffU)
+#define OVERLOAD_NOTICE_LENGTH (0xffffffffU)
+#define NOTICE_SIZE (2 * sizeof(uint32_t))
+
 /*
  Space available to read data from at least one device
 */
@@ -113,10 +142,35 @@
 #define DEFAULT_ENTROPY_BUF_SIZE ((2*1024*1024))
 
 #define DEFAULT_PORT (4545)
+#define DEFAULT_BACKLOG (1024)
+#define DEFAULT_DEFER_ACCEPT (5)
+#define DEFAULT_FASTOPEN (256)
+#define DEFAULT_NOTSENT_LOWAT (MAX_FRAME_SIZE)
+
+/* Connections accepted from each listener per iteration */
+#define ACCEPT_BUDGET (256)
 #define DEFAULT_VERBOSITY (2)
 
 #define MIN_BUF_SIZE (BUFFER_SPACE)
 
+#define DEFAULT_SPOOL_SIZE ((64*1024*1024))
+#define MIN_SPOOL_SIZE (BUFFER_SPACE)
+
+/* Seconds between warnings about dropped capture data */
+#define CAPTURE_WARNING_INTERVAL (10)
+
+/* Seconds between warnings about refused requests */
+#define ADMISSION_WARNING_INTERVAL (10)
+
+/* Seconds to wait for the previous daemon to release the devices after a restart */
+#define HANDOVER_WAIT_TIME (60)
+
+/* Seconds between writes of the request latency file */
+#define LATENCY_REPORT_INTERVAL (10)
+
+/* Clients with the most data that have their own latencies */
+#define LATENCY_TOP_CLIENTS (8)
+
 /**
 * Connected client information
 */
@@ -135,14 +189,94 @@ struct Client {
 	/* Client socket */
 	int socket;
 
+	/* Connection id in traces */
+	uint32_t id;
+
+	/* TLS session. NULL for plain TCP. */
+	TLSConnection *tls;
+
 	/* Time of last request. Used to enforce timeouts */
 	struct timespec last_request;
+
+	/* Listener that accepted the connection (HANDOVER_LISTENER_*) */
+	size_t listener;
+
+	/* Requests waiting for data. Used for latencies */
+	RequestTracker requests;
+
+	/* Whether refused requests are answered with an overload notice */
+	int overload_notices;
+
+	/* Bytes of the overload notice not sent yet. Notices are sent between frames. */
+	uint32_t notice_pending;
+	uint32_t notice_backoff_ms;
 };
 
 typedef struct Client Client;
 
+/**
+* Options of a listening socket. Set with -L.
+*
+* The socket options are set on the listener and inherited by the connections
+* it accepts, so accepting costs no extra system calls.
+*/
+struct ListenerOptions {
+	/* listen() backlog. Limited by net.core.somaxconn. */
+	int backlog;
+
+	/* Seconds the kernel waits for the first request before the connection is accepted. 0 disables. */
+	int defer_accept;
+
+	/* TCP Fast Open queue length. 0 disables. Needs net.ipv4.tcp_fastopen to allow servers. */
+	int fastopen;
+
+	/* Disable Nagle so small frames are not delayed */
+	int nodelay;
+
+	/*
+	 Sockets are only writable while less than this many bytes are unsent and
+	 frames are no larger, so little entropy waits in the kernel for a slow
+	 client. 0 leaves the kernel default.
+	*/
+	int notsent_lowat;
+
+	/* Socket buffer sizes. 0 leaves them to the kernel. */
+	int sndbuf;
+	int rcvbuf;
+
+	/* Milliseconds unacknowledged data may stay before the connection is dropped. 0 disables. */
+	int user_timeout;
+
+	/* Microseconds to busy poll the device queue on reads. 0 disables. */
+	int busy_poll;
+};
+
+typedef struct ListenerOptions ListenerOptions;
+
+#define LISTENER_DEFAULTS { DEFAULT_BACKLOG, DEFAULT_DEFER_ACCEPT, DEFAULT_FASTOPEN, 1, DEFAULT_NOTSENT_LOWAT, 0, 0, 0, 0 }
+
+static ListenerOptions listener_options[HANDOVER_MAX_LISTENERS] = { LISTENER_DEFAULTS, LISTENER_DEFAULTS };
+
 static QuantisUSBContext *ctx;
 
+/* Devices this daemon opens */
+static DeviceSelection *device_selection;
+
+/* Other entropy sources given with -e. NULL if there are none. */
+static SourcePool *sources;
+
+/* Min-entropy per byte assumed by the health tests of Quantis devices */
+#define DEVICE_HEALTH_ENTROPY (1.0)
+
+/**
+* State of an open Quantis device.
+*/
+struct DeviceState {
+	HealthTest health;
+	uint64_t bytes;
+};
+
+typedef struct DeviceState DeviceState;
 
 static Client *clients;
 static size_t client_sockets_length;
@@ -161,31 +295,130 @@ static int receiver_index = 0;
 */
 static DataBuffer *data_buf;
 
+/**
+ Optional overflow for data_buf. Holds data newer than anything in data_buf.
+*/
+static Spool *spool;
+
 static fd_set writefds;
 
-static int test_fd = -1;
+/**
+ Asynchronous writer for the test output file. Written to from on_read.
+*/
+static OutputBuffer *capture;
+
+/** Current capture file. Replaced by the writer thread when rotating. */
+static int capture_fd = -1;
+static const char *capture_file;
+static unsigned int capture_index;
+
+static uint64_t capture_dropped;
+static time_t capture_warning_time;
+
+/**
+ Set when the listeners use TLS.
+*/
+static TLSServer *tls_server;
+
+/**
+ Optional traffic trace for rngd-replay.
+*/
+static TraceWriter *trace;
+static uint32_t next_client_id = 1;
+
+/**
+ Socket to the daemon that took over after a restart. Closed at exit to tell
+ it that the devices are free.
+*/
+static int handover_peer = -1;
+
+/**
+ Request latencies per listener and for the busiest clients.
+*/
+static RequestStats *request_stats;
+static const char *const listener_names[HANDOVER_MAX_LISTENERS] = {"ipv4", "ipv6"};
+
+/** Written with the latencies when set with -R */
+static const char *latency_file;
+
+/**
+ Limits on the bytes requested and not sent yet. Set with -A.
+*/
+static Admission admission;
+static uint64_t admission_warning_refused;
+static time_t admission_warning_time;
+
+static void trace_event(int type, uint32_t id, uint64_t value)
+{
+	if (!trace) {
+		return;
+	}
+
+	if (trace_writer_record(trace, type, id, value)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Trace failed: %s", strerror(errno));
+		trace_writer_close(trace);
+		trace = NULL;
+	}
+}
 
 
-static int client_add(int sock)
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+/**
+* Adds a client. Fails with EMFILE when there are too many clients.
+*/
+static int client_add(int sock, size_t listener)
 {
 	if (num_client_sockets == client_sockets_length) {
+		errno = EMFILE;
 		return -1;
 	}
 
 	memset(&clients[num_client_sockets], 0, sizeof(Client));
 	clients[num_client_sockets].socket = sock;
+	clients[num_client_sockets].listener = listener;
+	request_tracker_init(&clients[num_client_sockets].requests);
+
+	if (tls_server) {
+		clients[num_client_sockets].tls = tls_connection_create(tls_server, sock);
+		if (!clients[num_client_sockets].tls) {
+			return -1;
+		}
+	}
+	clients[num_client_sockets].id = next_client_id++;
+
+	trace_event(TRACE_CONNECT, clients[num_client_sockets].id, 0);
 
 	num_client_sockets++;
 
+	PROBE3(rngd, client_add, clients[num_client_sockets - 1].id, sock, num_client_sockets);
+
 	return 0;
 }
 
+/**
+* Removes a client and closes its socket.
+*/
 static int client_remove_by_index(size_t i)
 {
 	if (i >= num_client_sockets) {
 		return -1;
 	}
 
+	trace_event(TRACE_DISCONNECT, clients[i].id, 0);
+	admission_remove(&admission, (uint64_t)clients[i].entropy_requested + clients[i].entropy_pending);
+
+	PROBE3(rngd, client_remove, clients[i].id, clients[i].entropy_requested, num_client_sockets - 1);
+
+	if (clients[i].tls) {
+		tls_connection_destroy(clients[i].tls);
+	}
+
+	close(clients[i].socket);
+
 	num_client_sockets--;
 	memmove(clients + i, clients + i + 1, sizeof(Client) * (num_client_sockets - i));
 
@@ -200,6 +433,64 @@ static int client_remove_by_index(size_t i)
 	return 0;
 }
 
+static ssize_t client_send(Client *client, const void *buf, size_t len)
+{
+	if (client->tls) {
+		return tls_connection_send(client->tls, buf, len);
+	}
+
+	return send(client->socket, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t client_recv(Client *client, void *buf, size_t len)
+{
+	if (client->tls) {
+		return tls_connection_recv(client->tls, buf, len);
+	}
+
+	return recv(client->socket, buf, len, 0);
+}
+
+/**
+* Queues an overload notice. A notice that is partly sent is finished first.
+*/
+static void client_queue_notice(Client *client, unsigned int backoff_ms)
+{
+	if (client->notice_pending && client->notice_pending < NOTICE_SIZE) {
+		return;
+	}
+
+	client->notice_pending = NOTICE_SIZE;
+	client->notice_backoff_ms = backoff_ms;
+}
+
+static void client_send_notice(Client *client)
+{
+	unsigned char notice[NOTICE_SIZE];
+	uint32_t value;
+	ssize_t send_status;
+
+	value = htonl(OVERLOAD_NOTICE_LENGTH);
+	memcpy(notice, &value, sizeof(value));
+	value = htonl(client->notice_backoff_ms);
+	memcpy(notice + sizeof(value), &value, sizeof(value));
+
+	send_status = client_send(client, notice + NOTICE_SIZE - client->notice_pending, client->notice_pending);
+	if (send_status > 0) {
+		client->notice_pending -= (uint32_t)send_status;
+	} else if (send_status < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Send error: %s", strerror(errno));
+	}
+}
+
+/**
+* Whether a request can be read although select did not report the socket.
+*/
+static int client_has_pending(const Client *client)
+{
+	return client->tls && tls_connection_pending(client->tls);
+}
+
 static void receiver_advance(void)
 {
 	receiver_index++;
@@ -218,14 +509,34 @@ static void send_entropy(void)
 	uint32_t send_len;
 	int clients_checked = 0;
 	uint32_t entropy_send;
+	uint32_t lowat;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
 	while(clients_checked < num_client_sockets) {
 		clients_checked++;
 
+		/* Overload notices go between frames */
+		if (clients[receiver_index].notice_pending && !clients[receiver_index].header_bytes_pending &&
+			!clients[receiver_index].entropy_pending) {
+			if (FD_ISSET(clients[receiver_index].socket, &writefds) &&
+				(!clients[receiver_index].tls || tls_connection_established(clients[receiver_index].tls))) {
+				client_send_notice(&clients[receiver_index]);
+			}
+
+			goto next_receiver;
+		}
+
 		if (!clients[receiver_index].keepalive_pending && !data_buf_available(data_buf)) {
 			goto next_receiver;
 		}
 
+		/* Nothing is sent before the TLS handshake is complete */
+		if (clients[receiver_index].tls && !tls_connection_established(clients[receiver_index].tls)) {
+			goto next_receiver;
+		}
+
 		/* Incomplete header */
 		if (clients[receiver_index].header_bytes_pending) {
 			header_size = clients[receiver_index].header_bytes_pending;
@@ -257,6 +568,12 @@ static void send_entropy(void)
 			write_size = MAX_FRAME_SIZE - header_size;
 		}
 
+		/* Writable means less than notsent_lowat is queued. Keep it within twice that. */
+		lowat = (uint32_t)listener_options[clients[receiver_index].listener].notsent_lowat;
+		if (lowat > header_size && write_size + header_size > lowat) {
+			write_size = lowat - header_size;
+		}
+
 		if (write_size > data_buf_available(data_buf)) {
 			write_size = (uint32_t)data_buf_available(data_buf);
 		}
@@ -287,7 +604,7 @@ static void send_entropy(void)
 		}
 
 		/* Write entropy */
-		send_status = send(sock, send_buf, write_size+header_size, MSG_NOSIGNAL);
+		send_status = client_send(&clients[receiver_index], send_buf, write_size+header_size);
 		if (send_status >= 0) {
 			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_DEBUG), "Sent %d bytes of entropy to client", write_size);
 
@@ -319,12 +636,27 @@ static void send_entropy(void)
 				clients[receiver_index].entropy_pending -= entropy_send;
 			}
 
+			if (entropy_send) {
+				trace_event(TRACE_SEND, clients[receiver_index].id, entropy_send);
+				admission_remove(&admission, entropy_send);
+				request_tracker_sent(&clients[receiver_index].requests, request_stats, clients[receiver_index].listener,
+					clients[receiver_index].id, timespec_ns(&now), entropy_send);
+			}
+
+			if ((size_t)send_status == write_size + header_size) {
+				PROBE3(rngd, frame_send, clients[receiver_index].id, write_size, send_status);
+			} else {
+				PROBE3(rngd, partial_send, clients[receiver_index].id, write_size + header_size, send_status);
+			}
+
 			/* Return unsent entropy to the data buffer */
 			if (entropy_send < write_size) {
 				data_buf_unread(data_buf, send_buf+send_status, write_size - entropy_send);
 			}
 
 		} else {
+			PROBE3(rngd, partial_send, clients[receiver_index].id, write_size + header_size, 0);
+
 			/* Return unsent entropy to the buffer */
 			data_buf_unread(data_buf, send_buf+HEADER_SIZE, write_size);
 
@@ -338,19 +670,161 @@ next_receiver:
 	}
 }
 
-static void on_read(QuantisUSBDevice *device, const unsigned char *data, int data_len)
+/**
+* Opens the next capture file that does not exist yet (FILE.1, FILE.2, ...).
+* Files left by a previous daemon are skipped after a restart.
+*/
+static int capture_open_next(void)
+{
+	char path[PATH_MAX];
+	int status;
+	int fd;
+
+	do {
+		status = snprintf(path, sizeof(path), "%s.%u", capture_file, ++capture_index);
+		if (status < 0 || (size_t)status >= sizeof(path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		fd = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR | S_IWUSR);
+	} while (fd < 0 && errno == EEXIST);
+
+	if (fd < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to create capture file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Capturing to %s", path);
+
+	return fd;
+}
+
+/**
+* Closes the current capture file and opens the next one.
+* Called on the capture writer thread.
+*/
+static int capture_rotate(int fd, void *user_data)
+{
+	close(fd);
+	capture_fd = -1;
+
+	fd = capture_open_next();
+	if (fd < 0) {
+		return -1;
+	}
+
+	capture_fd = fd;
+
+	return fd;
+}
+
+static void capture_stop(void)
+{
+	OutputBufferStats stats;
+
+	output_buf_get_stats(capture, &stats);
+
+	if (output_buf_close(capture)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Capture failed: %s", strerror(errno));
+	}
+
+	capture = NULL;
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Captured %" PRIu64 " bytes, dropped %" PRIu64 " bytes. Largest backlog %" PRIu64 " bytes",
+		stats.bytes_in - stats.bytes_dropped, stats.bytes_dropped, stats.max_bytes_queued);
+
+	if (capture_fd >= 0) {
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+static void capture_write(const unsigned char *data, size_t data_len)
+{
+	OutputBufferStats stats;
+	time_t now;
+
+	if (output_buf_write(capture, data, data_len)) {
+		capture_stop();
+		return;
+	}
+
+	output_buf_get_stats(capture, &stats);
+
+	if (stats.bytes_dropped != capture_dropped) {
+		now = time(NULL);
+
+		if (now - capture_warning_time >= CAPTURE_WARNING_INTERVAL) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Capture can not keep up. %" PRIu64 " bytes not captured",
+				stats.bytes_dropped - capture_dropped);
+
+			capture_dropped = stats.bytes_dropped;
+			capture_warning_time = now;
+		}
+	}
+}
+
+/**
+* Stores random bytes from any source in the order they arrive.
+*/
+static void store_entropy(const unsigned char *data, size_t data_len)
 {
 	size_t data_saved;
 
-	if (test_fd >= 0) {
-		write(test_fd, data, (size_t)data_len);
+	if (capture) {
+		capture_write(data, data_len);
 	}
 
-	data_saved = data_buf_write(data_buf, data, (size_t)data_len);
+	data_saved = 0;
+
+	/* Nothing may overtake spooled data to keep the hardware order */
+	if (!spool_available(spool)) {
+		data_saved = data_buf_write(data_buf, data, (size_t)data_len);
+	}
+
+	if (spool && data_saved < data_len) {
+		data_saved += spool_write(spool, data + data_saved, (size_t)data_len - data_saved);
+	}
 
 	if (data_saved < data_len) {
-		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "%zu bytes of entropy wasted", (size_t)data_len - data_saved);
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "%zu bytes of entropy wasted", data_len - data_saved);
 	}
+
+	admission_supply(&admission, data_len);
+}
+
+static void on_read(QuantisUSBDevice *device, const unsigned char *data, int data_len)
+{
+	DeviceState *state;
+	int result;
+
+	trace_event(TRACE_DEVICE, 0, (uint64_t)data_len);
+
+	state = (DeviceState *)quantis_usb_device_get_user_data(device);
+	if (state) {
+		result = health_test_run(&state->health, data, (size_t)data_len);
+		if (result != HEALTH_OK) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "USB device failed the %s test. Dropping %d bytes",
+				result == HEALTH_RCT_FAILED ? "repetition count" : "adaptive proportion", data_len);
+			return;
+		}
+
+		state->bytes += (uint64_t)data_len;
+	}
+
+	store_entropy(data, (size_t)data_len);
+}
+
+/**
+* Called with each chunk from the sources given with -e.
+*/
+static void on_source_read(unsigned int index, const unsigned char *data, size_t data_len, void *user_data)
+{
+	trace_event(TRACE_DEVICE, index + 1, (uint64_t)data_len);
+	PROBE2(rngd, source_read, index, data_len);
+
+	store_entropy(data, data_len);
 }
 
 /**
@@ -364,13 +838,169 @@ static void on_error(QuantisUSBDevice *device)
 
 static int should_read(void)
 {
-	return data_buf_space(data_buf) >= BUFFER_SPACE;
+	/* Everything goes to the spool while it holds anything */
+	if (spool_available(spool)) {
+		return spool_space(spool) >= BUFFER_SPACE;
+	}
+
+	return data_buf_space(data_buf) + spool_space(spool) >= BUFFER_SPACE;
+}
+
+/**
+ Moves spooled data to data_buf as space becomes available.
+*/
+static void spool_drain(void)
+{
+	static unsigned char drain_buf[BUFFER_SPACE];
+	size_t drain_size;
+
+	if (!spool_available(spool)) {
+		return;
+	}
+
+	while (spool_available(spool) && data_buf_space(data_buf)) {
+		drain_size = data_buf_space(data_buf);
+		if (drain_size > sizeof(drain_buf)) {
+			drain_size = sizeof(drain_buf);
+		}
+
+		drain_size = spool_read(spool, drain_buf, drain_size);
+		data_buf_write(data_buf, drain_buf, drain_size);
+	}
+
+	memset(drain_buf, 0, sizeof(drain_buf));
+}
+
+/**
+* Takes queued chunks from the other sources while there is room for them.
+*/
+static void read_sources(void)
+{
+	if (!sources) {
+		return;
+	}
+
+	while (should_read() && source_pool_read(sources, on_source_read, NULL)) {}
+}
+
+static void log_source_stats(void)
+{
+	SourceStats stats;
+	unsigned int i;
+
+	for (i=0; sources && i < source_pool_count(sources); i++) {
+		if (!source_pool_get_stats(sources, i, &stats)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Source %s: %" PRIu64 " bytes, %" PRIu64 " bytes/s, %" PRIu64 " health test failures",
+				source_pool_name(sources, i), stats.bytes, stats.rate, stats.health_failures);
+		}
+	}
+}
+
+static void log_request_latency(void)
+{
+	const RequestLatency *latency;
+	size_t i;
+
+	for (i=0; i < HANDOVER_MAX_LISTENERS; i++) {
+		latency = request_stats_listener(request_stats, i);
+		if (!latency || !latency->requests) {
+			continue;
+		}
+
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Listener %s: %" PRIu64 " requests. Latency to first byte p50 %" PRIu64
+			" us p99 %" PRIu64 " us, to last byte p50 %" PRIu64 " us p99 %" PRIu64 " us p99.9 %" PRIu64 " us max %" PRIu64 " us",
+			listener_names[i], latency->requests,
+			read_histogram_percentile(&latency->first_byte, 500) / 1000,
+			read_histogram_percentile(&latency->first_byte, 990) / 1000,
+			read_histogram_percentile(&latency->fulfilment, 500) / 1000,
+			read_histogram_percentile(&latency->fulfilment, 990) / 1000,
+			read_histogram_percentile(&latency->fulfilment, 999) / 1000,
+			latency->fulfilment.max / 1000);
+	}
+}
+
+static void log_admission_stats(void)
+{
+	AdmissionStats stats;
+
+	admission_get_stats(&admission, &stats);
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Supply %" PRIu64 " bytes/s, demand %" PRIu64 " bytes/s, %" PRIu64
+		" bytes outstanding. Refused %" PRIu64 " requests for %" PRIu64 " bytes",
+		stats.supply_rate, stats.demand_rate, stats.outstanding, stats.requests_refused, stats.bytes_refused);
+}
+
+/**
+* Warns about refused requests at most every ADMISSION_WARNING_INTERVAL seconds.
+*/
+static void warn_overload(time_t now)
+{
+	AdmissionStats stats;
+
+	if (now - admission_warning_time < ADMISSION_WARNING_INTERVAL) {
+		return;
+	}
+
+	admission_get_stats(&admission, &stats);
+
+	if (stats.requests_refused == admission_warning_refused) {
+		return;
+	}
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Overloaded. Refused %" PRIu64 " requests. Supply %" PRIu64
+		" bytes/s, demand %" PRIu64 " bytes/s, %" PRIu64 " bytes outstanding. Backoff hint %u ms",
+		stats.requests_refused - admission_warning_refused, stats.supply_rate, stats.demand_rate,
+		stats.outstanding, admission_backoff_ms(&admission));
+
+	admission_warning_refused = stats.requests_refused;
+	admission_warning_time = now;
+}
+
+/**
+* Replaces the file given with -R with the current latencies.
+*/
+static void write_request_latency(void)
+{
+	char tmp_file[PATH_MAX];
+	FILE *file;
+	int fd;
+
+	if (!latency_file) {
+		return;
+	}
+
+	if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", latency_file) >= sizeof(tmp_file)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Latency file name too long");
+		return;
+	}
+
+	fd = open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to write latency file %s: %s", tmp_file, strerror(errno));
+		return;
+	}
+
+	file = fdopen(fd, "w");
+	if (!file) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to write latency file %s: %s", tmp_file, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	request_stats_report_json(file, request_stats, listener_names);
+
+	/* Readers only ever see a complete file */
+	if (fclose(file) || rename(tmp_file, latency_file)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to write latency file %s: %s", latency_file, strerror(errno));
+		unlink(tmp_file);
+	}
 }
 
 static void on_device(QuantisUSBDevice *device, int present)
 {
 	char sn[128];
 	static const char* status[] = {"Closed", "Opened"};
+	DeviceState *state;
 
 	if (quantis_usb_get_serial_number(device, sn, 128)) {
 		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to get Device serial number: %s", strerror(errno));
@@ -379,57 +1009,410 @@ static void on_device(QuantisUSBDevice *device, int present)
 		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "%s USB RNG device. (Serial Number: %s)", status[!!present], sn);
 	}
 
-	if (present && should_read()) {
+	state = (DeviceState *)quantis_usb_device_get_user_data(device);
+
+	if (!present && state) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Read %" PRIu64 " bytes. %" PRIu64 " health test failures",
+			state->bytes, state->health.failures);
+		quantis_usb_device_set_user_data(device, NULL);
+		free(state);
+	}
+
+	if (present && !state) {
+		state = malloc(sizeof(DeviceState));
+		if (state) {
+			memset(state, 0, sizeof(DeviceState));
+			health_test_init(&state->health, DEVICE_HEALTH_ENTROPY);
+			quantis_usb_device_set_user_data(device, state);
+		} else {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Out of memory. Device not health tested");
+		}
+	}
+
+	/* Spares are read by quantis_usb_read_all once they are the only devices */
+	if (present && should_read() && quantis_usb_device_get_weight(device)) {
 		quantis_usb_read(device);
 	}
 }
 
+/**
+* Called by the device supervisor.
+*/
+static void on_recovery(QuantisUSBContext *ctx, const QuantisUSBRecoveryEvent *event)
+{
+	static const char* reasons[] = {"", "transfer timeout", "endpoint halt", "transfer error", "low read rate"};
+	static const char* actions[] = {"", "cancel", "clear halt", "reset", "reopen"};
+
+	if (event->status == 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "USB device %s stalled (%s). Recovering with %s",
+			event->serial_number, reasons[event->reason], actions[event->action]);
+	} else if (event->status > 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "USB device %s recovered with %s after %" PRIu64 " ms",
+			event->serial_number, actions[event->action], event->downtime_ns / 1000000);
+	} else {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "USB device %s not recovered with %s after %" PRIu64 " ms",
+			event->serial_number, actions[event->action], event->downtime_ns / 1000000);
+	}
+}
+
 static void error_log(QuantisUSBContext *ctx, const char *msg)
 {
 	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "%s: %s", msg, strerror(errno));
 }
 
-/*
- Use all available devices
-*/
-static int should_open_device(QuantisUSBDevice *device)
-{
-	return 1;
+/*
+ Use the devices selected with -d and -n. All devices by default.
+*/
+static int should_open_device(QuantisUSBDevice *device)
+{
+	static const char* reasons[] = {"", "denied", "not allowed", "belongs to another shard"};
+	char sn[128];
+	unsigned int weight;
+	int result;
+
+	if (quantis_usb_get_serial_number(device, sn, 128)) {
+		sn[0] = '\0';
+	}
+
+	result = devsel_select(device_selection, sn, &weight);
+	if (result != DEVSEL_OPEN) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Skipping USB RNG device %s: %s", sn, reasons[result]);
+		return 0;
+	}
+
+	quantis_usb_device_set_weight(device, weight);
+
+	return 1;
+}
+
+static int setnonblocking(int sock)
+{
+	int opts;
+
+	opts = fcntl(sock, F_GETFL);
+	if (opts < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Error while setting socket to non-blocking. fcntl(F_GETFL) failed: %s", strerror(errno));
+		return -1;
+	}
+
+	opts = (opts | O_NONBLOCK);
+	if (fcntl(sock, F_SETFL, opts) < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Error while setting socket to non-blocking. fcntl(F_SETFL) failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void listener_setsockopt(int sock, size_t listener, int level, int name, const char *option, int value)
+{
+	if (setsockopt(sock, level, name, &value, sizeof(value)) < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Unable to set %s on %s socket: %s", option, listener_names[listener], strerror(errno));
+	}
+}
+
+/**
+* Starts listening with the options given with -L. Also used for listeners taken
+* over after a restart, so the options can be changed with SIGHUP.
+*/
+static int listener_setup(int sock, size_t listener)
+{
+	const ListenerOptions *options = &listener_options[listener];
+
+	/* Buffer sizes must be set before listen() to take effect on the window scale */
+	if (options->sndbuf) {
+		listener_setsockopt(sock, listener, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", options->sndbuf);
+	}
+
+	if (options->rcvbuf) {
+		listener_setsockopt(sock, listener, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", options->rcvbuf);
+	}
+
+	if (listen(sock, options->backlog) < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to listen to %s socket: %s", listener_names[listener], strerror(errno));
+		return -1;
+	}
+
+	if (setnonblocking(sock)) {
+		return -1;
+	}
+
+	/* The first request arrives with the connection */
+	listener_setsockopt(sock, listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", options->defer_accept);
+
+	/* Clients can send the first request with the SYN */
+	if (options->fastopen) {
+		listener_setsockopt(sock, listener, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", options->fastopen);
+	}
+
+	listener_setsockopt(sock, listener, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", options->nodelay);
+
+	if (options->notsent_lowat) {
+		listener_setsockopt(sock, listener, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", options->notsent_lowat);
+	}
+
+	listener_setsockopt(sock, listener, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", options->user_timeout);
+
+	if (options->busy_poll) {
+		listener_setsockopt(sock, listener, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", options->busy_poll);
+	}
+
+	return 0;
+}
+
+/**
+* Accepts the pending connections of a listener, up to ACCEPT_BUDGET so a
+* reconnect storm does not starve the connected clients.
+*/
+static void accept_clients(int sock, size_t listener, const struct timespec *now)
+{
+	struct sockaddr_storage remote;
+	socklen_t remote_len;
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	size_t accepted = 0;
+	size_t rejected = 0;
+	int reject_errno = 0;
+	int client_sock;
+	int budget;
+
+	for (budget = ACCEPT_BUDGET; budget > 0; budget--) {
+		remote_len = sizeof(remote);
+		client_sock = accept4(sock, (struct sockaddr *)&remote, &remote_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (client_sock < 0) {
+			/* The connection was reset while queued */
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Could not accept client connection: %s", strerror(errno));
+			}
+
+			break;
+		}
+
+		if (client_add(client_sock, listener)) {
+			reject_errno = errno;
+			rejected++;
+			close(client_sock);
+			continue;
+		}
+
+		memcpy(&clients[num_client_sockets-1].last_request, now, sizeof(struct timespec));
+		accepted++;
+
+		/* Addresses are only formatted when they are logged */
+		if ((setlogmask(0) & LOG_MASK(LOG_DEBUG)) &&
+			!getnameinfo((struct sockaddr *)&remote, remote_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_DEBUG), "Accepted connection %" PRIu32 " from %s:%s",
+				clients[num_client_sockets-1].id, host, port);
+		}
+	}
+
+	if (accepted) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Accepted %zu connections on %s. Open connections: %zu",
+			accepted, listener_names[listener], num_client_sockets);
+	}
+
+	if (rejected) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Rejected %zu connections on %s. %s", rejected, listener_names[listener],
+			reject_errno == EMFILE ? "Too many clients" : strerror(reject_errno));
+	}
+}
+
+/**
+* Hands the listeners, the clients and all buffered data to a new daemon process
+* started with the same arguments. TLS sessions can not be moved so TLS clients
+* are disconnected first.
+*
+* Returns: 0 if the new process took over and this one must exit, -1 with errno set
+* if this process keeps running.
+*/
+static int restart(char **argv, int sock, int sock6)
+{
+	HandoverState state;
+	struct timespec now;
+	int64_t idle_ms;
+	size_t buffered;
+	size_t spooled;
+	size_t i;
+	pid_t pid;
+	int peer;
+	int saved_errno;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+		return -1;
+	}
+
+	for (i = num_client_sockets; i > 0; i--) {
+		if (clients[i - 1].tls) {
+			client_remove_by_index(i - 1);
+		}
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.listeners[HANDOVER_LISTENER_IPV4] = sock;
+	state.listeners[HANDOVER_LISTENER_IPV6] = sock6;
+	state.next_client_id = next_client_id;
+
+	if (num_client_sockets) {
+		state.clients = calloc(num_client_sockets, sizeof(HandoverClient));
+		if (!state.clients) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_client_sockets; i++) {
+		idle_ms = (now.tv_sec - clients[i].last_request.tv_sec) * 1000;
+		idle_ms += (now.tv_nsec - clients[i].last_request.tv_nsec) / 1000000L;
+
+		state.clients[i].socket = clients[i].socket;
+		state.clients[i].id = clients[i].id;
+		state.clients[i].entropy_requested = clients[i].entropy_requested;
+		state.clients[i].entropy_pending = clients[i].entropy_pending;
+		state.clients[i].header_bytes_pending = clients[i].header_bytes_pending;
+		state.clients[i].keepalive_pending = clients[i].keepalive_pending;
+		state.clients[i].idle_ms = idle_ms > 0 ? (uint64_t)idle_ms : 0;
+		state.clients[i].overload_notices = clients[i].overload_notices;
+		state.clients[i].notice_pending = clients[i].notice_pending;
+		state.clients[i].notice_backoff_ms = clients[i].notice_backoff_ms;
+	}
+
+	state.num_clients = num_client_sockets;
+
+	/* Spooled data is newer than anything in data_buf so it goes last */
+	buffered = data_buf_available(data_buf);
+	spooled = spool_available(spool);
+
+	if (buffered + spooled) {
+		state.data = malloc(buffered + spooled);
+		if (!state.data) {
+			handover_state_free(&state);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		data_buf_read(data_buf, state.data, buffered);
+		if (spooled) {
+			spool_read(spool, state.data + buffered, spooled);
+		}
+
+		state.data_len = buffered + spooled;
+	}
+
+	peer = handover_spawn(argv, &pid);
+	if (peer < 0) {
+		goto error;
+	}
+
+	if (handover_send(peer, &state)) {
+		saved_errno = errno;
+
+		/* Make sure the new process is gone before continuing with the same sockets */
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(peer);
+
+		errno = saved_errno;
+		goto error;
+	}
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Handed %zu connections and %zu bytes to process %ld",
+		state.num_clients, state.data_len, (long)pid);
+
+	handover_peer = peer;
+	handover_state_free(&state);
+
+	return 0;
+
+error:
+	saved_errno = errno;
+
+	/* Both are empty now so writing restores the original order */
+	if (state.data) {
+		data_buf_write(data_buf, state.data, buffered);
+		spool_write(spool, state.data + buffered, spooled);
+	}
+
+	handover_state_free(&state);
+
+	errno = saved_errno;
+	return -1;
 }
 
-#if 0
-/*
- This is an example on how to cause the daemon to use a specific device only
+/**
+* Takes the clients and the buffered data from the daemon that started this process.
 */
-static int should_open_device(QuantisUSBDevice *device)
+static void takeover(HandoverState *state)
 {
-	char sn[128];
+	struct timespec now;
+	HandoverClient *client;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	size_t data_saved;
+	size_t i;
 
-	if (!quantis_usb_get_serial_number(device, sn, 128)) {
-		return !strcmp("100887A410", sn);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	return 0;
-}
-#endif
+	next_client_id = state->next_client_id;
 
-static int setnonblocking(int sock)
-{
-	int opts;
+	for (i = 0; i < state->num_clients; i++) {
+		client = &state->clients[i];
 
-	opts = fcntl(sock, F_GETFL);
-	if (opts < 0) {
-		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Error while setting socket to non-blocking. fcntl(F_GETFL) failed: %s", strerror(errno));
-		return -1;
+		if (num_client_sockets == client_sockets_length) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Too many clients. Dropping connection %" PRIu32, client->id);
+			close(client->socket);
+			continue;
+		}
+
+		/* Clients keep their protocol state. They always use plain TCP since TLS sessions are not handed over. */
+		memset(&clients[num_client_sockets], 0, sizeof(Client));
+		clients[num_client_sockets].socket = client->socket;
+		clients[num_client_sockets].id = client->id;
+		clients[num_client_sockets].entropy_requested = client->entropy_requested;
+		clients[num_client_sockets].entropy_pending = client->entropy_pending;
+		clients[num_client_sockets].header_bytes_pending = client->header_bytes_pending;
+		clients[num_client_sockets].keepalive_pending = client->keepalive_pending;
+		request_tracker_init(&clients[num_client_sockets].requests);
+		request_tracker_add_untracked(&clients[num_client_sockets].requests,
+		                              (uint64_t)client->entropy_requested + client->entropy_pending);
+		clients[num_client_sockets].overload_notices = client->overload_notices;
+		clients[num_client_sockets].notice_pending = client->notice_pending <= NOTICE_SIZE ? client->notice_pending : 0;
+		clients[num_client_sockets].notice_backoff_ms = client->notice_backoff_ms;
+		admission_add(&admission, (uint64_t)client->entropy_requested + client->entropy_pending, 0);
+
+		/* The listener is not handed over. Both listen on the same port so the address family tells. */
+		addr_len = sizeof(addr);
+		if (!getsockname(client->socket, (struct sockaddr *)&addr, &addr_len) && addr.ss_family == AF_INET6) {
+			clients[num_client_sockets].listener = HANDOVER_LISTENER_IPV6;
+		} else {
+			clients[num_client_sockets].listener = HANDOVER_LISTENER_IPV4;
+		}
+
+		/* Keep the idle time so restarts never extend a timeout */
+		clients[num_client_sockets].last_request.tv_sec = now.tv_sec - (time_t)(client->idle_ms / 1000);
+		clients[num_client_sockets].last_request.tv_nsec = now.tv_nsec - (long)(client->idle_ms % 1000) * 1000000L;
+		if (clients[num_client_sockets].last_request.tv_nsec < 0) {
+			clients[num_client_sockets].last_request.tv_sec--;
+			clients[num_client_sockets].last_request.tv_nsec += 1000000000L;
+		}
+
+		num_client_sockets++;
 	}
 
-	opts = (opts | O_NONBLOCK);
-	if (fcntl(sock, F_SETFL, opts) < 0) {
-		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Error while setting socket to non-blocking. fcntl(F_SETFL) failed: %s", strerror(errno));
-		return -1;
+	data_saved = data_buf_write(data_buf, state->data, state->data_len);
+
+	if (spool && data_saved < state->data_len) {
+		data_saved += spool_write(spool, state->data + data_saved, state->data_len - data_saved);
 	}
 
-	return 0;
+	if (data_saved < state->data_len) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "%zu bytes of entropy wasted", state->data_len - data_saved);
+	}
+
+	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Took over %zu connections and %zu bytes of entropy", num_client_sockets, data_saved);
 }
 
 static void show_usage(const char *app)
@@ -439,13 +1422,33 @@ static void show_usage(const char *app)
 		"Options:\n"
 		"-4       Listens to IPv4 address only. (Default: both)\n"
 		"-6       Listens to IPv6 address only. (Default: both)\n"
+		"-A OPTS  Admission control: client=BYTES,total=BYTES outstanding (Default: no limits),\n"
+		"         backoff=MS smallest backoff hint (Default: %d)\n"
 		"-b SIZE  Buffer size. (Default: %d)\n"
+		"-C FILE  TLS certificate chain (PEM). Enables TLS 1.3 on all listeners. Requires -K\n"
+		"-d FILE  Device configuration: allow/deny lists, read weights and shard.\n"
+		"-e SRC   Also read from SRC: rdseed, hwrng or a device, file or FIFO path. Can be repeated.\n"
+		"         Append ,entropy=BITS to set the min-entropy per byte for the health tests (Default: 1)\n"
 		"-h       Help. Show this message and exit\n"
+		"-K FILE  TLS private key (PEM)\n"
+		"-L OPTS  Listener options, for both listeners or prefixed with ipv4: or ipv6:. Can be repeated.\n"
+		"         backlog=N (Default: %d), defer=SECONDS to wait for the first request (Default: %d, 0 disables),\n"
+		"         fastopen=N TCP Fast Open queue (Default: %d, 0 disables), nodelay=0|1 (Default: 1),\n"
+		"         notsent_lowat=BYTES unsent per client (Default: %d, 0 disables), sndbuf=BYTES, rcvbuf=BYTES,\n"
+		"         user_timeout=MS, busy_poll=US (Default: kernel settings)\n"
 		"-l LEVEL Log Verbosity. (0 Errors, 1 Warnings, 2 Info, 3 Debug) (Default: %d)\n"
+		"-m       Lock the buffer in memory so it is never swapped.\n"
+		"-n I/N   Only use the devices of shard I out of N daemons on this host (0 <= I < N)\n"
 		"-p PORT  Port to listen to (Default: %d)\n"
+		"-R FILE  Write request latencies (JSON) to FILE every %d seconds and on SIGUSR1.\n"
                 "-o FILE  Write all random numbers to this file. Used for testing.\n"
+		"-O OPTS  Output file options: size=BYTES,time=SECONDS start a new file (FILE.1, ...),\n"
+		"         sync=MS between fdatasync calls (Default: 1000, 0 disables), queue=BYTES of memory (Default: 16M)\n"
+		"-s FILE  Spool random numbers that don't fit in the buffer to this file. The file is created and unlinked.\n"
+		"-S SIZE  Spool file size. (Default: %d)\n"
+		"-T FILE  Record a traffic trace to this file for rngd-replay.\n"
 		"-v       Show version number.\n"
-		, app, DEFAULT_ENTROPY_BUF_SIZE, DEFAULT_VERBOSITY, DEFAULT_PORT);
+		, app, ADMISSION_MIN_BACKOFF, DEFAULT_ENTROPY_BUF_SIZE, DEFAULT_BACKLOG, DEFAULT_DEFER_ACCEPT, DEFAULT_FASTOPEN, DEFAULT_NOTSENT_LOWAT, DEFAULT_VERBOSITY, DEFAULT_PORT, LATENCY_REPORT_INTERVAL, DEFAULT_SPOOL_SIZE);
 }
 
 static void show_version(const char *app)
@@ -479,14 +1482,9 @@ int main(int argc, char **argv)
 
     	int sock = -1;
 	int sock6 = -1;
-	int client_sock;
 	/* server address */
 	struct sockaddr_in6 local6;
-	struct sockaddr_in6 remote6;
-
 	struct sockaddr_in local;
-	struct sockaddr_in remote;
-	socklen_t remote_len = sizeof(remote);
 	int nfds;
 	fd_set readfds;
 	fd_set errorfds;
@@ -496,10 +1494,17 @@ int main(int argc, char **argv)
 	struct timeval timeout;
 	struct timespec now;
 	int64_t idle_time; /* idle time in milliseconds */
+	time_t latency_report_time = 0;
 	ssize_t i;
 	int so_reuseaddr = 1;
+	int requests_pending;
 	int sfd;
 	sigset_t mask;
+	struct signalfd_siginfo siginfo;
+	int handover_sock;
+	int taken_over = 0;
+	HandoverState handover;
+	QuantisUSBSupervisorOptions supervisor_options;
 	int port = DEFAULT_PORT;
 	int opt;
 	int ipv4_enabled = 1;
@@ -507,9 +1512,38 @@ int main(int argc, char **argv)
 	int verbosity = DEFAULT_VERBOSITY;
 	size_t buf_size = DEFAULT_ENTROPY_BUF_SIZE;
 	const char *outfile = NULL;
+	const char *spoolfile = NULL;
+	const char *tracefile = NULL;
+	const char *tls_cert = NULL;
+	const char *tls_key = NULL;
+	const char *device_config = NULL;
+	const char *shard = NULL;
+	unsigned int shard_index;
+	unsigned int shard_count;
+	size_t spool_size = DEFAULT_SPOOL_SIZE;
+	int buf_flags = DATA_BUF_HUGEPAGES | DATA_BUF_NODUMP | DATA_BUF_WIPE;
+	OutputBufferOptions capture_options;
+	char *subopts;
+	char *value;
+	char *const capture_tokens[] = { "size", "time", "sync", "queue", NULL };
+	char *const admission_tokens[] = { "client", "total", "backoff", NULL };
+	char *const listener_tokens[] = { "backlog", "defer", "fastopen", "nodelay", "notsent_lowat", "sndbuf", "rcvbuf",
+		"user_timeout", "busy_poll", NULL };
+	ListenerOptions *options;
+	size_t first_listener;
+	size_t last_listener;
+	size_t listener;
+	AdmissionOptions admission_options;
+	unsigned long long number;
+	int token;
+
+	output_buf_options_init(&capture_options);
+	capture_options.drop_when_full = 1;
+
+	admission_options_init(&admission_options);
 
 	/* Option handling */
-	while ((opt = getopt(argc, argv, "46b:hl:o:p:v")) != -1) {
+	while ((opt = getopt(argc, argv, "46A:b:C:d:e:hK:l:L:mn:o:O:p:R:s:S:T:v")) != -1) {
         	switch (opt) {
 			case '4':
 				ipv4_enabled = 1;
@@ -518,6 +1552,35 @@ int main(int argc, char **argv)
 			case '6':
 				ipv4_enabled = 0;
 				ipv6_enabled = 1;
+				break;
+			case 'A':
+				subopts = optarg;
+
+				while (*subopts) {
+					token = getsubopt(&subopts, admission_tokens, &value);
+
+					if (token < 0 || !value || sscanf(value, "%llu", &number) != 1) {
+						fprintf(stderr, "Invalid admission option %s\n", value ? value : "");
+						exit(1);
+					}
+
+					switch (token) {
+						case 0:
+							admission_options.client_limit = number;
+							break;
+						case 1:
+							admission_options.total_limit = number;
+							break;
+						case 2:
+							if (number > ADMISSION_MAX_BACKOFF) {
+								fprintf(stderr, "Backoff hint out of bounds. Allowed (0 - %d)\n", ADMISSION_MAX_BACKOFF);
+								exit(1);
+							}
+							admission_options.min_backoff_ms = (unsigned int)number;
+							break;
+					}
+				}
+
 				break;
 			case 'b':
 				if (sscanf(optarg, "%zu", &buf_size) != 1) {
@@ -530,19 +1593,152 @@ int main(int argc, char **argv)
 					exit(1);
 				}
 
+				break;
+			case 'C':
+				tls_cert = optarg;
+				break;
+			case 'd':
+				device_config = optarg;
+				break;
+			case 'e':
+				if (!sources) {
+					sources = source_pool_create();
+					if (!sources) {
+						fprintf(stderr, "Out of memory\n");
+						exit(1);
+					}
+				}
+
+				if (source_pool_add(sources, optarg)) {
+					fprintf(stderr, "Invalid source %s: %s\n", optarg, strerror(errno));
+					exit(1);
+				}
 				break;
 			case 'h':
 				show_usage(argv[0]);
 				exit(0);
 				break;
+			case 'K':
+				tls_key = optarg;
+				break;
 			case 'l':
 				if (sscanf(optarg, "%d", &verbosity) != 1) {
 					fprintf(stderr, "Invalid port number\n");
 					exit(1);
 				}
 				break;
+			case 'L':
+				subopts = optarg;
+				first_listener = 0;
+				last_listener = HANDOVER_MAX_LISTENERS - 1;
+
+				/* Options apply to both listeners unless one is named */
+				for (listener = 0; listener < HANDOVER_MAX_LISTENERS; listener++) {
+					size_t name_len = strlen(listener_names[listener]);
+
+					if (!strncmp(subopts, listener_names[listener], name_len) && subopts[name_len] == ':') {
+						first_listener = last_listener = listener;
+						subopts += name_len + 1;
+					}
+				}
+
+				while (*subopts) {
+					token = getsubopt(&subopts, listener_tokens, &value);
+
+					if (token < 0 || !value || sscanf(value, "%llu", &number) != 1 || number > INT_MAX) {
+						fprintf(stderr, "Invalid listener option %s\n", value ? value : "");
+						exit(1);
+					}
+
+					if (token == 0 && !number) {
+						fprintf(stderr, "Backlog out of bounds\n");
+						exit(1);
+					}
+
+					for (listener = first_listener; listener <= last_listener; listener++) {
+						options = &listener_options[listener];
+
+						switch (token) {
+							case 0:
+								options->backlog = (int)number;
+								break;
+							case 1:
+								options->defer_accept = (int)number;
+								break;
+							case 2:
+								options->fastopen = (int)number;
+								break;
+							case 3:
+								options->nodelay = !!number;
+								break;
+							case 4:
+								options->notsent_lowat = (int)number;
+								break;
+							case 5:
+								options->sndbuf = (int)number;
+								break;
+							case 6:
+								options->rcvbuf = (int)number;
+								break;
+							case 7:
+								options->user_timeout = (int)number;
+								break;
+							case 8:
+								options->busy_poll = (int)number;
+								break;
+						}
+					}
+				}
+
+				break;
+			case 'm':
+				buf_flags |= DATA_BUF_LOCK;
+				break;
+			case 'n':
+				shard = optarg;
+				break;
 			case 'o':
 				outfile = optarg;
+				break;
+			case 'O':
+				subopts = optarg;
+
+				while (*subopts) {
+					token = getsubopt(&subopts, capture_tokens, &value);
+
+					if (token < 0 || !value || sscanf(value, "%llu", &number) != 1) {
+						fprintf(stderr, "Invalid output option %s\n", value ? value : "");
+						exit(1);
+					}
+
+					switch (token) {
+						case 0:
+							capture_options.rotate_size = number;
+							break;
+						case 1:
+							if (number > UINT_MAX / 1000) {
+								fprintf(stderr, "Rotation time out of bounds\n");
+								exit(1);
+							}
+							capture_options.rotate_interval_ms = (unsigned int)number * 1000;
+							break;
+						case 2:
+							if (number > UINT_MAX) {
+								fprintf(stderr, "Sync interval out of bounds\n");
+								exit(1);
+							}
+							capture_options.sync_interval_ms = (unsigned int)number;
+							break;
+						case 3:
+							if (number > get_max_alloc_size()) {
+								fprintf(stderr, "Output queue size out of bounds\n");
+								exit(1);
+							}
+							capture_options.buffer_size = (size_t)number;
+							break;
+					}
+				}
+
 				break;
         		case 'p':
 				if (sscanf(optarg, "%d", &port) != 1) {
@@ -550,6 +1746,27 @@ int main(int argc, char **argv)
 					exit(1);
 				}
 				break;
+			case 'R':
+				latency_file = optarg;
+				break;
+			case 's':
+				spoolfile = optarg;
+				break;
+			case 'S':
+				if (sscanf(optarg, "%zu", &spool_size) != 1) {
+					fprintf(stderr, "Invalid spool size\n");
+					exit(1);
+				}
+
+				if (spool_size < MIN_SPOOL_SIZE || spool_size > get_max_alloc_size()) {
+					fprintf(stderr, "Spool size out of bounds. Allowed (%zu - %zu)\n", MIN_SPOOL_SIZE, get_max_alloc_size());
+					exit(1);
+				}
+
+				break;
+			case 'T':
+				tracefile = optarg;
+				break;
 			case 'v':
 				show_version(argv[0]);
 				show_usage(argv[0]);
@@ -594,6 +1811,29 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	admission_init(&admission, &admission_options);
+
+	device_selection = devsel_create();
+	if (!device_selection) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (device_config && devsel_load(device_selection, device_config)) {
+		fprintf(stderr, "Invalid device configuration %s\n", device_config);
+		exit(1);
+	}
+
+	if (shard && devsel_set_shard(device_selection, shard)) {
+		fprintf(stderr, "Invalid shard %s\n", shard);
+		exit(1);
+	}
+
+	devsel_get_shard(device_selection, &shard_index, &shard_count);
+	if (shard_count) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Using the devices of shard %u of %u", shard_index, shard_count);
+	}
+
 	/* Ignore SIGPIPE */
         sa.sa_handler = SIG_IGN;
         sa.sa_flags = 0;
@@ -603,10 +1843,12 @@ int main(int argc, char **argv)
 		return -1;
         }
 
-	/* Handle SIGTERM and SIGINT. */
+	/* Handle SIGTERM and SIGINT. SIGHUP restarts without dropping connections. SIGUSR1 reports latencies. */
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
 
 	/* Block the signals that will be handled using signalfd(), so they don't
 	 * cause signal handlers or default signal actions to execute. */
@@ -622,13 +1864,32 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	data_buf = data_buf_create(buf_size);
+	/* Started by a running daemon to take over its connections */
+	handover_sock = handover_inherited_socket();
+
+	data_buf = data_buf_create_ex(buf_size, buf_flags);
 	if (!data_buf) {
-		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Out of memory");
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to allocate buffer: %s", strerror(errno));
 		return -3;
 	}
 
 
+	if (spoolfile) {
+		spool = spool_create(spoolfile, spool_size);
+		if (!spool) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to create spool file %s: %s", spoolfile, strerror(errno));
+			return -3;
+		}
+
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Spooling up to %zu bytes of random data", spool_capacity(spool));
+	}
+
+	request_stats = request_stats_create(HANDOVER_MAX_LISTENERS, LATENCY_TOP_CLIENTS);
+	if (!request_stats) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Out of memory");
+		return -3;
+	}
+
 	client_sockets_length = MAX_CLIENTS;
 	clients = malloc(client_sockets_length * sizeof(Client));
 	if (!clients) {
@@ -639,11 +1900,82 @@ int main(int argc, char **argv)
 	if (outfile) {
 		mode_t mode = S_IRUSR | S_IWUSR;
 
-		test_fd = open(outfile, O_WRONLY|O_CREAT|O_EXCL|O_SYNC, mode);
-		if (test_fd < 0) {
+		capture_file = outfile;
+
+		capture_fd = open(outfile, O_WRONLY|O_CREAT|O_EXCL, mode);
+
+		/* The previous daemon wrote the earlier files. Continue with the next one. */
+		if (capture_fd < 0 && errno == EEXIST && handover_sock >= 0) {
+			capture_fd = capture_open_next();
+		}
+
+		if (capture_fd < 0) {
 			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to create file to write test data");
 			return -3;
 		}
+
+		if (capture_options.rotate_size || capture_options.rotate_interval_ms) {
+			capture_options.rotate = capture_rotate;
+		}
+
+		capture = output_buf_create(capture_fd, &capture_options);
+		if (!capture) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to start writing test data: %s", strerror(errno));
+			return -3;
+		}
+	}
+
+	if (tracefile) {
+		int trace_fd;
+
+		trace_fd = open(tracefile, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR | S_IWUSR);
+
+		/* A trace can not be continued since it would refer to connections it has never seen */
+		if (trace_fd < 0 && errno == EEXIST && handover_sock >= 0) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Trace file %s exists. Not tracing after restart", tracefile);
+		} else if (trace_fd < 0) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to create trace file %s: %s", tracefile, strerror(errno));
+			return -3;
+		} else {
+			trace = trace_writer_create(trace_fd);
+			if (!trace) {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to start trace: %s", strerror(errno));
+				close(trace_fd);
+				return -3;
+			}
+		}
+	}
+
+	if (tls_cert || tls_key) {
+		if (!tls_cert || !tls_key) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "TLS needs both a certificate (-C) and a private key (-K)");
+			return -3;
+		}
+
+		tls_server = tls_server_create(tls_cert, tls_key);
+		if (!tls_server) {
+			return -3;
+		}
+	}
+
+	if (handover_sock >= 0) {
+		if (handover_receive(handover_sock, &handover)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to take over from the running daemon: %s", strerror(errno));
+			return -3;
+		}
+
+		/* Listeners stay as they are. -4, -6 and -p only apply to a fresh start. */
+		sock = handover.listeners[HANDOVER_LISTENER_IPV4];
+		sock6 = handover.listeners[HANDOVER_LISTENER_IPV6];
+		taken_over = 1;
+
+		takeover(&handover);
+		handover_state_free(&handover);
+
+		/* The devices can only be opened once the previous daemon has closed them */
+		if (handover_wait(handover_sock, HANDOVER_WAIT_TIME * 1000)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Previous daemon did not exit: %s", strerror(errno));
+		}
 	}
 
 	ctx = quantis_usb_init(on_read, on_error, on_device, should_open_device, error_log, NULL);
@@ -654,7 +1986,30 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	if (ipv4_enabled) {
+	/* Devices join as they become ready without stalling clients */
+	if (quantis_usb_start_open_thread(ctx)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to start device open thread: %s", strerror(errno));
+		exit_status = -3;
+		goto cleanup;
+	}
+
+	if (sources && source_pool_start(sources)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to start entropy sources: %s", strerror(errno));
+		exit_status = -3;
+		goto cleanup;
+	}
+
+	/* Stalled devices are reset or reopened instead of starving clients */
+	quantis_usb_supervisor_options_init(&supervisor_options);
+	supervisor_options.callback = on_recovery;
+
+	if (quantis_usb_start_supervisor(ctx, &supervisor_options)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to start device supervisor: %s", strerror(errno));
+		exit_status = -3;
+		goto cleanup;
+	}
+
+	if (ipv4_enabled && !taken_over) {
 		sock = socket(AF_INET, SOCK_STREAM, 0);
 		if (sock < 0) {
 			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to create IPv4 socket: %s", strerror(errno));
@@ -663,7 +2018,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (ipv6_enabled) {
+	if (ipv6_enabled && !taken_over) {
 		sock6 = socket(AF_INET6, SOCK_STREAM, 0);
 		if (sock6 < 0) {
 			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to create IPv6 socket: %s", strerror(errno));
@@ -672,7 +2027,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (sock >= 0) {
+	if (sock >= 0 && !taken_over) {
 		memset(&local, 0, sizeof(local));
 		local.sin_family = AF_INET;
 		local.sin_addr.s_addr = INADDR_ANY;
@@ -687,7 +2042,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (sock6 >= 0) {
+	if (sock6 >= 0 && !taken_over) {
 		memset(&local6, 0, sizeof(local6));
 		local6.sin6_family = AF_INET6;
 		local6.sin6_addr = in6addr_any;
@@ -703,37 +2058,23 @@ int main(int argc, char **argv)
 		}
 	}
 
-	quantis_usb_enable_hotplug(ctx, 1);
-
-	if (sock >= 0) {
-		if (listen(sock, 5) < 0) {
-		        syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to listen to IPv4 socket: %s", strerror(errno));
-			exit_status = 1;
-			goto cleanup;
-		}
-
-		if (setnonblocking(sock)) {
-			exit_status = 1;
-			goto cleanup;
-		}
+	if (sock >= 0 && listener_setup(sock, HANDOVER_LISTENER_IPV4)) {
+		exit_status = 1;
+		goto cleanup;
 	}
 
-	if (sock6 >= 0) {
-		if (listen(sock6, 5) < 0) {
-		        syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Unable to listen to IPv6 socket: %s", strerror(errno));
-			exit_status = 1;
-			goto cleanup;
-		}
-
-		if (setnonblocking(sock6)) {
-			exit_status = 1;
-			goto cleanup;
-		}
+	if (sock6 >= 0 && listener_setup(sock6, HANDOVER_LISTENER_IPV6)) {
+		exit_status = 1;
+		goto cleanup;
 	}
 
+	/* Only queues the devices. They are added while handling events. */
+	quantis_usb_enable_hotplug(ctx, 1);
 	quantis_usb_read_all(ctx);
 
-	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Listening for connections on port %d", port);
+	if (!taken_over) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Listening for connections on port %d", port);
+	}
 
 	for(;;) {
 		FD_ZERO(&readfds);
@@ -765,6 +2106,17 @@ int main(int argc, char **argv)
 			}
 		}
 
+		/* Queued source data is only taken while there is room for it */
+		if (sources && should_read()) {
+			FD_SET(source_pool_fd(sources), &readfds);
+
+			if (nfds <= source_pool_fd(sources)) {
+				nfds = source_pool_fd(sources) + 1;
+			}
+		}
+
+		requests_pending = 0;
+
 		for(i=0; i < num_client_sockets; i++) {
 			FD_SET(clients[i].socket, &readfds);
 			FD_SET(clients[i].socket, &writefds);
@@ -773,9 +2125,12 @@ int main(int argc, char **argv)
 			if (nfds <= clients[i].socket) {
 				nfds = clients[i].socket + 1;
 			}
+
+			requests_pending |= client_has_pending(&clients[i]);
 		}
 
-		timeout.tv_sec = MAX_IDLE_TIME / 2;
+		/* Requests already decrypted do not make the socket readable */
+		timeout.tv_sec = requests_pending ? 0 : MAX_IDLE_TIME / 2;
 		timeout.tv_usec = 0;
 
 		select_status = quantis_usb_before_poll(ctx, &nfds, &readfds, &writefds, &errorfds, &timeout);
@@ -802,6 +2157,28 @@ int main(int argc, char **argv)
 
 
 		if (FD_ISSET(sfd, &readfds)) {
+			if (read(sfd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+				siginfo.ssi_signo = 0;
+			}
+
+			if (siginfo.ssi_signo == SIGUSR1) {
+				log_admission_stats();
+				log_request_latency();
+				write_request_latency();
+				continue;
+			}
+
+			if (siginfo.ssi_signo == SIGHUP) {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Restarting");
+
+				if (!restart(argv, sock, sock6)) {
+					break;
+				}
+
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Restart failed: %s. Continuing", strerror(errno));
+				continue;
+			}
+
 			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Process signalled. Exiting");
 			break;
 		}
@@ -822,62 +2199,21 @@ int main(int argc, char **argv)
 			break;
 		}
 
-		/* Handle new connections IPv4 */
-	 	if (FD_ISSET(sock, &readfds)) {
-			remote_len = sizeof(remote);
-			client_sock = accept(sock, (struct sockaddr *)&remote, &remote_len);
+		admission_update(&admission, timespec_ns(&now));
+		warn_overload(now.tv_sec);
 
-			if (client_sock >= 0) {
-				if (setnonblocking(client_sock)) {
-					close(client_sock);
-				} else {
-					char str[INET_ADDRSTRLEN];
-					inet_ntop(AF_INET, &(remote.sin_addr), str, INET_ADDRSTRLEN);
-
-					status = client_add(client_sock);
-
-					if (status < 0) {
-						close(client_sock);
-						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Rejected connection from %s. Too many clients", str);
-					} else {
-						memcpy(&clients[num_client_sockets-1].last_request, &now, sizeof(struct timespec));
-						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Accepted connection from %s:%d. Open connections: %zu", str, (int)remote.sin_port, num_client_sockets);
-					}
-				}
-			} else {
-				if (errno != EAGAIN) {
-					syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Could not accept client connection: %s", strerror(errno));
-				}
-			}
+		if (latency_file && now.tv_sec - latency_report_time >= LATENCY_REPORT_INTERVAL) {
+			write_request_latency();
+			latency_report_time = now.tv_sec;
 		}
 
-		/* Handle new connections IPv6 */
-	 	if (FD_ISSET(sock6, &readfds)) {
-			remote_len = sizeof(remote6);
-			client_sock = accept(sock6, (struct sockaddr *)&remote6, &remote_len);
-
-			if (client_sock >= 0) {
-				if (setnonblocking(client_sock)) {
-					close(client_sock);
-				} else {
-					char str[INET6_ADDRSTRLEN];
-					inet_ntop(AF_INET6, &(remote6.sin6_addr), str, INET6_ADDRSTRLEN);
-
-					status = client_add(client_sock);
+		/* Handle new connections */
+		if (sock >= 0 && FD_ISSET(sock, &readfds)) {
+			accept_clients(sock, HANDOVER_LISTENER_IPV4, &now);
+		}
 
-					if (status < 0) {
-						close(client_sock);
-						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Rejected connection from %s. Too many clients", str);
-					} else {
-						memcpy(&clients[num_client_sockets-1].last_request, &now, sizeof(struct timespec));
-						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Accepted connection from %s:%d. Open connections: %zu", str, (int)remote6.sin6_port, num_client_sockets);
-					}
-				}
-			} else {
-				if (errno != EAGAIN) {
-					syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Could not accept client connection: %s", strerror(errno));
-				}
-			}
+		if (sock6 >= 0 && FD_ISSET(sock6, &readfds)) {
+			accept_clients(sock6, HANDOVER_LISTENER_IPV6, &now);
 		}
 
 		/* Handle requests */
@@ -895,18 +2231,48 @@ int main(int argc, char **argv)
 			idle_time += (now.tv_nsec - clients[i].last_request.tv_nsec) / 1000000000L;
 
 			if (idle_time >= MAX_IDLE_TIME) {
+				PROBE2(rngd, client_idle_timeout, clients[i].id, idle_time);
 				client_remove_by_index((size_t)i);
 				i--;
 				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Client connection time-out: %s. Open connections: %zu", strerror(errno), num_client_sockets);
 				continue;
 			}
 
-			if (FD_ISSET(clients[i].socket, &readfds)) {
+			if (clients[i].tls) {
+				if (!tls_connection_established(clients[i].tls)) {
+					if (!FD_ISSET(clients[i].socket, &readfds) && !FD_ISSET(clients[i].socket, &writefds)) {
+						continue;
+					}
+
+					status = tls_connection_handshake(clients[i].tls);
+					if (status < 0) {
+						client_remove_by_index((size_t)i);
+						i--;
+						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "TLS handshake failed. Open connections: %zu", num_client_sockets);
+						continue;
+					}
+
+					if (!status) {
+						continue;
+					}
+
+					syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "TLS session established (%s)",
+						tls_connection_is_ktls(clients[i].tls) ? "kernel TLS" : "userspace TLS");
+				} else if (tls_connection_wants_flush(clients[i].tls) && FD_ISSET(clients[i].socket, &writefds) &&
+					tls_connection_flush(clients[i].tls)) {
+					client_remove_by_index((size_t)i);
+					i--;
+					syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Client connection error: %s. Open connections: %zu", strerror(errno), num_client_sockets);
+					continue;
+				}
+			}
+
+			if (FD_ISSET(clients[i].socket, &readfds) || client_has_pending(&clients[i])) {
 				ssize_t recv_status;
 				uint32_t entropy_requested;
 				uint32_t new_entropy;
 
-				recv_status = recv(clients[i].socket, &entropy_requested, sizeof(uint32_t), 0);
+				recv_status = client_recv(&clients[i], &entropy_requested, sizeof(uint32_t));
 				/* Client disconnected */
 				if (recv_status == 0) {
 					client_remove_by_index((size_t)i);
@@ -938,8 +2304,32 @@ int main(int argc, char **argv)
 
 				entropy_requested = ntohl(entropy_requested);
 
+				memcpy(&clients[i].last_request, &now, sizeof(struct timespec));
+
+				if (entropy_requested == OVERLOAD_NOTICE_REQUEST) {
+					clients[i].overload_notices = 1;
+					continue;
+				}
+
 				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_DEBUG), "Client requested %d bytes of entropy", entropy_requested);
 
+				status = admission_check(&admission,
+					(uint64_t)clients[i].entropy_requested + clients[i].entropy_pending, entropy_requested);
+				if (status != ADMISSION_OK) {
+					PROBE3(rngd, request_refused, clients[i].id, entropy_requested, status);
+
+					if (clients[i].overload_notices) {
+						client_queue_notice(&clients[i], admission_backoff_ms(&admission));
+					} else {
+						/* Older clients only understand a closed connection */
+						client_remove_by_index((size_t)i);
+						i--;
+						syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Closed overloading connection. Open connections: %zu", num_client_sockets);
+					}
+
+					continue;
+				}
+
 				new_entropy = entropy_requested + clients[i].entropy_requested;
 
 				/* Overflow. No way to handle this properly. Disconnect client */
@@ -950,7 +2340,11 @@ int main(int argc, char **argv)
 				}
 
 				clients[i].entropy_requested = new_entropy;
-				memcpy(&clients[i].last_request, &now, sizeof(struct timespec));
+				admission_add(&admission, entropy_requested, 1);
+				request_tracker_add(&clients[i].requests, timespec_ns(&now), entropy_requested);
+
+				trace_event(TRACE_REQUEST, clients[i].id, entropy_requested);
+				PROBE3(rngd, request, clients[i].id, entropy_requested, clients[i].entropy_requested);
 			
 				if (!entropy_requested) {
 					clients[i].keepalive_pending = 1;
@@ -958,11 +2352,16 @@ int main(int argc, char **argv)
 			}
 		}
 
+		spool_drain();
 		send_entropy();
 
+		/* Sending made room. Refill now so the data is ready for the next iteration. */
+		spool_drain();
+
 		/* If we are low on entropy make sure we replenish it before it runs out */
 		if (should_read()) {
 			quantis_usb_read_all(ctx);
+			read_sources();
 		}
 
 		// syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_DEBUG), "Finished processing events iteration. Entropy available: %zu. Connections: %zu\n", data_buf_available(data_buf), num_client_sockets);
@@ -970,8 +2369,12 @@ int main(int argc, char **argv)
 
 cleanup:
 
-	if (test_fd >= 0) {
-		close(test_fd);
+	if (capture) {
+		capture_stop();
+	}
+
+	if (trace && trace_writer_close(trace)) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Trace failed: %s", strerror(errno));
 	}
 
 	if (sfd >= 0) {
@@ -980,6 +2383,10 @@ cleanup:
 
 	/* Close client sockets */
 	for(i=0; i < num_client_sockets; i++) {
+		if (clients[i].tls) {
+			tls_connection_destroy(clients[i].tls);
+		}
+
 		close(clients[i].socket);
 	}
 
@@ -987,6 +2394,8 @@ cleanup:
 		free(clients);
 	}
 
+	tls_server_destroy(tls_server);
+
 	if (sock >= 0) {
 		close(sock);
 	}
@@ -996,7 +2405,20 @@ cleanup:
 	}
 
 	quantis_usb_destroy(ctx);
+	log_source_stats();
+	log_admission_stats();
+	log_request_latency();
+	write_request_latency();
+	request_stats_destroy(request_stats);
+	source_pool_destroy(sources);
+	devsel_destroy(device_selection);
 	data_buf_destroy(data_buf);
+	spool_destroy(spool);
+
+	/* Tells the new daemon that the devices are free */
+	if (handover_peer >= 0) {
+		close(handover_peer);
+	}
 
 	syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Daemon shutdown. Status: %d", exit_status);
 
@@ -0,0 +1,488 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Simulated Quantis device for load testing the daemon without hardware.
+
+ Implements the part of quantisusb.h used by quantisusb-rngd with one
+ device that produces deterministic pseudo random bytes. Never use it to
+ serve clients: the output is predictable.
+
+ Environment:
+ QUANTIS_SIM_TRACE  Trace recorded with quantisusb-rngd -T. Reads complete at
+                    the recorded device arrival times and sizes.
+ QUANTIS_SIM_SPEED  Time scale for the trace. 2 replays twice as fast. (Default: 1)
+ QUANTIS_SIM_RATE   Bytes per second when there is no trace. (Default: 500000)
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "quantisusb.h"
+#include "trace.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Same as one bulk transfer of the real device */
+#define SIM_TRANSFER_SIZE (512*16)
+#define SIM_DEFAULT_RATE (500000)
+
+struct SimArrival {
+	uint64_t time_us;
+	size_t size;
+};
+
+struct QuantisUSBContext {
+	void *user_data;
+	QuantisUSBReadCallback read_callback;
+	QuantisUSBErrorCallback error_callback;
+	QuantisUSBDeviceCallback device_callback;
+	QuantisUSBDeviceShouldOpenCallback should_open_callback;
+
+	QuantisUSBDevice *device;
+
+	/* Recorded arrivals. Without a trace reads complete at a fixed rate. */
+	struct SimArrival *arrivals;
+	size_t arrival_count;
+	size_t next_arrival;
+	double speed;
+	uint64_t rate;
+
+	uint64_t start_us;
+
+	unsigned char *buffer;
+	size_t buffer_size;
+
+	uint64_t prng_state;
+};
+
+struct QuantisUSBDevice {
+	QuantisUSBContext *context;
+
+	int reading;
+	/* Completion time of the read in progress */
+	uint64_t due_us;
+
+	/* Only one device so weights do not change anything */
+	unsigned int weight;
+
+	void *user_data;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+/* xorshift64* */
+static uint64_t sim_random(QuantisUSBContext *ctx)
+{
+	ctx->prng_state ^= ctx->prng_state >> 12;
+	ctx->prng_state ^= ctx->prng_state << 25;
+	ctx->prng_state ^= ctx->prng_state >> 27;
+
+	return ctx->prng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int sim_load_trace(QuantisUSBContext *ctx, const char *path)
+{
+	TraceReader *trace;
+	TraceEvent event;
+	struct SimArrival *arrivals;
+	size_t length = 0;
+	int status;
+	int error;
+
+	trace = trace_reader_open(path);
+	if (!trace) {
+		return -1;
+	}
+
+	while ((status = trace_reader_next(trace, &event)) > 0) {
+		if (event.type != TRACE_DEVICE || !event.value) {
+			continue;
+		}
+
+		if (ctx->arrival_count == length) {
+			length = length ? length * 2 : 1024;
+
+			arrivals = realloc(ctx->arrivals, length * sizeof(struct SimArrival));
+			if (!arrivals) {
+				status = -1;
+				break;
+			}
+
+			ctx->arrivals = arrivals;
+		}
+
+		ctx->arrivals[ctx->arrival_count].time_us = (uint64_t)((double)event.time_us / ctx->speed);
+		ctx->arrivals[ctx->arrival_count].size = (size_t)event.value;
+		ctx->arrival_count++;
+	}
+
+	error = errno;
+	trace_reader_close(trace);
+	errno = error;
+
+	return status < 0 ? -1 : 0;
+}
+
+/**
+* Schedules the completion of a new read. Returns -1 if the trace is over.
+*/
+static int sim_schedule(QuantisUSBDevice *device)
+{
+	QuantisUSBContext *ctx = device->context;
+	uint64_t now = now_us();
+
+	if (ctx->arrivals) {
+		if (ctx->next_arrival == ctx->arrival_count) {
+			return -1;
+		}
+
+		device->due_us = ctx->start_us + ctx->arrivals[ctx->next_arrival].time_us;
+	} else {
+		device->due_us = now + SIM_TRANSFER_SIZE * 1000000ULL / ctx->rate;
+	}
+
+	return 0;
+}
+
+static int sim_complete(QuantisUSBDevice *device)
+{
+	QuantisUSBContext *ctx = device->context;
+	size_t size = SIM_TRANSFER_SIZE;
+	unsigned char *buffer;
+	uint64_t value;
+	size_t i;
+
+	if (ctx->arrivals) {
+		size = ctx->arrivals[ctx->next_arrival++].size;
+	}
+
+	if (size > ctx->buffer_size) {
+		buffer = realloc(ctx->buffer, size);
+		if (!buffer) {
+			return -1;
+		}
+
+		ctx->buffer = buffer;
+		ctx->buffer_size = size;
+	}
+
+	for (i = 0; i < size; i += sizeof(value)) {
+		value = sim_random(ctx);
+		memcpy(ctx->buffer + i, &value, size - i < sizeof(value) ? size - i : sizeof(value));
+	}
+
+	device->reading = 0;
+	ctx->read_callback(device, ctx->buffer, (int)size);
+
+	return 0;
+}
+
+QuantisUSBContext *quantis_usb_init(QuantisUSBReadCallback read_callback,
+                                    QuantisUSBErrorCallback error_callback,
+                                    QuantisUSBDeviceCallback device_callback,
+				    QuantisUSBDeviceShouldOpenCallback should_open_callback,
+				    QuantisUSBErrorLogger error_log,
+                                    void *user_data)
+{
+	QuantisUSBContext *ctx;
+	const char *value;
+
+	ctx = calloc(1, sizeof(struct QuantisUSBContext));
+	if (!ctx) {
+		return NULL;
+	}
+
+	ctx->read_callback = read_callback;
+	ctx->error_callback = error_callback;
+	ctx->device_callback = device_callback;
+	ctx->should_open_callback = should_open_callback;
+	ctx->user_data = user_data;
+	ctx->prng_state = 0x9E3779B97F4A7C15ULL;
+	ctx->speed = 1.0;
+	ctx->rate = SIM_DEFAULT_RATE;
+
+	value = getenv("QUANTIS_SIM_SPEED");
+	if (value && (sscanf(value, "%lf", &ctx->speed) != 1 || ctx->speed <= 0)) {
+		free(ctx);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	value = getenv("QUANTIS_SIM_RATE");
+	if (value && (sscanf(value, "%" SCNu64, &ctx->rate) != 1 || !ctx->rate)) {
+		free(ctx);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	value = getenv("QUANTIS_SIM_TRACE");
+	if (value && sim_load_trace(ctx, value)) {
+		quantis_usb_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void quantis_usb_destroy(QuantisUSBContext *ctx)
+{
+	if (!ctx) return;
+
+	quantis_usb_disable_hotplug(ctx);
+
+	free(ctx->arrivals);
+	free(ctx->buffer);
+	free(ctx);
+}
+
+int quantis_usb_enumerate(QuantisUSBContext *ctx)
+{
+	QuantisUSBDevice *device;
+
+	if (ctx->device) {
+		return 0;
+	}
+
+	device = calloc(1, sizeof(struct QuantisUSBDevice));
+	if (!device) {
+		return -1;
+	}
+
+	device->context = ctx;
+	device->weight = 1;
+
+	if (ctx->should_open_callback && !ctx->should_open_callback(device)) {
+		free(device);
+		return 0;
+	}
+
+	/* Trace times are relative to the device appearing */
+	ctx->device = device;
+	ctx->start_us = now_us();
+	ctx->next_arrival = 0;
+
+	if (ctx->device_callback) {
+		ctx->device_callback(device, 1);
+	}
+
+	return 0;
+}
+
+int quantis_usb_enable_hotplug(QuantisUSBContext *ctx, int enumerate)
+{
+	return enumerate ? quantis_usb_enumerate(ctx) : 0;
+}
+
+/* The simulated device opens instantly */
+int quantis_usb_start_open_thread(QuantisUSBContext *ctx)
+{
+	return 0;
+}
+
+int quantis_usb_stop_open_thread(QuantisUSBContext *ctx)
+{
+	return 0;
+}
+
+void quantis_usb_supervisor_options_init(QuantisUSBSupervisorOptions *options)
+{
+	memset(options, 0, sizeof(QuantisUSBSupervisorOptions));
+}
+
+/* The simulated device never stalls */
+int quantis_usb_start_supervisor(QuantisUSBContext *ctx, const QuantisUSBSupervisorOptions *options)
+{
+	return 0;
+}
+
+int quantis_usb_get_supervisor_stats(QuantisUSBContext *ctx, QuantisUSBSupervisorStats *stats)
+{
+	memset(stats, 0, sizeof(QuantisUSBSupervisorStats));
+	return 0;
+}
+
+int quantis_usb_disable_hotplug(QuantisUSBContext *ctx)
+{
+	if (ctx->device) {
+		if (ctx->device_callback) {
+			ctx->device_callback(ctx->device, 0);
+		}
+
+		free(ctx->device);
+		ctx->device = NULL;
+	}
+
+	return 0;
+}
+
+size_t quantis_usb_device_count(QuantisUSBContext *ctx)
+{
+	return ctx->device ? 1 : 0;
+}
+
+QuantisUSBDevice *quantis_usb_get_first_device(QuantisUSBContext *ctx)
+{
+	return ctx->device;
+}
+
+void quantis_usb_read_all(QuantisUSBContext *ctx)
+{
+	if (ctx->device) {
+		quantis_usb_read(ctx->device);
+	}
+}
+
+int quantis_usb_before_poll(QuantisUSBContext *ctx, int *nfds,
+                            fd_set *readfdset, fd_set *writefdset, fd_set *errorfdset,
+                            struct timeval *timeout)
+{
+	uint64_t now;
+	uint64_t wait_us;
+
+	if (!ctx->device || !ctx->device->reading) {
+		return 0;
+	}
+
+	now = now_us();
+	wait_us = ctx->device->due_us > now ? ctx->device->due_us - now : 0;
+
+	if ((uint64_t)timeout->tv_sec * 1000000ULL + (uint64_t)timeout->tv_usec > wait_us) {
+		timeout->tv_sec = (time_t)(wait_us / 1000000ULL);
+		timeout->tv_usec = (suseconds_t)(wait_us % 1000000ULL);
+	}
+
+	return 0;
+}
+
+int quantis_usb_after_poll(QuantisUSBContext *ctx, int timeout_expired,
+                             const fd_set *readfdset, const fd_set *writefdset, const fd_set *errorfdset)
+{
+	if (ctx->device && ctx->device->reading && now_us() >= ctx->device->due_us) {
+		return sim_complete(ctx->device);
+	}
+
+	return 0;
+}
+
+void *quantis_usb_get_user_data(QuantisUSBContext *ctx)
+{
+	return ctx->user_data;
+}
+
+QuantisUSBDevice *quantis_usb_device_get_next(QuantisUSBDevice *device)
+{
+	return NULL;
+}
+
+QuantisUSBDevice *quantis_usb_device_get_prev(QuantisUSBDevice *device)
+{
+	return NULL;
+}
+
+QuantisUSBContext *quantis_usb_device_get_context(QuantisUSBDevice *device)
+{
+	return device->context;
+}
+
+void quantis_usb_device_set_weight(QuantisUSBDevice *device, unsigned int weight)
+{
+	device->weight = weight;
+}
+
+unsigned int quantis_usb_device_get_weight(QuantisUSBDevice *device)
+{
+	return device->weight;
+}
+
+void quantis_usb_device_set_user_data(QuantisUSBDevice *device, void *user_data)
+{
+	device->user_data = user_data;
+}
+
+void *quantis_usb_device_get_user_data(QuantisUSBDevice *device)
+{
+	return device->user_data;
+}
+
+uint64_t quantis_usb_device_get_transfer_latency(QuantisUSBDevice *device)
+{
+	return 0;
+}
+
+int quantis_usb_read(QuantisUSBDevice *device)
+{
+	if (device->reading) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* The recorded device has nothing more to give */
+	if (sim_schedule(device)) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	device->reading = 1;
+
+	return 0;
+}
+
+int quantis_usb_read_cancel(QuantisUSBDevice *device)
+{
+	device->reading = 0;
+
+	return 0;
+}
+
+int quantis_usb_get_serial_number(QuantisUSBDevice *device, char *buffer, int buffer_len)
+{
+	if (buffer_len < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	strncpy(buffer, "SIMULATED", (size_t)buffer_len - 1);
+	buffer[buffer_len - 1] = '\0';
+
+	return 0;
+}
@@ -28,16 +28,38 @@
 * Asynchronous library for Quantis USB HW RNGs.
 */
 
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <poll.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <libusb.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#define HAVE_TIMERFD 1
+#define HAVE_EVENTFD 1
+#endif
+
+#ifndef HAVE_EVENTFD
+#include <fcntl.h>
+#endif
+
 #include "quantisusb.h"
+#include "probes.h"
 
 /*
 * lsusb output from Quantis USB.
@@ -112,6 +134,38 @@ Device Status:     0x0000
 
 #define USB_DEVICE_CONFIGURATION 1
 
+/* Event thread defaults. See quantis_usb_start_event_thread */
+#define EVENT_THREAD_DEFAULT_TRANSFERS 4
+#define EVENT_THREAD_MAX_TRANSFERS 64
+#define EVENT_THREAD_DEFAULT_BUFFER_SIZE (1024*1024)
+
+/* How long the event thread waits for events before checking whether it must stop. */
+#define EVENT_THREAD_POLL_MS 100
+
+/* Supervisor defaults. See quantis_usb_start_supervisor */
+#define SUPERVISOR_DEFAULT_TRANSFER_TIMEOUT_MS 1000
+#define SUPERVISOR_DEFAULT_MIN_RATE_PERCENT 25
+#define SUPERVISOR_DEFAULT_BACKOFF_MIN_MS 500
+#define SUPERVISOR_DEFAULT_BACKOFF_MAX_MS 60000
+
+/* A stall this soon after a recovery escalates to the next action */
+#define SUPERVISOR_STABLE_NS (10ULL * 1000000000ULL)
+
+/* Busy read time per rate sample and the number of slow samples in a row that make a stall */
+#define SUPERVISOR_WINDOW_NS (1000000000ULL)
+#define SUPERVISOR_SLOW_WINDOWS 3
+
+struct QuantisTransfer {
+	QuantisUSBDevice *device;
+	struct libusb_transfer *transfer;
+	int in_progress;
+
+	/* CLOCK_MONOTONIC time of submission in nanoseconds */
+	uint64_t submitted_ns;
+};
+
+typedef struct QuantisTransfer QuantisTransfer;
+
 
 struct QuantisPollFd {
 	int fd;
@@ -120,6 +174,58 @@ struct QuantisPollFd {
 
 typedef struct QuantisPollFd QuantisPollFd;
 
+/**
+ A descriptor added or removed by libusb on the open thread. Applied by the thread
+ handling events so poll_fds and the application notifiers are only used there.
+*/
+struct QuantisPollFdChange {
+	int fd;
+	short events;
+	int added;
+
+	struct QuantisPollFdChange *next;
+};
+
+typedef struct QuantisPollFdChange QuantisPollFdChange;
+
+/**
+ A device waiting to be opened or recovered on the open thread.
+ Only done jobs may be removed from the list and only by the thread handling events.
+*/
+struct QuantisOpenJob {
+	libusb_device *dev;
+
+	/* Set by the open thread. device is NULL and error is set if opening failed. */
+	QuantisUSBDevice *device;
+	int error;
+	int started;
+	int done;
+
+	/* The device was unplugged before it was added */
+	int left;
+
+	/* Supervisor recovery. action is 0 for devices that just arrived. */
+	int action;
+	int reason;
+	/* Set once the cancelled transfers of device have completed. Always set for arrivals. */
+	int ready;
+	/* device must be closed by the thread handling events before the job goes on. See supervisor_recover. */
+	int close_device;
+	/* Not started before this CLOCK_MONOTONIC time. Used for the reopen backoff. */
+	uint64_t not_before_ns;
+	unsigned int attempts;
+	unsigned int failures;
+	/* Bit per QuantisUSBRecoveryAction tried */
+	unsigned int tried;
+	uint64_t down_ns;
+	uint64_t best_rate;
+	char serial_number[256];
+
+	struct QuantisOpenJob *next;
+};
+
+typedef struct QuantisOpenJob QuantisOpenJob;
+
 struct QuantisUSBContext {
 	libusb_context* ctx;
 	libusb_hotplug_callback_handle hotplug_handle;
@@ -141,6 +247,57 @@ struct QuantisUSBContext {
 	size_t poll_fds_length;
 	size_t poll_fds_count;
 	QuantisPollFd *poll_fds;
+
+	/* Application event loop integration. See quantis_usb_set_pollfd_notifiers */
+	QuantisUSBPollFdAddedCallback pollfd_added_callback;
+	QuantisUSBPollFdRemovedCallback pollfd_removed_callback;
+	void *pollfd_user_data;
+
+	/* Armed with the next libusb timeout. -1 if not used. */
+	int timer_fd;
+
+	/* Transfers allocated for each device opened from now on */
+	unsigned int transfers_per_device;
+
+	/* Event thread mode. The thread fills the ring and the application reads from it. */
+	int event_thread_running;
+	int event_thread_stop;
+	int event_thread_stalled;
+	pthread_t event_thread;
+
+	/* Readable when the ring may have data. Same fd for both ends with eventfd. */
+	int event_fd;
+	int event_write_fd;
+
+	/* Single producer (event thread), single consumer ring of random bytes */
+	unsigned char *ring;
+	size_t ring_mask;
+	uint64_t ring_head;
+	uint64_t ring_tail;
+
+	/* Ring space promised to transfers in flight. Only used by the event thread. */
+	size_t ring_reserved;
+
+	/* Open thread mode. Devices are opened there and added while handling events. */
+	int open_thread_running;
+	int open_thread_stop;
+	pthread_t open_thread;
+	pthread_mutex_t open_lock;
+	pthread_cond_t open_cond;
+	QuantisOpenJob *open_jobs;
+
+	/* Descriptor changes made on the open thread, oldest first. Protected by open_lock. */
+	QuantisPollFdChange *pollfd_changes;
+	QuantisPollFdChange **pollfd_changes_tail;
+
+	/* Readable when a job is done. Part of poll_fds while the thread runs. */
+	int open_fd;
+	int open_write_fd;
+
+	/* Supervisor. Stats are only changed by the thread handling events. */
+	int supervisor_running;
+	QuantisUSBSupervisorOptions supervisor;
+	QuantisUSBSupervisorStats supervisor_stats;
 };
 
 struct QuantisUSBDevice {
@@ -152,12 +309,48 @@ struct QuantisUSBDevice {
 
 	uint8_t endpoint_address;
 	unsigned int max_packet_size;
-	struct libusb_transfer *transfer;
-	int read_in_progress;
+
+	unsigned int transfer_count;
+	QuantisTransfer *transfers;
+	unsigned int reads_in_progress;
+
+	/* Set in event thread mode when a read fails. The device is not read again. */
+	int read_failed;
+
+	/* Submission to completion time of the last completed transfer */
+	uint64_t transfer_latency_ns;
+
+	/* Read when the device is opened so getting it never blocks. serial_number_error is the errno if that failed. */
+	char serial_number[256];
+	int serial_number_error;
+
+	/* Share of quantis_usb_read_all rounds. See quantis_usb_device_set_weight */
+	unsigned int weight;
+	unsigned int read_credit;
+
+	/* Supervisor state. recovery_job is set while the device is out of the pool. */
+	QuantisOpenJob *recovery_job;
+	int recovery_level;
+	uint64_t recovered_ns;
+	uint64_t window_bytes;
+	uint64_t window_busy_ns;
+	uint64_t best_rate;
+	unsigned int slow_windows;
+
+	void *user_data;
 };
 
 
 static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_device *dev);
+static void quantis_usb_device_arrived(QuantisUSBContext *ctx, libusb_device *dev);
+static void quantis_usb_destroy_device(QuantisUSBDevice *device);
+static void open_thread_add_devices(QuantisUSBContext *ctx);
+static int supervisor_recover(QuantisUSBContext *ctx, QuantisOpenJob *job);
+static void supervisor_recovered(QuantisUSBContext *ctx, QuantisOpenJob *job);
+static void open_thread_push(QuantisUSBContext *ctx, QuantisOpenJob *job);
+static void open_thread_ready(QuantisUSBContext *ctx, QuantisOpenJob *job);
+static void supervisor_transfer_done(QuantisTransfer *qtransfer);
+static void supervisor_stall(QuantisUSBDevice *device, int reason);
 
 static int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
                      libusb_hotplug_event event, void *user_data);
@@ -239,12 +432,41 @@ static void quantis_ctx_log_error(QuantisUSBContext *ctx, const char *msg)
 }
 
 
-static void quantis_ctx_pollfd_added_cb(int fd, short events, void *user_data)
+/**
+ Whether libusb called a pollfd notifier from the open thread.
+*/
+static int quantis_ctx_on_open_thread(QuantisUSBContext *ctx)
 {
-	QuantisUSBContext *ctx;
-	QuantisPollFd *poll_fds;
+	return ctx->open_thread_running && pthread_equal(pthread_self(), ctx->open_thread);
+}
+
+/**
+ Queues a descriptor change made on the open thread. See open_thread_apply_pollfds.
+*/
+static void quantis_ctx_pollfd_defer(QuantisUSBContext *ctx, int fd, short events, int added)
+{
+	QuantisPollFdChange *change;
+
+	change = malloc(sizeof(QuantisPollFdChange));
+	if (!change) {
+		quantis_ctx_log_error(ctx, "Unable to allocate memory for poll_fds");
+		return;
+	}
+
+	change->fd = fd;
+	change->events = events;
+	change->added = added;
+	change->next = NULL;
 
-	ctx = (QuantisUSBContext*)user_data;
+	pthread_mutex_lock(&ctx->open_lock);
+	*ctx->pollfd_changes_tail = change;
+	ctx->pollfd_changes_tail = &change->next;
+	pthread_mutex_unlock(&ctx->open_lock);
+}
+
+static void quantis_ctx_pollfd_add(QuantisUSBContext *ctx, int fd, short events)
+{
+	QuantisPollFd *poll_fds;
 
 	/* Array full or not allocated */
 	if (ctx->poll_fds_length == ctx->poll_fds_count) {
@@ -262,24 +484,97 @@ static void quantis_ctx_pollfd_added_cb(int fd, short events, void *user_data)
 	ctx->poll_fds[ctx->poll_fds_count].fd = fd;
 	ctx->poll_fds[ctx->poll_fds_count].events = events;
 	ctx->poll_fds_count++;
+
+	if (ctx->pollfd_added_callback) {
+		ctx->pollfd_added_callback(fd, events, ctx->pollfd_user_data);
+	}
 }
 
-static void quantis_ctx_pollfd_removed_cb(int fd, void *user_data)
+static void quantis_ctx_pollfd_remove(QuantisUSBContext *ctx, int fd)
 {
-	QuantisUSBContext *ctx;
 	size_t i;
 
-	ctx = (QuantisUSBContext*)user_data;
-
 	for (i=0; i < ctx->poll_fds_count; i++) {
 		if (ctx->poll_fds[i].fd == fd) {
+			/* Order does not matter. Move the last one in its place. */
 			ctx->poll_fds_count--;
-			memmove(&ctx->poll_fds[i], &ctx->poll_fds[i+1], (ctx->poll_fds_count - i) * sizeof(QuantisPollFd));
+			ctx->poll_fds[i] = ctx->poll_fds[ctx->poll_fds_count];
+
+			if (ctx->pollfd_removed_callback) {
+				ctx->pollfd_removed_callback(fd, ctx->pollfd_user_data);
+			}
 			break;
 		}
 	}
 }
 
+/**
+ libusb calls the notifiers on the thread opening or closing a device. Changes made on
+ the open thread are handed over to the thread handling events, which owns poll_fds.
+*/
+static void quantis_ctx_pollfd_added_cb(int fd, short events, void *user_data)
+{
+	QuantisUSBContext *ctx = (QuantisUSBContext*)user_data;
+
+	if (quantis_ctx_on_open_thread(ctx)) {
+		quantis_ctx_pollfd_defer(ctx, fd, events, 1);
+		return;
+	}
+
+	quantis_ctx_pollfd_add(ctx, fd, events);
+}
+
+static void quantis_ctx_pollfd_removed_cb(int fd, void *user_data)
+{
+	QuantisUSBContext *ctx = (QuantisUSBContext*)user_data;
+
+	if (quantis_ctx_on_open_thread(ctx)) {
+		quantis_ctx_pollfd_defer(ctx, fd, 0, 0);
+		return;
+	}
+
+	quantis_ctx_pollfd_remove(ctx, fd);
+}
+
+/**
+ Arms the timer with the next libusb timeout or disarms it if there is none.
+*/
+static int quantis_ctx_arm_timer(QuantisUSBContext *ctx)
+{
+#ifdef HAVE_TIMERFD
+	struct itimerspec its;
+	struct timeval tv;
+	int status;
+
+	if (ctx->timer_fd < 0) {
+		return 0;
+	}
+
+	memset(&its, 0, sizeof(struct itimerspec));
+
+	status = libusb_get_next_timeout(ctx->ctx, &tv);
+	if (status < 0) {
+		usb_set_errno(status);
+		return -1;
+	}
+
+	if (status > 0) {
+		/* Already expired. A zero value would disarm the timer instead. */
+		if (!tv.tv_sec && !tv.tv_usec) {
+			tv.tv_usec = 1;
+		}
+
+		its.it_value.tv_sec = tv.tv_sec;
+		its.it_value.tv_nsec = tv.tv_usec * 1000;
+	}
+
+	if (timerfd_settime(ctx->timer_fd, 0, &its, NULL)) {
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 
 static void quantis_ctx_init_pollfds(QuantisUSBContext *ctx)
 {
@@ -389,7 +684,7 @@ int quantis_usb_enumerate(QuantisUSBContext *context)
 			continue;
 		}
 
-		quantis_usb_open_device(context, dev);
+		quantis_usb_device_arrived(context, dev);
 	}
 	
 
@@ -418,6 +713,12 @@ QuantisUSBContext *quantis_usb_init(QuantisUSBReadCallback read_callback, Quanti
 	ctx->should_open_callback = should_open_callback;
 	ctx->error_log = error_log;
 	ctx->user_data = user_data;
+	ctx->timer_fd = -1;
+	ctx->event_fd = -1;
+	ctx->event_write_fd = -1;
+	ctx->open_fd = -1;
+	ctx->open_write_fd = -1;
+	ctx->transfers_per_device = 1;
 
 	if (libusb_init(&ctx->ctx) != LIBUSB_SUCCESS) {
 		free(ctx);
@@ -433,6 +734,9 @@ void quantis_usb_destroy(QuantisUSBContext *ctx)
 {
 	if (!ctx) return;
 
+	quantis_usb_stop_event_thread(ctx);
+	quantis_usb_stop_open_thread(ctx);
+
 	/* Remove pollfd notifiers. We will free them anyway */
 	libusb_set_pollfd_notifiers(ctx->ctx,
 		NULL,
@@ -443,6 +747,12 @@ void quantis_usb_destroy(QuantisUSBContext *ctx)
 		free(ctx->poll_fds);
 	}
 
+#ifdef HAVE_TIMERFD
+	if (ctx->timer_fd >= 0) {
+		close(ctx->timer_fd);
+	}
+#endif
+
 	/* Stop hotplug */
 	if (ctx->hotplug_ref) {
 		quantis_usb_disable_hotplug(ctx);
@@ -471,13 +781,16 @@ static int usb_process(QuantisUSBContext *ctx)
 
 	memset(&zero_tv, 0, sizeof(struct timeval));
 
-	status = libusb_handle_events_locked(ctx->ctx, &zero_tv);
+	/* Takes the events lock so this is safe even if another thread handles events */
+	status = libusb_handle_events_timeout_completed(ctx->ctx, &zero_tv, NULL);
 
 	if (status) {
 		usb_set_errno(status);
 		return -1;
 	}
 
+	open_thread_add_devices(ctx);
+
 	return 0;
 }
 
@@ -584,6 +897,72 @@ int quantis_usb_after_poll(QuantisUSBContext *ctx, int timeout_expired, const fd
 	return 0;
 }
 
+int quantis_usb_set_pollfd_notifiers(QuantisUSBContext *ctx, QuantisUSBPollFdAddedCallback added_cb,
+                                     QuantisUSBPollFdRemovedCallback removed_cb, void *user_data)
+{
+	size_t i;
+
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Let the previous owner forget about the descriptors */
+	if (ctx->pollfd_removed_callback) {
+		for (i=0; i < ctx->poll_fds_count; i++) {
+			ctx->pollfd_removed_callback(ctx->poll_fds[i].fd, ctx->pollfd_user_data);
+		}
+
+		if (ctx->timer_fd >= 0) {
+			ctx->pollfd_removed_callback(ctx->timer_fd, ctx->pollfd_user_data);
+		}
+	}
+
+	ctx->pollfd_added_callback = added_cb;
+	ctx->pollfd_removed_callback = removed_cb;
+	ctx->pollfd_user_data = user_data;
+
+#ifdef HAVE_TIMERFD
+	if (added_cb && ctx->timer_fd < 0 && !libusb_pollfds_handle_timeouts(ctx->ctx)) {
+		ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (ctx->timer_fd < 0) {
+			quantis_ctx_log_error(ctx, "timerfd_create");
+			return -1;
+		}
+	}
+#endif
+
+	if (added_cb) {
+		for (i=0; i < ctx->poll_fds_count; i++) {
+			added_cb(ctx->poll_fds[i].fd, ctx->poll_fds[i].events, user_data);
+		}
+
+		if (ctx->timer_fd >= 0) {
+			added_cb(ctx->timer_fd, POLLIN, user_data);
+		}
+	}
+
+	return quantis_ctx_arm_timer(ctx);
+}
+
+int quantis_usb_handle_events(QuantisUSBContext *ctx)
+{
+#ifdef HAVE_TIMERFD
+	uint64_t expirations;
+
+	/* Clear readiness. EAGAIN only means the timer has not expired. */
+	if (ctx->timer_fd >= 0 && read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		quantis_ctx_log_error(ctx, "timerfd read");
+	}
+#endif
+
+	if (usb_process(ctx)) {
+		return -1;
+	}
+
+	return quantis_ctx_arm_timer(ctx);
+}
+
 int quantis_usb_poll(QuantisUSBContext *context, struct timeval *timeout)
 {
 	int nfds;
@@ -618,15 +997,44 @@ size_t quantis_usb_device_count(QuantisUSBContext *ctx)
 }
 
 
+static void event_thread_transfer_done(QuantisTransfer *qtransfer);
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 static void read_callback(struct libusb_transfer *transfer)
 {
+	QuantisTransfer *qtransfer;
 	QuantisUSBDevice *device;
 	QuantisUSBContext *context;
 
-	device = (QuantisUSBDevice *)transfer->user_data;
+	qtransfer = (QuantisTransfer *)transfer->user_data;
+	device = qtransfer->device;
 	context = device->context;
 
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	device->transfer_latency_ns = monotonic_ns() - qtransfer->submitted_ns;
+
+	PROBE5(quantisusb, transfer_complete, device->serial_number, (int)(qtransfer - device->transfers),
+		(int)transfer->status, transfer->actual_length, device->transfer_latency_ns);
+
+	if (context->event_thread_running) {
+		qtransfer->in_progress = 0;
+		device->reads_in_progress--;
+		event_thread_transfer_done(qtransfer);
+		supervisor_transfer_done(qtransfer);
+		return;
+	}
+
+	/* Devices being recovered are not in the pool. Their transfers only finish. */
+	if (device->recovery_job) {
+		/* Nothing to report */
+	} else if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 		if (context->read_callback) {
 			context->read_callback(device, transfer->buffer, transfer->actual_length);
 		}
@@ -638,7 +1046,10 @@ static void read_callback(struct libusb_transfer *transfer)
 		}
 	}
 
-	device->read_in_progress = 0;
+	qtransfer->in_progress = 0;
+	device->reads_in_progress--;
+
+	supervisor_transfer_done(qtransfer);
 }
 
 void quantis_usb_read_all(QuantisUSBContext *context)
@@ -646,15 +1057,52 @@ void quantis_usb_read_all(QuantisUSBContext *context)
 	QuantisUSBDevice *device;
 	QuantisUSBDevice *prev = NULL;
 	QuantisUSBDevice *next;
+	unsigned int max_weight = 0;
 	int read_status;
 
+	for (device = context->devices; device; device = device->next) {
+		if (device->weight > max_weight) {
+			max_weight = device->weight;
+		}
+	}
+
 	for (device = context->devices; device;) {
+		/* Every device gets weight credits per round and reads once it has max_weight.
+		   Devices with weight 0 are spares read only when no other device is present. */
+		if (max_weight) {
+			if (device->read_credit < max_weight) {
+				device->read_credit += device->weight;
+			}
+
+			if (device->read_credit < max_weight) {
+				prev = device;
+				device = device->next;
+				continue;
+			}
+		}
+
 		read_status = quantis_usb_read(device);
 
+		if (max_weight && read_status == 0) {
+			device->read_credit -= max_weight;
+		}
+
 		if (read_status < 0 && errno != EAGAIN && errno != EINTR) {
+			int error = errno;
+
 			quantis_ctx_log_error(context, "quantisusb read error");
 			next = device->next;
-			quantis_usb_close_device(device, prev);
+
+			/* Unplugged devices are closed through hotplug */
+			if (context->supervisor_running && error != ENODEV) {
+				supervisor_stall(device, QUANTIS_USB_STALL_ERROR);
+				if (!device->recovery_job) {
+					prev = device;
+				}
+			} else {
+				quantis_usb_close_device(device, prev);
+			}
+
 			device = next;
 			continue;
 		}
@@ -664,26 +1112,61 @@ void quantis_usb_read_all(QuantisUSBContext *context)
 	}
 }
 
-int quantis_usb_read(QuantisUSBDevice *device)
+static int quantis_usb_submit(QuantisTransfer *qtransfer)
 {
 	int status;
 
-	if (!device || !device->transfer) {
+	qtransfer->in_progress = 1;
+	qtransfer->device->reads_in_progress++;
+	qtransfer->submitted_ns = monotonic_ns();
+
+	status = libusb_submit_transfer(qtransfer->transfer);
+	if (status) {
+		qtransfer->in_progress = 0;
+		qtransfer->device->reads_in_progress--;
+		usb_set_errno(status);
+		return -1;
+	}
+
+	PROBE4(quantisusb, transfer_submit, qtransfer->device->serial_number, (int)(qtransfer - qtransfer->device->transfers),
+		qtransfer->transfer->length, qtransfer->device->reads_in_progress);
+
+	return 0;
+}
+
+int quantis_usb_read(QuantisUSBDevice *device)
+{
+	unsigned int i;
+	int submitted = 0;
+
+	if (!device || !device->transfers) {
 		return -1;
 	}
 
-	if (device->read_in_progress) {
+	if (device->reads_in_progress == device->transfer_count) {
 		errno = EAGAIN;
 		return -1;
 	}
 
-	device->read_in_progress = 1;
+	for (i=0; i < device->transfer_count; i++) {
+		if (device->transfers[i].in_progress) {
+			continue;
+		}
 
-	status = libusb_submit_transfer(device->transfer);
-	if (status) {
-		device->read_in_progress = 0;
-		usb_set_errno(status);
-		return -1;
+		if (quantis_usb_submit(&device->transfers[i])) {
+			/* Report the error only if nothing could be submitted */
+			if (!submitted) {
+				return -1;
+			}
+			break;
+		}
+
+		submitted++;
+	}
+
+	/* The transfer may have moved the next libusb timeout */
+	if (device->context->timer_fd >= 0) {
+		return quantis_ctx_arm_timer(device->context);
 	}
 
 	return 0;
@@ -692,24 +1175,23 @@ int quantis_usb_read(QuantisUSBDevice *device)
 int quantis_usb_read_cancel(QuantisUSBDevice *device)
 {
 	int status;
+	unsigned int i;
 
 	if (!device) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (!device->read_in_progress) {
-		return 0;
-	}
-
-	status = libusb_cancel_transfer(device->transfer);
+	for (i=0; i < device->transfer_count && device->reads_in_progress; i++) {
+		if (!device->transfers[i].in_progress) {
+			continue;
+		}
 
-	if (status == LIBUSB_ERROR_NOT_FOUND) {
-		return 0;
-	}
+		status = libusb_cancel_transfer(device->transfers[i].transfer);
 
-	if (status) {
-		usb_set_errno(status);
+		if (status && status != LIBUSB_ERROR_NOT_FOUND) {
+			usb_set_errno(status);
+		}
 	}
 
 	return 0;
@@ -717,22 +1199,23 @@ int quantis_usb_read_cancel(QuantisUSBDevice *device)
 
 int quantis_usb_get_serial_number(QuantisUSBDevice *device, char *buffer, int buffer_len)
 {
-	int status;
-
-	status = libusb_get_string_descriptor_ascii(device->device_handle,
-                                              device->desc.iSerialNumber,
-                                              (unsigned char*)buffer,
-                                              buffer_len);
+	if (!device || !buffer || buffer_len <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (status < 0) {
-		usb_set_errno(status);
-		status = -1;
+	if (device->serial_number_error) {
+		errno = device->serial_number_error;
+		return -1;
 	}
 
-	return status;
+	/* Truncated like libusb_get_string_descriptor_ascii */
+	snprintf(buffer, (size_t)buffer_len, "%s", device->serial_number);
+
+	return 0;
 }
 
-static struct libusb_transfer *quantis_usb_create_transfer(QuantisUSBDevice *device)
+static struct libusb_transfer *quantis_usb_create_transfer(QuantisUSBDevice *device, QuantisTransfer *qtransfer)
 {
 	unsigned char *buffer;
 	size_t buffer_len;
@@ -755,21 +1238,59 @@ static struct libusb_transfer *quantis_usb_create_transfer(QuantisUSBDevice *dev
 
 	memset(buffer, 0, buffer_len);
 
-	device->transfer = libusb_alloc_transfer(0);
-	if (!device->transfer) {
+	qtransfer->device = device;
+	qtransfer->transfer = libusb_alloc_transfer(0);
+	if (!qtransfer->transfer) {
 		free(buffer);
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	libusb_fill_bulk_transfer(device->transfer, device->device_handle, device->endpoint_address,
+	libusb_fill_bulk_transfer(qtransfer->transfer, device->device_handle, device->endpoint_address,
 	buffer,
 	(int)buffer_len,
 	read_callback,
-	device,
-	0);
+	qtransfer,
+	device->context->supervisor_running ? device->context->supervisor.transfer_timeout_ms : 0);
+
+	return qtransfer->transfer;
+}
+
+/**
+ Grows the device transfers to count. No transfer may be in progress.
+*/
+static int quantis_usb_create_transfers(QuantisUSBDevice *device, unsigned int count)
+{
+	QuantisTransfer *transfers;
+	unsigned int i;
+
+	if (count <= device->transfer_count) {
+		return 0;
+	}
+
+	transfers = realloc(device->transfers, count * sizeof(QuantisTransfer));
+	if (!transfers) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(transfers + device->transfer_count, 0, (count - device->transfer_count) * sizeof(QuantisTransfer));
+	device->transfers = transfers;
+
+	/* The array may have moved */
+	for (i=0; i < device->transfer_count; i++) {
+		device->transfers[i].transfer->user_data = &device->transfers[i];
+	}
+
+	for (i=device->transfer_count; i < count; i++) {
+		if (!quantis_usb_create_transfer(device, &device->transfers[i])) {
+			return -1;
+		}
 
-	return device->transfer;
+		device->transfer_count++;
+	}
+
+	return 0;
 }
 
 QuantisUSBContext *quantis_usb_device_get_context(QuantisUSBDevice *device)
@@ -779,6 +1300,42 @@ QuantisUSBContext *quantis_usb_device_get_context(QuantisUSBDevice *device)
 	return device->context;
 }
 
+void quantis_usb_device_set_user_data(QuantisUSBDevice *device, void *user_data)
+{
+	if (!device) return;
+
+	device->user_data = user_data;
+}
+
+void quantis_usb_device_set_weight(QuantisUSBDevice *device, unsigned int weight)
+{
+	if (!device) return;
+
+	device->weight = weight;
+	device->read_credit = 0;
+}
+
+unsigned int quantis_usb_device_get_weight(QuantisUSBDevice *device)
+{
+	if (!device) return 0;
+
+	return device->weight;
+}
+
+void *quantis_usb_device_get_user_data(QuantisUSBDevice *device)
+{
+	if (!device) return NULL;
+
+	return device->user_data;
+}
+
+uint64_t quantis_usb_device_get_transfer_latency(QuantisUSBDevice *device)
+{
+	if (!device) return 0;
+
+	return device->transfer_latency_ns;
+}
+
 QuantisUSBDevice *quantis_usb_get_first_device(QuantisUSBContext *ctx)
 {
 	if (!ctx) return NULL;
@@ -811,15 +1368,21 @@ static void quantis_usb_destroy_device(QuantisUSBDevice *device)
 		libusb_close(device->device_handle);
 	}
 
-	if (device->transfer) {
-		if (device->transfer->buffer) {
-			free(device->transfer->buffer);
-			device->transfer->buffer = NULL;
-		}
+	if (device->transfers) {
+		unsigned int i;
 
-		libusb_free_transfer(device->transfer);
-		device->transfer = NULL;
-	}
+		for (i=0; i < device->transfer_count; i++) {
+			if (device->transfers[i].transfer->buffer) {
+				free(device->transfers[i].transfer->buffer);
+				device->transfers[i].transfer->buffer = NULL;
+			}
+
+			libusb_free_transfer(device->transfers[i].transfer);
+		}
+
+		free(device->transfers);
+		device->transfers = NULL;
+	}
 
 	free(device);
 }
@@ -828,7 +1391,7 @@ void quantis_usb_close_device(QuantisUSBDevice *device, QuantisUSBDevice *prev)
 {
 	if (!device) return;
 
-	if (device->read_in_progress) {
+	if (device->reads_in_progress) {
 		quantis_usb_read_cancel(device);
 	}
 
@@ -848,7 +1411,11 @@ void quantis_usb_close_device(QuantisUSBDevice *device, QuantisUSBDevice *prev)
 }
 
 
-static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_device *dev)
+/**
+ Opens, configures and claims a device. Blocks on control transfers.
+ The device is not added to the context.
+*/
+static QuantisUSBDevice *quantis_usb_setup_device(QuantisUSBContext *ctx, libusb_device *dev)
 {
 	enum libusb_error status;
 	int device_configuration;
@@ -865,6 +1432,7 @@ static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_
 
 	memset(device, 0, sizeof(struct QuantisUSBDevice));
 	device->context = ctx;
+	device->weight = 1;
 
 	status = libusb_get_device_descriptor(dev, &device->desc);
 	if (status) {
@@ -897,6 +1465,17 @@ static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_
 		return NULL;
 	}
 
+	status = libusb_get_string_descriptor_ascii(device->device_handle, device->desc.iSerialNumber,
+		(unsigned char *)device->serial_number, sizeof(device->serial_number));
+	if (status < 0) {
+		/* Not fatal. Only reported by quantis_usb_get_serial_number. */
+		int saved_errno = errno;
+
+		usb_set_errno(status);
+		device->serial_number_error = errno;
+		errno = saved_errno;
+	}
+
 	if (ctx->should_open_callback) {
 		if (!ctx->should_open_callback(device)) {
 			libusb_close(device->device_handle);
@@ -1016,13 +1595,17 @@ static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_
 
 	libusb_free_config_descriptor(usbConfig);
 
-	device->transfer = quantis_usb_create_transfer(device);
-	if (!device->transfer) {
+	if (quantis_usb_create_transfers(device, ctx->transfers_per_device)) {
 		quantis_ctx_log_error(ctx, "quantis_usb_create_transfer");
 		quantis_usb_destroy_device(device);
 		return NULL;
 	}
 
+	return device;
+}
+
+static void quantis_usb_add_device(QuantisUSBContext *ctx, QuantisUSBDevice *device)
+{
 	if (!ctx->devices) {
 		ctx->devices = device;
 	} else {
@@ -1035,10 +1618,59 @@ static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_
 	if (ctx->device_callback) {
 		ctx->device_callback(device, 1);
 	}
+}
+
+static QuantisUSBDevice *quantis_usb_open_device(QuantisUSBContext *ctx, libusb_device *dev)
+{
+	QuantisUSBDevice *device;
+
+	device = quantis_usb_setup_device(ctx, dev);
+	if (device) {
+		quantis_usb_add_device(ctx, device);
+	}
 
 	return device;
 }
 
+/**
+ Queues a device for the open thread.
+*/
+static int open_thread_queue(QuantisUSBContext *ctx, libusb_device *dev)
+{
+	QuantisOpenJob *job;
+
+	job = malloc(sizeof(QuantisOpenJob));
+	if (!job) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(job, 0, sizeof(QuantisOpenJob));
+	job->dev = libusb_ref_device(dev);
+	job->ready = 1;
+
+	open_thread_push(ctx, job);
+
+	return 0;
+}
+
+static void quantis_usb_device_arrived(QuantisUSBContext *ctx, libusb_device *dev)
+{
+	if (ctx->open_thread_running) {
+		if (open_thread_queue(ctx, dev)) {
+			quantis_ctx_log_error(ctx, "Could not open USB device");
+		}
+		return;
+	}
+
+	errno = 0;
+	if (!quantis_usb_open_device(ctx, dev)) {
+		if (errno) {
+			quantis_ctx_log_error(ctx, "Could not open USB device");
+		}
+	}
+}
+
 static int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
                      libusb_hotplug_event event, void *user_data)
 {
@@ -1047,27 +1679,1294 @@ static int hotplug_callback(struct libusb_context *ctx, struct libusb_device *de
 	context = (QuantisUSBContext *)user_data;
 
 	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-		errno = 0;
-		if (!quantis_usb_open_device(context, dev)) {
-			if (errno) {
-				quantis_ctx_log_error(context, "Could not open USB device");
-			}
-		}
+		quantis_usb_device_arrived(context, dev);
 
 	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
 		QuantisUSBDevice *device;
 		QuantisUSBDevice *prev;
+		QuantisOpenJob *job;
 
 		prev = NULL;
 
 		for (device = context->devices; device; device = device->next) {
 			if (libusb_get_device(device->device_handle) == dev) {
 				quantis_usb_close_device(device, prev);
-				break;
+				return 0;
 			}
 			prev = device;
 		}
+
+		/* Not added yet. It is dropped once the open thread is done with it. */
+		if (context->open_thread_running) {
+			pthread_mutex_lock(&context->open_lock);
+			for (job = context->open_jobs; job; job = job->next) {
+				if (job->dev == dev) {
+					job->left = 1;
+				}
+			}
+			pthread_mutex_unlock(&context->open_lock);
+		}
+	}
+
+	return 0;
+}
+
+/* Event thread mode */
+
+static size_t ring_used(QuantisUSBContext *ctx)
+{
+	return (size_t)(__atomic_load_n(&ctx->ring_head, __ATOMIC_ACQUIRE) -
+	                __atomic_load_n(&ctx->ring_tail, __ATOMIC_ACQUIRE));
+}
+
+static size_t ring_capacity(QuantisUSBContext *ctx)
+{
+	return ctx->ring_mask + 1;
+}
+
+/**
+ Called by the event thread only. Space was reserved when the transfer was submitted.
+*/
+static void ring_write(QuantisUSBContext *ctx, const unsigned char *data, size_t data_len)
+{
+	uint64_t head;
+	size_t offset;
+	size_t first;
+
+	head = ctx->ring_head;
+	offset = (size_t)head & ctx->ring_mask;
+	first = ring_capacity(ctx) - offset;
+
+	if (first > data_len) {
+		first = data_len;
+	}
+
+	memcpy(ctx->ring + offset, data, first);
+	memcpy(ctx->ring, data + first, data_len - first);
+
+	__atomic_store_n(&ctx->ring_head, head + data_len, __ATOMIC_RELEASE);
+}
+
+/**
+ Called by the reading thread only.
+*/
+static size_t ring_read(QuantisUSBContext *ctx, unsigned char *buffer, size_t buffer_len)
+{
+	uint64_t tail;
+	size_t available;
+	size_t offset;
+	size_t first;
+
+	tail = ctx->ring_tail;
+	available = (size_t)(__atomic_load_n(&ctx->ring_head, __ATOMIC_ACQUIRE) - tail);
+
+	if (buffer_len > available) {
+		buffer_len = available;
+	}
+
+	if (!buffer_len) {
+		return 0;
+	}
+
+	offset = (size_t)tail & ctx->ring_mask;
+	first = ring_capacity(ctx) - offset;
+
+	if (first > buffer_len) {
+		first = buffer_len;
+	}
+
+	memcpy(buffer, ctx->ring + offset, first);
+	memcpy(buffer + first, ctx->ring, buffer_len - first);
+
+	/* Pairs with the stalled flag in event_thread_submit */
+	__atomic_store_n(&ctx->ring_tail, tail + buffer_len, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&ctx->event_thread_stalled, 0, __ATOMIC_SEQ_CST)) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(ctx->ctx);
+#endif
+	}
+
+	return buffer_len;
+}
+
+static void event_fd_signal(QuantisUSBContext *ctx)
+{
+	uint64_t value = 1;
+
+	if (write(ctx->event_write_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		quantis_ctx_log_error(ctx, "event fd write");
+	}
+}
+
+static void event_fd_drain(QuantisUSBContext *ctx)
+{
+	unsigned char buffer[64];
+
+	/* An eventfd is cleared with a single read. A pipe may need more. */
+	while (read(ctx->event_fd, buffer, sizeof(buffer)) == sizeof(buffer)) {}
+}
+
+static void event_thread_transfer_done(QuantisTransfer *qtransfer)
+{
+	struct libusb_transfer *transfer;
+	QuantisUSBDevice *device;
+	QuantisUSBContext *ctx;
+
+	transfer = qtransfer->transfer;
+	device = qtransfer->device;
+	ctx = device->context;
+
+	ctx->ring_reserved -= (size_t)transfer->length;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->actual_length > 0) {
+			ring_write(ctx, transfer->buffer, (size_t)transfer->actual_length);
+			event_fd_signal(ctx);
+		}
+		return;
+	}
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		return;
+	}
+
+	device->read_failed = 1;
+	usb_transfer_set_errno(transfer->status);
+
+	if (ctx->error_callback && !device->recovery_job) {
+		ctx->error_callback(device);
+	}
+}
+
+/**
+ Keeps every idle transfer of every device in flight as long as the ring can take its data.
+*/
+static void event_thread_submit(QuantisUSBContext *ctx)
+{
+	QuantisUSBDevice *device;
+	QuantisUSBDevice *next;
+	QuantisTransfer *qtransfer;
+	size_t length;
+	unsigned int i;
+
+	for (device = ctx->devices; device; device = next) {
+		/* The supervisor may take the device out of the list */
+		next = device->next;
+
+		if (device->read_failed) {
+			continue;
+		}
+
+		for (i=0; i < device->transfer_count; i++) {
+			qtransfer = &device->transfers[i];
+
+			if (qtransfer->in_progress) {
+				continue;
+			}
+
+			length = (size_t)qtransfer->transfer->length;
+
+			if (ring_used(ctx) + ctx->ring_reserved + length > ring_capacity(ctx)) {
+				/* Ask the reader to wake us up and check again in case it just did */
+				__atomic_store_n(&ctx->event_thread_stalled, 1, __ATOMIC_SEQ_CST);
+
+				if (ring_used(ctx) + ctx->ring_reserved + length > ring_capacity(ctx)) {
+					return;
+				}
+			}
+
+			if (quantis_usb_submit(qtransfer)) {
+				int error = errno;
+
+				quantis_ctx_log_error(ctx, "quantisusb read error");
+				device->read_failed = 1;
+
+				if (ctx->supervisor_running && error != ENODEV) {
+					supervisor_stall(device, QUANTIS_USB_STALL_ERROR);
+				}
+				break;
+			}
+
+			ctx->ring_reserved += length;
+		}
+	}
+}
+
+static int event_thread_reads_in_progress(QuantisUSBContext *ctx)
+{
+	QuantisUSBDevice *device;
+
+	for (device = ctx->devices; device; device = device->next) {
+		if (device->reads_in_progress) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *event_thread_main(void *user_data)
+{
+	QuantisUSBContext *ctx;
+	QuantisUSBDevice *device;
+	struct timeval tv;
+	int status;
+
+	ctx = (QuantisUSBContext *)user_data;
+
+	while (!__atomic_load_n(&ctx->event_thread_stop, __ATOMIC_ACQUIRE)) {
+		open_thread_add_devices(ctx);
+		event_thread_submit(ctx);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = EVENT_THREAD_POLL_MS * 1000;
+
+		status = libusb_handle_events_timeout_completed(ctx->ctx, &tv, NULL);
+		if (status && status != LIBUSB_ERROR_INTERRUPTED) {
+			usb_set_errno(status);
+			quantis_ctx_log_error(ctx, "libusb_handle_events");
+		}
+	}
+
+	/* Transfers must not complete after the ring is gone */
+	for (device = ctx->devices; device; device = device->next) {
+		quantis_usb_read_cancel(device);
+	}
+
+	while (event_thread_reads_in_progress(ctx)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = EVENT_THREAD_POLL_MS * 1000;
+
+		if (libusb_handle_events_timeout_completed(ctx->ctx, &tv, NULL)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void event_thread_free(QuantisUSBContext *ctx)
+{
+	if (ctx->event_fd >= 0) {
+		close(ctx->event_fd);
+	}
+
+	if (ctx->event_write_fd >= 0 && ctx->event_write_fd != ctx->event_fd) {
+		close(ctx->event_write_fd);
+	}
+
+	ctx->event_fd = -1;
+	ctx->event_write_fd = -1;
+
+	free(ctx->ring);
+	ctx->ring = NULL;
+}
+
+int quantis_usb_start_event_thread(QuantisUSBContext *ctx, size_t buffer_size, unsigned int transfers)
+{
+	QuantisUSBDevice *device;
+	size_t capacity;
+#ifndef HAVE_EVENTFD
+	int fds[2];
+#endif
+
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ctx->event_thread_running || event_thread_reads_in_progress(ctx)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!transfers) {
+		transfers = EVENT_THREAD_DEFAULT_TRANSFERS;
+	} else if (transfers > EVENT_THREAD_MAX_TRANSFERS) {
+		transfers = EVENT_THREAD_MAX_TRANSFERS;
+	}
+
+	if (!buffer_size) {
+		buffer_size = EVENT_THREAD_DEFAULT_BUFFER_SIZE;
+	}
+
+	/* Power of two so positions can be masked */
+	for (capacity = 4096; capacity < buffer_size; capacity <<= 1) {
+		if (capacity > SIZE_MAX / 2) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	ctx->ring = malloc(capacity);
+	if (!ctx->ring) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ctx->ring_mask = capacity - 1;
+	ctx->ring_head = 0;
+	ctx->ring_tail = 0;
+	ctx->ring_reserved = 0;
+
+#ifdef HAVE_EVENTFD
+	ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ctx->event_write_fd = ctx->event_fd;
+	if (ctx->event_fd < 0) {
+		event_thread_free(ctx);
+		return -1;
+	}
+#else
+	if (pipe(fds)) {
+		event_thread_free(ctx);
+		return -1;
+	}
+
+	ctx->event_fd = fds[0];
+	ctx->event_write_fd = fds[1];
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+	/* Devices already open get the extra transfers now */
+	for (device = ctx->devices; device; device = device->next) {
+		if (quantis_usb_create_transfers(device, transfers)) {
+			quantis_ctx_log_error(ctx, "quantis_usb_create_transfer");
+		}
+	}
+
+	ctx->transfers_per_device = transfers;
+	ctx->event_thread_stop = 0;
+	ctx->event_thread_stalled = 0;
+	ctx->event_thread_running = 1;
+
+	if (pthread_create(&ctx->event_thread, NULL, event_thread_main, ctx)) {
+		ctx->event_thread_running = 0;
+		event_thread_free(ctx);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return 0;
+}
+
+int quantis_usb_stop_event_thread(QuantisUSBContext *ctx)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->event_thread_running) {
+		return 0;
+	}
+
+	__atomic_store_n(&ctx->event_thread_stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(ctx->ctx);
+#endif
+
+	pthread_join(ctx->event_thread, NULL);
+
+	ctx->event_thread_running = 0;
+	event_thread_free(ctx);
+
+	return 0;
+}
+
+int quantis_usb_get_event_fd(QuantisUSBContext *ctx)
+{
+	if (!ctx || !ctx->event_thread_running) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ctx->event_fd;
+}
+
+ssize_t quantis_usb_read_bytes(QuantisUSBContext *ctx, unsigned char *buffer, size_t buffer_len, int timeout_ms)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	struct timespec deadline;
+	size_t copied = 0;
+	long wait_ms;
+
+	if (!ctx || !ctx->event_thread_running || buffer_len > SSIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
 	}
 
+	for (;;) {
+		/* Clear readiness first so data written after the read below is signalled again */
+		event_fd_drain(ctx);
+
+		copied += ring_read(ctx, buffer + copied, buffer_len - copied);
+		if (copied == buffer_len) {
+			break;
+		}
+
+		if (timeout_ms > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+
+			if (wait_ms <= 0) {
+				break;
+			}
+		} else {
+			wait_ms = timeout_ms;
+		}
+
+		if (!wait_ms) {
+			break;
+		}
+
+		pfd.fd = ctx->event_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, (int)wait_ms) < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+
+	if (!copied && buffer_len) {
+		errno = (timeout_ms == 0)? EAGAIN: ETIMEDOUT;
+		return -1;
+	}
+
+	return (ssize_t)copied;
+}
+
+/* Open thread */
+
+static void open_fd_signal(QuantisUSBContext *ctx)
+{
+	uint64_t value = 1;
+
+	if (write(ctx->open_write_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		quantis_ctx_log_error(ctx, "open fd write");
+	}
+}
+
+static void open_fd_drain(QuantisUSBContext *ctx)
+{
+	unsigned char buffer[64];
+
+	while (read(ctx->open_fd, buffer, sizeof(buffer)) == sizeof(buffer)) {}
+}
+
+/**
+ Appends a job. Devices are opened in the order they arrived.
+*/
+static void open_thread_push(QuantisUSBContext *ctx, QuantisOpenJob *job)
+{
+	QuantisOpenJob **link;
+
+	pthread_mutex_lock(&ctx->open_lock);
+
+	for (link = &ctx->open_jobs; *link; link = &(*link)->next) {}
+	*link = job;
+
+	pthread_cond_signal(&ctx->open_cond);
+	pthread_mutex_unlock(&ctx->open_lock);
+}
+
+/**
+ Lets the open thread start a recovery once the device has no transfers in flight.
+*/
+static void open_thread_ready(QuantisUSBContext *ctx, QuantisOpenJob *job)
+{
+	pthread_mutex_lock(&ctx->open_lock);
+	job->ready = 1;
+	pthread_cond_signal(&ctx->open_cond);
+	pthread_mutex_unlock(&ctx->open_lock);
+}
+
+/**
+ Finds the next job to start or the time the next delayed job may start.
+*/
+static QuantisOpenJob *open_thread_next(QuantisUSBContext *ctx, uint64_t now, uint64_t *wake_ns)
+{
+	QuantisOpenJob *job;
+
+	*wake_ns = 0;
+
+	for (job = ctx->open_jobs; job; job = job->next) {
+		if (job->started || !job->ready) {
+			continue;
+		}
+
+		if (job->not_before_ns <= now || job->left) {
+			return job;
+		}
+
+		if (!*wake_ns || job->not_before_ns < *wake_ns) {
+			*wake_ns = job->not_before_ns;
+		}
+	}
+
+	return NULL;
+}
+
+static void *open_thread_main(void *user_data)
+{
+	QuantisUSBContext *ctx;
+	QuantisOpenJob *job;
+	QuantisUSBDevice *device;
+	struct timespec ts;
+	uint64_t wake_ns;
+	int left;
+	int error;
+	int requeue;
+
+	ctx = (QuantisUSBContext *)user_data;
+
+	pthread_mutex_lock(&ctx->open_lock);
+
+	while (!ctx->open_thread_stop) {
+		job = open_thread_next(ctx, monotonic_ns(), &wake_ns);
+
+		if (!job && wake_ns) {
+			ts.tv_sec = (time_t)(wake_ns / 1000000000ULL);
+			ts.tv_nsec = (long)(wake_ns % 1000000000ULL);
+			pthread_cond_timedwait(&ctx->open_cond, &ctx->open_lock, &ts);
+			continue;
+		}
+
+		if (!job) {
+			pthread_cond_wait(&ctx->open_cond, &ctx->open_lock);
+			continue;
+		}
+
+		job->started = 1;
+		left = job->left;
+
+		pthread_mutex_unlock(&ctx->open_lock);
+
+		device = NULL;
+		error = 0;
+		requeue = 0;
+
+		if (left) {
+			/* Dropped when added */
+		} else if (job->action) {
+			requeue = supervisor_recover(ctx, job);
+		} else {
+			errno = 0;
+			device = quantis_usb_setup_device(ctx, job->dev);
+			error = errno;
+		}
+
+		pthread_mutex_lock(&ctx->open_lock);
+
+		if (requeue) {
+			job->started = 0;
+			continue;
+		}
+
+		if (!job->action) {
+			job->device = device;
+			job->error = device ? 0 : error;
+		}
+		job->done = 1;
+
+		open_fd_signal(ctx);
+	}
+
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	return NULL;
+}
+
+/**
+ Applies the descriptor changes made on the open thread. Nothing is applied while a
+ job runs: a descriptor it adds may still be closed on a failed open, and selecting
+ on it after that would fail.
+*/
+static void open_thread_apply_pollfds(QuantisUSBContext *ctx)
+{
+	QuantisPollFdChange *changes;
+	QuantisPollFdChange *change;
+	QuantisOpenJob *job;
+
+	pthread_mutex_lock(&ctx->open_lock);
+
+	for (job = ctx->open_jobs; job; job = job->next) {
+		if (job->started && !job->done) {
+			break;
+		}
+	}
+
+	changes = NULL;
+	if (!job || !ctx->open_thread_running) {
+		changes = ctx->pollfd_changes;
+		ctx->pollfd_changes = NULL;
+		ctx->pollfd_changes_tail = &ctx->pollfd_changes;
+	}
+
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	while ((change = changes)) {
+		changes = change->next;
+
+		if (change->added) {
+			quantis_ctx_pollfd_add(ctx, change->fd, change->events);
+		} else {
+			quantis_ctx_pollfd_remove(ctx, change->fd);
+		}
+
+		free(change);
+	}
+}
+
+/**
+ Adds the devices the open thread is done with. Called by the thread handling events
+ so the device list and callbacks stay on that thread.
+*/
+static void open_thread_add_devices(QuantisUSBContext *ctx)
+{
+	QuantisOpenJob *done;
+	QuantisOpenJob **tail;
+	QuantisOpenJob **link;
+	QuantisOpenJob *job;
+
+	if (!ctx->open_thread_running) {
+		return;
+	}
+
+	open_fd_drain(ctx);
+	open_thread_apply_pollfds(ctx);
+
+	done = NULL;
+	tail = &done;
+
+	pthread_mutex_lock(&ctx->open_lock);
+
+	link = &ctx->open_jobs;
+	while ((job = *link)) {
+		if (job->done) {
+			*link = job->next;
+			job->next = NULL;
+			*tail = job;
+			tail = &job->next;
+		} else {
+			link = &job->next;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	while ((job = done)) {
+		done = job->next;
+
+		if (job->close_device) {
+			quantis_usb_destroy_device(job->device);
+			job->device = NULL;
+			job->close_device = 0;
+
+			/* Reopened by the open thread after the backoff */
+			if (job->action == QUANTIS_USB_RECOVERY_REOPEN && !job->left) {
+				job->next = NULL;
+				job->started = 0;
+				job->done = 0;
+				open_thread_push(ctx, job);
+				continue;
+			}
+		}
+
+		if (job->action) {
+			supervisor_recovered(ctx, job);
+		} else if (job->device && job->left) {
+			quantis_usb_destroy_device(job->device);
+		} else if (job->device) {
+			quantis_usb_add_device(ctx, job->device);
+		} else if (job->error && !job->left) {
+			errno = job->error;
+			quantis_ctx_log_error(ctx, "Could not open USB device");
+		}
+
+		libusb_unref_device(job->dev);
+		free(job);
+	}
+}
+
+static void open_thread_free(QuantisUSBContext *ctx)
+{
+	QuantisOpenJob *job;
+	struct timeval tv;
+	int tries;
+
+	while ((job = ctx->open_jobs)) {
+		ctx->open_jobs = job->next;
+
+		/* Devices being recovered may still have cancelled transfers in flight */
+		for (tries = 0; job->device && job->device->reads_in_progress && tries < 10; tries++) {
+			quantis_usb_read_cancel(job->device);
+
+			tv.tv_sec = 0;
+			tv.tv_usec = EVENT_THREAD_POLL_MS * 1000;
+
+			if (libusb_handle_events_timeout_completed(ctx->ctx, &tv, NULL)) {
+				break;
+			}
+		}
+
+		if (job->device) {
+			quantis_usb_destroy_device(job->device);
+		}
+
+		libusb_unref_device(job->dev);
+		free(job);
+	}
+
+	if (ctx->open_fd >= 0) {
+		close(ctx->open_fd);
+	}
+
+	if (ctx->open_write_fd >= 0 && ctx->open_write_fd != ctx->open_fd) {
+		close(ctx->open_write_fd);
+	}
+
+	ctx->open_fd = -1;
+	ctx->open_write_fd = -1;
+}
+
+int quantis_usb_start_open_thread(QuantisUSBContext *ctx)
+{
+	pthread_condattr_t condattr;
+#ifndef HAVE_EVENTFD
+	int fds[2];
+#endif
+
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ctx->open_thread_running) {
+		return 0;
+	}
+
+#ifdef HAVE_EVENTFD
+	ctx->open_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ctx->open_write_fd = ctx->open_fd;
+	if (ctx->open_fd < 0) {
+		return -1;
+	}
+#else
+	if (pipe(fds)) {
+		return -1;
+	}
+
+	ctx->open_fd = fds[0];
+	ctx->open_write_fd = fds[1];
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+	if (pthread_mutex_init(&ctx->open_lock, NULL)) {
+		open_thread_free(ctx);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* The reopen backoff is measured with the monotonic clock */
+	if (pthread_condattr_init(&condattr)) {
+		pthread_mutex_destroy(&ctx->open_lock);
+		open_thread_free(ctx);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+	if (pthread_cond_init(&ctx->open_cond, &condattr)) {
+		pthread_condattr_destroy(&condattr);
+		pthread_mutex_destroy(&ctx->open_lock);
+		open_thread_free(ctx);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pthread_condattr_destroy(&condattr);
+
+	ctx->open_thread_stop = 0;
+	ctx->pollfd_changes = NULL;
+	ctx->pollfd_changes_tail = &ctx->pollfd_changes;
+
+	/* The thread waits for the lock so it sees open_thread set before opening anything */
+	pthread_mutex_lock(&ctx->open_lock);
+
+	if (pthread_create(&ctx->open_thread, NULL, open_thread_main, ctx)) {
+		pthread_mutex_unlock(&ctx->open_lock);
+		pthread_cond_destroy(&ctx->open_cond);
+		pthread_mutex_destroy(&ctx->open_lock);
+		open_thread_free(ctx);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ctx->open_thread_running = 1;
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	/* Finished jobs wake up the application's poll like any libusb descriptor */
+	quantis_ctx_pollfd_added_cb(ctx->open_fd, POLLIN, ctx);
+
+	return 0;
+}
+
+int quantis_usb_stop_open_thread(QuantisUSBContext *ctx)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->open_thread_running) {
+		return 0;
+	}
+
+	/* Recoveries need the open thread */
+	ctx->supervisor_running = 0;
+
+	pthread_mutex_lock(&ctx->open_lock);
+	ctx->open_thread_stop = 1;
+	pthread_cond_signal(&ctx->open_cond);
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	pthread_join(ctx->open_thread, NULL);
+
+	ctx->open_thread_running = 0;
+
+	/* Descriptors of devices opened but not added yet are removed again below */
+	open_thread_apply_pollfds(ctx);
+
+	quantis_ctx_pollfd_removed_cb(ctx->open_fd, ctx);
+
+	/* Devices opened but not added yet are closed without callbacks */
+	open_thread_free(ctx);
+
+	pthread_cond_destroy(&ctx->open_cond);
+	pthread_mutex_destroy(&ctx->open_lock);
+
+	return 0;
+}
+
+/* Supervisor */
+
+static void supervisor_report(QuantisUSBContext *ctx, const char *serial_number, int reason, int action, int status, uint64_t downtime_ns)
+{
+	QuantisUSBRecoveryEvent event;
+
+	if (!ctx->supervisor.callback) {
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.serial_number = serial_number;
+	event.reason = reason;
+	event.action = action;
+	event.status = status;
+	event.downtime_ns = downtime_ns;
+
+	ctx->supervisor.callback(ctx, &event);
+}
+
+/**
+ Takes a device out of the pool. It stays allocated for the open thread.
+*/
+static void supervisor_detach(QuantisUSBDevice *device)
+{
+	QuantisUSBContext *ctx = device->context;
+	QuantisUSBDevice *prev;
+
+	prev = quantis_usb_device_get_prev(device);
+
+	if (prev) {
+		prev->next = device->next;
+	} else {
+		ctx->devices = device->next;
+	}
+
+	device->next = NULL;
+	ctx->device_count--;
+
+	if (ctx->device_callback) {
+		ctx->device_callback(device, 0);
+	}
+}
+
+/**
+ Handles a stall detected on the thread handling events.
+*/
+static void supervisor_stall(QuantisUSBDevice *device, int reason)
+{
+	QuantisUSBContext *ctx = device->context;
+	QuantisOpenJob *job = NULL;
+	uint64_t now;
+	int level;
+
+	if (device->recovery_job) {
+		return;
+	}
+
+	now = monotonic_ns();
+
+	/* Escalate if the previous recovery did not last */
+	level = QUANTIS_USB_RECOVERY_CANCEL;
+	if (device->recovery_level && now - device->recovered_ns < SUPERVISOR_STABLE_NS) {
+		level = device->recovery_level + 1;
+	}
+
+	if (reason == QUANTIS_USB_STALL_HALT && level < QUANTIS_USB_RECOVERY_CLEAR_HALT) {
+		level = QUANTIS_USB_RECOVERY_CLEAR_HALT;
+	}
+
+	if (level > QUANTIS_USB_RECOVERY_REOPEN) {
+		level = QUANTIS_USB_RECOVERY_REOPEN;
+	}
+
+	device->recovery_level = level;
+	device->slow_windows = 0;
+	ctx->supervisor_stats.stalls++;
+
+	PROBE3(quantisusb, device_stall, device->serial_number, reason, level);
+
+	supervisor_report(ctx, device->serial_number, reason, level, 0, 0);
+
+	if (level > QUANTIS_USB_RECOVERY_CANCEL) {
+		job = malloc(sizeof(QuantisOpenJob));
+		if (!job) {
+			quantis_ctx_log_error(ctx, "Could not recover USB device");
+			level = QUANTIS_USB_RECOVERY_CANCEL;
+		}
+	}
+
+	if (!job) {
+		/* Stale transfers complete as cancelled and the device is read again */
+		quantis_usb_read_cancel(device);
+		device->read_failed = 0;
+		device->recovered_ns = now;
+		ctx->supervisor_stats.cancels++;
+
+		supervisor_report(ctx, device->serial_number, reason, level, 1, 0);
+		return;
+	}
+
+	memset(job, 0, sizeof(QuantisOpenJob));
+	job->dev = libusb_ref_device(libusb_get_device(device->device_handle));
+	job->device = device;
+	job->action = level;
+	job->reason = reason;
+	job->down_ns = now;
+	job->best_rate = device->best_rate;
+	job->ready = !device->reads_in_progress;
+	memcpy(job->serial_number, device->serial_number, sizeof(job->serial_number));
+
+	supervisor_detach(device);
+	device->recovery_job = job;
+	quantis_usb_read_cancel(device);
+
+	ctx->supervisor_stats.recovering++;
+
+	/* Started once the cancelled transfers are back. See supervisor_transfer_done */
+	open_thread_push(ctx, job);
+}
+
+/**
+ Updates the read rate of a device. Several slow samples in a row are a stall.
+*/
+static void supervisor_sample(QuantisUSBDevice *device, int bytes)
+{
+	QuantisUSBContext *ctx = device->context;
+	uint64_t rate;
+
+	if (bytes <= 0) {
+		return;
+	}
+
+	device->window_bytes += (uint64_t)bytes;
+	device->window_busy_ns += device->transfer_latency_ns;
+
+	if (device->window_busy_ns < SUPERVISOR_WINDOW_NS) {
+		return;
+	}
+
+	rate = device->window_bytes * 1000000000ULL / device->window_busy_ns;
+	device->window_bytes = 0;
+	device->window_busy_ns = 0;
+
+	if (rate >= device->best_rate) {
+		device->best_rate = rate;
+		device->slow_windows = 0;
+		return;
+	}
+
+	if (!ctx->supervisor.min_rate_percent || rate * 100 >= device->best_rate * ctx->supervisor.min_rate_percent) {
+		device->slow_windows = 0;
+		return;
+	}
+
+	if (++device->slow_windows >= SUPERVISOR_SLOW_WINDOWS) {
+		supervisor_stall(device, QUANTIS_USB_STALL_SLOW);
+	}
+}
+
+/**
+ Called for every finished transfer after it was counted as done.
+*/
+static void supervisor_transfer_done(QuantisTransfer *qtransfer)
+{
+	struct libusb_transfer *transfer;
+	QuantisUSBDevice *device;
+	QuantisUSBContext *ctx;
+
+	transfer = qtransfer->transfer;
+	device = qtransfer->device;
+	ctx = device->context;
+
+	if (!ctx->supervisor_running) {
+		return;
+	}
+
+	/* The open thread must not touch the device while transfers are in flight */
+	if (device->recovery_job) {
+		if (!device->reads_in_progress) {
+			open_thread_ready(ctx, device->recovery_job);
+		}
+		return;
+	}
+
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			supervisor_sample(device, transfer->actual_length);
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			supervisor_stall(device, QUANTIS_USB_STALL_TIMEOUT);
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			supervisor_stall(device, QUANTIS_USB_STALL_HALT);
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			/* Cancelled on purpose or unplugged, which hotplug handles */
+			break;
+		default:
+			supervisor_stall(device, QUANTIS_USB_STALL_ERROR);
+			break;
+	}
+}
+
+static uint64_t supervisor_backoff_ns(QuantisUSBContext *ctx, unsigned int attempts)
+{
+	uint64_t delay_ms;
+
+	delay_ms = ctx->supervisor.backoff_min_ms;
+
+	while (attempts-- && delay_ms < ctx->supervisor.backoff_max_ms) {
+		delay_ms *= 2;
+	}
+
+	if (delay_ms > ctx->supervisor.backoff_max_ms) {
+		delay_ms = ctx->supervisor.backoff_max_ms;
+	}
+
+	return delay_ms * 1000000ULL;
+}
+
+/**
+ Runs the blocking recovery steps on the open thread. Escalates when a step fails.
+ On return job->device is the recovered device or NULL if it is gone.
+
+ The device's descriptors are selected by the thread handling events, so it is never
+ closed here: close_device hands it back and the reopen continues once it is closed.
+
+ Returns: 1 if the job must run again after job->not_before_ns, 0 when it is done.
+*/
+static int supervisor_recover(QuantisUSBContext *ctx, QuantisOpenJob *job)
+{
+	QuantisUSBDevice *device;
+	int status;
+
+	if (job->action == QUANTIS_USB_RECOVERY_CLEAR_HALT) {
+		job->tried |= 1U << QUANTIS_USB_RECOVERY_CLEAR_HALT;
+
+		status = libusb_clear_halt(job->device->device_handle, job->device->endpoint_address);
+		if (!status) {
+			return 0;
+		}
+
+		job->failures++;
+		job->action = QUANTIS_USB_RECOVERY_RESET;
+	}
+
+	if (job->action == QUANTIS_USB_RECOVERY_RESET) {
+		job->tried |= 1U << QUANTIS_USB_RECOVERY_RESET;
+
+		status = libusb_reset_device(job->device->device_handle);
+		if (!status) {
+			return 0;
+		}
+
+		job->failures++;
+
+		/* The device enumerates again and arrives through hotplug */
+		if (status == LIBUSB_ERROR_NOT_FOUND) {
+			job->close_device = 1;
+			return 0;
+		}
+
+		job->action = QUANTIS_USB_RECOVERY_REOPEN;
+	}
+
+	job->tried |= 1U << QUANTIS_USB_RECOVERY_REOPEN;
+
+	if (job->device) {
+		job->close_device = 1;
+
+		/* Give the device time to settle before the first attempt */
+		job->not_before_ns = monotonic_ns() + supervisor_backoff_ns(ctx, job->attempts++);
+		return 0;
+	}
+
+	errno = 0;
+	device = quantis_usb_setup_device(ctx, job->dev);
+	if (device) {
+		job->device = device;
+		return 0;
+	}
+
+	/* Rejected by the application */
+	if (!errno) {
+		return 0;
+	}
+
+	job->failures++;
+	job->not_before_ns = monotonic_ns() + supervisor_backoff_ns(ctx, job->attempts++);
+
+	return 1;
+}
+
+/**
+ Puts a recovered device back into the pool on the thread handling events.
+*/
+static void supervisor_recovered(QuantisUSBContext *ctx, QuantisOpenJob *job)
+{
+	QuantisUSBSupervisorStats *stats = &ctx->supervisor_stats;
+	QuantisUSBDevice *device = job->device;
+	uint64_t now;
+	uint64_t downtime;
+
+	now = monotonic_ns();
+	downtime = now - job->down_ns;
+
+	stats->recovering--;
+	stats->failures += job->failures;
+	stats->downtime_ns += downtime;
+
+	if (job->tried & (1U << QUANTIS_USB_RECOVERY_CLEAR_HALT)) {
+		stats->clear_halts++;
+	}
+	if (job->tried & (1U << QUANTIS_USB_RECOVERY_RESET)) {
+		stats->resets++;
+	}
+	if (job->tried & (1U << QUANTIS_USB_RECOVERY_REOPEN)) {
+		stats->reopens++;
+	}
+
+	if (device && job->left) {
+		quantis_usb_destroy_device(device);
+		device = NULL;
+	}
+
+	PROBE4(quantisusb, device_recovered, job->serial_number, job->action, device ? 1 : -1, downtime);
+
+	if (!device) {
+		supervisor_report(ctx, job->serial_number, job->reason, job->action, -1, downtime);
+		return;
+	}
+
+	device->recovery_job = NULL;
+	device->recovery_level = job->action;
+	device->recovered_ns = now;
+	device->best_rate = job->best_rate;
+	device->window_bytes = 0;
+	device->window_busy_ns = 0;
+	device->slow_windows = 0;
+	device->read_failed = 0;
+
+	quantis_usb_add_device(ctx, device);
+
+	supervisor_report(ctx, job->serial_number, job->reason, job->action, 1, downtime);
+}
+
+void quantis_usb_supervisor_options_init(QuantisUSBSupervisorOptions *options)
+{
+	memset(options, 0, sizeof(QuantisUSBSupervisorOptions));
+
+	options->transfer_timeout_ms = SUPERVISOR_DEFAULT_TRANSFER_TIMEOUT_MS;
+	options->min_rate_percent = SUPERVISOR_DEFAULT_MIN_RATE_PERCENT;
+	options->backoff_min_ms = SUPERVISOR_DEFAULT_BACKOFF_MIN_MS;
+	options->backoff_max_ms = SUPERVISOR_DEFAULT_BACKOFF_MAX_MS;
+}
+
+int quantis_usb_start_supervisor(QuantisUSBContext *ctx, const QuantisUSBSupervisorOptions *options)
+{
+	QuantisUSBDevice *device;
+	unsigned int i;
+
+	if (!ctx || !options || options->backoff_min_ms > options->backoff_max_ms) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (quantis_usb_start_open_thread(ctx)) {
+		return -1;
+	}
+
+	ctx->supervisor = *options;
+	if (!ctx->supervisor.backoff_min_ms) {
+		ctx->supervisor.backoff_min_ms = 1;
+	}
+
+	/* Transfers already created take the timeout on their next submission */
+	for (device = ctx->devices; device; device = device->next) {
+		for (i=0; i < device->transfer_count; i++) {
+			device->transfers[i].transfer->timeout = ctx->supervisor.transfer_timeout_ms;
+		}
+	}
+
+	ctx->supervisor_running = 1;
+
+	return 0;
+}
+
+int quantis_usb_get_supervisor_stats(QuantisUSBContext *ctx, QuantisUSBSupervisorStats *stats)
+{
+	if (!ctx || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->supervisor_running) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	*stats = ctx->supervisor_stats;
+
 	return 0;
 }
@@ -33,6 +33,8 @@
 #define _QUANTISUSB_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/time.h>
 
 /* Export Macros */
@@ -130,6 +132,101 @@ typedef int (*QuantisUSBDeviceShouldOpenCallback) (QuantisUSBDevice *device);
 */
 typedef void (*QuantisUSBErrorLogger) (QuantisUSBContext *, const char *);
 
+/**
+* Called when a file descriptor must be added to the application's poll set.
+* events uses the poll() flags (POLLIN, POLLOUT).
+*/
+typedef void (*QuantisUSBPollFdAddedCallback) (int fd, short events, void *user_data);
+
+/**
+* Called when a file descriptor must be removed from the application's poll set.
+*/
+typedef void (*QuantisUSBPollFdRemovedCallback) (int fd, void *user_data);
+
+/**
+* Why the supervisor took a device out of service.
+*/
+enum QuantisUSBStallReason {
+	/** A transfer did not complete within the transfer timeout */
+	QUANTIS_USB_STALL_TIMEOUT = 1,
+	/** The endpoint is halted */
+	QUANTIS_USB_STALL_HALT,
+	/** A transfer or submission failed */
+	QUANTIS_USB_STALL_ERROR,
+	/** The read rate dropped well below the best rate seen for the device */
+	QUANTIS_USB_STALL_SLOW
+};
+
+/**
+* Recovery actions in the order the supervisor escalates through them.
+*/
+enum QuantisUSBRecoveryAction {
+	/** Cancel the transfers in flight. The device stays in the pool. */
+	QUANTIS_USB_RECOVERY_CANCEL = 1,
+	/** libusb_clear_halt on the bulk endpoint */
+	QUANTIS_USB_RECOVERY_CLEAR_HALT,
+	/** libusb_reset_device */
+	QUANTIS_USB_RECOVERY_RESET,
+	/** Close the device and open it again with exponential backoff */
+	QUANTIS_USB_RECOVERY_REOPEN
+};
+
+/**
+* Reported by the supervisor.
+*/
+struct QuantisUSBRecoveryEvent {
+	/** Serial number of the device or an empty string */
+	const char *serial_number;
+	/** QuantisUSBStallReason */
+	int reason;
+	/** QuantisUSBRecoveryAction */
+	int action;
+	/** 0 when the stall is detected, 1 once the device is back in the pool, -1 if the action failed */
+	int status;
+	/** Time the device has been out of the pool */
+	uint64_t downtime_ns;
+};
+
+typedef struct QuantisUSBRecoveryEvent QuantisUSBRecoveryEvent;
+
+/**
+* Called on the thread handling events when the supervisor detects a stall or recovers a device.
+*/
+typedef void (*QuantisUSBRecoveryCallback) (QuantisUSBContext *ctx, const QuantisUSBRecoveryEvent *event);
+
+struct QuantisUSBSupervisorOptions {
+	/** Transfers taking longer are a stall. 0 waits forever. (Default: 1000) */
+	unsigned int transfer_timeout_ms;
+	/** A device reading below this percentage of its best rate for several seconds is a stall. 0 disables. (Default: 25) */
+	unsigned int min_rate_percent;
+	/** First delay before opening a device again. Doubles after each failure. (Default: 500) */
+	unsigned int backoff_min_ms;
+	/** (Default: 60000) */
+	unsigned int backoff_max_ms;
+	/** Optional */
+	QuantisUSBRecoveryCallback callback;
+};
+
+typedef struct QuantisUSBSupervisorOptions QuantisUSBSupervisorOptions;
+
+struct QuantisUSBSupervisorStats {
+	/** Stalls detected */
+	uint64_t stalls;
+	/** Actions taken */
+	uint64_t cancels;
+	uint64_t clear_halts;
+	uint64_t resets;
+	uint64_t reopens;
+	/** Actions that failed */
+	uint64_t failures;
+	/** Total time devices were out of the pool, not counting devices still recovering */
+	uint64_t downtime_ns;
+	/** Devices out of the pool now */
+	size_t recovering;
+};
+
+typedef struct QuantisUSBSupervisorStats QuantisUSBSupervisorStats;
+
 /**
 * Initializes a new context.
 *
@@ -181,6 +278,7 @@ QUANTISUSB_PUBLIC QuantisUSBDevice *quantis_usb_get_first_device(QuantisUSBConte
 
 /**
 * Reads data from all available devices.
+* Devices are read in proportion to their weight. See quantis_usb_device_set_weight.
 */
 QUANTISUSB_PUBLIC void quantis_usb_read_all(QuantisUSBContext *context);
 
@@ -214,6 +312,133 @@ QUANTISUSB_PUBLIC int quantis_usb_before_poll(QuantisUSBContext *ctx, int *nfds,
 QUANTISUSB_PUBLIC int quantis_usb_after_poll(QuantisUSBContext *ctx, int timeout_expired,
                              const fd_set *readfdset, const fd_set *writefdset, const fd_set *errorfdset);
 
+/**
+* Event loop integration for applications using epoll, libuv, libevent or similar.
+* An alternative to quantis_usb_before_poll and quantis_usb_after_poll.
+*
+* added_cb is called immediately for every file descriptor already in use and later
+* whenever one is added. removed_cb is called when one is removed, including for all
+* descriptors of previously set notifiers when they are replaced. Pass NULL callbacks
+* to stop notifications.
+*
+* On Linux, if libusb timeouts cannot be handled through its own descriptors a timerfd
+* armed with the next libusb timeout is announced through added_cb as well.
+*
+* Call quantis_usb_handle_events whenever any announced descriptor becomes ready.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_set_pollfd_notifiers(QuantisUSBContext *ctx,
+                                    QuantisUSBPollFdAddedCallback added_cb,
+                                    QuantisUSBPollFdRemovedCallback removed_cb,
+                                    void *user_data);
+
+/**
+* Processes all pending events without blocking and re-arms the timeout timer.
+* Callbacks are called from this function.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_handle_events(QuantisUSBContext *ctx);
+
+/**
+* Starts a background thread that handles all libusb events and keeps several transfers
+* in flight per device. Data is stored in an internal buffer read with quantis_usb_read_bytes
+* instead of being passed to the read callback. Error and device callbacks are called from
+* the event thread.
+*
+* Enumerate or enable hotplug before calling this. While the thread runs do not call
+* any other function on the context or its devices except the ones below and
+* quantis_usb_destroy.
+*
+* @param ctx The context.
+* @param buffer_size Size of the internal buffer in bytes. Rounded up to a power of two. 0 for 1MB.
+* @param transfers Transfers in flight per device. 0 for the default (4).
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_start_event_thread(QuantisUSBContext *ctx, size_t buffer_size,
+                                    unsigned int transfers);
+
+/**
+* Stops the event thread after cancelling all transfers. Data still buffered is discarded.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_stop_event_thread(QuantisUSBContext *ctx);
+
+/**
+* Reads random bytes buffered by the event thread. Only one thread may read at a time.
+*
+* @param ctx The context.
+* @param buffer Buffer to fill.
+* @param buffer_len Number of bytes wanted.
+* @param timeout_ms Maximum time to wait for buffer_len bytes. 0 never waits, negative waits forever.
+*
+* Returns: The number of bytes read which is less than buffer_len only if the timeout expired,
+* or -1 with errno set to EAGAIN or ETIMEDOUT if nothing was available.
+*/
+QUANTISUSB_PUBLIC ssize_t quantis_usb_read_bytes(QuantisUSBContext *ctx, unsigned char *buffer,
+                                    size_t buffer_len, int timeout_ms);
+
+/**
+* Gets a descriptor that becomes readable when the event thread has buffered new data.
+* It is cleared by quantis_usb_read_bytes.
+*
+* Returns: The descriptor or -1 if the event thread is not running.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_get_event_fd(QuantisUSBContext *ctx);
+
+/**
+* Starts a thread that opens devices so hotplug and enumeration never block event handling.
+* Opening claims the interface, parses the descriptors and reads the serial number,
+* which is cached for quantis_usb_get_serial_number.
+*
+* Opened devices are added and reported through the device callback while handling events.
+* The thread's descriptor is included in quantis_usb_before_poll and announced through
+* the pollfd notifiers so no extra polling is needed. Descriptors of devices opened on the
+* thread are only selected and announced once handed over, always from the thread handling events.
+* The should open callback and the error logger are also called from the open thread.
+*
+* Call this before enumerating or enabling hotplug.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_start_open_thread(QuantisUSBContext *ctx);
+
+/**
+* Stops the open thread and the supervisor. Devices that are opened or being recovered but not added yet are closed.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_stop_open_thread(QuantisUSBContext *ctx);
+
+/**
+* Sets the default supervisor options.
+*/
+QUANTISUSB_PUBLIC void quantis_usb_supervisor_options_init(QuantisUSBSupervisorOptions *options);
+
+/**
+* Starts supervising all devices. Stalled devices are recovered by escalating from
+* cancelling their transfers to clearing the endpoint halt, resetting the device and
+* finally reopening it with exponential backoff. A stall within 10 seconds of the
+* previous recovery escalates to the next action.
+*
+* Devices being recovered are reported as closed through the device callback and
+* as opened once they are back. Blocking steps run on the open thread, which is
+* started if necessary. Devices are closed for a reopen while handling events.
+*
+* Returns: 0 on success, -1 otherwise.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_start_supervisor(QuantisUSBContext *ctx, const QuantisUSBSupervisorOptions *options);
+
+/**
+* Gets the supervisor counters.
+*
+* Returns: 0 on success, -1 if the supervisor is not running.
+*/
+QUANTISUSB_PUBLIC int quantis_usb_get_supervisor_stats(QuantisUSBContext *ctx, QuantisUSBSupervisorStats *stats);
+
 
 /**
 * Gets the user data associated with the context.
@@ -250,6 +475,32 @@ QUANTISUSB_PUBLIC void quantis_usb_close_device(QuantisUSBDevice *device, Quanti
 */
 QUANTISUSB_PUBLIC QuantisUSBContext *quantis_usb_device_get_context(QuantisUSBDevice *device);
 
+/**
+* Sets the share of quantis_usb_read_all calls that read the device. A device with
+* weight 1 is read once for every 4 reads of a device with weight 4.
+* Devices with weight 0 are spares, only read while all other devices have weight 0 too.
+* Can be called from the should open callback. (Default: 1)
+*/
+QUANTISUSB_PUBLIC void quantis_usb_device_set_weight(QuantisUSBDevice *device, unsigned int weight);
+
+QUANTISUSB_PUBLIC unsigned int quantis_usb_device_get_weight(QuantisUSBDevice *device);
+
+/**
+* Associates application data with the given device. The data is not touched by the library.
+*/
+QUANTISUSB_PUBLIC void quantis_usb_device_set_user_data(QuantisUSBDevice *device, void *user_data);
+
+/**
+* Gets the application data set with quantis_usb_device_set_user_data or NULL.
+*/
+QUANTISUSB_PUBLIC void *quantis_usb_device_get_user_data(QuantisUSBDevice *device);
+
+/**
+* Gets the time in nanoseconds from submission to completion of the transfer
+* whose data is being delivered. Only meaningful inside the read callback.
+*/
+QUANTISUSB_PUBLIC uint64_t quantis_usb_device_get_transfer_latency(QuantisUSBDevice *device);
+
 /**
  Requests data from the device.
 */
@@ -261,7 +512,8 @@ QUANTISUSB_PUBLIC int quantis_usb_read(QuantisUSBDevice *device);
 QUANTISUSB_PUBLIC int quantis_usb_read_cancel(QuantisUSBDevice *device);
 
 /**
-* Gets the serial number for the given device.
+* Gets the serial number for the given device. The serial number is read when the device
+* is opened so this never blocks.
 *
 * Returns: 0 on success, -1 otherwise
 */
@@ -0,0 +1,379 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#include "readstats.h"
+#include <inttypes.h>
+#include <string.h>
+
+#define GIB (1024.0*1024.0*1024.0)
+
+/* Percentiles in reports, in tenths of a percent */
+static const unsigned int percentiles[] = {500, 900, 990, 999};
+static const char *const percentile_names[] = {"p50", "p90", "p99", "p99.9"};
+
+#define PERCENTILE_COUNT (sizeof(percentiles) / sizeof(percentiles[0]))
+
+int read_stats_parse_format(const char *name)
+{
+	if (!strcmp(name, "text")) return READ_STATS_TEXT;
+	if (!strcmp(name, "json")) return READ_STATS_JSON;
+	if (!strcmp(name, "csv")) return READ_STATS_CSV;
+
+	return -1;
+}
+
+#define SUB_BUCKETS (1U << READ_STATS_SUB_BITS)
+
+/**
+* Values below SUB_BUCKETS have their own bucket. Above that the bucket is
+* the position of the top bit followed by the next READ_STATS_SUB_BITS bits.
+*/
+static unsigned int bucket_index(uint64_t value)
+{
+	unsigned int exponent;
+
+	if (value < SUB_BUCKETS) {
+		return (unsigned int)value;
+	}
+
+	exponent = 63U - (unsigned int)__builtin_clzll(value);
+
+	return ((exponent - READ_STATS_SUB_BITS + 1) << READ_STATS_SUB_BITS) |
+		(unsigned int)((value >> (exponent - READ_STATS_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_lower_bound(unsigned int bucket)
+{
+	unsigned int exponent;
+
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+
+	exponent = (bucket >> READ_STATS_SUB_BITS) + READ_STATS_SUB_BITS - 1;
+
+	return (uint64_t)(SUB_BUCKETS | (bucket & (SUB_BUCKETS - 1))) << (exponent - READ_STATS_SUB_BITS);
+}
+
+static uint64_t bucket_upper_bound(unsigned int bucket)
+{
+	if (bucket + 1 >= READ_STATS_BUCKETS) {
+		return UINT64_MAX;
+	}
+
+	return bucket_lower_bound(bucket + 1) - 1;
+}
+
+void read_histogram_add(ReadHistogram *histogram, uint64_t value)
+{
+	histogram->buckets[bucket_index(value)]++;
+
+	if (!histogram->count || value < histogram->min) histogram->min = value;
+	if (value > histogram->max) histogram->max = value;
+
+	histogram->count++;
+	histogram->sum += value;
+}
+
+static void histogram_merge(ReadHistogram *dst, const ReadHistogram *src)
+{
+	unsigned int i;
+
+	if (!src->count) {
+		return;
+	}
+
+	for (i=0; i < READ_STATS_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+
+	if (!dst->count || src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+uint64_t read_histogram_percentile(const ReadHistogram *histogram, unsigned int permille)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t bound;
+	unsigned int i;
+
+	if (!histogram->count) {
+		return 0;
+	}
+
+	rank = (histogram->count * permille + 999) / 1000;
+	if (!rank) rank = 1;
+
+	for (i=0; i < READ_STATS_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+
+		if (seen >= rank) {
+			bound = bucket_upper_bound(i);
+			return bound < histogram->max? bound: histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
+
+void read_stats_init(ReadStats *stats, const char *name)
+{
+	memset(stats, 0, sizeof(ReadStats));
+	strncpy(stats->name, name, sizeof(stats->name) - 1);
+}
+
+void read_stats_reset(ReadStats *stats)
+{
+	stats->bytes = 0;
+	stats->transfers = 0;
+	memset(&stats->latency, 0, sizeof(ReadHistogram));
+	memset(&stats->jitter, 0, sizeof(ReadHistogram));
+}
+
+void read_stats_add(ReadStats *stats, uint64_t now_ns, size_t len, uint64_t latency_ns)
+{
+	uint64_t interval;
+
+	stats->bytes += len;
+	stats->transfers++;
+
+	if (latency_ns) {
+		read_histogram_add(&stats->latency, latency_ns);
+	}
+
+	if (stats->last_ns) {
+		interval = now_ns - stats->last_ns;
+
+		if (stats->last_interval_ns) {
+			read_histogram_add(&stats->jitter, interval > stats->last_interval_ns?
+				interval - stats->last_interval_ns: stats->last_interval_ns - interval);
+		}
+
+		stats->last_interval_ns = interval;
+	}
+
+	stats->last_ns = now_ns;
+}
+
+void read_stats_merge(ReadStats *dst, const ReadStats *src)
+{
+	dst->bytes += src->bytes;
+	dst->transfers += src->transfers;
+	histogram_merge(&dst->latency, &src->latency);
+	histogram_merge(&dst->jitter, &src->jitter);
+}
+
+static double rate(const ReadStats *stats, double seconds)
+{
+	return seconds > 0? (double)stats->bytes / seconds: 0;
+}
+
+static void report_text_histogram(FILE *file, const char *title, const ReadHistogram *histogram, int buckets)
+{
+	unsigned int i;
+
+	if (!histogram->count) {
+		return;
+	}
+
+	fprintf(file, "  %s (ns): min %" PRIu64, title, histogram->min);
+
+	for (i=0; i < PERCENTILE_COUNT; i++) {
+		fprintf(file, " %s %" PRIu64, percentile_names[i], read_histogram_percentile(histogram, percentiles[i]));
+	}
+
+	fprintf(file, " max %" PRIu64 " mean %" PRIu64 "\n", histogram->max, histogram->sum / histogram->count);
+
+	if (!buckets) {
+		return;
+	}
+
+	for (i=0; i < READ_STATS_BUCKETS; i++) {
+		if (histogram->buckets[i]) {
+			fprintf(file, "    >= %" PRIu64 ": %" PRIu64 "\n", bucket_lower_bound(i), histogram->buckets[i]);
+		}
+	}
+}
+
+static void report_text(FILE *file, ReadStats *const *stats, size_t count, const ReadStats *total,
+                        double seconds, double cpu_seconds)
+{
+	size_t i;
+
+	fprintf(file, "Elapsed: %.3f s. Total read: %" PRIu64 " bytes in %" PRIu64 " transfers. Read rate: %.0f bytes/sec\n",
+		seconds, total->bytes, total->transfers, rate(total, seconds));
+
+	if (total->bytes) {
+		fprintf(file, "CPU: %.3f s. %.3f CPU s/GiB\n", cpu_seconds, cpu_seconds / ((double)total->bytes / GIB));
+	}
+
+	for (i=0; i < count; i++) {
+		fprintf(file, "Device %s: %" PRIu64 " bytes in %" PRIu64 " transfers. Read rate: %.0f bytes/sec\n",
+			stats[i]->name, stats[i]->bytes, stats[i]->transfers, rate(stats[i], seconds));
+		report_text_histogram(file, "Transfer latency", &stats[i]->latency, 0);
+		report_text_histogram(file, "Callback jitter", &stats[i]->jitter, 0);
+	}
+
+	fprintf(file, "All devices:\n");
+	report_text_histogram(file, "Transfer latency", &total->latency, 1);
+	report_text_histogram(file, "Callback jitter", &total->jitter, 1);
+}
+
+/**
+* Writes a string as a JSON string. Serial numbers are plain ASCII but are escaped anyway.
+*/
+static void report_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', file);
+			fputc(*str, file);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(file, "\\u%04x", (unsigned int)(unsigned char)*str);
+		} else {
+			fputc(*str, file);
+		}
+	}
+
+	fputc('"', file);
+}
+
+void read_histogram_report_json(FILE *file, const char *name, const ReadHistogram *histogram)
+{
+	unsigned int i;
+	int first = 1;
+
+	fprintf(file, "\"%s\":{\"count\":%" PRIu64 ",\"min\":%" PRIu64 ",\"max\":%" PRIu64 ",\"mean\":%" PRIu64,
+		name, histogram->count, histogram->min, histogram->max,
+		histogram->count? histogram->sum / histogram->count: 0);
+
+	for (i=0; i < PERCENTILE_COUNT; i++) {
+		fprintf(file, ",\"%s\":%" PRIu64, percentile_names[i], read_histogram_percentile(histogram, percentiles[i]));
+	}
+
+	/* Buckets as [lower bound, count] pairs */
+	fprintf(file, ",\"buckets\":[");
+
+	for (i=0; i < READ_STATS_BUCKETS; i++) {
+		if (histogram->buckets[i]) {
+			fprintf(file, "%s[%" PRIu64 ",%" PRIu64 "]", first? "": ",", bucket_lower_bound(i), histogram->buckets[i]);
+			first = 0;
+		}
+	}
+
+	fprintf(file, "]}");
+}
+
+static void report_json_source(FILE *file, const ReadStats *stats, double seconds)
+{
+	fprintf(file, "{\"name\":");
+	report_json_string(file, stats->name);
+	fprintf(file, ",\"bytes\":%" PRIu64 ",\"transfers\":%" PRIu64 ",\"bytes_per_sec\":%.0f,",
+		stats->bytes, stats->transfers, rate(stats, seconds));
+	read_histogram_report_json(file, "latency_ns", &stats->latency);
+	fputc(',', file);
+	read_histogram_report_json(file, "jitter_ns", &stats->jitter);
+	fputc('}', file);
+}
+
+static void report_json(FILE *file, ReadStats *const *stats, size_t count, const ReadStats *total,
+                        double seconds, double cpu_seconds)
+{
+	size_t i;
+
+	fprintf(file, "{\"seconds\":%.6f,\"cpu_seconds\":%.6f,\"cpu_seconds_per_gib\":%.6f,\"total\":",
+		seconds, cpu_seconds, total->bytes? cpu_seconds / ((double)total->bytes / GIB): 0);
+	report_json_source(file, total, seconds);
+	fprintf(file, ",\"devices\":[");
+
+	for (i=0; i < count; i++) {
+		if (i) fputc(',', file);
+		report_json_source(file, stats[i], seconds);
+	}
+
+	fprintf(file, "]}\n");
+}
+
+static void report_csv_row(FILE *file, const ReadStats *stats, double seconds, double cpu_seconds)
+{
+	unsigned int i;
+
+	/* Serial numbers do not contain commas or quotes */
+	fprintf(file, "%s,%.6f,%" PRIu64 ",%" PRIu64 ",%.0f,%.6f",
+		stats->name, seconds, stats->bytes, stats->transfers, rate(stats, seconds), cpu_seconds);
+
+	fprintf(file, ",%" PRIu64, stats->latency.min);
+	for (i=0; i < PERCENTILE_COUNT; i++) {
+		fprintf(file, ",%" PRIu64, read_histogram_percentile(&stats->latency, percentiles[i]));
+	}
+	fprintf(file, ",%" PRIu64, stats->latency.max);
+
+	for (i=0; i < PERCENTILE_COUNT; i++) {
+		fprintf(file, ",%" PRIu64, read_histogram_percentile(&stats->jitter, percentiles[i]));
+	}
+	fprintf(file, ",%" PRIu64 "\n", stats->jitter.max);
+}
+
+static void report_csv(FILE *file, ReadStats *const *stats, size_t count, const ReadStats *total,
+                       double seconds, double cpu_seconds)
+{
+	size_t i;
+
+	fprintf(file, "name,seconds,bytes,transfers,bytes_per_sec,cpu_seconds,"
+		"latency_min_ns,latency_p50_ns,latency_p90_ns,latency_p99_ns,latency_p999_ns,latency_max_ns,"
+		"jitter_p50_ns,jitter_p90_ns,jitter_p99_ns,jitter_p999_ns,jitter_max_ns\n");
+
+	for (i=0; i < count; i++) {
+		/* CPU time is only known for the whole process */
+		report_csv_row(file, stats[i], seconds, 0);
+	}
+
+	report_csv_row(file, total, seconds, cpu_seconds);
+}
+
+void read_stats_report(FILE *file, int format, ReadStats *const *stats, size_t count,
+                       const ReadStats *total, double seconds, double cpu_seconds)
+{
+	switch (format) {
+		case READ_STATS_JSON:
+			report_json(file, stats, count, total, seconds, cpu_seconds);
+			break;
+		case READ_STATS_CSV:
+			report_csv(file, stats, count, total, seconds, cpu_seconds);
+			break;
+		default:
+			report_text(file, stats, count, total, seconds, cpu_seconds);
+			break;
+	}
+}
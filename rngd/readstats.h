@@ -0,0 +1,122 @@
+#ifndef _READSTATS_H_
+#define _READSTATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Throughput and timing statistics for quantisusb-reader benchmarks.
+*/
+
+/*
+ Each power of two is split in 2^READ_STATS_SUB_BITS linear buckets,
+ so bucket bounds are within 12.5% of the values they count.
+*/
+#define READ_STATS_SUB_BITS (3)
+#define READ_STATS_BUCKETS ((64 - READ_STATS_SUB_BITS + 1) << READ_STATS_SUB_BITS)
+
+/**
+* Logarithmic histogram of nanosecond values.
+*/
+struct ReadHistogram {
+	uint64_t buckets[READ_STATS_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+typedef struct ReadHistogram ReadHistogram;
+
+/**
+* Statistics for one source of data (a device or all devices).
+*/
+struct ReadStats {
+	char name[64];
+	uint64_t bytes;
+	uint64_t transfers;
+
+	/** Submission to completion time of each transfer, when known */
+	ReadHistogram latency;
+
+	/** Change in time between consecutive callbacks */
+	ReadHistogram jitter;
+
+	uint64_t last_ns;
+	uint64_t last_interval_ns;
+};
+
+typedef struct ReadStats ReadStats;
+
+/**
+* Report formats.
+*/
+enum ReadStatsFormat {
+	READ_STATS_TEXT = 0,
+	READ_STATS_JSON,
+	READ_STATS_CSV
+};
+
+/**
+* Parses a report format name (text, json or csv).
+*
+* Returns: The format or -1 if the name is not known.
+*/
+int read_stats_parse_format(const char *name);
+
+/**
+* Adds a value to a histogram.
+*/
+void read_histogram_add(ReadHistogram *histogram, uint64_t value);
+
+/**
+* Gets the upper bound of the bucket holding the given percentile (in tenths of a percent).
+* The bound is limited to the largest recorded value.
+*/
+uint64_t read_histogram_percentile(const ReadHistogram *histogram, unsigned int permille);
+
+/**
+* Writes a histogram as a JSON member "name":{...} with its percentiles and buckets.
+*/
+void read_histogram_report_json(FILE *file, const char *name, const ReadHistogram *histogram);
+
+/**
+* Initializes stats with the given name.
+*/
+void read_stats_init(ReadStats *stats, const char *name);
+
+/**
+* Clears the counters. Keeps the time of the last callback so jitter stays continuous.
+*/
+void read_stats_reset(ReadStats *stats);
+
+/**
+* Records a transfer of len bytes that completed at now_ns.
+* latency_ns is 0 if the transfer latency is not known.
+*/
+void read_stats_add(ReadStats *stats, uint64_t now_ns, size_t len, uint64_t latency_ns);
+
+/**
+* Adds the counters of src to dst.
+*/
+void read_stats_merge(ReadStats *dst, const ReadStats *src);
+
+/**
+* Writes a report for the given sources and their total.
+*
+* seconds is the measured time and cpu_seconds the process CPU time used in it.
+*/
+void read_stats_report(FILE *file, int format, ReadStats *const *stats, size_t count,
+                       const ReadStats *total, double seconds, double cpu_seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
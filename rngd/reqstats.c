@@ -0,0 +1,274 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "reqstats.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Latencies of one of the clients that received the most data.
+*/
+struct ClientLatency {
+	uint32_t id;
+	size_t listener;
+
+	/** Bytes sent to the client when it was last updated */
+	uint64_t bytes_sent;
+
+	RequestLatency latency;
+};
+
+typedef struct ClientLatency ClientLatency;
+
+struct RequestStats {
+	RequestLatency *listeners;
+	size_t num_listeners;
+
+	ClientLatency *clients;
+	size_t num_clients;
+	size_t max_clients;
+};
+
+void request_tracker_init(RequestTracker *tracker)
+{
+	memset(tracker, 0, sizeof(RequestTracker));
+}
+
+void request_tracker_add(RequestTracker *tracker, uint64_t now_ns, uint32_t bytes)
+{
+	RequestSegment *segment;
+
+	if (!bytes) {
+		return;
+	}
+
+	if (tracker->count == REQUEST_TRACKER_SEGMENTS) {
+		segment = &tracker->segments[(tracker->first + tracker->count - 1) % REQUEST_TRACKER_SEGMENTS];
+		segment->bytes = bytes > UINT32_MAX - segment->bytes? UINT32_MAX: segment->bytes + bytes;
+		return;
+	}
+
+	segment = &tracker->segments[(tracker->first + tracker->count) % REQUEST_TRACKER_SEGMENTS];
+	segment->start_ns = now_ns;
+	segment->bytes = bytes;
+	segment->sent = 0;
+	segment->tracked = 1;
+
+	tracker->count++;
+}
+
+void request_tracker_add_untracked(RequestTracker *tracker, uint64_t bytes)
+{
+	RequestSegment *segment;
+
+	while (bytes && tracker->count < REQUEST_TRACKER_SEGMENTS) {
+		segment = &tracker->segments[(tracker->first + tracker->count) % REQUEST_TRACKER_SEGMENTS];
+		segment->start_ns = 0;
+		segment->bytes = bytes > UINT32_MAX? UINT32_MAX: (uint32_t)bytes;
+		segment->sent = 0;
+		segment->tracked = 0;
+
+		bytes -= segment->bytes;
+		tracker->count++;
+	}
+}
+
+/**
+* Finds the latencies of a client, taking the place of the client with the
+* least data if this one received more.
+*
+* Returns: The latencies or NULL if the client is not one of the top clients.
+*/
+static RequestLatency *client_latency(RequestStats *stats, size_t listener, uint32_t client_id, uint64_t bytes_sent)
+{
+	ClientLatency *client = NULL;
+	size_t i;
+
+	for (i=0; i < stats->num_clients; i++) {
+		if (stats->clients[i].id == client_id) {
+			stats->clients[i].bytes_sent = bytes_sent;
+			return &stats->clients[i].latency;
+		}
+
+		if (!client || stats->clients[i].bytes_sent < client->bytes_sent) {
+			client = &stats->clients[i];
+		}
+	}
+
+	if (stats->num_clients < stats->max_clients) {
+		client = &stats->clients[stats->num_clients++];
+	} else if (!client || client->bytes_sent >= bytes_sent) {
+		return NULL;
+	}
+
+	memset(client, 0, sizeof(ClientLatency));
+	client->id = client_id;
+	client->listener = listener;
+	client->bytes_sent = bytes_sent;
+
+	return &client->latency;
+}
+
+void request_tracker_sent(RequestTracker *tracker, RequestStats *stats, size_t listener, uint32_t client_id,
+                          uint64_t now_ns, uint32_t bytes)
+{
+	RequestSegment *segment;
+	RequestLatency *latency[2];
+	uint64_t elapsed;
+	uint32_t len;
+	size_t i;
+
+	tracker->bytes_sent += bytes;
+
+	if (!tracker->count || !bytes) {
+		return;
+	}
+
+	latency[0] = listener < stats->num_listeners? &stats->listeners[listener]: NULL;
+	latency[1] = client_latency(stats, listener, client_id, tracker->bytes_sent);
+
+	while (bytes && tracker->count) {
+		segment = &tracker->segments[tracker->first];
+		elapsed = now_ns > segment->start_ns? now_ns - segment->start_ns: 0;
+
+		len = segment->bytes - segment->sent;
+		if (len > bytes) {
+			len = bytes;
+		}
+
+		for (i=0; i < 2; i++) {
+			if (!latency[i] || !segment->tracked) {
+				continue;
+			}
+
+			if (!segment->sent) {
+				read_histogram_add(&latency[i]->first_byte, elapsed);
+			}
+
+			if (segment->sent + len == segment->bytes) {
+				read_histogram_add(&latency[i]->fulfilment, elapsed);
+				latency[i]->requests++;
+				latency[i]->bytes += segment->bytes;
+			}
+		}
+
+		segment->sent += len;
+		bytes -= len;
+
+		if (segment->sent == segment->bytes) {
+			tracker->first = (tracker->first + 1) % REQUEST_TRACKER_SEGMENTS;
+			tracker->count--;
+		}
+	}
+}
+
+RequestStats *request_stats_create(size_t listeners, size_t top_clients)
+{
+	RequestStats *stats;
+
+	stats = calloc(1, sizeof(RequestStats));
+	if (!stats) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	stats->listeners = calloc(listeners ? listeners : 1, sizeof(RequestLatency));
+	stats->clients = calloc(top_clients ? top_clients : 1, sizeof(ClientLatency));
+
+	if (!stats->listeners || !stats->clients) {
+		request_stats_destroy(stats);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	stats->num_listeners = listeners;
+	stats->max_clients = top_clients;
+
+	return stats;
+}
+
+void request_stats_destroy(RequestStats *stats)
+{
+	if (!stats) {
+		return;
+	}
+
+	free(stats->listeners);
+	free(stats->clients);
+	free(stats);
+}
+
+const RequestLatency *request_stats_listener(const RequestStats *stats, size_t listener)
+{
+	if (listener >= stats->num_listeners) {
+		return NULL;
+	}
+
+	return &stats->listeners[listener];
+}
+
+static void report_json_latency(FILE *file, const RequestLatency *latency)
+{
+	fprintf(file, "\"requests\":%" PRIu64 ",\"bytes\":%" PRIu64 ",", latency->requests, latency->bytes);
+	read_histogram_report_json(file, "first_byte_ns", &latency->first_byte);
+	fputc(',', file);
+	read_histogram_report_json(file, "fulfilment_ns", &latency->fulfilment);
+}
+
+void request_stats_report_json(FILE *file, const RequestStats *stats, const char *const *names)
+{
+	size_t i;
+
+	/* Listener names are fixed strings that need no escaping */
+	fprintf(file, "{\"listeners\":[");
+
+	for (i=0; i < stats->num_listeners; i++) {
+		fprintf(file, "%s{\"name\":\"%s\",", i? ",": "", names[i]);
+		report_json_latency(file, &stats->listeners[i]);
+		fputc('}', file);
+	}
+
+	fprintf(file, "],\"clients\":[");
+
+	for (i=0; i < stats->num_clients; i++) {
+		fprintf(file, "%s{\"id\":%" PRIu32 ",\"listener\":\"%s\",\"bytes_sent\":%" PRIu64 ",",
+			i? ",": "", stats->clients[i].id, names[stats->clients[i].listener], stats->clients[i].bytes_sent);
+		report_json_latency(file, &stats->clients[i].latency);
+		fputc('}', file);
+	}
+
+	fprintf(file, "]}\n");
+}
@@ -0,0 +1,118 @@
+#ifndef _REQSTATS_H_
+#define _REQSTATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "readstats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ End-to-end latency of client requests.
+
+ Each request is a segment of bytes with the time it arrived. Bytes sent to
+ the client complete the oldest segments first, recording the time from the
+ request to its first byte and to its last byte. Latencies are kept for each
+ listener and for the clients that received the most data.
+*/
+
+/**
+ Outstanding requests tracked per client. Further requests are merged into
+ the newest one, which makes their latency look shorter.
+*/
+#define REQUEST_TRACKER_SEGMENTS (16)
+
+struct RequestSegment {
+	uint64_t start_ns;
+	uint32_t bytes;
+	uint32_t sent;
+
+	/** Zero for bytes requested before a restart, which are sent without recording latencies */
+	int tracked;
+};
+
+typedef struct RequestSegment RequestSegment;
+
+/**
+* Outstanding requests of a client. Kept in the client.
+*/
+struct RequestTracker {
+	RequestSegment segments[REQUEST_TRACKER_SEGMENTS];
+	unsigned int first;
+	unsigned int count;
+
+	/** Bytes sent to the client. Ranks clients for the per client latencies. */
+	uint64_t bytes_sent;
+};
+
+typedef struct RequestTracker RequestTracker;
+
+/**
+* Latencies of a listener or a client.
+*/
+struct RequestLatency {
+	uint64_t requests;
+	uint64_t bytes;
+
+	/** Request to first byte (ns) */
+	ReadHistogram first_byte;
+
+	/** Request to last byte (ns) */
+	ReadHistogram fulfilment;
+};
+
+typedef struct RequestLatency RequestLatency;
+
+struct RequestStats;
+typedef struct RequestStats RequestStats;
+
+void request_tracker_init(RequestTracker *tracker);
+
+/**
+* Adds a request for bytes that arrived at now_ns. Empty requests are ignored.
+*/
+void request_tracker_add(RequestTracker *tracker, uint64_t now_ns, uint32_t bytes);
+
+/**
+* Adds bytes that were requested before a restart. They are sent before any later
+* request but their latencies are not recorded.
+*/
+void request_tracker_add_untracked(RequestTracker *tracker, uint64_t bytes);
+
+/**
+* Completes the oldest requests with bytes sent at now_ns and records their latencies.
+* Bytes sent for requests that are not tracked (after a restart) are only counted.
+*/
+void request_tracker_sent(RequestTracker *tracker, RequestStats *stats, size_t listener, uint32_t client_id,
+                          uint64_t now_ns, uint32_t bytes);
+
+/**
+* Creates the statistics for the given number of listeners and keeps the
+* latencies of top_clients clients.
+*
+* Returns: The statistics or NULL with errno set.
+*/
+RequestStats *request_stats_create(size_t listeners, size_t top_clients);
+
+void request_stats_destroy(RequestStats *stats);
+
+/**
+* Gets the latencies of a listener. NULL if listener is out of range.
+*/
+const RequestLatency *request_stats_listener(const RequestStats *stats, size_t listener);
+
+/**
+* Writes all latencies as JSON. names has one name per listener.
+*/
+void request_stats_report_json(FILE *file, const RequestStats *stats, const char *const *names);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,692 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Replays a traffic trace recorded with quantisusb-rngd -T against a running
+ daemon and compares request latency and throughput with the recording.
+
+ Usage: rngd-replay [OPTIONS] TRACE
+
+ For reproducible runs start the daemon built against the simulated device
+ (quantisusb-rngd-sim) with QUANTIS_SIM_TRACE set to the same trace and the
+ same speed right before this tool, so the device delivers data at the
+ recorded times. Trace times are relative to the daemon start.
+
+ Latency is measured from sending a request until its last byte is received.
+ The daemon serves requests of a connection in order so a request completes
+ once all bytes up to and including it were received.
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include <inttypes.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "trace.h"
+#include "readstats.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "4545"
+
+#define HEADER_SIZE (sizeof(uint32_t))
+#define RECV_BUFFER_SIZE (65536)
+
+/* How long to wait for outstanding requests once the trace is over */
+#define DRAIN_TIMEOUT_MS (5000)
+
+struct PendingRequest {
+	/* Bytes received on the connection when this request is complete */
+	uint64_t end;
+	uint64_t time_ns;
+};
+
+/**
+* A connection of the trace. Used both to evaluate the recording and for the replay.
+*/
+struct ReplayConnection {
+	int fd;
+
+	uint64_t requested;
+	uint64_t received;
+
+	/* Requests not yet complete, oldest first */
+	struct PendingRequest *pending;
+	size_t pending_head;
+	size_t pending_count;
+	size_t pending_length;
+
+	/* The trace closed the connection. Done once the pending requests complete. */
+	int closing;
+
+	/* Response parsing */
+	unsigned char header[HEADER_SIZE];
+	size_t header_len;
+	uint32_t payload_left;
+};
+
+/**
+* Latency and throughput of one run.
+*/
+struct ReplayResult {
+	ReadHistogram latency;
+	uint64_t requests;
+	uint64_t incomplete;
+	uint64_t bytes;
+	uint64_t connections;
+	double seconds;
+};
+
+static TraceEvent *events;
+static size_t event_count;
+
+static struct ReplayConnection *connections;
+static size_t connection_count;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+* Loads the client events of a trace. Device events are left to the simulated device.
+*/
+static int load_trace(const char *path)
+{
+	TraceReader *trace;
+	TraceEvent event;
+	TraceEvent *new_events;
+	size_t length = 0;
+	int status;
+	int error;
+
+	trace = trace_reader_open(path);
+	if (!trace) {
+		return -1;
+	}
+
+	while ((status = trace_reader_next(trace, &event)) > 0) {
+		if (event.type == TRACE_DEVICE) {
+			continue;
+		}
+
+		if (event_count == length) {
+			length = length ? length * 2 : 4096;
+
+			new_events = realloc(events, length * sizeof(TraceEvent));
+			if (!new_events) {
+				status = -1;
+				break;
+			}
+
+			events = new_events;
+		}
+
+		events[event_count++] = event;
+
+		if (event.id >= connection_count) {
+			connection_count = (size_t)event.id + 1;
+		}
+	}
+
+	error = errno;
+	trace_reader_close(trace);
+	errno = error;
+
+	if (status < 0) {
+		return -1;
+	}
+
+	connections = calloc(connection_count ? connection_count : 1, sizeof(struct ReplayConnection));
+	if (!connections) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void reset_connections(void)
+{
+	size_t i;
+
+	for (i=0; i < connection_count; i++) {
+		free(connections[i].pending);
+		memset(&connections[i], 0, sizeof(struct ReplayConnection));
+		connections[i].fd = -1;
+	}
+}
+
+static int add_request(struct ReplayConnection *conn, uint32_t size, uint64_t time_ns)
+{
+	struct PendingRequest *pending;
+	size_t i;
+
+	conn->requested += size;
+
+	/* Keep-alives have nothing to wait for */
+	if (!size) {
+		return 0;
+	}
+
+	if (conn->pending_count == conn->pending_length) {
+		pending = malloc((conn->pending_length ? conn->pending_length * 2 : 8) * sizeof(struct PendingRequest));
+		if (!pending) {
+			return -1;
+		}
+
+		for (i=0; i < conn->pending_count; i++) {
+			pending[i] = conn->pending[(conn->pending_head + i) % conn->pending_length];
+		}
+
+		free(conn->pending);
+		conn->pending = pending;
+		conn->pending_head = 0;
+		conn->pending_length = conn->pending_length ? conn->pending_length * 2 : 8;
+	}
+
+	i = (conn->pending_head + conn->pending_count) % conn->pending_length;
+	conn->pending[i].end = conn->requested;
+	conn->pending[i].time_ns = time_ns;
+	conn->pending_count++;
+
+	return 0;
+}
+
+static void add_received(struct ReplayConnection *conn, uint64_t bytes, uint64_t time_ns, struct ReplayResult *result)
+{
+	struct PendingRequest *request;
+
+	conn->received += bytes;
+	result->bytes += bytes;
+
+	while (conn->pending_count) {
+		request = &conn->pending[conn->pending_head];
+		if (request->end > conn->received) {
+			break;
+		}
+
+		read_histogram_add(&result->latency, time_ns - request->time_ns);
+		result->requests++;
+
+		conn->pending_head = (conn->pending_head + 1) % conn->pending_length;
+		conn->pending_count--;
+	}
+}
+
+static void count_incomplete(struct ReplayResult *result)
+{
+	size_t i;
+
+	for (i=0; i < connection_count; i++) {
+		result->incomplete += connections[i].pending_count;
+	}
+}
+
+/**
+* Gets latency and throughput as recorded by the daemon.
+*/
+static int evaluate_recording(struct ReplayResult *result)
+{
+	const TraceEvent *event;
+	size_t i;
+
+	memset(result, 0, sizeof(struct ReplayResult));
+	reset_connections();
+
+	for (i=0; i < event_count; i++) {
+		event = &events[i];
+
+		switch (event->type) {
+			case TRACE_CONNECT:
+				result->connections++;
+				break;
+			case TRACE_REQUEST:
+				if (add_request(&connections[event->id], (uint32_t)event->value, event->time_us * 1000ULL)) {
+					return -1;
+				}
+				break;
+			case TRACE_SEND:
+				add_received(&connections[event->id], event->value, event->time_us * 1000ULL, result);
+				break;
+		}
+	}
+
+	/* Like the replay, measured from the start of the daemon */
+	if (event_count) {
+		result->seconds = (double)events[event_count - 1].time_us / 1e6;
+	}
+
+	count_incomplete(result);
+
+	return 0;
+}
+
+static int connect_to(const struct addrinfo *addresses)
+{
+	const struct addrinfo *addr;
+	int fd;
+
+	for (addr = addresses; addr; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+
+		if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+			if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK)) {
+				close(fd);
+				return -1;
+			}
+
+			return fd;
+		}
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+/**
+* Reads the available responses of a connection.
+*
+* Returns: 0 on success, -1 if the connection was closed or failed.
+*/
+static int receive(struct ReplayConnection *conn, struct ReplayResult *result)
+{
+	static unsigned char buf[RECV_BUFFER_SIZE];
+	ssize_t status;
+	size_t offset;
+	size_t len;
+	uint32_t size;
+	uint64_t now;
+
+	status = recv(conn->fd, buf, sizeof(buf), 0);
+	if (status < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+
+	if (!status) {
+		return -1;
+	}
+
+	now = now_ns();
+
+	for (offset = 0; offset < (size_t)status; offset += len) {
+		if (conn->payload_left) {
+			len = (size_t)status - offset;
+			if (len > conn->payload_left) len = conn->payload_left;
+
+			conn->payload_left -= (uint32_t)len;
+			add_received(conn, len, now, result);
+			continue;
+		}
+
+		len = HEADER_SIZE - conn->header_len;
+		if (len > (size_t)status - offset) len = (size_t)status - offset;
+
+		memcpy(conn->header + conn->header_len, buf + offset, len);
+		conn->header_len += len;
+
+		if (conn->header_len == HEADER_SIZE) {
+			memcpy(&size, conn->header, HEADER_SIZE);
+			conn->payload_left = ntohl(size);
+			conn->header_len = 0;
+		}
+	}
+
+	return 0;
+}
+
+static void disconnect(struct ReplayConnection *conn)
+{
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+/**
+* Runs one event of the trace.
+*/
+static void replay_event(const TraceEvent *event, const struct addrinfo *addresses, struct ReplayResult *result)
+{
+	struct ReplayConnection *conn = &connections[event->id];
+	uint32_t request;
+
+	switch (event->type) {
+		case TRACE_CONNECT:
+			conn->fd = connect_to(addresses);
+			if (conn->fd < 0) {
+				fprintf(stderr, "Unable to connect: %s\n", strerror(errno));
+				break;
+			}
+
+			result->connections++;
+			break;
+		case TRACE_DISCONNECT:
+			/* The replay may be behind the recording. Do not cut off requests in flight. */
+			if (conn->pending_count) {
+				conn->closing = 1;
+			} else {
+				disconnect(conn);
+			}
+			break;
+		case TRACE_REQUEST:
+			if (conn->fd < 0) {
+				break;
+			}
+
+			request = htonl((uint32_t)event->value);
+			if (send(conn->fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+				fprintf(stderr, "Unable to send request: %s\n", strerror(errno));
+				disconnect(conn);
+				break;
+			}
+
+			if (add_request(conn, (uint32_t)event->value, now_ns())) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			break;
+	}
+}
+
+static int replay(const struct addrinfo *addresses, double speed, struct ReplayResult *result)
+{
+	struct pollfd *fds;
+	size_t *fd_connections;
+	size_t nfds;
+	size_t next = 0;
+	uint64_t start;
+	uint64_t due;
+	uint64_t now;
+	uint64_t drain_deadline = 0;
+	uint64_t outstanding;
+	struct ReplayConnection *conn;
+	int timeout;
+	size_t i;
+
+	memset(result, 0, sizeof(struct ReplayResult));
+	reset_connections();
+
+	fds = malloc((connection_count ? connection_count : 1) * sizeof(struct pollfd));
+	fd_connections = malloc((connection_count ? connection_count : 1) * sizeof(size_t));
+	if (!fds || !fd_connections) {
+		free(fds);
+		free(fd_connections);
+		return -1;
+	}
+
+	start = now_ns();
+
+	for (;;) {
+		now = now_ns();
+
+		/* Run everything that is due */
+		while (next < event_count) {
+			due = start + (uint64_t)((double)events[next].time_us * 1000.0 / speed);
+			if (due > now) {
+				break;
+			}
+
+			if (events[next].type != TRACE_SEND) {
+				replay_event(&events[next], addresses, result);
+			}
+
+			next++;
+		}
+
+		nfds = 0;
+		outstanding = 0;
+
+		for (i=0; i < connection_count; i++) {
+			if (connections[i].fd < 0) {
+				continue;
+			}
+
+			fds[nfds].fd = connections[i].fd;
+			fds[nfds].events = POLLIN;
+			fd_connections[nfds] = i;
+			nfds++;
+
+			outstanding += connections[i].pending_count;
+		}
+
+		if (next == event_count) {
+			if (!outstanding) {
+				break;
+			}
+
+			if (!drain_deadline) {
+				drain_deadline = now + DRAIN_TIMEOUT_MS * 1000000ULL;
+			} else if (now >= drain_deadline) {
+				break;
+			}
+
+			timeout = (int)((drain_deadline - now + 999999) / 1000000);
+		} else {
+			due = start + (uint64_t)((double)events[next].time_us * 1000.0 / speed);
+			timeout = (int)((due - now + 999999) / 1000000);
+		}
+
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (i=0; i < nfds; i++) {
+			conn = &connections[fd_connections[i]];
+
+			if (fds[i].revents && receive(conn, result)) {
+				disconnect(conn);
+			} else if (conn->closing && !conn->pending_count) {
+				disconnect(conn);
+			}
+		}
+	}
+
+	result->seconds = (double)(now_ns() - start) / 1e9;
+
+	count_incomplete(result);
+
+	for (i=0; i < connection_count; i++) {
+		disconnect(&connections[i]);
+	}
+
+	free(fds);
+	free(fd_connections);
+
+	return 0;
+}
+
+/* Only the recording is reported when not replaying */
+static int dry_run;
+
+static void report_row(const char *name, double recorded, double replayed)
+{
+	printf("%-18s %14.0f", name, recorded);
+
+	if (dry_run) {
+		printf("\n");
+		return;
+	}
+
+	printf(" %14.0f", replayed);
+
+	if (recorded > 0) {
+		printf(" %+9.1f%%", (replayed - recorded) * 100.0 / recorded);
+	}
+
+	printf("\n");
+}
+
+static void report(const struct ReplayResult *recorded, const struct ReplayResult *replayed, double speed)
+{
+	static const unsigned int percentiles[] = {500, 900, 990, 999};
+	static const char *percentile_names[] = {"latency p50 us", "latency p90 us", "latency p99 us", "latency p99.9 us"};
+	size_t i;
+
+	if (dry_run) {
+		printf("%-18s %14s\n", "", "recorded");
+	} else {
+		printf("%-18s %14s %14s %10s\n", "", "recorded", "replayed", "delta");
+	}
+
+	report_row("connections", (double)recorded->connections, (double)replayed->connections);
+	report_row("requests", (double)recorded->requests, (double)replayed->requests);
+	report_row("incomplete", (double)recorded->incomplete, (double)replayed->incomplete);
+	report_row("bytes", (double)recorded->bytes, (double)replayed->bytes);
+
+	/* The recording is compressed in time by the replay speed. So are its latencies. */
+	report_row("duration ms", recorded->seconds * 1e3 / speed, replayed->seconds * 1e3);
+	report_row("bytes/s", recorded->seconds > 0 ? (double)recorded->bytes * speed / recorded->seconds : 0,
+		replayed->seconds > 0 ? (double)replayed->bytes / replayed->seconds : 0);
+
+	for (i=0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		report_row(percentile_names[i], (double)read_histogram_percentile(&recorded->latency, percentiles[i]) / 1e3 / speed,
+			(double)read_histogram_percentile(&replayed->latency, percentiles[i]) / 1e3);
+	}
+
+	report_row("latency max us", (double)recorded->latency.max / 1e3 / speed, (double)replayed->latency.max / 1e3);
+}
+
+static void show_usage(const char *app)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] TRACE\n\n"
+		"Options:\n"
+		"-H HOST  Daemon address. (Default: %s)\n"
+		"-h       Help. Show this message and exit\n"
+		"-n       Only report the recorded latency and throughput\n"
+		"-p PORT  Daemon port. (Default: %s)\n"
+		"-x SPEED Replay speed. 2 replays twice as fast. (Default: 1)\n"
+		, app, DEFAULT_HOST, DEFAULT_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = DEFAULT_HOST;
+	const char *port = DEFAULT_PORT;
+	double speed = 1.0;
+	struct addrinfo hints;
+	struct addrinfo *addresses = NULL;
+	struct ReplayResult recorded;
+	struct ReplayResult replayed;
+	int status;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "H:hnp:x:")) != -1) {
+		switch (opt) {
+			case 'H':
+				host = optarg;
+				break;
+			case 'h':
+				show_usage(argv[0]);
+				return 0;
+			case 'n':
+				dry_run = 1;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'x':
+				if (sscanf(optarg, "%lf", &speed) != 1 || speed <= 0) {
+					fprintf(stderr, "Invalid speed\n");
+					return 1;
+				}
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	if (load_trace(argv[optind])) {
+		fprintf(stderr, "Unable to read trace %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	if (evaluate_recording(&recorded)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	memset(&replayed, 0, sizeof(replayed));
+
+	if (!dry_run) {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		status = getaddrinfo(host, port, &hints, &addresses);
+		if (status) {
+			fprintf(stderr, "Unable to resolve %s: %s\n", host, gai_strerror(status));
+			return 1;
+		}
+
+		if (replay(addresses, speed, &replayed)) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		freeaddrinfo(addresses);
+	}
+
+	report(&recorded, &replayed, speed);
+
+	reset_connections();
+	free(connections);
+	free(events);
+
+	return 0;
+}
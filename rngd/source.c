@@ -0,0 +1,738 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "source.h"
+#include "health.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_RDSEED 1
+#endif
+
+#define SOURCE_MAX (16)
+
+/* Bytes read at once and chunks queued per source */
+#define SOURCE_CHUNK_SIZE (4096)
+#define SOURCE_QUEUE_CHUNKS (16)
+
+/* Consecutive chunks failing the health tests before a source is stopped */
+#define SOURCE_MAX_HEALTH_FAILURES (8)
+
+/* RDSEED fails when the CPU's entropy pool is empty. Retries before sleeping. */
+#define RDSEED_RETRIES (64)
+#define RDSEED_SLEEP_US (100)
+
+#define SOURCE_DEFAULT_ENTROPY (1.0)
+
+enum SourceType {
+	SOURCE_FILE = 0,
+	SOURCE_RDSEED
+};
+
+struct Source {
+	SourcePool *pool;
+	unsigned int index;
+	int type;
+	char *name;
+	char *path;
+	int fd;
+	int fifo;
+
+	HealthTest health;
+	unsigned int consecutive_failures;
+
+	pthread_t thread;
+	int thread_started;
+
+	/* Ring of chunks. Only the reader advances head and only the source fills the slot after the last. */
+	unsigned char *chunks;
+	size_t chunk_len[SOURCE_QUEUE_CHUNKS];
+	unsigned int head;
+	unsigned int count;
+
+	SourceStats stats;
+	struct timespec started;
+};
+
+typedef struct Source Source;
+
+struct SourcePool {
+	Source sources[SOURCE_MAX];
+	unsigned int num_sources;
+	/* Next source for source_pool_read */
+	unsigned int next;
+
+	pthread_mutex_t lock;
+	/* Signalled when queue space becomes available or on stop */
+	pthread_cond_t space;
+	int stop;
+	int running;
+
+	/* Readable when data is queued */
+	int notify_fd;
+	int notify_write_fd;
+
+	/* Readable once the pool is stopping. Wakes up sources waiting in poll. */
+	int stop_fd;
+	int stop_write_fd;
+};
+
+static void source_wipe(unsigned char *data, size_t data_len)
+{
+	memset(data, 0, data_len);
+	__asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
+SourcePool *source_pool_create(void)
+{
+	SourcePool *pool;
+
+	pool = malloc(sizeof(SourcePool));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(pool, 0, sizeof(SourcePool));
+	pool->notify_fd = -1;
+	pool->notify_write_fd = -1;
+	pool->stop_fd = -1;
+	pool->stop_write_fd = -1;
+
+	if (pthread_mutex_init(&pool->lock, NULL)) {
+		free(pool);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (pthread_cond_init(&pool->space, NULL)) {
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return pool;
+}
+
+#ifdef HAVE_RDSEED
+static int rdseed_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+
+	return !!(ebx & bit_RDSEED);
+}
+
+static int rdseed_step(unsigned long *value)
+{
+	unsigned char ok;
+
+	__asm__ __volatile__("rdseed %0; setc %1" : "=r"(*value), "=qm"(ok) : : "cc");
+
+	return ok;
+}
+#endif
+
+int source_pool_add(SourcePool *pool, const char *spec)
+{
+	Source *source;
+	const char *options;
+	char *end;
+	double entropy = SOURCE_DEFAULT_ENTROPY;
+	size_t name_len;
+
+	if (pool->running || pool->num_sources == SOURCE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	options = strchr(spec, ',');
+	name_len = options ? (size_t)(options - spec) : strlen(spec);
+
+	if (!name_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (options) {
+		if (strncmp(options, ",entropy=", 9)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		errno = 0;
+		entropy = strtod(options + 9, &end);
+		if (errno || end == options + 9 || *end) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	source = &pool->sources[pool->num_sources];
+	memset(source, 0, sizeof(Source));
+
+	if (health_test_init(&source->health, entropy)) {
+		return -1;
+	}
+
+	source->name = malloc(name_len + 1);
+	if (!source->name) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(source->name, spec, name_len);
+	source->name[name_len] = '\0';
+
+	source->pool = pool;
+	source->index = pool->num_sources;
+	source->fd = -1;
+	source->path = source->name;
+
+	if (!strcmp(source->name, "rdseed")) {
+#ifdef HAVE_RDSEED
+		if (!rdseed_supported()) {
+			free(source->name);
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		source->type = SOURCE_RDSEED;
+		source->path = NULL;
+#else
+		free(source->name);
+		errno = ENOTSUP;
+		return -1;
+#endif
+	} else if (!strcmp(source->name, "hwrng")) {
+		source->path = "/dev/hwrng";
+	}
+
+	source->chunks = malloc(SOURCE_QUEUE_CHUNKS * SOURCE_CHUNK_SIZE);
+	if (!source->chunks) {
+		free(source->name);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pool->num_sources++;
+
+	return 0;
+}
+
+unsigned int source_pool_count(const SourcePool *pool)
+{
+	return pool->num_sources;
+}
+
+const char *source_pool_name(const SourcePool *pool, unsigned int index)
+{
+	if (index >= pool->num_sources) {
+		return NULL;
+	}
+
+	return pool->sources[index].name;
+}
+
+static void source_notify(SourcePool *pool)
+{
+	uint64_t value = 1;
+
+	if (write(pool->notify_write_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Source notify error: %s", strerror(errno));
+	}
+}
+
+/**
+ Reads the next chunk from a file source. Waits for data or the pool to stop.
+
+ Returns: The number of bytes read, 0 at the end of a regular file or -1 with errno set.
+*/
+static ssize_t source_read_file(Source *source, unsigned char *buffer)
+{
+	struct pollfd pfds[2];
+	ssize_t len;
+
+	for (;;) {
+		pfds[0].fd = source->fd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		pfds[1].fd = source->pool->stop_fd;
+		pfds[1].events = POLLIN;
+		pfds[1].revents = 0;
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (pfds[1].revents) {
+			errno = ECANCELED;
+			return -1;
+		}
+
+		len = read(source->fd, buffer, SOURCE_CHUNK_SIZE);
+		if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+
+		return len;
+	}
+}
+
+#ifdef HAVE_RDSEED
+static ssize_t source_read_rdseed(Source *source, unsigned char *buffer)
+{
+	unsigned long value;
+	size_t filled = 0;
+	unsigned int retries = 0;
+
+	while (filled < SOURCE_CHUNK_SIZE) {
+		if (!rdseed_step(&value)) {
+			if (++retries < RDSEED_RETRIES) {
+				continue;
+			}
+
+			/* Shared with every other user of the CPU. Let the pool refill. */
+			if (__atomic_load_n(&source->pool->stop, __ATOMIC_ACQUIRE)) {
+				errno = ECANCELED;
+				return -1;
+			}
+
+			retries = 0;
+			usleep(RDSEED_SLEEP_US);
+			continue;
+		}
+
+		retries = 0;
+		memcpy(buffer + filled, &value, sizeof(value));
+		filled += sizeof(value);
+	}
+
+	value = 0;
+
+	return (ssize_t)filled;
+}
+#endif
+
+static ssize_t source_read_chunk(Source *source, unsigned char *buffer)
+{
+#ifdef HAVE_RDSEED
+	if (source->type == SOURCE_RDSEED) {
+		return source_read_rdseed(source, buffer);
+	}
+#endif
+
+	return source_read_file(source, buffer);
+}
+
+/**
+ Queues a chunk once there is space.
+
+ Returns: 0 on success, -1 if the pool is stopping.
+*/
+static int source_queue(Source *source, const unsigned char *data, size_t data_len)
+{
+	SourcePool *pool = source->pool;
+	unsigned int slot;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (source->count == SOURCE_QUEUE_CHUNKS && !pool->stop) {
+		pthread_cond_wait(&pool->space, &pool->lock);
+	}
+
+	if (pool->stop) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	slot = (source->head + source->count) % SOURCE_QUEUE_CHUNKS;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	/* The reader never touches slots past the queued ones */
+	memcpy(source->chunks + (size_t)slot * SOURCE_CHUNK_SIZE, data, data_len);
+	source->chunk_len[slot] = data_len;
+
+	pthread_mutex_lock(&pool->lock);
+	source->count++;
+	source->stats.bytes += data_len;
+	pthread_mutex_unlock(&pool->lock);
+
+	source_notify(pool);
+
+	return 0;
+}
+
+static void *source_thread_main(void *user_data)
+{
+	Source *source;
+	SourcePool *pool;
+	unsigned char buffer[SOURCE_CHUNK_SIZE];
+	ssize_t len;
+	int result;
+
+	source = (Source *)user_data;
+	pool = source->pool;
+
+	for (;;) {
+		len = source_read_chunk(source, buffer);
+
+		if (len < 0) {
+			if (errno == ECANCELED) {
+				break;
+			}
+
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Source %s read error: %s", source->name, strerror(errno));
+
+			pthread_mutex_lock(&pool->lock);
+			source->stats.read_errors++;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		if (len == 0) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Source %s ended", source->name);
+			break;
+		}
+
+		result = health_test_run(&source->health, buffer, (size_t)len);
+		if (result != HEALTH_OK) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING), "Source %s failed the %s test. Dropping %zd bytes",
+				source->name, result == HEALTH_RCT_FAILED ? "repetition count" : "adaptive proportion", len);
+
+			pthread_mutex_lock(&pool->lock);
+			source->stats.health_failures++;
+			pthread_mutex_unlock(&pool->lock);
+
+			source_wipe(buffer, (size_t)len);
+
+			if (++source->consecutive_failures == SOURCE_MAX_HEALTH_FAILURES) {
+				syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Source %s keeps failing health tests. Disabled", source->name);
+				break;
+			}
+			continue;
+		}
+
+		source->consecutive_failures = 0;
+
+		if (source_queue(source, buffer, (size_t)len)) {
+			break;
+		}
+	}
+
+	source_wipe(buffer, sizeof(buffer));
+
+	pthread_mutex_lock(&pool->lock);
+	source->stats.finished = 1;
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static int source_open(Source *source)
+{
+	struct stat st;
+	int flags = O_RDONLY;
+
+	if (source->type != SOURCE_FILE) {
+		return 0;
+	}
+
+	if (stat(source->path, &st)) {
+		return -1;
+	}
+
+	/* Keeping the write side open means no end of file when a writer leaves */
+	source->fifo = S_ISFIFO(st.st_mode);
+	if (source->fifo) {
+		flags = O_RDWR;
+	}
+
+	source->fd = open(source->path, flags);
+	if (source->fd < 0) {
+		return -1;
+	}
+
+	fcntl(source->fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+static int source_pool_pipe(int *read_fd, int *write_fd)
+{
+#ifdef HAVE_EVENTFD
+	*read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	*write_fd = *read_fd;
+
+	return (*read_fd < 0) ? -1 : 0;
+#else
+	int fds[2];
+
+	if (pipe(fds)) {
+		return -1;
+	}
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	*read_fd = fds[0];
+	*write_fd = fds[1];
+
+	return 0;
+#endif
+}
+
+static void source_pool_stop(SourcePool *pool)
+{
+	uint64_t value = 1;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->space);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (pool->stop_write_fd >= 0 && write(pool->stop_write_fd, &value, sizeof(value)) < 0) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Source stop error: %s", strerror(errno));
+	}
+
+	for (i=0; i < pool->num_sources; i++) {
+		if (pool->sources[i].thread_started) {
+			pthread_join(pool->sources[i].thread, NULL);
+			pool->sources[i].thread_started = 0;
+		}
+	}
+
+	pool->running = 0;
+}
+
+int source_pool_start(SourcePool *pool)
+{
+	Source *source;
+	unsigned int i;
+	int error;
+
+	if (pool->running) {
+		return 0;
+	}
+
+	if (source_pool_pipe(&pool->notify_fd, &pool->notify_write_fd) ||
+		source_pool_pipe(&pool->stop_fd, &pool->stop_write_fd)) {
+		return -1;
+	}
+
+	pool->running = 1;
+
+	for (i=0; i < pool->num_sources; i++) {
+		source = &pool->sources[i];
+
+		if (source_open(source)) {
+			error = errno;
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to open source %s: %s", source->name, strerror(errno));
+			source_pool_stop(pool);
+			errno = error;
+			return -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &source->started);
+
+		if (pthread_create(&source->thread, NULL, source_thread_main, source)) {
+			syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Unable to start source %s", source->name);
+			source_pool_stop(pool);
+			errno = EAGAIN;
+			return -1;
+		}
+
+		source->thread_started = 1;
+	}
+
+	return 0;
+}
+
+int source_pool_fd(const SourcePool *pool)
+{
+	return pool->notify_fd;
+}
+
+size_t source_pool_read(SourcePool *pool, SourceCallback callback, void *user_data)
+{
+	unsigned char drain[64];
+	Source *source = NULL;
+	unsigned char *chunk;
+	size_t chunk_len;
+	unsigned int i;
+
+	if (!pool->running) {
+		return 0;
+	}
+
+	/* Anything queued after this is signalled again */
+	while (read(pool->notify_fd, drain, sizeof(drain)) > 0) {}
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (i=0; i < pool->num_sources; i++) {
+		source = &pool->sources[(pool->next + i) % pool->num_sources];
+		if (source->count) {
+			break;
+		}
+		source = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!source) {
+		return 0;
+	}
+
+	pool->next = (source->index + 1) % pool->num_sources;
+
+	/* The source only writes past the queued chunks so the head is stable */
+	chunk = source->chunks + (size_t)source->head * SOURCE_CHUNK_SIZE;
+	chunk_len = source->chunk_len[source->head];
+
+	callback(source->index, chunk, chunk_len, user_data);
+	source_wipe(chunk, chunk_len);
+
+	pthread_mutex_lock(&pool->lock);
+	source->head = (source->head + 1) % SOURCE_QUEUE_CHUNKS;
+	source->count--;
+	pthread_cond_broadcast(&pool->space);
+	pthread_mutex_unlock(&pool->lock);
+
+	return chunk_len;
+}
+
+int source_pool_get_stats(SourcePool *pool, unsigned int index, SourceStats *stats)
+{
+	Source *source;
+	struct timespec now;
+	uint64_t elapsed_ms;
+
+	if (index >= pool->num_sources) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	source = &pool->sources[index];
+
+	pthread_mutex_lock(&pool->lock);
+	*stats = source->stats;
+	pthread_mutex_unlock(&pool->lock);
+
+	stats->rate = 0;
+
+	if (source->started.tv_sec || source->started.tv_nsec) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		elapsed_ms = (uint64_t)(now.tv_sec - source->started.tv_sec) * 1000 +
+			(uint64_t)((now.tv_nsec - source->started.tv_nsec) / 1000000);
+
+		if (elapsed_ms) {
+			stats->rate = stats->bytes * 1000 / elapsed_ms;
+		}
+	}
+
+	return 0;
+}
+
+void source_pool_destroy(SourcePool *pool)
+{
+	Source *source;
+	unsigned int i;
+
+	if (!pool) {
+		return;
+	}
+
+	if (pool->running) {
+		source_pool_stop(pool);
+	}
+
+	for (i=0; i < pool->num_sources; i++) {
+		source = &pool->sources[i];
+
+		if (source->fd >= 0) {
+			close(source->fd);
+		}
+
+		source_wipe(source->chunks, SOURCE_QUEUE_CHUNKS * SOURCE_CHUNK_SIZE);
+		free(source->chunks);
+		free(source->name);
+	}
+
+	if (pool->notify_fd >= 0) {
+		close(pool->notify_fd);
+	}
+
+	if (pool->notify_write_fd >= 0 && pool->notify_write_fd != pool->notify_fd) {
+		close(pool->notify_write_fd);
+	}
+
+	if (pool->stop_fd >= 0) {
+		close(pool->stop_fd);
+	}
+
+	if (pool->stop_write_fd >= 0 && pool->stop_write_fd != pool->stop_fd) {
+		close(pool->stop_write_fd);
+	}
+
+	pthread_cond_destroy(&pool->space);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,113 @@
+#ifndef _SOURCE_H_
+#define _SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Entropy sources read alongside the Quantis devices.
+
+ Every source is read on its own thread into a small queue of chunks so a
+ slow or blocking source never holds up the others. Chunks pass the source's
+ health tests before they are queued. The application takes chunks in round
+ robin order with source_pool_read and appends them to its output unchanged,
+ so the throughput of all sources adds up and every chunk is attributed to
+ one source.
+
+ A source is one of:
+
+   rdseed          The RDSEED instruction of x86 CPUs.
+   hwrng           /dev/hwrng, the kernel hardware RNG (TPM, virtio-rng, ...).
+   PATH            Any other character device, regular file or FIFO. Regular
+                   files end at their end, FIFOs wait for the next writer.
+
+ followed by an optional ",entropy=BITS" with the min-entropy per byte the
+ health tests assume. (Default: 1)
+*/
+struct SourcePool;
+typedef struct SourcePool SourcePool;
+
+struct SourceStats {
+	/** Bytes that passed the health tests */
+	uint64_t bytes;
+	/** Chunks dropped because a health test failed */
+	uint64_t health_failures;
+	uint64_t read_errors;
+	/** Average bytes per second since the source was started */
+	uint64_t rate;
+	/** Set once the source stopped for good */
+	int finished;
+};
+
+typedef struct SourceStats SourceStats;
+
+/**
+* Called with each chunk. index is the source's position in the order they were added.
+*/
+typedef void (*SourceCallback) (unsigned int index, const unsigned char *data, size_t data_len, void *user_data);
+
+/**
+* Returns: The pool or NULL with errno set.
+*/
+SourcePool *source_pool_create(void);
+
+/**
+* Stops all sources and wipes queued data.
+*/
+void source_pool_destroy(SourcePool *pool);
+
+/**
+* Adds a source described by spec. Sources can only be added before source_pool_start.
+*
+* Returns: 0 on success, -1 with errno set. errno is EINVAL for an invalid spec and
+* ENOTSUP if the CPU has no RDSEED.
+*/
+int source_pool_add(SourcePool *pool, const char *spec);
+
+/**
+* Gets the number of sources.
+*/
+unsigned int source_pool_count(const SourcePool *pool);
+
+/**
+* Gets the name of a source.
+*/
+const char *source_pool_name(const SourcePool *pool, unsigned int index);
+
+/**
+* Opens the sources and starts reading. Errors are reported through syslog.
+*
+* Returns: 0 on success, -1 with errno set.
+*/
+int source_pool_start(SourcePool *pool);
+
+/**
+* Gets a descriptor that becomes readable when chunks are queued.
+*/
+int source_pool_fd(const SourcePool *pool);
+
+/**
+* Passes the next queued chunk to callback, taking sources in turn.
+* The chunk is wiped afterwards.
+*
+* Returns: The chunk size or 0 if nothing is queued.
+*/
+size_t source_pool_read(SourcePool *pool, SourceCallback callback, void *user_data);
+
+/**
+* Gets the counters of a source.
+*
+* Returns: 0 on success, -1 with errno set to EINVAL.
+*/
+int source_pool_get_stats(SourcePool *pool, unsigned int index, SourceStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,363 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Overflow spool for random bytes.
+
+ Data is encrypted with ChaCha20 before it touches the mapping. The key stream
+ position is the absolute byte offset in the spool which only grows so no part
+ of the key stream is ever used twice. The key is generated at startup and never
+ leaves memory so the file contents are useless once the process exits.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "spool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CHACHA_BLOCK_SIZE (64)
+
+/* Bytes encrypted on the stack before being copied to the mapping */
+#define SPOOL_CHUNK_SIZE (4096)
+
+struct Spool {
+	unsigned char *map;
+	size_t capacity;
+
+	/* Total bytes ever written and read. Positions in the file are modulo capacity. */
+	uint64_t head;
+	uint64_t tail;
+
+	uint32_t key[8];
+};
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+/**
+ Clears memory in a way the compiler can not optimize away.
+*/
+static void spool_wipe(void *data, size_t data_len)
+{
+	memset(data, 0, data_len);
+	__asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
+/**
+ ChaCha20 block with a 64-bit block counter and a zero nonce.
+*/
+static void chacha20_block(const uint32_t key[8], uint64_t counter, unsigned char out[CHACHA_BLOCK_SIZE])
+{
+	uint32_t input[16];
+	uint32_t x[16];
+	int i;
+
+	input[0] = 0x61707865;
+	input[1] = 0x3320646e;
+	input[2] = 0x79622d32;
+	input[3] = 0x6b206574;
+	memcpy(input + 4, key, 8 * sizeof(uint32_t));
+	input[12] = (uint32_t)counter;
+	input[13] = (uint32_t)(counter >> 32);
+	input[14] = 0;
+	input[15] = 0;
+
+	memcpy(x, input, sizeof(x));
+
+	for (i=0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12])
+		QUARTERROUND(x[1], x[5], x[9], x[13])
+		QUARTERROUND(x[2], x[6], x[10], x[14])
+		QUARTERROUND(x[3], x[7], x[11], x[15])
+		QUARTERROUND(x[0], x[5], x[10], x[15])
+		QUARTERROUND(x[1], x[6], x[11], x[12])
+		QUARTERROUND(x[2], x[7], x[8], x[13])
+		QUARTERROUND(x[3], x[4], x[9], x[14])
+	}
+
+	for (i=0; i < 16; i++) {
+		x[i] += input[i];
+		out[4*i] = (unsigned char)x[i];
+		out[4*i + 1] = (unsigned char)(x[i] >> 8);
+		out[4*i + 2] = (unsigned char)(x[i] >> 16);
+		out[4*i + 3] = (unsigned char)(x[i] >> 24);
+	}
+
+	spool_wipe(x, sizeof(x));
+}
+
+/**
+ XORs data with the key stream starting at byte position pos.
+*/
+static void chacha20_xor(const uint32_t key[8], uint64_t pos, unsigned char *data, size_t data_len)
+{
+	unsigned char block[CHACHA_BLOCK_SIZE];
+	size_t offset;
+	size_t len;
+	size_t i;
+
+	offset = (size_t)(pos % CHACHA_BLOCK_SIZE);
+
+	while (data_len) {
+		chacha20_block(key, pos / CHACHA_BLOCK_SIZE, block);
+
+		len = CHACHA_BLOCK_SIZE - offset;
+		if (len > data_len) {
+			len = data_len;
+		}
+
+		for (i=0; i < len; i++) {
+			data[i] ^= block[offset + i];
+		}
+
+		data += len;
+		data_len -= len;
+		pos += len;
+		offset = 0;
+	}
+
+	spool_wipe(block, sizeof(block));
+}
+
+static int spool_generate_key(Spool *spool)
+{
+	unsigned char *key;
+	size_t key_len;
+	ssize_t status;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	key = (unsigned char *)spool->key;
+	key_len = sizeof(spool->key);
+
+	while (key_len) {
+		status = read(fd, key, key_len);
+		if (status <= 0) {
+			if (status < 0 && errno == EINTR) {
+				continue;
+			}
+
+			close(fd);
+			errno = EIO;
+			return -1;
+		}
+
+		key += status;
+		key_len -= (size_t)status;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+Spool *spool_create(const char *path, size_t capacity)
+{
+	Spool *spool;
+	long page_size;
+	int status;
+	int fd;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0) {
+		page_size = 4096;
+	}
+
+	if (!capacity || capacity > SIZE_MAX - (size_t)page_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	capacity = (capacity + (size_t)page_size - 1) / (size_t)page_size * (size_t)page_size;
+
+	spool = malloc(sizeof(Spool));
+	if (!spool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(spool, 0, sizeof(Spool));
+	spool->capacity = capacity;
+
+	if (spool_generate_key(spool)) {
+		free(spool);
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		spool_destroy(spool);
+		return NULL;
+	}
+
+	/* Only reachable through the mapping from now on */
+	unlink(path);
+
+	/* Allocate now so writing to the mapping can't fail with SIGBUS later */
+	status = posix_fallocate(fd, 0, (off_t)capacity);
+	if (status) {
+		close(fd);
+		spool_destroy(spool);
+		errno = status;
+		return NULL;
+	}
+
+	spool->map = mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (spool->map == MAP_FAILED) {
+		spool->map = NULL;
+		spool_destroy(spool);
+		return NULL;
+	}
+
+	return spool;
+}
+
+void spool_destroy(Spool *spool)
+{
+	if (!spool) {
+		return;
+	}
+
+	if (spool->map) {
+		munmap(spool->map, spool->capacity);
+	}
+
+	spool_wipe(spool->key, sizeof(spool->key));
+	free(spool);
+}
+
+size_t spool_available(const Spool *spool)
+{
+	if (!spool) return 0;
+
+	return (size_t)(spool->head - spool->tail);
+}
+
+size_t spool_space(const Spool *spool)
+{
+	if (!spool) return 0;
+
+	return spool->capacity - spool_available(spool);
+}
+
+size_t spool_capacity(const Spool *spool)
+{
+	if (!spool) return 0;
+
+	return spool->capacity;
+}
+
+size_t spool_write(Spool *spool, const unsigned char *data, size_t data_len)
+{
+	unsigned char chunk[SPOOL_CHUNK_SIZE];
+	size_t written = 0;
+	size_t offset;
+	size_t len;
+
+	if (data_len > spool_space(spool)) {
+		data_len = spool_space(spool);
+	}
+
+	while (written < data_len) {
+		offset = (size_t)(spool->head % spool->capacity);
+
+		len = data_len - written;
+		if (len > SPOOL_CHUNK_SIZE) {
+			len = SPOOL_CHUNK_SIZE;
+		}
+
+		if (len > spool->capacity - offset) {
+			len = spool->capacity - offset;
+		}
+
+		/* Plain text never reaches the mapping */
+		memcpy(chunk, data + written, len);
+		chacha20_xor(spool->key, spool->head, chunk, len);
+		memcpy(spool->map + offset, chunk, len);
+
+		spool->head += len;
+		written += len;
+	}
+
+	spool_wipe(chunk, sizeof(chunk));
+
+	return written;
+}
+
+size_t spool_read(Spool *spool, unsigned char *data, size_t data_len)
+{
+	size_t read = 0;
+	size_t offset;
+	size_t len;
+
+	if (data_len > spool_available(spool)) {
+		data_len = spool_available(spool);
+	}
+
+	while (read < data_len) {
+		offset = (size_t)(spool->tail % spool->capacity);
+
+		len = data_len - read;
+		if (len > spool->capacity - offset) {
+			len = spool->capacity - offset;
+		}
+
+		memcpy(data + read, spool->map + offset, len);
+		chacha20_xor(spool->key, spool->tail, data + read, len);
+
+		/* Consumed exactly once */
+		spool_wipe(spool->map + offset, len);
+
+		spool->tail += len;
+		read += len;
+	}
+
+	return read;
+}
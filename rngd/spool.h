@@ -0,0 +1,65 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Bounded FIFO of random bytes kept in a memory mapped file.
+
+ Used as overflow for the in-memory buffer. The file is unlinked as soon as it is
+ created and its contents are encrypted with a key that only exists in memory.
+ Bytes are wiped from the file once read.
+*/
+struct Spool;
+typedef struct Spool Spool;
+
+/**
+* Creates a spool backed by a new file at path. The file must not exist.
+* Capacity is rounded up to a multiple of the page size and the disk space
+* is allocated immediately.
+*
+* Returns: The spool or NULL with errno set.
+*/
+Spool *spool_create(const char *path, size_t capacity);
+
+/**
+* Destroys a spool and wipes its key.
+*/
+void spool_destroy(Spool *spool);
+
+/**
+* Returns number of bytes available for reading.
+*/
+size_t spool_available(const Spool *spool);
+
+/**
+* Gets the number of bytes available for writing.
+*/
+size_t spool_space(const Spool *spool);
+
+/**
+* Gets the capacity in bytes.
+*/
+size_t spool_capacity(const Spool *spool);
+
+/**
+* Appends data to the spool. Returns the number of bytes written.
+*/
+size_t spool_write(Spool *spool, const unsigned char *data, size_t data_len);
+
+/**
+* Removes up to data_len bytes from the spool. The bytes read are wiped from the file.
+* Returns the number of bytes read.
+*/
+size_t spool_read(Spool *spool, unsigned char *data, size_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ TLS 1.3 sessions for client connections with kernel TLS offload.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "tlsserver.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct TLSServer {
+	SSL_CTX *ctx;
+};
+
+struct TLSConnection {
+	SSL *ssl;
+	int fd;
+
+	int established;
+	int ktls;
+
+	/* Userspace TLS only. Records are written to wbio and queued in out until sent. */
+	BIO *wbio;
+	unsigned char *out;
+	size_t out_size;
+	size_t out_offset;
+	size_t out_len;
+};
+
+/**
+* Logs and clears the OpenSSL error queue.
+*/
+static void tls_log_errors(int priority, const char *msg)
+{
+	char buf[256];
+	unsigned long error;
+	int logged = 0;
+
+	while ((error = ERR_get_error()) != 0) {
+		ERR_error_string_n(error, buf, sizeof(buf));
+		syslog(LOG_MAKEPRI(LOG_DAEMON, priority), "%s: %s", msg, buf);
+		logged = 1;
+	}
+
+	if (!logged) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, priority), "%s", msg);
+	}
+}
+
+TLSServer *tls_server_create(const char *cert_file, const char *key_file)
+{
+	TLSServer *server;
+
+	server = malloc(sizeof(TLSServer));
+	if (!server) {
+		syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), "Out of memory");
+		return NULL;
+	}
+
+	server->ctx = SSL_CTX_new(TLS_server_method());
+	if (!server->ctx) {
+		tls_log_errors(LOG_CRIT, "Unable to create TLS context");
+		free(server);
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(server->ctx, TLS1_3_VERSION);
+
+	/* Session tickets would be sent after the handshake and are never used by clients */
+	SSL_CTX_set_num_tickets(server->ctx, 0);
+	SSL_CTX_set_session_cache_mode(server->ctx, SSL_SESS_CACHE_OFF);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(server->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	if (SSL_CTX_use_certificate_chain_file(server->ctx, cert_file) != 1) {
+		tls_log_errors(LOG_CRIT, "Unable to load TLS certificate");
+		tls_server_destroy(server);
+		return NULL;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(server->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(server->ctx) != 1) {
+		tls_log_errors(LOG_CRIT, "Unable to load TLS private key");
+		tls_server_destroy(server);
+		return NULL;
+	}
+
+	return server;
+}
+
+void tls_server_destroy(TLSServer *server)
+{
+	if (!server) return;
+
+	SSL_CTX_free(server->ctx);
+	free(server);
+}
+
+TLSConnection *tls_connection_create(TLSServer *server, int fd)
+{
+	TLSConnection *conn;
+
+	conn = calloc(1, sizeof(TLSConnection));
+	if (!conn) {
+		return NULL;
+	}
+
+	conn->fd = fd;
+	conn->ssl = SSL_new(server->ctx);
+	if (!conn->ssl) {
+		free(conn);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (SSL_set_fd(conn->ssl, fd) != 1) {
+		SSL_free(conn->ssl);
+		free(conn);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	SSL_set_accept_state(conn->ssl);
+
+	return conn;
+}
+
+/**
+* Moves records written by OpenSSL to the send queue.
+*/
+static int tls_connection_collect(TLSConnection *conn)
+{
+	unsigned char *out;
+	size_t pending;
+	size_t size;
+	int status;
+
+	pending = BIO_ctrl_pending(conn->wbio);
+	if (!pending) {
+		return 0;
+	}
+
+	if (conn->out_offset) {
+		memmove(conn->out, conn->out + conn->out_offset, conn->out_len - conn->out_offset);
+		conn->out_len -= conn->out_offset;
+		conn->out_offset = 0;
+	}
+
+	if (conn->out_len + pending > conn->out_size) {
+		size = conn->out_len + pending;
+
+		out = realloc(conn->out, size);
+		if (!out) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		conn->out = out;
+		conn->out_size = size;
+	}
+
+	status = BIO_read(conn->wbio, conn->out + conn->out_len, (int)pending);
+	if (status > 0) {
+		conn->out_len += (size_t)status;
+	}
+
+	return 0;
+}
+
+int tls_connection_handshake(TLSConnection *conn)
+{
+	int status;
+
+	if (conn->established) {
+		return 1;
+	}
+
+	ERR_clear_error();
+
+	status = SSL_accept(conn->ssl);
+	if (status != 1) {
+		switch (SSL_get_error(conn->ssl, status)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				return 0;
+			default:
+				tls_log_errors(LOG_INFO, "TLS handshake failed");
+				errno = EPROTO;
+				return -1;
+		}
+	}
+
+	conn->established = 1;
+
+#ifdef BIO_get_ktls_send
+	conn->ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+#endif
+
+	/* Without kernel TLS records go to memory so sends never have to be repeated with the same data */
+	if (!conn->ktls) {
+		conn->wbio = BIO_new(BIO_s_mem());
+		if (!conn->wbio) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		SSL_set0_wbio(conn->ssl, conn->wbio);
+	}
+
+	return 1;
+}
+
+int tls_connection_established(const TLSConnection *conn)
+{
+	return conn->established;
+}
+
+int tls_connection_is_ktls(const TLSConnection *conn)
+{
+	return conn->ktls;
+}
+
+ssize_t tls_connection_recv(TLSConnection *conn, void *buf, size_t len)
+{
+	int status;
+
+	if (len > INT_MAX) len = INT_MAX;
+
+	ERR_clear_error();
+	errno = 0;
+
+	status = SSL_read(conn->ssl, buf, (int)len);
+
+	/* Reading may answer a key update */
+	if (conn->wbio && (tls_connection_collect(conn) || tls_connection_flush(conn))) {
+		return -1;
+	}
+
+	if (status > 0) {
+		return status;
+	}
+
+	switch (SSL_get_error(conn->ssl, status)) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			/* EOF without close_notify */
+			if (!errno) {
+				return 0;
+			}
+			return -1;
+		default:
+			tls_log_errors(LOG_INFO, "TLS receive failed");
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+int tls_connection_pending(const TLSConnection *conn)
+{
+	return conn->established && SSL_has_pending(conn->ssl);
+}
+
+ssize_t tls_connection_send(TLSConnection *conn, const void *buf, size_t len)
+{
+	int status;
+
+	if (conn->ktls) {
+		return send(conn->fd, buf, len, MSG_NOSIGNAL);
+	}
+
+	if (tls_connection_flush(conn)) {
+		return -1;
+	}
+
+	/* One frame at a time is queued */
+	if (conn->out_len) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (len > INT_MAX) len = INT_MAX;
+
+	ERR_clear_error();
+
+	status = SSL_write(conn->ssl, buf, (int)len);
+	if (status <= 0) {
+		tls_log_errors(LOG_INFO, "TLS send failed");
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (tls_connection_collect(conn) || tls_connection_flush(conn)) {
+		return -1;
+	}
+
+	return status;
+}
+
+int tls_connection_wants_flush(const TLSConnection *conn)
+{
+	return conn->out_len != 0;
+}
+
+int tls_connection_flush(TLSConnection *conn)
+{
+	ssize_t status;
+
+	while (conn->out_offset < conn->out_len) {
+		status = send(conn->fd, conn->out + conn->out_offset, conn->out_len - conn->out_offset, MSG_NOSIGNAL);
+		if (status < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return 0;
+			}
+
+			return -1;
+		}
+
+		conn->out_offset += (size_t)status;
+	}
+
+	conn->out_offset = 0;
+	conn->out_len = 0;
+
+	return 0;
+}
+
+void tls_connection_destroy(TLSConnection *conn)
+{
+	if (!conn) return;
+
+	if (conn->established) {
+		ERR_clear_error();
+		SSL_shutdown(conn->ssl);
+
+		if (conn->wbio && !tls_connection_collect(conn)) {
+			tls_connection_flush(conn);
+		}
+	}
+
+	ERR_clear_error();
+
+	SSL_free(conn->ssl);
+	free(conn->out);
+	free(conn);
+}
@@ -0,0 +1,97 @@
+#ifndef _TLSSERVER_H_
+#define _TLSSERVER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ TLS 1.3 for client connections.
+
+ The handshake is done with OpenSSL. Once it completes the session keys are
+ handed to kernel TLS when the kernel supports it, so entropy frames are sent
+ with plain send() on the socket and encrypted in the kernel without another
+ copy. Otherwise records are encrypted in userspace and queued per connection.
+ Either way tls_connection_send behaves like a non-blocking send().
+*/
+struct TLSServer;
+typedef struct TLSServer TLSServer;
+
+struct TLSConnection;
+typedef struct TLSConnection TLSConnection;
+
+/**
+* Loads the certificate chain and private key (PEM) for the listeners.
+*
+* Returns: The server or NULL. Errors are reported through syslog.
+*/
+TLSServer *tls_server_create(const char *cert_file, const char *key_file);
+
+void tls_server_destroy(TLSServer *server);
+
+/**
+* Starts a server side session on a connected non-blocking socket.
+* The socket is not closed by the connection.
+*
+* Returns: The connection or NULL with errno set.
+*/
+TLSConnection *tls_connection_create(TLSServer *server, int fd);
+
+/**
+* Continues the handshake. Call whenever the socket is readable or writable.
+*
+* Returns: 1 once the handshake is complete, 0 if it needs more I/O or -1 if it failed.
+*/
+int tls_connection_handshake(TLSConnection *conn);
+
+/**
+* Whether the handshake is complete.
+*/
+int tls_connection_established(const TLSConnection *conn);
+
+/**
+* Whether sends go through kernel TLS.
+*/
+int tls_connection_is_ktls(const TLSConnection *conn);
+
+/**
+* Reads decrypted data. Same return values and errno as recv() on a non-blocking socket.
+*/
+ssize_t tls_connection_recv(TLSConnection *conn, void *buf, size_t len);
+
+/**
+* Whether decrypted data is buffered and can be read without the socket becoming readable.
+*/
+int tls_connection_pending(const TLSConnection *conn);
+
+/**
+* Sends data. Same return values and errno as send() on a non-blocking socket.
+*/
+ssize_t tls_connection_send(TLSConnection *conn, const void *buf, size_t len);
+
+/**
+* Whether encrypted data is waiting for the socket to become writable.
+*/
+int tls_connection_wants_flush(const TLSConnection *conn);
+
+/**
+* Sends queued encrypted data.
+*
+* Returns: 0 on success or if the socket is full, -1 with errno set on errors.
+*/
+int tls_connection_flush(TLSConnection *conn);
+
+/**
+* Sends close_notify if possible and frees the session.
+*/
+void tls_connection_destroy(TLSConnection *conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ Copyright (c) 2013, Nicos Panayides <nicosp@gmail.com>
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ Traffic trace files. See trace.h for the format.
+*/
+
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
+#include "trace.h"
+#include "outbuf.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Memory queued for the writer thread */
+#define TRACE_BUFFER_SIZE (4*1024*1024)
+
+/* Type and three varints of at most 10 bytes */
+#define MAX_RECORD_SIZE (1 + 3 * 10)
+
+struct TraceWriter {
+	int fd;
+	OutputBuffer *output;
+
+	uint64_t start_us;
+	uint64_t last_us;
+};
+
+struct TraceReader {
+	FILE *file;
+	uint64_t time_us;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static size_t put_varint(unsigned char *buf, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+
+	buf[len++] = (unsigned char)value;
+
+	return len;
+}
+
+/**
+* Returns 1 if a varint was read, 0 at the end of the file before any byte
+* or -1 with errno set.
+*/
+static int get_varint(FILE *file, uint64_t *value)
+{
+	unsigned int shift = 0;
+	int c;
+
+	*value = 0;
+
+	for (;;) {
+		c = getc(file);
+		if (c == EOF) {
+			if (ferror(file)) return -1;
+			if (!shift) return 0;
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (shift > 63) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		*value |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+
+		if (!(c & 0x80)) {
+			return 1;
+		}
+	}
+}
+
+TraceWriter *trace_writer_create(int fd)
+{
+	TraceWriter *trace;
+	OutputBufferOptions options;
+
+	trace = malloc(sizeof(TraceWriter));
+	if (!trace) {
+		return NULL;
+	}
+
+	output_buf_options_init(&options);
+	options.buffer_size = TRACE_BUFFER_SIZE;
+	options.zero_copy = 0;
+
+	trace->fd = fd;
+	trace->output = output_buf_create(fd, &options);
+	if (!trace->output) {
+		free(trace);
+		return NULL;
+	}
+
+	trace->start_us = now_us();
+	trace->last_us = 0;
+
+	if (output_buf_write(trace->output, (const unsigned char *)TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		output_buf_close(trace->output);
+		free(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+int trace_writer_record(TraceWriter *trace, int type, uint32_t id, uint64_t value)
+{
+	unsigned char record[MAX_RECORD_SIZE];
+	uint64_t time_us;
+	size_t len;
+
+	time_us = now_us() - trace->start_us;
+
+	record[0] = (unsigned char)type;
+	len = 1;
+	len += put_varint(record + len, time_us - trace->last_us);
+	len += put_varint(record + len, id);
+	len += put_varint(record + len, value);
+
+	trace->last_us = time_us;
+
+	return output_buf_write(trace->output, record, len);
+}
+
+int trace_writer_close(TraceWriter *trace)
+{
+	int status;
+	int error;
+
+	if (!trace) return 0;
+
+	status = output_buf_close(trace->output);
+	error = errno;
+
+	if (close(trace->fd) && !status) {
+		status = -1;
+		error = errno;
+	}
+
+	free(trace);
+
+	errno = error;
+	return status;
+}
+
+TraceReader *trace_reader_open(const char *path)
+{
+	TraceReader *trace;
+	char magic[TRACE_MAGIC_LEN];
+	int error;
+
+	trace = malloc(sizeof(TraceReader));
+	if (!trace) {
+		return NULL;
+	}
+
+	trace->time_us = 0;
+	trace->file = fopen(path, "rb");
+	if (!trace->file) {
+		error = errno;
+		free(trace);
+		errno = error;
+		return NULL;
+	}
+
+	if (fread(magic, 1, TRACE_MAGIC_LEN, trace->file) != TRACE_MAGIC_LEN ||
+		memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		trace_reader_close(trace);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return trace;
+}
+
+int trace_reader_next(TraceReader *trace, TraceEvent *event)
+{
+	uint64_t delta;
+	uint64_t id;
+	int c;
+
+	c = getc(trace->file);
+	if (c == EOF) {
+		return ferror(trace->file) ? -1 : 0;
+	}
+
+	if (c < TRACE_CONNECT || c > TRACE_DEVICE ||
+		get_varint(trace->file, &delta) != 1 ||
+		get_varint(trace->file, &id) != 1 ||
+		get_varint(trace->file, &event->value) != 1 ||
+		id > UINT32_MAX) {
+		if (!ferror(trace->file)) errno = EINVAL;
+		return -1;
+	}
+
+	trace->time_us += delta;
+
+	event->type = c;
+	event->time_us = trace->time_us;
+	event->id = (uint32_t)id;
+
+	return 1;
+}
+
+void trace_reader_close(TraceReader *trace)
+{
+	if (!trace) return;
+
+	fclose(trace->file);
+	free(trace);
+}
@@ -0,0 +1,107 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ Compact binary trace of the daemon traffic, used to reproduce
+ production load locally with rngd-replay.
+
+ The file starts with TRACE_MAGIC followed by records of:
+ the event type (1 byte), the microseconds since the previous record,
+ the connection id and the value. All numbers after the type are
+ unsigned LEB128 varints so most records take 4-6 bytes.
+*/
+
+#define TRACE_MAGIC "RNGTRC01"
+#define TRACE_MAGIC_LEN (8)
+
+/**
+* Event types.
+*/
+enum TraceEventType {
+	/** A client connected. id is a new connection id. */
+	TRACE_CONNECT = 1,
+	/** A client disconnected or was disconnected. */
+	TRACE_DISCONNECT,
+	/** A client requested value bytes. 0 is a keep-alive. */
+	TRACE_REQUEST,
+	/** value bytes of entropy were sent to a client, not counting headers. */
+	TRACE_SEND,
+	/** A device read of value bytes completed. id is 0 for Quantis devices or 1 + the index of a source given with -e. */
+	TRACE_DEVICE
+};
+
+/**
+* A decoded trace record.
+*/
+struct TraceEvent {
+	/** One of TraceEventType */
+	int type;
+	/** Microseconds since the start of the trace */
+	uint64_t time_us;
+	uint32_t id;
+	uint64_t value;
+};
+
+typedef struct TraceEvent TraceEvent;
+
+struct TraceWriter;
+typedef struct TraceWriter TraceWriter;
+
+struct TraceReader;
+typedef struct TraceReader TraceReader;
+
+/**
+* Starts a trace on fd. Records are written by a separate thread.
+* On success the trace takes ownership of fd.
+*
+* Returns: The writer or NULL with errno set.
+*/
+TraceWriter *trace_writer_create(int fd);
+
+/**
+* Appends a record timestamped with the current time.
+*
+* Returns: 0 on success, -1 with errno set if writing failed.
+*/
+int trace_writer_record(TraceWriter *trace, int type, uint32_t id, uint64_t value);
+
+/**
+* Writes all pending records and closes the trace.
+*
+* Returns: 0 on success, -1 with errno set if any write failed.
+*/
+int trace_writer_close(TraceWriter *trace);
+
+/**
+* Opens a trace for reading.
+*
+* Returns: The reader or NULL with errno set. errno is EINVAL if the file is not a trace.
+*/
+TraceReader *trace_reader_open(const char *path);
+
+/**
+* Reads the next record.
+*
+* Returns: 1 if a record was read, 0 at the end of the trace or -1 with errno set.
+* errno is EINVAL if the trace is truncated or corrupt.
+*/
+int trace_reader_next(TraceReader *trace, TraceEvent *event);
+
+/**
+* Closes a trace opened with trace_reader_open.
+*/
+void trace_reader_close(TraceReader *trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif